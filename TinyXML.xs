@@ -7,9 +7,93 @@ static void (*std_free)(void *) = free;
 #include "XSUB.h"
 
 #include <txml.h>
+#include <txml_xpath.h>
+#include <txml_nodeset.h>
 
 #include "const-c.inc"
 
+// the context node passed to the XPath functions (undef for the root)
+static XmlNode *
+XmlXPathContextNode(SV *node)
+{
+    if (!SvOK(node))
+        return NULL;
+    if (!sv_derived_from(node, "XmlNodePtr"))
+        croak("node is not of type XmlNodePtr");
+    return INT2PTR(XmlNode *, SvIV((SV*)SvRV(node)));
+}
+
+// node-sets are returned as array references, the other values as scalars
+static SV *
+XmlXPathValueToSV(TXml *xml, XmlXPathValue *value)
+{
+    AV *nodes;
+    size_t i;
+    switch(value->type) {
+        case XML_XPATH_NODESET:
+            nodes = newAV();
+            for (i = 0; i < value->set.count; i++) {
+                XmlXPathNode *n = &value->set.nodes[i];
+                if (n->type == XML_XPATH_NODE_ROOT)
+                    av_push(nodes, sv_setref_pv(newSV(0), "TXmlPtr", (void *)xml));
+                else if (n->type == XML_XPATH_NODE_ATTRIBUTE)
+                    av_push(nodes, sv_setref_pv(newSV(0), "XmlNodeAttributePtr", (void *)n->attr));
+                else if (n->type == XML_XPATH_NODE_TEXT && n->node->type == XML_NODETYPE_SIMPLE)
+                    av_push(nodes, newSVpv(n->node->value, 0)); // the value of an element
+                else
+                    av_push(nodes, sv_setref_pv(newSV(0), "XmlNodePtr", (void *)n->node));
+            }
+            return newRV_noinc((SV *)nodes);
+        case XML_XPATH_BOOLEAN:
+            return newSViv(value->boolean);
+        case XML_XPATH_NUMBER:
+            return newSVnv(value->number);
+        default:
+            return newSVpv(value->string, 0);
+    }
+}
+
+// hands the elements matched by XmlStreamBuffer()/XmlStreamFile() to a perl callback,
+// which returns true to stop the parser
+static int
+XmlStreamToPerl(TXml *xml, XmlNode *node, void *priv)
+{
+    dSP;
+    int count, stop = 1;
+
+    ENTER;
+    SAVETMPS;
+    PUSHMARK(SP);
+    XPUSHs(sv_2mortal(sv_setref_pv(newSV(0), "XmlNodePtr", (void *)node)));
+    PUTBACK;
+    count = call_sv((SV *)priv, G_SCALAR|G_EVAL);
+    SPAGAIN;
+    if (count == 1) {
+        SV *res = POPs;
+        stop = SvTRUE(res) || SvTRUE(ERRSV);
+    }
+    PUTBACK;
+    FREETMPS;
+    LEAVE;
+    return stop;
+}
+
+// the ids matched by the XmlFilter functions (undef on errors)
+static SV *
+XmlFilterIdsToSV(XmlErr err, unsigned long *ids, size_t count)
+{
+    AV *res;
+    size_t i;
+    if (err != XML_NOERR)
+        return newSV(0); // RETVAL gets mortalized
+    res = newAV();
+    for (i = 0; i < count; i++)
+        av_push(res, newSVuv(ids[i]));
+    if (ids)
+        free(ids);
+    return newRV_noinc((SV *)res);
+}
+
 MODULE = XML::TinyXML        PACKAGE = XML::TinyXML        
 
 INCLUDE: const-xs.inc
@@ -113,6 +197,20 @@ unsigned long
 XmlCountChildren(node)
     XmlNode *node
 
+void
+XmlNumberNodes(xml)
+    TXml *xml
+
+int
+XmlIsAncestor(ancestor, node)
+    XmlNode *ancestor
+    XmlNode *node
+
+int
+XmlCompareNodes(a, b)
+    XmlNode *a
+    XmlNode *b
+
 TXml *
 XmlCreateContext()
 
@@ -139,10 +237,10 @@ XmlDump(xml)
     TXml *xml
     PREINIT:
     char *dump;
-    int outlen;
+    size_t outlen;
     SV   *sv = &PL_sv_undef;
     CODE:
-    dump = XmlDump(xml, &outlen);
+    dump = XmlDumpSize(xml, &outlen);
     if (dump) {
         sv = newSVpv(dump, outlen);
         std_free(dump);
@@ -151,11 +249,248 @@ XmlDump(xml)
     OUTPUT:
     RETVAL
 
-char *
+#ifndef WIN32
+
+int
+XmlDumpFd(xml, fd)
+    TXml *xml
+    int fd
+
+XmlWriter *
+XmlCreateFdWriter(fd, pretty)
+    int fd
+    int pretty
+
+int
+XmlSaveSnapshot(xml, path)
+    TXml *xml
+    char *path
+
+int
+XmlLoadSnapshot(xml, path)
+    TXml *xml
+    char *path
+
+int
+XmlFreeze(xml)
+    TXml *xml
+
+XmlPublisher *
+XmlCreatePublisher()
+
+void
+XmlDestroyPublisher(pub)
+    XmlPublisher *pub
+
+int
+XmlPublish(pub, xml)
+    XmlPublisher *pub
+    TXml *xml
+
+TXml *
+XmlPin(pub)
+    XmlPublisher *pub
+
+void
+XmlUnpin(xml)
+    TXml *xml
+
+unsigned long
+XmlPublisherVersion(pub)
+    XmlPublisher *pub
+
+#endif
+
+SV *
 XmlDumpBranch(xml, rNode, depth)
     TXml *xml
     XmlNode *rNode
     unsigned int    depth
+    PREINIT:
+    char *dump;
+    size_t outlen;
+    SV   *sv = &PL_sv_undef;
+    CODE:
+    dump = XmlDumpBranchSize(xml, rNode, depth, &outlen);
+    if (dump) {
+        sv = newSVpv(dump, outlen);
+        std_free(dump);
+    }
+    RETVAL = sv;
+    OUTPUT:
+    RETVAL
+
+SV *
+XmlXPathEvaluate(xml, node, expr)
+    TXml *xml
+    SV *node
+    char *expr
+    PREINIT:
+    XmlXPathValue *value;
+    CODE:
+    value = XmlXPathEvaluate(xml, XmlXPathContextNode(node), expr);
+    if (!value)
+        XSRETURN_UNDEF;
+    RETVAL = XmlXPathValueToSV(xml, value);
+    XmlXPathDestroyValue(value);
+    OUTPUT:
+    RETVAL
+
+XmlXPathExpr *
+XmlXPathCompile(expr)
+    char *expr
+
+void
+XmlXPathDestroyExpr(compiled)
+    XmlXPathExpr *compiled
+
+SV *
+XmlXPathEvaluateCompiled(xml, node, compiled)
+    TXml *xml
+    SV *node
+    XmlXPathExpr *compiled
+    PREINIT:
+    XmlXPathValue *value;
+    CODE:
+    value = XmlXPathEvaluateCompiled(xml, XmlXPathContextNode(node), compiled);
+    if (!value)
+        XSRETURN_UNDEF;
+    RETVAL = XmlXPathValueToSV(xml, value);
+    XmlXPathDestroyValue(value);
+    OUTPUT:
+    RETVAL
+
+XmlXPathCache *
+XmlXPathCreateCache(size)
+    unsigned long size
+
+void
+XmlXPathDestroyCache(cache)
+    XmlXPathCache *cache
+
+SV *
+XmlXPathCacheEvaluate(cache, xml, node, expr)
+    XmlXPathCache *cache
+    TXml *xml
+    SV *node
+    char *expr
+    PREINIT:
+    XmlXPathValue *value;
+    CODE:
+    value = XmlXPathCacheEvaluate(cache, xml, XmlXPathContextNode(node), expr);
+    if (!value)
+        XSRETURN_UNDEF;
+    RETVAL = XmlXPathValueToSV(xml, value);
+    XmlXPathDestroyValue(value);
+    OUTPUT:
+    RETVAL
+
+XmlXPathBatch *
+XmlXPathCreateBatch(exprs)
+    AV *exprs
+    PREINIT:
+    XmlXPathExpr **compiled;
+    int count, i;
+    CODE:
+    count = av_len(exprs) + 1;
+    Newx(compiled, count + 1, XmlXPathExpr *);
+    for (i = 0; i < count; i++) {
+        SV **expr = av_fetch(exprs, i, 0);
+        if (!expr || !sv_derived_from(*expr, "XmlXPathExprPtr")) {
+            Safefree(compiled);
+            croak("Expression %d is not of type XmlXPathExprPtr", i);
+        }
+        compiled[i] = INT2PTR(XmlXPathExpr *, SvIV((SV*)SvRV(*expr)));
+    }
+    RETVAL = XmlXPathCreateBatch(compiled, count);
+    Safefree(compiled);
+    OUTPUT:
+    RETVAL
+
+void
+XmlXPathDestroyBatch(batch)
+    XmlXPathBatch *batch
+
+void
+XmlXPathBatchEvaluate(xml, node, batch)
+    TXml *xml
+    SV *node
+    XmlXPathBatch *batch
+    PREINIT:
+    XmlXPathValue **values;
+    int count, i;
+    PPCODE:
+    count = XmlXPathBatchCount(batch);
+    Newxz(values, count + 1, XmlXPathValue *);
+    if (XmlXPathBatchEvaluate(batch, xml, XmlXPathContextNode(node), values) != XML_NOERR) {
+        Safefree(values);
+        XSRETURN_EMPTY;
+    }
+    EXTEND(SP, count);
+    for (i = 0; i < count; i++) {
+        PUSHs(values[i] ? sv_2mortal(XmlXPathValueToSV(xml, values[i])) : &PL_sv_undef);
+        XmlXPathDestroyValue(values[i]);
+    }
+    Safefree(values);
+
+XmlNodeSet *
+XmlCreateNodeSet(xml)
+    TXml *xml
+
+void
+XmlDestroyNodeSet(set)
+    XmlNodeSet *set
+
+int
+XmlNodeSetAdd(set, node)
+    XmlNodeSet *set
+    XmlNode *node
+
+size_t
+XmlNodeSetCount(set)
+    XmlNodeSet *set
+
+XmlNode *
+XmlNodeSetItem(set, position)
+    XmlNodeSet *set
+    size_t position
+
+int
+XmlNodeSetContains(set, node)
+    XmlNodeSet *set
+    XmlNode *node
+
+void
+XmlNodeSetNodes(set)
+    XmlNodeSet *set
+    PREINIT:
+    size_t i;
+    PPCODE:
+    XmlNodeSetSort(set);
+    EXTEND(SP, set->count);
+    for (i = 0; i < set->count; i++)
+        PUSHs(sv_2mortal(sv_setref_pv(newSV(0), "XmlNodePtr", (void *)set->nodes[i])));
+
+XmlNodeSet *
+XmlNodeSetUnion(a, b)
+    XmlNodeSet *a
+    XmlNodeSet *b
+
+XmlNodeSet *
+XmlNodeSetIntersection(a, b)
+    XmlNodeSet *a
+    XmlNodeSet *b
+
+XmlNodeSet *
+XmlNodeSetDifference(a, b)
+    XmlNodeSet *a
+    XmlNodeSet *b
+
+XmlNodeSet *
+XmlNodeSetRange(set, first, last)
+    XmlNodeSet *set
+    size_t first
+    size_t last
 
 XmlNode *
 XmlGetBranch(xml, index)
@@ -177,6 +512,154 @@ XmlGetNode(xml, path)
     TXml *xml
     char *path
 
+XmlCompiledPath *
+XmlCompilePath(path)
+    char *path
+
+XmlErr
+XmlIndexAttributes(xml, ...)
+    TXml *xml
+    PREINIT:
+    char **names = NULL;
+    int i;
+    CODE:
+    if (items > 1) {
+        Newx(names, items - 1, char *);
+        for (i = 1; i < items; i++)
+            names[i - 1] = SvPV_nolen(ST(i));
+    }
+    RETVAL = XmlIndexAttributes(xml, names, items - 1);
+    Safefree(names);
+    OUTPUT:
+    RETVAL
+
+void
+XmlDropIndex(xml)
+    TXml *xml
+
+int
+XmlIsIndexed(xml, name)
+    TXml *xml
+    char *name
+
+XmlNode *
+XmlGetNodeByAttribute(xml, name, value)
+    TXml *xml
+    char *name
+    char *value
+
+XmlNode *
+XmlGetNodeCompiled(xml, compiled)
+    TXml *xml
+    XmlCompiledPath *compiled
+
+void
+XmlDestroyCompiledPath(compiled)
+    XmlCompiledPath *compiled
+
+XmlStreamPath *
+XmlCompileStreamPath(path)
+    char *path
+
+void
+XmlDestroyStreamPath(path)
+    XmlStreamPath *path
+
+XmlErr
+XmlStreamBuffer(xml, buf, path, callback)
+    TXml *xml
+    char *buf
+    XmlStreamPath *path
+    SV *callback
+    CODE:
+    RETVAL = XmlStreamBuffer(xml, buf, path, XmlStreamToPerl, (void *)callback);
+    OUTPUT:
+    RETVAL
+
+XmlErr
+XmlStreamFile(xml, file, path, callback)
+    TXml *xml
+    char *file
+    XmlStreamPath *path
+    SV *callback
+    CODE:
+    RETVAL = XmlStreamFile(xml, file, path, XmlStreamToPerl, (void *)callback);
+    OUTPUT:
+    RETVAL
+
+XmlFilter *
+XmlCreateFilter()
+
+void
+XmlDestroyFilter(filter)
+    XmlFilter *filter
+
+XmlErr
+XmlFilterAdd(filter, path, id)
+    XmlFilter *filter
+    char *path
+    unsigned long id
+
+size_t
+XmlFilterCount(filter)
+    XmlFilter *filter
+
+SV *
+XmlFilterDocument(filter, xml)
+    XmlFilter *filter
+    TXml *xml
+    PREINIT:
+    unsigned long *ids = NULL;
+    size_t count = 0;
+    XmlErr err;
+    CODE:
+    err = XmlFilterDocument(filter, xml, &ids, &count);
+    RETVAL = XmlFilterIdsToSV(err, ids, count);
+    OUTPUT:
+    RETVAL
+
+SV *
+XmlFilterBuffer(filter, xml, buf)
+    XmlFilter *filter
+    TXml *xml
+    char *buf
+    PREINIT:
+    unsigned long *ids = NULL;
+    size_t count = 0;
+    XmlErr err;
+    CODE:
+    err = XmlFilterBuffer(filter, xml, buf, &ids, &count);
+    RETVAL = XmlFilterIdsToSV(err, ids, count);
+    OUTPUT:
+    RETVAL
+
+SV *
+XmlFilterFile(filter, xml, file)
+    XmlFilter *filter
+    TXml *xml
+    char *file
+    PREINIT:
+    unsigned long *ids = NULL;
+    size_t count = 0;
+    XmlErr err;
+    CODE:
+    err = XmlFilterFile(filter, xml, file, &ids, &count);
+    RETVAL = XmlFilterIdsToSV(err, ids, count);
+    OUTPUT:
+    RETVAL
+
+void
+XmlGetNodes(xml, path)
+    TXml *xml
+    char *path
+    PREINIT:
+    XmlPathIterator iterator;
+    XmlNode *node;
+    PPCODE:
+    XmlPathIteratorInit(&iterator, xml, path);
+    while ((node = XmlPathIteratorNext(&iterator)))
+        XPUSHs(sv_2mortal(sv_setref_pv(newSV(0), "XmlNodePtr", (void *)node)));
+
 char *
 XmlGetNodeValue(node)
     XmlNode *node
@@ -220,6 +703,112 @@ XmlSubstBranch(xml, index, newBranch)
 int
 XmlHasIconv()
 
+int
+XmlHasCompression(compression)
+    int compression
+
+AV *
+XmlParseFiles(contexts, paths, numThreads)
+    AV *contexts
+    AV *paths
+    int numThreads
+    PREINIT:
+    TXml **xmls;
+    char **files;
+    XmlErr *errors;
+    AV *results;
+    int count, i;
+    CODE:
+    count = av_len(paths) + 1;
+    if (av_len(contexts) + 1 != count)
+        croak("Got %d contexts for %d files", (int)av_len(contexts) + 1, count);
+    Newx(xmls, count + 1, TXml *);
+    Newx(files, count + 1, char *);
+    Newx(errors, count + 1, XmlErr);
+    for (i = 0; i < count; i++) {
+        SV **ctx = av_fetch(contexts, i, 0);
+        SV **path = av_fetch(paths, i, 0);
+        if (!ctx || !sv_derived_from(*ctx, "TXmlPtr")) {
+            Safefree(xmls);
+            Safefree(files);
+            Safefree(errors);
+            croak("Context %d is not of type TXmlPtr", i);
+        }
+        xmls[i] = INT2PTR(TXml *, SvIV((SV*)SvRV(*ctx)));
+        files[i] = (path && SvOK(*path)) ? SvPV_nolen(*path) : "";
+    }
+    XmlParseFiles(xmls, files, count, numThreads, errors);
+    results = (AV *)sv_2mortal((SV *)newAV());
+    for (i = 0; i < count; i++)
+        av_push(results, newSViv(errors[i]));
+    Safefree(xmls);
+    Safefree(files);
+    Safefree(errors);
+    RETVAL = results;
+    OUTPUT:
+    RETVAL
+
+XmlWriter *
+XmlCreateBufferWriter(pretty)
+    int pretty
+
+void
+XmlDestroyWriter(writer)
+    XmlWriter *writer
+
+int
+XmlWriterFlush(writer)
+    XmlWriter *writer
+
+char *
+XmlWriterBuffer(writer)
+    XmlWriter *writer
+
+int
+XmlWriterStartDocument(writer)
+    XmlWriter *writer
+
+int
+XmlWriterStartElement(writer, name)
+    XmlWriter *writer
+    char *name
+
+int
+XmlWriterStartElementNS(writer, ns, name)
+    XmlWriter *writer
+    XmlNamespace *ns
+    char *name
+
+int
+XmlWriterAttribute(writer, name, value)
+    XmlWriter *writer
+    char *name
+    char *value
+
+int
+XmlWriterNamespace(writer, ns)
+    XmlWriter *writer
+    XmlNamespace *ns
+
+int
+XmlWriterText(writer, text)
+    XmlWriter *writer
+    char *text
+
+int
+XmlWriterCData(writer, data)
+    XmlWriter *writer
+    char *data
+
+int
+XmlWriterComment(writer, comment)
+    XmlWriter *writer
+    char *comment
+
+int
+XmlWriterEndElement(writer)
+    XmlWriter *writer
+
 MODULE = XML::TinyXML        PACKAGE = XmlNamespace
 
 XmlNamespace *
@@ -321,9 +910,9 @@ name(THIS, __value = NO_INIT)
     CODE:
     RETVAL = newSVpv(THIS->name, 0);
     if (items > 1) {
-        if(THIS->name)
-            free(THIS->name);
-        THIS->name = __value;
+        if (THIS->node && THIS->node->readOnly)
+            croak("Attribute %s can't be modified (read-only node)", THIS->name);
+        XmlSetAttributeName(THIS, __value);
     }
     OUTPUT:
     RETVAL
@@ -336,9 +925,9 @@ value(THIS, __value = NO_INIT)
     CODE:
     RETVAL = newSVpv(THIS->value, 0);
     if (items > 1) {
-        if(THIS->value)
-            free(THIS->value);
-        THIS->value = __value;
+        if (THIS->node && THIS->node->readOnly)
+            croak("Attribute %s can't be modified (read-only node)", THIS->name);
+        XmlSetAttributeValue(THIS, __value);
     }
     OUTPUT:
     RETVAL
@@ -402,9 +991,12 @@ name(THIS, __value = NO_INIT)
     CODE:
     RETVAL = newSVpv(THIS->name, 0);
     if (items > 1) {
+        if (THIS->readOnly)
+            croak("Node %s can't be modified (read-only node)", THIS->name);
         if(THIS->name)
             free(THIS->name);
         THIS->name = __value;
+        XmlInvalidateNode(THIS);
     }
     OUTPUT:
     RETVAL
@@ -416,8 +1008,14 @@ parent(THIS, __value = NO_INIT)
     PROTOTYPE: $;$
     CODE:
     RETVAL = THIS->parent;
-    if (items > 1)
+    if (items > 1) {
+        if (THIS->readOnly)
+            croak("Node %s can't be modified (read-only node)", THIS->name);
+        XmlInvalidateNode(THIS->parent);
         THIS->parent = __value;
+        THIS->cacheState = XML_CACHE_NONE;
+        XmlInvalidateNode(THIS->parent);
+    }
     OUTPUT:
     RETVAL
 
@@ -440,8 +1038,12 @@ type(THIS, __value = NO_INIT)
     PROTOTYPE: $;$
     CODE:
     RETVAL = THIS->type;
-    if (items > 1)
+    if (items > 1) {
+        if (THIS->readOnly)
+            croak("Node %s can't be modified (read-only node)", THIS->name);
         THIS->type = __value;
+        XmlInvalidateNode(THIS);
+    }
     OUTPUT:
     RETVAL
 
@@ -595,6 +1197,87 @@ ignoreWhiteSpaces(THIS, __value = NO_INIT)
     OUTPUT:
     RETVAL
 
+int
+atomicSave(THIS, __value = NO_INIT)
+    TXml *THIS
+    int __value
+    PROTOTYPE: $;$
+    CODE:
+    RETVAL = THIS->atomicSave;
+    if (items > 1)
+        THIS->atomicSave = __value;
+    OUTPUT:
+    RETVAL
+
+int
+dumpCache(THIS, __value = NO_INIT)
+    TXml *THIS
+    int __value
+    PROTOTYPE: $;$
+    CODE:
+    RETVAL = THIS->dumpCache;
+    if (items > 1)
+        THIS->dumpCache = __value;
+    OUTPUT:
+    RETVAL
+
+int
+dumpThreads(THIS, __value = NO_INIT)
+    TXml *THIS
+    int __value
+    PROTOTYPE: $;$
+    CODE:
+    RETVAL = THIS->dumpThreads;
+    if (items > 1)
+        THIS->dumpThreads = __value;
+    OUTPUT:
+    RETVAL
+
+int
+validateUtf8(THIS, __value = NO_INIT)
+    TXml *THIS
+    int __value
+    PROTOTYPE: $;$
+    CODE:
+    RETVAL = THIS->validateUtf8;
+    if (items > 1)
+        THIS->validateUtf8 = __value;
+    OUTPUT:
+    RETVAL
+
+int
+compression(THIS, __value = NO_INIT)
+    TXml *THIS
+    int __value
+    PROTOTYPE: $;$
+    CODE:
+    RETVAL = THIS->compression;
+    if (items > 1)
+        THIS->compression = __value;
+    OUTPUT:
+    RETVAL
+
+int
+lockTimeout(THIS, __value = NO_INIT)
+    TXml *THIS
+    int __value
+    PROTOTYPE: $;$
+    CODE:
+    RETVAL = THIS->lockTimeout;
+    if (items > 1)
+        THIS->lockTimeout = __value;
+    OUTPUT:
+    RETVAL
+
+int
+readOnly(THIS)
+    TXml *THIS
+    PROTOTYPE: $
+    CODE:
+    RETVAL = THIS->readOnly;
+    OUTPUT:
+    RETVAL
+
 int
 hasIconv(THIS)
     CODE:
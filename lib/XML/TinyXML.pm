@@ -124,11 +124,13 @@ package XML::TinyXML;
 use strict;
 use warnings;
 use Carp;
+use IO::Handle;
 
 require Exporter;
 use AutoLoader;
 
 use XML::TinyXML::Node;
+use XML::TinyXML::NodeAttribute;
 our @ISA = qw(Exporter);
 
 # Items to export into callers namespace by default. Note: do not export
@@ -170,20 +172,66 @@ our @EXPORT = qw(
 	XmlDestroyNode
 	XmlDump
 	XmlDumpBranch
+        XmlDumpFd
 	XmlGetBranch
 	XmlGetChildNode
 	XmlGetChildNodeByName
 	XmlGetNode
+        XmlGetNodes
+        XmlNumberNodes
+        XmlIsAncestor
+        XmlCompareNodes
+        XmlIndexAttributes
+        XmlDropIndex
+        XmlIsIndexed
+        XmlGetNodeByAttribute
+        XmlCompilePath
+        XmlGetNodeCompiled
+        XmlDestroyCompiledPath
 	XmlGetNodeValue
         XmlNextSibling
 	XmlParseBuffer
 	XmlParseFile
+        XmlCompileStreamPath
+        XmlDestroyStreamPath
+        XmlStreamBuffer
+        XmlStreamFile
+        XmlCreateFilter
+        XmlDestroyFilter
+        XmlFilterAdd
+        XmlFilterCount
+        XmlFilterDocument
+        XmlFilterBuffer
+        XmlFilterFile
+        XmlLoadSnapshot
+        XmlFreeze
         XmlPrevSibling
 	XmlRemoveBranch
         XmlRemoveChildNode
         XmlRemoveChildNodeAtIndex
 	XmlRemoveNode
 	XmlSave
+        XmlSaveSnapshot
+        XmlXPathEvaluate
+        XmlXPathCompile
+        XmlXPathDestroyExpr
+        XmlXPathEvaluateCompiled
+        XmlXPathCreateCache
+        XmlXPathDestroyCache
+        XmlXPathCacheEvaluate
+        XmlXPathCreateBatch
+        XmlXPathDestroyBatch
+        XmlXPathBatchEvaluate
+        XmlCreateNodeSet
+        XmlDestroyNodeSet
+        XmlNodeSetAdd
+        XmlNodeSetCount
+        XmlNodeSetItem
+        XmlNodeSetContains
+        XmlNodeSetUnion
+        XmlNodeSetIntersection
+        XmlNodeSetDifference
+        XmlNodeSetRange
 	XmlSetNodeValue
         XmlSetOutputEncoding
 	XmlSubstBranch
@@ -253,6 +301,12 @@ if $arg is an HASHREF or a scalar
                       the value of the root node.
         attrs =>  attributes of the 'contextually added' $root node 
         encoding => output encoding to use (among iconv supported ones)
+        atomicSave => see atomicSave()
+        dumpCache => see dumpCache()
+        dumpThreads => see dumpThreads()
+        validateUtf8 => see validateUtf8()
+        compression => see compression()
+        lockTimeout => see lockTimeout()
     );
 
 =cut
@@ -269,6 +323,12 @@ sub new {
     $self->allowMultipleRootNodes($params{multipleRootNodes}) if ($params{multipleRootNodes});
     $self->ignoreBlanks($params{ignoreBlanks}) if (defined($params{ignoreBlanks}));
     $self->ignoreWhiteSpaces($params{ignoreWhiteSpaces}) if (defined($params{ignoreWhiteSpaces}));
+    $self->atomicSave($params{atomicSave}) if (defined($params{atomicSave}));
+    $self->dumpCache($params{dumpCache}) if (defined($params{dumpCache}));
+    $self->dumpThreads($params{dumpThreads}) if (defined($params{dumpThreads}));
+    $self->validateUtf8($params{validateUtf8}) if (defined($params{validateUtf8}));
+    $self->compression($params{compression}) if (defined($params{compression}));
+    $self->lockTimeout($params{lockTimeout}) if (defined($params{lockTimeout}));
     if($root) {
         if(UNIVERSAL::isa($root, "XML::TinyXML::Node")) {
             XmlAddRootNode($self->{_ctx}, $root->{_node});
@@ -292,6 +352,30 @@ sub open {
            : undef;
 }
 
+=item * loadFiles (\@paths, %params)
+
+Class method to load a lot of files at once.
+Files are read and parsed on a pool of threads, so that waiting for the disk
+overlaps with parsing.
+
+%params are passed to new() when creating the object for each file.
+Additionally, 'threads' sets the number of threads to use (default is 4,
+files are loaded one after the other if the module has been built without
+pthreads support).
+
+Returns a list of XML::TinyXML objects in the same order as @paths
+(undef for the files which couldn't be loaded)
+
+=cut
+
+sub loadFiles {
+    my ($class, $paths, %params) = @_;
+    my $threads = defined($params{threads}) ? delete($params{threads}) : 4;
+    my @objects = map { $class->new(undef, %params) } @$paths;
+    my $results = XmlParseFiles([ map { $_->{_ctx} } @objects ], $paths, $threads);
+    return map { $results->[$_] == $class->XML_NOERR ? $objects[$_] : undef } 0..$#objects;
+}
+
 =item * addNodeAttribute ($node, $key, $value)
 
 Adds an attribute to a specific $node
@@ -391,10 +475,37 @@ sub dump {
     return XmlDump($self->{_ctx});
 }
 
+=item * dumpToHandle ($fh)
+
+Writes the XML structure represented internally straight to the filehandle $fh
+(which can be a file, a pipe or a socket).
+
+The document is not stringified in memory first: node names, values and
+attributes are passed to the kernel directly from the underlying C structures.
+
+If compression() has been set, the output is compressed on the fly.
+
+Returns XML_NOERR if success, a specific error code otherwise
+
+=cut
+
+sub dumpToHandle {
+    my ($self, $fh) = @_;
+    my $fd = ref($fh) ? fileno($fh) : $fh;
+    return $self->XML_BADARGS
+        unless (defined($fd));
+    # flush anything perl has still buffered before writing behind its back
+    $fh->flush if (ref($fh));
+    return XmlDumpFd($self->{_ctx}, $fd);
+}
+
 =item * loadFile ($path)
 
 Load the xml structure from a file
 
+gzip and zstd compressed files are decompressed on the fly
+(see hasCompression())
+
 =cut
 
 sub loadFile {
@@ -455,6 +566,64 @@ sub loadBuffer {
     return XmlParseBuffer($self->{_ctx}, $buf);
 }
 
+=item * streamBuffer ($buf, $path, $callback)
+
+Parse the xml document in $buf calling $callback for each element matching $path
+as soon as its end tag is parsed, with the element (an XML::TinyXML::Node object
+holding the whole subtree) as argument.
+
+Only a forward-only subset of XPath is accepted for $path : child ('/') and
+descendant ('//') steps testing the name of the elements ('name', 'prefix:name',
+'prefix:*' or '*'), each one followed by any number of [@attr], [@attr='value'],
+[@attr!='value'] and [n] predicates (n being the position among the siblings
+passing the same test, as in "//item[2]").
+
+The elements which don't belong to a matching subtree are released as soon as they
+end, so huge documents can be processed in little memory, but the nodes passed to
+$callback are released as well once it returns : their content must be copied
+if needed later. The document is left empty once done.
+
+If $callback dies, the parsing stops and the error is propagated.
+
+Returns XML_NOERR if success, a specific error code otherwise
+(XML_BADARGS if $path is malformed or not supported)
+
+=cut
+
+sub streamBuffer {
+    my ($self, $buf, $path, $callback) = @_;
+    return $self->_stream(\&XmlStreamBuffer, $buf, $path, $callback);
+}
+
+=item * streamFile ($file, $path, $callback)
+
+Same as streamBuffer() but the document is read from $file.
+Uncompressed files are mapped in memory instead of being loaded.
+
+=cut
+
+sub streamFile {
+    my ($self, $file, $path, $callback) = @_;
+    return $self->_stream(\&XmlStreamFile, $file, $path, $callback);
+}
+
+sub _stream {
+    my ($self, $parser, $input, $path, $callback) = @_;
+    return $self->XML_BADARGS
+        unless(defined($input) and defined($path) and ref($callback) eq "CODE");
+    my $compiled = XmlCompileStreamPath($path);
+    return $self->XML_BADARGS unless($compiled);
+    my $error;
+    my $res = $parser->($self->{_ctx}, $input, $compiled, sub {
+        return 0 if (eval { $callback->(XML::TinyXML::Node->new($_[0])); 1 });
+        $error = $@;
+        return 1;
+    });
+    XmlDestroyStreamPath($compiled);
+    die $error if (defined($error));
+    return $res;
+}
+
 =item * getNode ($path)
 
 Get a node at a specific path.
@@ -463,15 +632,158 @@ $path must be of the form: '/rootnode/child1/child2/leafnod'
 and the leading '/' is optional (since all paths will be interpreted
 as absolute)
 
+$path can also be an XML::TinyXML::Path object, to avoid parsing
+the same path again at each lookup.
+
 Returns an XML::TinyXML::Node object
 
 =cut
 
 sub getNode {
     my ($self, $path) = @_;
+    return XML::TinyXML::Node->new(XmlGetNodeCompiled($self->{_ctx}, $path->{_path}))
+        if (UNIVERSAL::isa($path, "XML::TinyXML::Path"));
     return XML::TinyXML::Node->new(XmlGetNode($self->{_ctx}, $path));
 }
 
+=item * getNodes ($path)
+
+Get all the nodes matching a path, in document order.
+
+$path has the same format accepted by getNode(), but each component
+matches all the children with that name (not only the first one).
+'name[n]' still matches only the n-th child with that name, while
+'name[@attr]' and 'name[@attr="value"]' match all the children having the attribute.
+
+Returns a list of XML::TinyXML::Node objects
+
+=cut
+
+sub getNodes {
+    my ($self, $path) = @_;
+    return map { XML::TinyXML::Node->new($_) } XmlGetNodes($self->{_ctx}, $path);
+}
+
+=item * indexAttributes ([ @names ])
+
+Index the nodes of the document by the value of the attributes named in @names
+('id' if not provided), replacing the attributes indexed so far.
+The index is kept up to date while the document is modified.
+
+Indexed attributes make getNodeByAttribute() constant time, and they're used as well by
+getNode() for predicates like 'name[@attr="value"]' and by the id() XPath function.
+
+Returns XML_NOERR if success, a specific error code otherwise
+
+=cut
+
+sub indexAttributes {
+    my ($self, @names) = @_;
+    return XmlIndexAttributes($self->{_ctx}, @names);
+}
+
+=item * dropIndex ()
+
+Drop the index built by indexAttributes()
+
+=cut
+
+sub dropIndex {
+    my $self = shift;
+    XmlDropIndex($self->{_ctx});
+}
+
+=item * getNodeByAttribute ($name, $value)
+
+Get the first node (in document order) having the attribute $name set to $value.
+$name must be indexed (see indexAttributes()).
+
+Returns an XML::TinyXML::Node object (undef if there is no such node)
+
+=cut
+
+sub getNodeByAttribute {
+    my ($self, $name, $value) = @_;
+    return XML::TinyXML::Node->new(XmlGetNodeByAttribute($self->{_ctx}, $name, $value));
+}
+
+=item * xpath ($expr, [ $node ])
+
+Evaluate the XPath 1.0 expression $expr using the native evaluator.
+$node (an XML::TinyXML::Node object) is used as context node,
+if not provided the expression is evaluated at the root of the document.
+
+$expr can be either a string or an XML::TinyXML::XPath object (a compiled expression).
+Strings are compiled only the first time they are seen: the compiled expressions
+are kept in a cache shared by all the documents (holding at most 256 expressions).
+
+All the axes and the whole core function library are supported.
+Unprefixed names match elements in any namespace, while prefixed ones
+must use the same prefix used in the document.
+
+If $expr selects a node-set, returns the selected nodes in document order:
+XML::TinyXML::Node objects for elements, comments and CDATA sections,
+XML::TinyXML::NodeAttribute objects for attributes, plain strings for the
+value of elements (text()) and the XML::TinyXML object itself for the root.
+In scalar context only the first node is returned.
+
+Otherwise returns the resulting string, number or boolean (1 or 0).
+
+Returns undef (or an empty list) if $expr is malformed
+
+=cut
+
+my $xpathCache;
+
+sub xpath {
+    my ($self, $expr, $node) = @_;
+    my $res;
+    if (UNIVERSAL::isa($expr, "XML::TinyXML::XPath")) {
+        $res = XmlXPathEvaluateCompiled($self->{_ctx}, $node ? $node->{_node} : undef, $expr->{_expr});
+    } else {
+        $xpathCache = XmlXPathCreateCache(256) unless($xpathCache);
+        $res = XmlXPathCacheEvaluate($xpathCache, $self->{_ctx}, $node ? $node->{_node} : undef, $expr);
+    }
+    return unless(defined($res));
+    return $res unless(ref($res) eq "ARRAY");
+    my @nodes = $self->_xpathNodes($res);
+    return wantarray ? @nodes : $nodes[0];
+}
+
+=item * xpathBatch ($batch, [ $node ])
+
+Evaluates all the expressions of $batch (an XML::TinyXML::XPath::Batch object)
+during a single walk of the document, using $node as context node if provided.
+
+Returns a list with the value of each expression (in the order they have been
+added to the batch) : node-sets are returned as array references (holding the
+same objects returned by xpath()), the other values as scalars.
+The value of an expression which can't be evaluated is undef
+
+=cut
+
+sub xpathBatch {
+    my ($self, $batch, $node) = @_;
+    my @values = XmlXPathBatchEvaluate($self->{_ctx}, $node ? $node->{_node} : undef, $batch->{_batch});
+    return map { ref($_) eq "ARRAY" ? [ $self->_xpathNodes($_) ] : $_ } @values;
+}
+
+# wrap the nodes returned by the XmlXPath functions
+sub _xpathNodes {
+    my ($self, $res) = @_;
+    return map {
+        if (!ref($_)) {
+            $_;
+        } elsif (UNIVERSAL::isa($_, "XmlNodeAttributePtr")) {
+            XML::TinyXML::NodeAttribute->new($_);
+        } elsif (UNIVERSAL::isa($_, "TXmlPtr")) {
+            $self;
+        } else {
+            XML::TinyXML::Node->new($_);
+        }
+    } @$res;
+}
+
 =item * getChildNode ($node, $index)
 
 Get the child of $node at index $index.
@@ -629,6 +941,9 @@ sub cNode {
 
 Save the xml document represented internally into $path.
 
+The file is compressed if compression() has been set,
+or if $path ends with '.gz' (gzip) or '.zst' (zstd).
+
 Returns XML_NOERR if success, a specific error code otherwise
 
 =cut
@@ -638,6 +953,75 @@ sub save {
     return XmlSave($self->{_ctx}, $path);
 }
 
+=item * saveSnapshot ($path)
+
+Save a binary image of the document into $path, which can be loaded back
+by loadSnapshot() much faster than parsing the xml again.
+
+Snapshots are meant as a cache of the parsed document : they can be loaded
+only on hosts with the same architecture and by the same version of this module.
+The file is replaced atomically, so processes still using the previous
+snapshot are not affected.
+
+Returns XML_NOERR if success, a specific error code otherwise
+
+=cut
+
+sub saveSnapshot {
+    my ($self, $path) = @_;
+    return XmlSaveSnapshot($self->{_ctx}, $path);
+}
+
+=item * loadSnapshot ($path)
+
+Load a snapshot saved by saveSnapshot(), replacing the current document.
+
+The snapshot is mapped in memory and used in place, so loading takes about
+the same time regardless of the size of the document, and the memory is
+shared among all the processes loading the same snapshot.
+The document can be queried and dumped as usual but it's read-only (see isReadOnly())
+until a new document is loaded.
+
+Returns XML_NOERR if success, a specific error code otherwise
+
+=cut
+
+sub loadSnapshot {
+    my ($self, $path) = @_;
+    return XmlLoadSnapshot($self->{_ctx}, $path);
+}
+
+=item * freeze ()
+
+Compact the document in a single read-only block of memory.
+From then on it can't be modified (see isReadOnly()) but lookups through getNode(),
+getChildNodeByName() and the node accessors don't modify anything nor allocate
+memory in the underlying library, so they can safely run concurrently
+(from C threads sharing the same context).
+
+Node objects obtained before freezing must not be used anymore.
+
+Returns XML_NOERR if success, a specific error code otherwise
+
+=cut
+
+sub freeze {
+    my $self = shift;
+    return XmlFreeze($self->{_ctx});
+}
+
+=item * isReadOnly ()
+
+Returns true if the document has been loaded from a snapshot (or frozen) and can't be modified.
+Methods modifying it return XML_UPDATE_ERR (or die, for node accessors).
+
+=cut
+
+sub isReadOnly {
+    my $self = shift;
+    return $self->{_ctx}->readOnly;
+}
+
 =item * setOutputEncoding ($encoding)
 
 Sets the output encding to the specified one
@@ -774,6 +1158,142 @@ sub ignoreWhiteSpaces {
            : $self->{_ctx}->ignoreWhiteSpaces;
 }
 
+=item * atomicSave ($bool)
+
+Controls how save() writes the document.
+
+If true, the document is written to a temporary file next to $path, flushed
+to disk and then renamed over $path. Readers will always see either the old
+or the new document and a crash in the middle of a save never leaves a
+truncated file around. The previous version is kept as "$path.bck" by
+hardlinking it (instead of copying its content).
+
+Not available on win32, where save() always rewrites the file in place.
+
+Default is 0.
+
+=cut
+
+sub atomicSave {
+    my ($self, $val) = @_;
+    return defined($val)
+           ? $self->{_ctx}->atomicSave($val)
+           : $self->{_ctx}->atomicSave;
+}
+
+=item * dumpCache ($bool)
+
+If true, the serialized document is kept in memory after each dump
+(including the ones done by save() and dumpToHandle()) and following dumps
+will serialize again only the branches modified in the meanwhile.
+Useful when dumping the same big document over and over after small changes.
+
+Changes are tracked by all methods modifying nodes and attributes
+(but renaming a namespace is not).
+
+Default is 0.
+
+=cut
+
+sub dumpCache {
+    my ($self, $val) = @_;
+    return defined($val)
+           ? $self->{_ctx}->dumpCache($val)
+           : $self->{_ctx}->dumpCache;
+}
+
+=item * dumpThreads ($num)
+
+If greater than 1, dumps (including the ones done by save() and dumpToHandle())
+will serialize the children of the root node on $num threads and join the
+results in order. Worth it for wide documents with a lot of big branches
+under the root node.
+
+Ignored if dumpCache() is enabled or if the module has been built without
+pthreads support.
+
+Default is 0.
+
+=cut
+
+sub dumpThreads {
+    my ($self, $val) = @_;
+    return defined($val)
+           ? $self->{_ctx}->dumpThreads($val)
+           : $self->{_ctx}->dumpThreads;
+}
+
+=item * validateUtf8 ($bool)
+
+If true, loadFile() and loadBuffer() will refuse (returning XML_BAD_CHARS)
+utf-8 documents containing malformed sequences in element names, attributes,
+values or comments.
+
+Default is 0.
+
+=cut
+
+sub validateUtf8 {
+    my ($self, $val) = @_;
+    return defined($val)
+           ? $self->{_ctx}->validateUtf8($val)
+           : $self->{_ctx}->validateUtf8;
+}
+
+=item * compression ($type)
+
+Compresses the output of save() and dumpToHandle().
+$type can be 'none', 'gzip' or 'zstd'.
+Returns the current compression type (or undef if $type is unknown).
+
+Default is 'none' (but save() compresses files named *.gz or *.zst anyway).
+
+=cut
+
+my %compressions = (none => 0, gzip => 1, zstd => 2);
+
+sub compression {
+    my ($self, $type) = @_;
+    if (defined($type)) {
+        return undef unless(exists($compressions{$type}));
+        $self->{_ctx}->compression($compressions{$type});
+    }
+    my $val = $self->{_ctx}->compression;
+    my ($name) = grep { $compressions{$_} == $val } keys(%compressions);
+    return $name;
+}
+
+=item * lockTimeout ($ms)
+
+loadFile() reads files holding a shared lock and save() writes them holding an
+exclusive one (advisory locks, respected by all the processes using this module).
+If the lock is held by another process, they wait for it up to $ms milliseconds
+before failing. 0 means not to wait at all, a negative value to wait forever.
+
+Default is 5000.
+
+=cut
+
+sub lockTimeout {
+    my ($self, $val) = @_;
+    return defined($val)
+           ? $self->{_ctx}->lockTimeout($val)
+           : $self->{_ctx}->lockTimeout;
+}
+
+=item * hasCompression ($type)
+
+Returns true if support for $type compression ('gzip' or 'zstd')
+has been compiled in
+
+=cut
+
+sub hasCompression {
+    my ($self, $type) = @_;
+    return 0 unless(defined($type) && exists($compressions{$type}));
+    return XmlHasCompression($compressions{$type});
+}
+
 sub hasIconv {
     my $self = shift;
     return $self->{_ctx}->hasIconv;
@@ -781,8 +1301,12 @@ sub hasIconv {
 
 sub DESTROY {
     my $self = shift;
-    XmlDestroyContext($self->{_ctx})
-        if($self->{_ctx});
+    return unless($self->{_ctx});
+    if ($self->{_pinned}) { # obtained from XML::TinyXML::Publisher::pin()
+        XmlUnpin($self->{_ctx});
+    } else {
+        XmlDestroyContext($self->{_ctx});
+    }
 }
 
 # Autoload methods go after =cut, and are processed by the autosplit program.
@@ -829,6 +1353,7 @@ None by default.
   XmlNode *XmlGetChildNode(XmlNode *node, unsigned long index)
   XmlNode *XmlGetChildNodeByName(XmlNode *node,char *name);
   XmlNode *XmlGetNode(TXml *xml,  char *path)
+  XmlNode *XmlGetNodes(TXml *xml, char *path) (returns a list)
   unsigned long XmlCountBranches(TXml *xml)
   int XmlRemoveBranch(TXml *xml, unsigned long index)
   XmlNode *XmlGetBranch(TXml *xml,unsigned long index);
@@ -836,10 +1361,14 @@ None by default.
   int XmlParseBuffer(TXml *xml, char *buf)
   int XmlSave(TXml *xml, char *path)
   char *XmlDump(TXml *xml, int *outlen)
+  int XmlDumpFd(TXml *xml, int fd)
 
 =head1 SEE ALSO
 
   XML::TinyXML::Node
+  XML::TinyXML::Path (to parse paths used by getNode() only once)
+  XML::TinyXML::XPath (to compile XPath expressions once and evaluate them many times)
+  XML::TinyXML::Writer (to produce huge documents without building a tree)
 
 You should also see libtinyxml documentation (mostly txml.h, redistributed with this module)
 
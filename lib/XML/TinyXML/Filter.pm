@@ -0,0 +1,184 @@
+# -*- tab-width: 4 -*-
+# ex: set tabstop=4:
+
+=head1 NAME
+
+XML::TinyXML::Filter - Route documents to the subscribers of the paths they match
+
+=head1 SYNOPSIS
+
+=over 4
+
+  use XML::TinyXML;
+  use XML::TinyXML::Filter;
+
+  $filter = XML::TinyXML::Filter->new();
+  $filter->add("books", "//item[\@type='book']", "/catalog/books");
+  $filter->add("music", "//item[\@type='cd']");
+  $filter->add("notes", "/catalog//p:note[\@lang='en']");
+
+  foreach $message (@messages) {
+      @subscribers = $filter->matchBuffer($message);
+      ...
+  }
+
+  @subscribers = $filter->match($txml); # documents already loaded
+
+=back
+
+=head1 DESCRIPTION
+
+A set of subscriptions, each one made of a subscriber and one or more paths.
+All the paths are merged into a single automaton (the steps they have in common
+are shared) which is run once over the document, so matching it costs about the
+same regardless of the number of subscriptions.
+
+Paths use the forward-only syntax accepted by XML::TinyXML::streamBuffer(),
+except for positional predicates.
+
+=head1 INSTANCE VARIABLES
+
+=over 4
+
+=item * _filter
+
+Reference to the underlying XmlFilterPtr object (which is a binding to the XmlFilter C structure)
+
+=item * _subscribers
+
+The subscribers, indexed by the id used for them in the underlying filter
+
+=item * _ids
+
+The ids of the subscribers, by subscriber
+
+=back
+
+=head1 METHODS
+
+=over 4
+
+=cut
+
+package XML::TinyXML::Filter;
+
+use strict;
+use warnings;
+use XML::TinyXML;
+
+our $VERSION = "0.34";
+
+=item new ()
+
+Creates an empty filter
+
+=cut
+sub new {
+    my ($class) = @_;
+    my $filter = XML::TinyXML::XmlCreateFilter();
+    return undef unless($filter);
+    return bless({ _filter => $filter, _subscribers => [], _ids => {} }, $class);
+}
+
+=item add ($subscriber, @paths)
+
+Subscribes $subscriber (any defined scalar, compared as a string)
+to the documents matching any of @paths.
+
+Returns the number of paths which couldn't be added
+(because they are malformed or not supported)
+
+=cut
+sub add {
+    my ($self, $subscriber, @paths) = @_;
+    return scalar(@paths) unless(defined($subscriber));
+    my $id = $self->{_ids}->{$subscriber};
+    unless (defined($id)) {
+        push(@{$self->{_subscribers}}, $subscriber);
+        $id = $self->{_ids}->{$subscriber} = $#{$self->{_subscribers}};
+    }
+    return scalar(grep {
+        !defined($_) or XML::TinyXML::XmlFilterAdd($self->{_filter}, $_, $id) != XML_NOERR
+    } @paths);
+}
+
+=item count ()
+
+Returns the number of paths added to the filter
+
+=cut
+sub count {
+    my $self = shift;
+    return XML::TinyXML::XmlFilterCount($self->{_filter});
+}
+
+=item match ($txml)
+
+Returns the subscribers of the paths matched by the document held by
+the XML::TinyXML object $txml (in the order they have been added)
+
+=cut
+sub match {
+    my ($self, $txml) = @_;
+    return () unless(UNIVERSAL::isa($txml, "XML::TinyXML"));
+    return $self->_subscribers(XML::TinyXML::XmlFilterDocument($self->{_filter}, $txml->{_ctx}));
+}
+
+=item matchBuffer ($buf)
+
+Same as match() but the document is parsed from $buf without building its tree.
+Parsing stops as soon as all the paths have been matched.
+
+Returns an empty list if the document is malformed
+
+=cut
+sub matchBuffer {
+    my ($self, $buf) = @_;
+    my $txml = XML::TinyXML->new();
+    return $self->_subscribers(XML::TinyXML::XmlFilterBuffer($self->{_filter}, $txml->{_ctx}, $buf));
+}
+
+=item matchFile ($file)
+
+Same as matchBuffer() but the document is read from $file
+
+=cut
+sub matchFile {
+    my ($self, $file) = @_;
+    my $txml = XML::TinyXML->new();
+    return $self->_subscribers(XML::TinyXML::XmlFilterFile($self->{_filter}, $txml->{_ctx}, $file));
+}
+
+sub _subscribers {
+    my ($self, $ids) = @_;
+    return () unless($ids);
+    return map { $self->{_subscribers}->[$_] } @$ids;
+}
+
+sub DESTROY {
+    my $self = shift;
+    XML::TinyXML::XmlDestroyFilter($self->{_filter})
+        if($self->{_filter});
+}
+
+1;
+
+=back
+
+=head1 SEE ALSO
+
+  XML::TinyXML
+
+=head1 AUTHOR
+
+xant, E<lt>xant@cpan.orgE<gt>
+
+=head1 COPYRIGHT AND LICENSE
+
+Copyright (C) 2008-2010 by xant
+
+This library is free software; you can redistribute it and/or modify
+it under the same terms as Perl itself, either Perl version 5.8.8 or,
+at your option, any later version of Perl 5 you may have available.
+
+=cut
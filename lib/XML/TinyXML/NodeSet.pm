@@ -0,0 +1,220 @@
+# -*- tab-width: 4 -*-
+# ex: set tabstop=4:
+
+=head1 NAME
+
+XML::TinyXML::NodeSet - Sets of nodes kept in document order
+
+=head1 SYNOPSIS
+
+=over 4
+
+  use XML::TinyXML;
+  use XML::TinyXML::NodeSet;
+
+  $big = XML::TinyXML::NodeSet->new($txml, $txml->getNodes("/items/item[\@size='big']"));
+  $red = XML::TinyXML::NodeSet->new($txml, $txml->getNodes("/items/item[\@color='red']"));
+
+  @bigAndRed = $big->intersection($red)->nodes;
+  @bigOrRed = $big->union($red)->nodes;
+  @bigNotRed = $big->difference($red)->nodes;
+  @firstTen = $big->range(1, 10)->nodes;
+
+=back
+
+=head1 DESCRIPTION
+
+A set of distinct nodes of a document, held by the underlying C library
+as an array sorted in document order. Sets are combined by merging the
+arrays, so union, intersection and difference take linear time.
+
+A set refers to the nodes, so it shouldn't be used anymore once
+its nodes have been removed from the document.
+
+=head1 INSTANCE VARIABLES
+
+=over 4
+
+=item * _set
+
+Reference to the underlying XmlNodeSetPtr object (which is a binding to the XmlNodeSet C structure)
+
+=item * _xml
+
+The XML::TinyXML object holding the nodes
+
+=back
+
+=head1 METHODS
+
+=over 4
+
+=cut
+
+package XML::TinyXML::NodeSet;
+
+use strict;
+use warnings;
+use XML::TinyXML;
+use XML::TinyXML::Node;
+
+our $VERSION = "0.34";
+
+=item new ($xml, [ @nodes ])
+
+Creates a set of nodes of the XML::TinyXML object $xml,
+initially holding @nodes (see add())
+
+=cut
+sub new {
+    my ($class, $xml, @nodes) = @_;
+    return undef unless(UNIVERSAL::isa($xml, "XML::TinyXML"));
+    my $set = XML::TinyXML::XmlCreateNodeSet($xml->{_ctx});
+    return undef unless($set);
+    my $self = bless({ _set => $set, _xml => $xml }, $class);
+    $self->add(@nodes);
+    return $self;
+}
+
+sub _wrap {
+    my ($self, $set) = @_;
+    return undef unless($set);
+    return bless({ _set => $set, _xml => $self->{_xml} }, ref($self));
+}
+
+=item add (@nodes)
+
+Adds @nodes (XML::TinyXML::Node objects or XmlNodePtr references) to the set.
+Nodes already in the set are ignored.
+
+Returns the number of nodes which couldn't be added
+(because they don't belong to the document)
+
+=cut
+sub add {
+    my ($self, @nodes) = @_;
+    my $errors = 0;
+    foreach my $node (@nodes) {
+        $node = $node->{_node} if(UNIVERSAL::isa($node, "XML::TinyXML::Node"));
+        if (!UNIVERSAL::isa($node, "XmlNodePtr") or
+            XML::TinyXML::XmlNodeSetAdd($self->{_set}, $node) != XML_NOERR)
+        {
+            $errors++;
+        }
+    }
+    return $errors;
+}
+
+=item count ()
+
+Returns the number of nodes in the set
+
+=cut
+sub count {
+    my $self = shift;
+    return XML::TinyXML::XmlNodeSetCount($self->{_set});
+}
+
+=item nodes ()
+
+Returns the nodes of the set (as XML::TinyXML::Node objects) in document order
+
+=cut
+sub nodes {
+    my $self = shift;
+    return map { XML::TinyXML::Node->new($_) } XML::TinyXML::XmlNodeSetNodes($self->{_set});
+}
+
+=item item ($position)
+
+Returns the node at $position (starting from 1) in document order,
+undef if out of range
+
+=cut
+sub item {
+    my ($self, $position) = @_;
+    return undef unless($position and $position > 0);
+    my $node = XML::TinyXML::XmlNodeSetItem($self->{_set}, $position);
+    return $node ? XML::TinyXML::Node->new($node) : undef;
+}
+
+=item contains ($node)
+
+Returns true if $node is in the set
+
+=cut
+sub contains {
+    my ($self, $node) = @_;
+    $node = $node->{_node} if(UNIVERSAL::isa($node, "XML::TinyXML::Node"));
+    return 0 unless(UNIVERSAL::isa($node, "XmlNodePtr"));
+    return XML::TinyXML::XmlNodeSetContains($self->{_set}, $node);
+}
+
+=item union ($set)
+
+Returns a new set with the nodes found in this set or in $set
+
+=cut
+sub union {
+    my ($self, $other) = @_;
+    return $self->_wrap(XML::TinyXML::XmlNodeSetUnion($self->{_set}, $other->{_set}));
+}
+
+=item intersection ($set)
+
+Returns a new set with the nodes found both in this set and in $set
+
+=cut
+sub intersection {
+    my ($self, $other) = @_;
+    return $self->_wrap(XML::TinyXML::XmlNodeSetIntersection($self->{_set}, $other->{_set}));
+}
+
+=item difference ($set)
+
+Returns a new set with the nodes of this set which are not in $set
+
+=cut
+sub difference {
+    my ($self, $other) = @_;
+    return $self->_wrap(XML::TinyXML::XmlNodeSetDifference($self->{_set}, $other->{_set}));
+}
+
+=item range ($first, [ $last ])
+
+Returns a new set with the nodes from position $first up to position $last
+(or up to the end of the set if $last is omitted), counting from 1
+
+=cut
+sub range {
+    my ($self, $first, $last) = @_;
+    return $self->_wrap(XML::TinyXML::XmlNodeSetRange($self->{_set}, $first || 1, $last || 0));
+}
+
+sub DESTROY {
+    my $self = shift;
+    XML::TinyXML::XmlDestroyNodeSet($self->{_set})
+        if($self->{_set});
+}
+
+1;
+
+=back
+
+=head1 SEE ALSO
+
+  XML::TinyXML XML::TinyXML::Selector::XPath
+
+=head1 AUTHOR
+
+xant, E<lt>xant@cpan.orgE<gt>
+
+=head1 COPYRIGHT AND LICENSE
+
+Copyright (C) 2008-2010 by xant
+
+This library is free software; you can redistribute it and/or modify
+it under the same terms as Perl itself, either Perl version 5.8.8 or,
+at your option, any later version of Perl 5 you may have available.
+
+=cut
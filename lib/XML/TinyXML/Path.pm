@@ -0,0 +1,105 @@
+# -*- tab-width: 4 -*-
+# ex: set tabstop=4:
+
+=head1 NAME
+
+XML::TinyXML::Path - Compiled paths for XML::TinyXML::getNode()
+
+=head1 SYNOPSIS
+
+=over 4
+
+  use XML::TinyXML;
+  use XML::TinyXML::Path;
+
+  $path = XML::TinyXML::Path->new("/servers/server[\@name='main']/port");
+
+  foreach $config (@configs) {
+      $port = $config->getNode($path)->value;
+      ...
+  }
+
+=back
+
+=head1 DESCRIPTION
+
+A path (in the format accepted by XML::TinyXML::getNode()) parsed only once.
+Entities in the attribute values of its predicates are decoded once as well,
+so looking it up in a document only compares names and values.
+
+=head1 INSTANCE VARIABLES
+
+=over 4
+
+=item * _path
+
+Reference to the underlying XmlCompiledPathPtr object (which is a binding to the XmlCompiledPath C structure)
+
+=back
+
+=head1 METHODS
+
+=over 4
+
+=cut
+
+package XML::TinyXML::Path;
+
+use strict;
+use warnings;
+use XML::TinyXML;
+
+our $VERSION = "0.34";
+
+=item new ($path)
+
+Compiles $path.
+
+Returns undef if $path contains unknown entities
+
+=cut
+sub new {
+    my ($class, $path) = @_;
+    return undef unless(defined($path));
+    my $compiled = XML::TinyXML::XmlCompilePath($path);
+    return undef unless($compiled);
+    return bless({ _path => $compiled, _string => $path }, $class);
+}
+
+=item string ()
+
+Returns the path as it was given to new()
+
+=cut
+sub string {
+    my $self = shift;
+    return $self->{_string};
+}
+
+sub DESTROY {
+    my $self = shift;
+    XML::TinyXML::XmlDestroyCompiledPath($self->{_path})
+        if($self->{_path});
+}
+
+1;
+
+=back
+
+=head1 SEE ALSO
+
+  XML::TinyXML
+
+=head1 AUTHOR
+
+xant, E<lt>xant@cpan.orgE<gt>
+
+=head1 COPYRIGHT AND LICENSE
+
+Copyright (C) 2008-2010 by xant
+
+This library is free software; you can redistribute it and/or modify
+it under the same terms as Perl itself, either Perl version 5.8.8 or,
+at your option, any later version of Perl 5 you may have available.
+
+=cut
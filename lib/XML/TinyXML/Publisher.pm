@@ -0,0 +1,150 @@
+# -*- tab-width: 4 -*-
+# ex: set tabstop=4:
+
+=head1 NAME
+
+XML::TinyXML::Publisher - Versioned publishing of documents to concurrent readers
+
+=head1 SYNOPSIS
+
+=over 4
+
+  use XML::TinyXML;
+  use XML::TinyXML::Publisher;
+
+  $publisher = XML::TinyXML::Publisher->new();
+
+  $config = XML::TinyXML->new();
+  $config->loadFile("config.xml");
+  $publisher->publish($config); # $config is empty from now on
+
+  # readers
+  $current = $publisher->pin;
+  $value = $current->getNode("/some/value")->value;
+  undef($current); # unpinned
+
+  # reloading
+  $config = XML::TinyXML->new();
+  $config->loadFile("config.xml");
+  $publisher->publish($config);
+
+=back
+
+=head1 DESCRIPTION
+
+Publishes successive versions of a document. A new version replaces the
+current one atomically, while readers pin the version they are using
+without taking any lock : a pinned version stays valid and unchanged until
+it's released, even if newer ones get published meanwhile.
+Each version is freed as soon as it's not pinned anymore.
+
+This is mostly useful to C code embedding the library (see XmlPublish() in txml.h),
+where readers run on many threads.
+
+=head1 INSTANCE VARIABLES
+
+=over 4
+
+=item * _publisher
+
+Reference to the underlying XmlPublisherPtr object (which is a binding to the XmlPublisher C structure)
+
+=back
+
+=head1 METHODS
+
+=over 4
+
+=cut
+
+package XML::TinyXML::Publisher;
+
+use strict;
+use warnings;
+use XML::TinyXML;
+
+our $VERSION = "0.34";
+
+=item new ()
+
+Creates a new publisher, with no document published yet
+
+=cut
+sub new {
+    my ($class) = @_;
+    my $publisher = XML::TinyXML::XmlCreatePublisher();
+    return undef unless($publisher);
+    return bless({ _publisher => $publisher }, $class);
+}
+
+=item publish ($txml)
+
+Publishes the document held by the XML::TinyXML object $txml as the new version.
+The document is frozen (see XML::TinyXML::freeze()) and moved into the publisher,
+leaving $txml empty.
+
+Returns XML_NOERR if success, a specific error code otherwise
+
+=cut
+sub publish {
+    my ($self, $txml) = @_;
+    return XML::TinyXML->XML_BADARGS
+        unless(UNIVERSAL::isa($txml, "XML::TinyXML") && !$txml->{_pinned});
+    my $rc = XML::TinyXML::XmlPublish($self->{_publisher}, $txml->{_ctx});
+    $txml->{_ctx} = XML::TinyXML::XmlCreateContext()
+        if ($rc == XML::TinyXML->XML_NOERR);
+    return $rc;
+}
+
+=item pin ()
+
+Returns an XML::TinyXML object holding the current version of the document
+(undef if none has been published). The version is released when the object goes away.
+
+The returned object is read-only (see XML::TinyXML::isReadOnly())
+
+=cut
+sub pin {
+    my $self = shift;
+    my $ctx = XML::TinyXML::XmlPin($self->{_publisher});
+    return undef unless($ctx);
+    return bless({ _ctx => $ctx, _pinned => 1 }, "XML::TinyXML");
+}
+
+=item version ()
+
+Returns the number of versions published so far
+
+=cut
+sub version {
+    my $self = shift;
+    return XML::TinyXML::XmlPublisherVersion($self->{_publisher});
+}
+
+sub DESTROY {
+    my $self = shift;
+    XML::TinyXML::XmlDestroyPublisher($self->{_publisher})
+        if($self->{_publisher});
+}
+
+1;
+
+=back
+
+=head1 SEE ALSO
+
+  XML::TinyXML
+
+=head1 AUTHOR
+
+xant, E<lt>xant@cpan.orgE<gt>
+
+=head1 COPYRIGHT AND LICENSE
+
+Copyright (C) 2008-2010 by xant
+
+This library is free software; you can redistribute it and/or modify
+it under the same terms as Perl itself, either Perl version 5.8.8 or,
+at your option, any later version of Perl 5 you may have available.
+
+=cut
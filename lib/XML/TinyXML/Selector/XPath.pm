@@ -15,6 +15,9 @@ XML::TinyXML::Selector::XPath - XPath-compliant selector for XML::TinyXML
 
   $selector = XML::TinyXML::Selector->new($xml, "XPath");
 
+  # or, to use the native XPath 1.0 evaluator (much faster on big documents):
+  $selector = XML::TinyXML::Selector->new($xml, "XPath", native => 1);
+
   #####
   Assuming the following xml data :
   <?xml version="1.0"?>
@@ -81,6 +84,7 @@ use base qw(XML::TinyXML::Selector);
 use XML::TinyXML::Selector::XPath::Context;
 use XML::TinyXML::Selector::XPath::Functions;
 use XML::TinyXML::Selector::XPath::Axes;
+use XML::TinyXML::NodeSet;
 
 our $VERSION = '0.34';
 
@@ -140,11 +144,23 @@ our @Axes = qw(
     ancestor-or-self
 );
 
-=item * init ()
+=item * init (%args)
+
+Accepted arguments :
+
+  native => 1
+
+    evaluate the expressions with the native XPath 1.0 evaluator
+    (see XML::TinyXML::xpath()) instead of the pure-perl implementation.
+    Expressions are evaluated relative to $cnode (or to the root of the document)
+    and strictly follow the XPath specification, so results can differ from
+    the ones obtained with the pure-perl implementation
+    (for instance '*' doesn't select comments and literals must be quoted)
 
 =cut
 sub init {
     my ($self, %args) = @_;
+    $self->{native} = $args{native};
     $self->{context} = XML::TinyXML::Selector::XPath::Context->new($self->{_xml});
     return $self;
 }
@@ -153,9 +169,14 @@ sub init {
 
 =cut
 sub select {
-    my ($self, $expr) = @_;
-    my $expanded_expr = $self->_expand_abbreviated($expr);
-    my $set = $self->_select_unabbreviated($expanded_expr);
+    my ($self, $expr, $cnode) = @_;
+    my $set;
+    if ($self->{native}) {
+        $set = $self->_select_native($expr, $cnode);
+    } else {
+        my $expanded_expr = $self->_expand_abbreviated($expr);
+        $set = $self->_select_unabbreviated($expanded_expr);
+    }
     if ($set) {
         return wantarray
                ? @$set
@@ -182,6 +203,12 @@ sub resetContext {
 
 ###### PRIVATE METHODS ######
 
+# the context isn't used (nor updated) by the native evaluator
+sub _select_native {
+    my ($self, $expr, $cnode) = @_;
+    return [ $self->{_xml}->xpath($expr, $cnode) ];
+}
+
 sub _expand_abbreviated {
     my ($self, $expr) = @_;
 
@@ -233,6 +260,22 @@ sub _expand_axis {
     }
 }
 
+# Private method
+# 'and' and 'or' between the sets selected by two predicates are
+# an intersection and an union, computed by merging the sets in document order
+sub _combine_sets {
+    my ($self, $op, @sets) = @_;
+    @sets = map {
+        UNIVERSAL::isa($_, "XML::TinyXML::NodeSet")
+            ? $_
+            : XML::TinyXML::NodeSet->new($self->{_xml}, grep { defined } @{$_ || []})
+    } @sets[0, 1];
+    my $set = ($op eq 'and')
+            ? $sets[0]->intersection($sets[1])
+            : $sets[0]->union($sets[1]);
+    return [ $set->nodes ];
+}
+
 sub _unescape {
     my ($self, $string) = @_;
 
@@ -334,26 +377,23 @@ sub _select_unabbreviated {
                     } elsif ($predicate_string =~ /::/) {
                         my ($p, $v) = split('=', $predicate_string);
                         $v =~ s/(^['"]|['"]$)//g if ($v); # XXX - unsafe dequoting ... think more to find a better regexp
-                        my %uniq;
-                        my @nodepaths;
+                        # the set drops the duplicates and keeps the nodes in document order
+                        my $set = XML::TinyXML::NodeSet->new($self->{_xml});
                         foreach my $node ($self->_select_unabbreviated($p ,1)) {
                             if ($node->type eq "ATTRIBUTE") {
-                                my $nodepath = $node->node->path;
                                 next if ($v && $node->value ne $self->_unescape($v));
-                                push(@nodepaths, $nodepath) if (!$uniq{$nodepath});
-                                $uniq{$nodepath} = $node->node
+                                $set->add($node->node);
                             } else {
                                 my $parent = $node->parent;
                                 if ($parent) {
                                     next if ($v && $node->value ne $v);
-                                    push(@nodepaths, $parent->path) if (!$uniq{$parent->path});
-                                    $uniq{$parent->path} = $parent
+                                    $set->add($parent);
                                 } else {
                                     # TODO - Error Messages
                                 }
                             }
                         }
-                        push (@itemrefs, [ map { $uniq{$_} } @nodepaths ]);
+                        push (@itemrefs, $set);
                     } else {
                         my $predicate = $self->_parse_predicate($predicate_string);
                         if ($predicate->{attr}) {
@@ -394,7 +434,9 @@ sub _select_unabbreviated {
                     $self->{context} = $saved_context2;
                 }
                 if ($op) {
-                    $self->context->{items}  = $self->context->operators->{$op}->(@itemrefs);
+                    $self->context->{items} = $self->_combine_sets($op, @itemrefs);
+                } elsif (UNIVERSAL::isa($itemrefs[0], "XML::TinyXML::NodeSet")) {
+                    $self->context->{items} = [ $itemrefs[0]->nodes ];
                 } else {
                     $self->context->{items} = $itemrefs[0];
                 }
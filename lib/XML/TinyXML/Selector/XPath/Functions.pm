@@ -28,6 +28,9 @@ sub count {
 
 sub id {
     my ($class, $context, $id, $cnode) = @_;
+    my $xml = $context->{xml};
+    return $xml->getNodeByAttribute("id", $id)
+        if (!$cnode && XML::TinyXML::XmlIsIndexed($xml->{_ctx}, "id"));
     foreach my $child ($cnode?$cnode->children:$context->{xml}->rootNodes) {
         my @selection;
         if ($child->attributes->{id} and $child->attributes->{id} eq $id) {
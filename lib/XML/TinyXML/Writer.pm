@@ -0,0 +1,235 @@
+# -*- tab-width: 4 -*-
+# ex: set tabstop=4:
+
+=head1 NAME
+
+XML::TinyXML::Writer - Streaming xml writer
+
+=head1 SYNOPSIS
+
+=over 4
+
+  use XML::TinyXML::Writer;
+
+  open(my $fh, ">", "export.xml");
+  $writer = XML::TinyXML::Writer->new(fh => $fh, pretty => 1);
+
+  $writer->startDocument;
+  $writer->startElement("rows");
+  foreach my $row (@rows) {
+      $writer->startElement("row");
+      $writer->attribute("id", $row->{id});
+      $writer->text($row->{value});
+      $writer->endElement;
+  }
+  $writer->endElement;
+  $writer->flush;
+
+  # without a filehandle the output is kept in memory
+  $writer = XML::TinyXML::Writer->new();
+  ...
+  $xmlstring = $writer->buffer;
+
+=back
+
+=head1 DESCRIPTION
+
+Produces an xml document on the fly without building any tree, so that
+even huge documents can be exported using a constant amount of memory.
+The output is collected in a fixed-size buffer which is written to the
+filehandle each time it fills up (and when flush() is called).
+
+Values and attributes are escaped the same way XML::TinyXML::dump() does.
+
+=head1 INSTANCE VARIABLES
+
+=over 4
+
+=item * _writer
+
+Reference to the underlying XmlWriterPtr object (which is a binding to the XmlWriter C structure)
+
+=back
+
+=head1 METHODS
+
+=over 4
+
+=cut
+
+package XML::TinyXML::Writer;
+
+use strict;
+use warnings;
+use XML::TinyXML;
+
+our $VERSION = "0.34";
+
+=item new (%args)
+
+Creates a new writer. Accepted arguments are :
+
+=over
+
+=item * fh
+
+The filehandle where the output will be written to.
+If missing, the output is kept in memory and can be obtained through buffer()
+
+=item * pretty
+
+If true the output will be indented the same way XML::TinyXML::dump() does
+when ignoreBlanks is set
+
+=back
+
+=cut
+sub new {
+    my ($class, %args) = @_;
+    my $pretty = $args{pretty} ? 1 : 0;
+    my $writer;
+    if (defined($args{fh})) {
+        my $fd = ref($args{fh}) ? fileno($args{fh}) : $args{fh};
+        return undef unless(defined($fd));
+        $writer = XML::TinyXML::XmlCreateFdWriter($fd, $pretty);
+    } else {
+        $writer = XML::TinyXML::XmlCreateBufferWriter($pretty);
+    }
+    return undef unless($writer);
+    my $self = bless({ _writer => $writer, _fh => $args{fh} }, $class);
+    $self->_syncHandle;
+    return $self;
+}
+
+# flush anything perl has still buffered on the filehandle before
+# writing behind its back
+sub _syncHandle {
+    my $self = shift;
+    my $fh = $self->{_fh};
+    if (ref($fh)) {
+        my $old = select($fh);
+        $| = 1;
+        select($old);
+    }
+}
+
+=item startDocument ()
+
+Writes the <?xml ... ?> declaration (the output is always utf-8)
+
+=cut
+sub startDocument {
+    my $self = shift;
+    return XML::TinyXML::XmlWriterStartDocument($self->{_writer});
+}
+
+=item startElement ($name)
+
+Opens a new element (nested in the current one, if any).
+$name can contain a namespace prefix (as in "ns:name")
+
+=cut
+sub startElement {
+    my ($self, $name) = @_;
+    return XML::TinyXML::XmlWriterStartElement($self->{_writer}, $name);
+}
+
+=item attribute ($name, $value)
+
+Adds an attribute to the element just opened
+(before any text or child has been written to it)
+
+=cut
+sub attribute {
+    my ($self, $name, $value) = @_;
+    return XML::TinyXML::XmlWriterAttribute($self->{_writer}, $name, defined($value) ? $value : "");
+}
+
+=item text ($text)
+
+Writes some text inside the current element
+
+=cut
+sub text {
+    my ($self, $text) = @_;
+    return XML::TinyXML::XmlWriterText($self->{_writer}, defined($text) ? $text : "");
+}
+
+=item cdata ($data)
+
+Writes a CDATA section inside the current element
+
+=cut
+sub cdata {
+    my ($self, $data) = @_;
+    return XML::TinyXML::XmlWriterCData($self->{_writer}, defined($data) ? $data : "");
+}
+
+=item comment ($comment)
+
+Writes a comment
+
+=cut
+sub comment {
+    my ($self, $comment) = @_;
+    return XML::TinyXML::XmlWriterComment($self->{_writer}, defined($comment) ? $comment : "");
+}
+
+=item endElement ()
+
+Closes the current element
+
+=cut
+sub endElement {
+    my $self = shift;
+    return XML::TinyXML::XmlWriterEndElement($self->{_writer});
+}
+
+=item flush ()
+
+Writes all the buffered output to the filehandle
+
+=cut
+sub flush {
+    my $self = shift;
+    return XML::TinyXML::XmlWriterFlush($self->{_writer});
+}
+
+=item buffer ()
+
+Returns the output produced so far (only if the writer has no filehandle)
+
+=cut
+sub buffer {
+    my $self = shift;
+    return undef if (defined($self->{_fh}));
+    return XML::TinyXML::XmlWriterBuffer($self->{_writer});
+}
+
+sub DESTROY {
+    my $self = shift;
+    XML::TinyXML::XmlDestroyWriter($self->{_writer})
+        if($self->{_writer});
+}
+
+1;
+
+=back
+
+=head1 SEE ALSO
+
+  XML::TinyXML
+
+=head1 AUTHOR
+
+xant, E<lt>xant@cpan.orgE<gt>
+
+=head1 COPYRIGHT AND LICENSE
+
+Copyright (C) 2008-2010 by xant
+
+This library is free software; you can redistribute it and/or modify
+it under the same terms as Perl itself, either Perl version 5.8.8 or,
+at your option, any later version of Perl 5 you may have available.
+
+=cut
@@ -0,0 +1,120 @@
+# -*- tab-width: 4 -*-
+# ex: set tabstop=4:
+
+=head1 NAME
+
+XML::TinyXML::XPath - Compiled XPath expressions
+
+=head1 SYNOPSIS
+
+=over 4
+
+  use XML::TinyXML;
+  use XML::TinyXML::XPath;
+
+  $xpath = XML::TinyXML::XPath->new("//item[\@id = 'a']/price");
+
+  foreach $txml (@documents) {
+      @prices = $xpath->evaluate($txml);
+      ...
+  }
+
+=back
+
+=head1 DESCRIPTION
+
+An XPath 1.0 expression parsed only once, which can then be evaluated
+any number of times against any document (see XML::TinyXML::xpath()).
+
+A compiled expression is never modified by the evaluation, so the same
+object can be safely shared by many threads.
+
+=head1 INSTANCE VARIABLES
+
+=over 4
+
+=item * _expr
+
+Reference to the underlying XmlXPathExprPtr object (which is a binding to the XmlXPathExpr C structure)
+
+=back
+
+=head1 METHODS
+
+=over 4
+
+=cut
+
+package XML::TinyXML::XPath;
+
+use strict;
+use warnings;
+use XML::TinyXML;
+
+our $VERSION = "0.34";
+
+=item new ($expr)
+
+Compiles the XPath expression $expr.
+
+Returns undef if $expr is malformed
+
+=cut
+sub new {
+    my ($class, $expr) = @_;
+    return undef unless(defined($expr));
+    my $compiled = XML::TinyXML::XmlXPathCompile($expr);
+    return undef unless($compiled);
+    return bless({ _expr => $compiled, _string => $expr }, $class);
+}
+
+=item evaluate ($txml, [ $node ])
+
+Evaluates the expression against the document held by the XML::TinyXML object $txml,
+using $node (an XML::TinyXML::Node object) as context node if provided.
+
+Returns the same as XML::TinyXML::xpath()
+
+=cut
+sub evaluate {
+    my ($self, $txml, $node) = @_;
+    return $txml->xpath($self, $node);
+}
+
+=item string ()
+
+Returns the expression as it was given to new()
+
+=cut
+sub string {
+    my $self = shift;
+    return $self->{_string};
+}
+
+sub DESTROY {
+    my $self = shift;
+    XML::TinyXML::XmlXPathDestroyExpr($self->{_expr})
+        if($self->{_expr});
+}
+
+1;
+
+=back
+
+=head1 SEE ALSO
+
+  XML::TinyXML
+
+=head1 AUTHOR
+
+xant, E<lt>xant@cpan.orgE<gt>
+
+=head1 COPYRIGHT AND LICENSE
+
+Copyright (C) 2008-2010 by xant
+
+This library is free software; you can redistribute it and/or modify
+it under the same terms as Perl itself, either Perl version 5.8.8 or,
+at your option, any later version of Perl 5 you may have available.
+
+=cut
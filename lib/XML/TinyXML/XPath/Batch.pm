@@ -0,0 +1,130 @@
+# -*- tab-width: 4 -*-
+# ex: set tabstop=4:
+
+=head1 NAME
+
+XML::TinyXML::XPath::Batch - XPath expressions evaluated together
+
+=head1 SYNOPSIS
+
+=over 4
+
+  use XML::TinyXML;
+  use XML::TinyXML::XPath::Batch;
+
+  $batch = XML::TinyXML::XPath::Batch->new("/order/\@id",
+                                           "/order/customer/name/text()",
+                                           "//item[\@type='book']/price");
+
+  foreach $txml (@orders) {
+      ($id, $name, $prices) = $batch->evaluate($txml);
+      ...
+  }
+
+=back
+
+=head1 DESCRIPTION
+
+A set of XPath 1.0 expressions compiled once and evaluated all at once.
+
+The location paths which only walk down the tree (made of child, descendant,
+descendant-or-self and self steps, optionally ending with an attribute step,
+whose predicates don't depend on the position of the nodes) are merged so that
+their common prefixes are evaluated only once, and all of them are evaluated
+during a single walk of the document. Any other expression is evaluated on its own.
+
+=head1 INSTANCE VARIABLES
+
+=over 4
+
+=item * _batch
+
+Reference to the underlying XmlXPathBatchPtr object (which is a binding to the XmlXPathBatch C structure)
+
+=back
+
+=head1 METHODS
+
+=over 4
+
+=cut
+
+package XML::TinyXML::XPath::Batch;
+
+use strict;
+use warnings;
+use XML::TinyXML;
+use XML::TinyXML::XPath;
+
+our $VERSION = "0.34";
+
+=item new (@exprs)
+
+Creates a batch of expressions.
+@exprs can hold strings or XML::TinyXML::XPath objects.
+
+Returns undef if any of the expressions is malformed
+
+=cut
+sub new {
+    my ($class, @exprs) = @_;
+    my @compiled = map {
+        UNIVERSAL::isa($_, "XML::TinyXML::XPath") ? $_ : XML::TinyXML::XPath->new($_)
+    } @exprs;
+    return undef if (grep { !defined($_) } @compiled);
+    # the batch holds its own references to the compiled expressions
+    my $batch = XML::TinyXML::XmlXPathCreateBatch([ map { $_->{_expr} } @compiled ]);
+    return undef unless($batch);
+    return bless({ _batch => $batch, _strings => [ map { $_->string } @compiled ] }, $class);
+}
+
+=item evaluate ($txml, [ $node ])
+
+Evaluates all the expressions against the document held by the XML::TinyXML object $txml,
+using $node (an XML::TinyXML::Node object) as context node if provided.
+
+Returns the same as XML::TinyXML::xpathBatch()
+
+=cut
+sub evaluate {
+    my ($self, $txml, $node) = @_;
+    return $txml->xpathBatch($self, $node);
+}
+
+=item strings ()
+
+Returns the expressions as they were given to new()
+
+=cut
+sub strings {
+    my $self = shift;
+    return @{$self->{_strings}};
+}
+
+sub DESTROY {
+    my $self = shift;
+    XML::TinyXML::XmlXPathDestroyBatch($self->{_batch})
+        if($self->{_batch});
+}
+
+1;
+
+=back
+
+=head1 SEE ALSO
+
+  XML::TinyXML XML::TinyXML::XPath
+
+=head1 AUTHOR
+
+xant, E<lt>xant@cpan.orgE<gt>
+
+=head1 COPYRIGHT AND LICENSE
+
+Copyright (C) 2008-2010 by xant
+
+This library is free software; you can redistribute it and/or modify
+it under the same terms as Perl itself, either Perl version 5.8.8 or,
+at your option, any later version of Perl 5 you may have available.
+
+=cut
@@ -1,7 +1,7 @@
 
 use strict;
 
-use Test::More tests => 4;
+use Test::More tests => 10;
 BEGIN { use_ok('XML::TinyXML') };
 
 my $txml = XML::TinyXML->new();
@@ -42,3 +42,30 @@ is ($node->value, ' ');
 
 #warn "IN '$in'";
 #warn "OUT '$out'";
+
+# dumping straight to a filehandle must produce the very same output
+use File::Temp qw(tempfile);
+foreach my $blanks (1, 0) {
+    $txml->ignoreBlanks($blanks);
+    $txml->loadFile("./t/t.xml");
+    my ($fh, $filename) = tempfile(UNLINK => 1);
+    is ($txml->dumpToHandle($fh), XML_NOERR);
+    close($fh);
+    open(IN, $filename);
+    my $written = join('', <IN>);
+    close(IN);
+    is ($written, $txml->dump, "dumpToHandle (ignoreBlanks = $blanks)");
+}
+
+# what has been printed before is flushed, without touching the handle settings
+my ($fh, $filename) = tempfile(UNLINK => 1);
+print $fh "<!-- before -->\n";
+$txml->dumpToHandle($fh);
+my $old = select($fh);
+my $autoflush = $|;
+select($old);
+ok (!$autoflush, "autoflush left off");
+close($fh);
+open(IN, $filename);
+is (join('', <IN>), "<!-- before -->\n" . $txml->dump, "buffered output written first");
+close(IN);
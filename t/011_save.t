@@ -0,0 +1,43 @@
+use strict;
+use Test::More;
+use XML::TinyXML;
+use File::Temp qw(tempdir);
+
+if ($^O eq 'MSWin32') {
+    plan skip_all => "atomic saves are not supported on win32";
+} else {
+    plan tests => 10;
+}
+
+my $dir = tempdir(CLEANUP => 1);
+my $path = "$dir/save.xml";
+
+my $txml = XML::TinyXML->new();
+$txml->loadFile("./t/t.xml");
+my $orig = $txml->dump;
+
+is ($txml->atomicSave, 0, "atomicSave defaults to off");
+$txml->atomicSave(1);
+is ($txml->atomicSave, 1);
+
+is ($txml->save($path), XML_NOERR, "save on a new file");
+ok (! -e "$path.bck", "nothing to backup on a new file");
+
+my $txml2 = XML::TinyXML->new();
+$txml2->loadFile($path);
+is ($txml2->dump, $orig, "saved document reloads unchanged");
+
+chmod(0640, $path);
+my $ino = (stat($path))[1];
+$txml->getNode("/hello")->value("there");
+is ($txml->save($path), XML_NOERR, "save over an existing file");
+is ((stat($path))[2] & 07777, 0640, "permissions are preserved");
+is ((stat("$path.bck"))[1], $ino, "backup is a link to the replaced file");
+
+$txml2->loadFile("$path.bck");
+is ($txml2->dump, $orig, "backup holds the previous version");
+
+opendir(my $dh, $dir);
+my @leftovers = grep { /\.tmp$/ } readdir($dh);
+closedir($dh);
+is (scalar(@leftovers), 0, "no temporary files left around");
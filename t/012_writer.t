@@ -0,0 +1,70 @@
+use strict;
+use Test::More tests => 9;
+use XML::TinyXML;
+use XML::TinyXML::Writer;
+use File::Temp qw(tempfile);
+
+sub writeDocument {
+    my $writer = shift;
+    $writer->startDocument;
+    $writer->startElement("xml");
+    $writer->attribute("xmlns", "foo://bar");
+    $writer->attribute("xmlns:bar", "bar://foo");
+    $writer->comment(" commento1 ");
+    $writer->startElement("hello");
+    $writer->text("world");
+    $writer->endElement;
+    $writer->startElement("foo");
+    $writer->cdata(" this should unescape <&; etc... :) ");
+    $writer->endElement;
+    $writer->startElement("bar:parent");
+    $writer->attribute("xmlns", "bar://child");
+    $writer->attribute("xmlns:special_child", "bar://special_child");
+    $writer->startElement("child1");
+    $writer->endElement;
+    $writer->startElement("special_child:child2");
+    $writer->endElement;
+    $writer->startElement("child3");
+    $writer->endElement;
+    $writer->endElement;
+    $writer->startElement("parent");
+    $writer->attribute("attr", "val");
+    $writer->startElement("blah");
+    $writer->attribute("attr", "val2");
+    $writer->text("SECOND");
+    $writer->endElement;
+    $writer->endElement;
+    $writer->startElement("qtest");
+    $writer->attribute("qattr", '"qval"');
+    $writer->text("TEST");
+    $writer->endElement;
+    $writer->endElement;
+}
+
+foreach my $pretty (1, 0) {
+    my $txml = XML::TinyXML->new();
+    $txml->ignoreBlanks($pretty);
+    $txml->loadFile("./t/t.xml");
+
+    my $writer = XML::TinyXML::Writer->new(pretty => $pretty);
+    writeDocument($writer);
+    is ($writer->buffer, $txml->dump, "writer output matches dump() (pretty: $pretty)");
+
+    my ($fh, $filename) = tempfile(UNLINK => 1);
+    $writer = XML::TinyXML::Writer->new(fh => $fh, pretty => $pretty);
+    writeDocument($writer);
+    is ($writer->flush, XML_NOERR, "flush to filehandle");
+    close($fh);
+    open($fh, "<", $filename);
+    my $out = do { local $/; <$fh> };
+    close($fh);
+    is ($out, $txml->dump, "streamed output matches dump() (pretty: $pretty)");
+}
+
+my $writer = XML::TinyXML::Writer->new();
+$writer->startElement("a");
+$writer->text("1 < 2 & 3");
+isnt ($writer->attribute("late", "attr"), XML_NOERR, "attributes can't follow text");
+$writer->endElement;
+isnt ($writer->endElement, XML_NOERR, "no element left to close");
+is ($writer->buffer, "<a>1 &lt; 2 &amp; 3</a>", "text is escaped");
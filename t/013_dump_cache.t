@@ -0,0 +1,49 @@
+use strict;
+use Test::More tests => 12;
+use XML::TinyXML;
+use XML::TinyXML::NodeAttribute;
+
+my $txml = XML::TinyXML->new(undef, dumpCache => 1);
+is ($txml->dumpCache, 1, "dumpCache can be enabled from the constructor");
+$txml->loadFile("./t/t.xml");
+
+# compare the (cached) dump with a full serialization of the same tree
+sub checkDump {
+    my ($msg) = @_;
+    my $cached = $txml->dump;
+    $txml->dumpCache(0);
+    my $full = $txml->dump;
+    $txml->dumpCache(1);
+    is ($cached, $full, $msg);
+}
+
+checkDump("first dump");
+is ($txml->dump, $txml->dump, "repeated dumps are stable");
+
+$txml->getNode("/hello")->value("there");
+checkDump("value changed");
+
+my $blah = $txml->getNode("/parent[2]/blah");
+$blah->addAttributes(newattr => "a < b");
+checkDump("attribute added");
+
+$blah->removeAttribute(0);
+checkDump("attribute removed");
+
+$txml->getNode("/parent[2]")->addChildNode("newchild", "newvalue", { a => 1 });
+checkDump("child added");
+
+$txml->getNode("/qtest")->addChildNode($txml->getNode("/parent[2]/newchild"));
+checkDump("child moved to another branch");
+
+my $attr = $txml->getNode("/qtest")->getAttribute(0);
+$attr->value("changed");
+checkDump("attribute value changed in place");
+
+$txml->getNode("/foo")->name("renamed");
+checkDump("node renamed");
+
+$txml->ignoreBlanks(0);
+checkDump("output format changed");
+$txml->ignoreBlanks(1);
+checkDump("output format restored");
@@ -0,0 +1,39 @@
+use strict;
+use Test::More tests => 5;
+use XML::TinyXML;
+use File::Temp qw(tempfile);
+
+my $txml = XML::TinyXML->new("root");
+my $root = $txml->getRootNode(0);
+for my $i (1..200) {
+    my $item = XML::TinyXML::Node->new("item", undef, { id => $i });
+    $root->addChildNode($item);
+    $item->addChildNode("name", "item $i & co");
+    $item->addChildNode("value", $i * 2);
+}
+
+foreach my $blanks (1, 0) {
+    $txml->ignoreBlanks($blanks);
+    $txml->dumpThreads(0);
+    my $expected = $txml->dump;
+    $txml->dumpThreads(4);
+    is ($txml->dump, $expected, "parallel dump (ignoreBlanks: $blanks)");
+}
+is ($txml->dumpThreads, 4);
+
+my ($fh, $filename) = tempfile(UNLINK => 1);
+my $expected = $txml->dump;
+SKIP: {
+    skip "dumpToHandle() is not available on win32", 1 if ($^O eq 'MSWin32');
+    $txml->dumpToHandle($fh);
+    close($fh);
+    open($fh, "<", $filename);
+    my $out = do { local $/; <$fh> };
+    close($fh);
+    is ($out, $expected, "parallel dump to a filehandle");
+}
+
+# a single big branch can't be split, but must still be dumped
+my $single = XML::TinyXML->new("root", dumpThreads => 4);
+$single->getRootNode(0)->addChildNode("only", "child");
+like ($single->dump, qr{<root>\s*<only>child</only>\s*</root>}, "nothing to split");
@@ -0,0 +1,28 @@
+use strict;
+use Test::More tests => 6;
+use XML::TinyXML;
+use Encode;
+use File::Temp qw(tempfile);
+
+# UTF-16/UTF-32 documents are converted natively (iconv is not needed)
+my $txml = XML::TinyXML->new();
+$txml->loadFile("./t/t.xml");
+my $expected = $txml->dump;
+
+my $ucs2 = XML::TinyXML->new();
+is ($ucs2->loadFile("./t/t-ucs2.xml"), XML_NOERR, "load UCS-2 file");
+is ($ucs2->dump, $expected, "UCS-2 file matches its utf8 counterpart");
+
+my $doc = "<root><text>ascii \x{e9} \x{20ac} \x{1F600}</text></root>";
+my $utf8 = XML::TinyXML->new();
+$utf8->loadBuffer(encode("UTF-8", $doc));
+
+foreach my $encoding ("UTF-16LE", "UTF-16BE", "UTF-32LE", "UTF-32BE") {
+    my ($fh, $filename) = tempfile(UNLINK => 1);
+    binmode($fh);
+    print $fh encode($encoding, "\x{feff}$doc");
+    close($fh);
+    my $converted = XML::TinyXML->new();
+    $converted->loadFile($filename);
+    is ($converted->dump, $utf8->dump, "load $encoding file");
+}
@@ -0,0 +1,42 @@
+use strict;
+use Test::More;
+use XML::TinyXML;
+use Encode;
+use File::Temp qw(tempfile);
+
+my $txml;
+BEGIN {
+    $txml = XML::TinyXML->new();
+    if (!$txml->hasIconv) {
+        plan skip_all => "Iconv functionalities disabled at compile time";
+    } else {
+        plan tests => 5;
+    }
+}
+
+# long enough to be converted in several chunks
+my $body = join("", map { "<item id=\"$_\">caf\x{e9} $_</item>" } 1..2000);
+$txml->loadBuffer(encode("UTF-8", "<root>$body</root>"));
+$txml->ignoreBlanks(0);
+my $utf8 = decode("UTF-8", $txml->dump);
+
+$txml->setOutputEncoding("ISO-8859-1");
+(my $expected = $utf8) =~ s/encoding="utf-8"/encoding="ISO-8859-1"/;
+is ($txml->dump, encode("ISO-8859-1", $expected), "dump converted to ISO-8859-1");
+is ($txml->dump, encode("ISO-8859-1", $expected), "converter reused by the next dump");
+
+$txml->setOutputEncoding("utf-8");
+is (decode("UTF-8", $txml->dump), $utf8, "back to utf-8");
+
+SKIP: {
+    skip "dumpToHandle() is not available on win32", 2 if ($^O eq 'MSWin32');
+    $txml->setOutputEncoding("UTF-16BE");
+    my ($fh, $filename) = tempfile(UNLINK => 1);
+    is ($txml->dumpToHandle($fh), XML_NOERR, "converted dump to a filehandle");
+    close($fh);
+    open($fh, "<:raw", $filename);
+    my $out = do { local $/; <$fh> };
+    close($fh);
+    ($expected = $utf8) =~ s/encoding="utf-8"/encoding="UTF-16BE"/;
+    is ($out, encode("UTF-16BE", $expected), "streamed UTF-16BE output");
+}
@@ -0,0 +1,33 @@
+use strict;
+use Test::More tests => 13;
+use XML::TinyXML;
+
+my $txml = XML::TinyXML->new();
+is ($txml->validateUtf8, 0, "validation is off by default");
+
+my $valid = "<root attr=\"caf\xc3\xa9\"><node>\xe2\x82\xac \xf0\x9f\x98\x80</node><!-- \xc3\xa9 --></root>";
+my $badValue = "<root><node>caf\xe9</node></root>";
+my $badAttr = "<root attr=\"\xc0\xaf\"/>";
+my $surrogate = "<root><node>\xed\xa0\x80</node></root>";
+
+is ($txml->loadBuffer($badValue), XML_NOERR, "malformed utf-8 accepted without validation");
+
+$txml->validateUtf8(1);
+is ($txml->loadBuffer($valid), XML_NOERR, "well-formed utf-8");
+is ($txml->getNode("/node")->value, "\xe2\x82\xac \xf0\x9f\x98\x80");
+is ($txml->loadBuffer($badValue), XML_BAD_CHARS, "malformed value");
+is ($txml->loadBuffer($badAttr), XML_BAD_CHARS, "overlong sequence in an attribute");
+is ($txml->loadBuffer($surrogate), XML_BAD_CHARS, "encoded surrogate");
+
+my $latin1 = "<?xml version=\"1.0\" encoding=\"ISO-8859-1\"?>\n<root><node>caf\xe9</node></root>";
+is ($txml->loadBuffer($latin1), XML_NOERR, "documents in other encodings are not checked");
+
+# character references are stored in utf-8, wherever they appear
+$txml = XML::TinyXML->new();
+$txml->validateUtf8(1);
+is ($txml->loadBuffer("<root><node>x&#200;y</node></root>"), XML_NOERR, "character reference in a value");
+is ($txml->getNode("/node")->value, "x\xc3\x88y", "decoded to utf-8");
+is ($txml->loadBuffer("<root attr=\"&#200;\"/>"), XML_NOERR, "character reference in an attribute");
+is ($txml->getRootNode(0)->attributes->{attr}, "\xc3\x88", "attribute decoded to utf-8");
+$txml->loadBuffer("<root><node id=\"caf\xc3\xa9\">1</node></root>");
+is ($txml->getNode("/node[\@id='caf&#233;']")->value, 1, "character reference in a path");
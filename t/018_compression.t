@@ -0,0 +1,94 @@
+use strict;
+use Test::More;
+use XML::TinyXML;
+use File::Temp qw(tempdir);
+use IO::Compress::Gzip qw(gzip $GzipError);
+use IO::Uncompress::Gunzip qw(gunzip $GunzipError);
+use Encode;
+
+my $txml;
+BEGIN {
+    $txml = XML::TinyXML->new();
+    if (!$txml->hasCompression('gzip')) {
+        plan skip_all => "zlib support disabled at compile time";
+    } else {
+        plan tests => 16;
+    }
+}
+
+sub slurp {
+    my $path = shift;
+    open(my $fh, "<:raw", $path) or return undef;
+    my $data = do { local $/; <$fh> };
+    close($fh);
+    return $data;
+}
+
+sub spew {
+    my ($path, $data) = @_;
+    open(my $fh, ">:raw", $path) or die "Can't write $path: $!";
+    print $fh $data;
+    close($fh);
+}
+
+my $dir = tempdir(CLEANUP => 1);
+
+# big enough to be compressed and decompressed in several chunks
+my $body = join("", map { "<item id=\"$_\">value $_ &amp; more</item>" } 1..10000);
+$txml->loadBuffer("<root>$body</root>");
+my $plain = $txml->dump;
+
+is ($txml->save("$dir/doc.xml.gz"), XML_NOERR, "saved to a .gz file");
+my $compressed = slurp("$dir/doc.xml.gz");
+is (substr($compressed, 0, 2), "\x1f\x8b", "file names ending with .gz are compressed");
+ok (length($compressed) < length($plain) / 4, "output actually compressed");
+my $out;
+gunzip(\$compressed => \$out) or diag($GunzipError);
+is ($out, $plain, "compressed save matches dump()");
+
+my $loaded = XML::TinyXML->new();
+is ($loaded->loadFile("$dir/doc.xml.gz"), XML_NOERR, "compressed file loaded");
+is ($loaded->dump, $plain, "decompressed document");
+
+# members of concatenated gzip files are joined (as gunzip does)
+my ($head, $tail) = ("<root>" . substr($body, 0, 1000), substr($body, 1000) . "</root>");
+my ($gzHead, $gzTail);
+gzip(\$head => \$gzHead) or diag($GzipError);
+gzip(\$tail => \$gzTail) or diag($GzipError);
+spew("$dir/multi.xml.gz", $gzHead . $gzTail);
+$loaded = XML::TinyXML->new();
+is ($loaded->loadFile("$dir/multi.xml.gz"), XML_NOERR, "multi-member gzip file loaded");
+is ($loaded->dump, $plain, "all the members have been read");
+
+spew("$dir/truncated.xml.gz", substr($compressed, 0, length($compressed) / 2));
+$loaded = XML::TinyXML->new();
+isnt ($loaded->loadFile("$dir/truncated.xml.gz"), XML_NOERR, "truncated gzip file refused");
+
+# the decompressed document is still checked for its encoding
+my $utf16 = encode("UTF-16", "<root><item>caf\x{e9}</item></root>");
+my $gzUtf16;
+gzip(\$utf16 => \$gzUtf16) or diag($GzipError);
+spew("$dir/utf16.xml.gz", $gzUtf16);
+$loaded = XML::TinyXML->new();
+is ($loaded->loadFile("$dir/utf16.xml.gz"), XML_NOERR, "compressed UTF-16 file loaded");
+is (decode("UTF-8", $loaded->getNode("/item")->value), "caf\x{e9}", "compressed UTF-16 file converted");
+
+is ($txml->compression("bogus"), undef, "unknown compression refused");
+
+SKIP: {
+    skip "dumpToHandle() and atomicSave() are not available on win32", 4 if ($^O eq 'MSWin32');
+    $txml->compression("gzip");
+    open(my $fh, ">:raw", "$dir/handle.gz");
+    is ($txml->dumpToHandle($fh), XML_NOERR, "compressed dump to a filehandle");
+    close($fh);
+    $compressed = slurp("$dir/handle.gz");
+    gunzip(\$compressed => \$out) or diag($GunzipError);
+    is ($out, $plain, "compressed dump matches dump()");
+    $txml->compression("none");
+
+    $txml->atomicSave(1);
+    is ($txml->save("$dir/atomic.xml.gz"), XML_NOERR, "atomic save to a .gz file");
+    $loaded = XML::TinyXML->new();
+    $loaded->loadFile("$dir/atomic.xml.gz");
+    is ($loaded->dump, $plain, "atomically saved file loaded back");
+}
@@ -0,0 +1,28 @@
+use strict;
+use Test::More tests => 6;
+use XML::TinyXML;
+use File::Temp qw(tempdir);
+
+my $dir = tempdir(CLEANUP => 1);
+my @paths;
+foreach my $i (1..64) {
+    my $path = "$dir/fragment$i.xml";
+    open(my $fh, ">", $path) or die "Can't write $path: $!";
+    print $fh "<config id=\"$i\">\n  <value>$i</value>\n</config>\n";
+    close($fh);
+    push(@paths, $path);
+}
+
+my @docs = XML::TinyXML->loadFiles(\@paths, threads => 8);
+is (scalar(@docs), 64, "one object for each file");
+is (scalar(grep { defined($_) } @docs), 64, "all the files loaded");
+is_deeply ([ map { $_->getNode("/value")->value } @docs ], [ 1..64 ],
+    "documents returned in the same order as the paths");
+
+# parameters are passed to new()
+my ($doc) = XML::TinyXML->loadFiles([ $paths[0] ], ignoreBlanks => 0, threads => 1);
+is ($doc->ignoreBlanks, 0, "parameters applied to the created objects");
+
+@docs = XML::TinyXML->loadFiles([ $paths[0], "$dir/missing.xml", $paths[1] ]);
+ok (!defined($docs[1]), "undef returned for a missing file");
+is ($docs[2]->getNode("/value")->value, 2, "following files still loaded");
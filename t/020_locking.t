@@ -0,0 +1,80 @@
+use strict;
+use Test::More;
+use XML::TinyXML;
+use File::Temp qw(tempdir);
+use Fcntl qw(F_SETLK F_RDLCK F_WRLCK SEEK_SET);
+use Time::HiRes qw(time);
+use Config;
+
+BEGIN {
+    # struct flock is packed by hand, so stick to the layout we know
+    if ($^O ne 'linux' || $Config{ivsize} != 8 || $Config{lseeksize} != 8) {
+        plan skip_all => "struct flock layout unknown on this platform";
+    } else {
+        plan tests => 9;
+    }
+}
+
+my $dir = tempdir(CLEANUP => 1);
+my $path = "$dir/locked.xml";
+my $content = "<config>\n  <value>1</value>\n</config>\n";
+open(my $out, ">", $path) or die "Can't write $path: $!";
+print $out $content;
+close($out);
+
+# holds a lock on $path from another process until killed
+sub lockFromChild {
+    my $type = shift;
+    pipe(my $reader, my $writer) or die "pipe: $!";
+    my $pid = fork();
+    die "fork: $!" unless (defined($pid));
+    if (!$pid) {
+        close($reader);
+        open(my $fh, "+<", $path) or exit(1);
+        my $flock = pack("s s x4 q q i x4", $type, SEEK_SET, 0, 0, 0);
+        fcntl($fh, F_SETLK, $flock) or exit(1);
+        syswrite($writer, "locked\n");
+        sleep(60);
+        exit(0);
+    }
+    close($writer);
+    my $ready = <$reader>;
+    close($reader);
+    die "child couldn't lock $path" unless ($ready);
+    return $pid;
+}
+
+sub release {
+    my $pid = shift;
+    kill('TERM', $pid);
+    waitpid($pid, 0);
+}
+
+my $txml = XML::TinyXML->new();
+is ($txml->lockTimeout, 5000, "default lock timeout");
+
+my $pid = lockFromChild(F_WRLCK);
+$txml->lockTimeout(200);
+my $start = time;
+isnt ($txml->loadFile($path), XML_NOERR, "can't read a file locked for writing");
+my $elapsed = time - $start;
+ok ($elapsed >= 0.15 && $elapsed < 2, "gave up after the lock timeout");
+
+$txml->lockTimeout(0);
+$start = time;
+isnt ($txml->loadFile($path), XML_NOERR, "no wait with a 0 timeout");
+ok (time - $start < 0.1, "returned immediately");
+release($pid);
+
+# readers don't exclude each other
+$pid = lockFromChild(F_RDLCK);
+$txml->lockTimeout(200);
+is ($txml->loadFile($path), XML_NOERR, "file read while shared by another reader");
+is ($txml->getNode("/value")->value, 1, "content read");
+
+$txml->getNode("/value")->value(2);
+isnt ($txml->save($path), XML_NOERR, "can't write a file being read");
+release($pid);
+open(my $in, "<", $path);
+is (do { local $/; <$in> }, $content, "busy file left untouched");
+close($in);
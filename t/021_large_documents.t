@@ -0,0 +1,41 @@
+use strict;
+use Test::More;
+use XML::TinyXML;
+use File::Temp qw(tempdir);
+use Config;
+
+BEGIN {
+    # needs about 3GB of memory and 3GB of disk space
+    if (!$ENV{TXML_TEST_LARGE}) {
+        plan skip_all => "set TXML_TEST_LARGE to run tests on documents bigger than 2GB";
+    } elsif ($Config{sizesize} < 8) {
+        plan skip_all => "documents bigger than 2GB need a 64-bit perl";
+    } else {
+        plan tests => 6;
+    }
+}
+
+my $dir = tempdir(CLEANUP => 1);
+my $path = "$dir/large.xml";
+
+# escaping makes the document 5 times bigger than the tree holding it
+my $children = 100;
+my $value = "&" x (5 * 1024 * 1024);
+my $txml = XML::TinyXML->new("root");
+my $root = $txml->getRootNode(0);
+$root->addChildNode("item", $value) for (1..$children);
+
+is ($txml->save($path), XML_NOERR, "document bigger than 2GB saved");
+ok (-s $path > 2**31, "saved file is bigger than 2GB");
+undef($txml);
+
+$txml = XML::TinyXML->new();
+is ($txml->loadFile($path), XML_NOERR, "document bigger than 2GB loaded");
+$root = $txml->getRootNode(0);
+is ($root->countChildren, $children, "all the children loaded");
+is ($root->getChildNode($children - 1)->value, $value, "values past the 2GB offset loaded");
+unlink($path);
+
+my $branch = XML::TinyXML::XmlDumpBranch($txml->{_ctx}, $root->getChildNode(0)->{_node}, 0);
+(my $escaped = $value) =~ s/&/&amp;/g;
+like ($branch, qr/^<item>\Q$escaped\E<\/item>\s*$/, "branch dumped through the size_t api");
@@ -0,0 +1,71 @@
+use strict;
+use Test::More;
+use XML::TinyXML;
+use File::Temp qw(tempdir);
+
+BEGIN {
+    if ($^O eq 'MSWin32') {
+        plan skip_all => "snapshots are not available on win32";
+    } else {
+        plan tests => 21;
+    }
+}
+
+my $dir = tempdir(CLEANUP => 1);
+my $path = "$dir/doc.snap";
+
+my $body = join("", map { "<item id=\"$_\" kind=\"test\">value $_ &amp; more</item>" } 1..1000);
+my $txml = XML::TinyXML->new();
+$txml->loadBuffer("<root xmlns:t=\"urn:test\"><config><value>42</value></config>" .
+                  "<t:extra t:flag=\"yes\">namespaced</t:extra><!--comment-->$body</root>");
+my $plain = $txml->dump;
+is ($txml->saveSnapshot($path), XML_NOERR, "snapshot saved");
+
+my $loaded = XML::TinyXML->new();
+is ($loaded->loadSnapshot($path), XML_NOERR, "snapshot loaded");
+ok ($loaded->isReadOnly, "loaded document is read-only");
+is ($loaded->dump, $plain, "snapshot dumps as the original document");
+is ($loaded->getNode("/config/value")->value, 42, "node looked up by path");
+is ($loaded->getRootNode(0)->countChildren, 1003, "all the children loaded");
+my $item = $loaded->getRootNode(0)->getChildNode(502);
+is ($item->attributes->{id}, 500, "attribute read");
+is ($item->parent->name, "root", "parent linked");
+
+$item->value("changed");
+is ($item->value, "value 500 & more", "value not changed");
+is (XML::TinyXML::XmlSetNodeValue($item->{_node}, "changed"), XML_UPDATE_ERR, "XML_UPDATE_ERR on update");
+is ($loaded->removeBranch(0), XML_UPDATE_ERR, "branches can't be removed");
+eval { $item->name("renamed") };
+ok ($@, "read-only node can't be renamed");
+
+# the same snapshot mapped twice in the same process can't get the same address
+my $again = XML::TinyXML->new();
+is ($again->loadSnapshot($path), XML_NOERR, "snapshot loaded twice");
+is ($again->dump, $plain, "relocated snapshot dumps as the original document");
+
+open(my $out, ">", "$dir/bogus.snap");
+print $out "TXMLSNAP" . ("\0" x 1024);
+close($out);
+isnt ($loaded->loadSnapshot("$dir/bogus.snap"), XML_NOERR, "corrupt snapshot refused");
+is ($loaded->dump, $plain, "document left in place");
+
+$loaded->loadBuffer("<root><value>1</value></root>");
+ok (!$loaded->isReadOnly, "parsed document is writable again");
+$loaded->getNode("/value")->value(2);
+is ($loaded->getNode("/value")->value, 2, "document modified");
+
+# a valid header followed by a corrupt tree is refused wherever the image gets mapped
+open(my $in, "<:raw", $path);
+my $image = do { local $/; <$in> };
+close($in);
+my ($nodes, $nodeSize) = (unpack("Q", substr($image, 56, 8)), unpack("L", substr($image, 20, 4)));
+substr($image, $nodes, $nodeSize) = "\xff" x $nodeSize;
+open($out, ">:raw", "$dir/corrupt.snap");
+print $out $image;
+close($out);
+my $broken = XML::TinyXML->new();
+my $first = XML::TinyXML->new();
+is ($first->loadSnapshot($path), XML_NOERR, "preferred address taken");
+isnt ($broken->loadSnapshot("$dir/corrupt.snap"), XML_NOERR, "corrupt tree refused when relocated");
+undef($first);
+isnt ($broken->loadSnapshot("$dir/corrupt.snap"), XML_NOERR, "corrupt tree refused at the preferred address");
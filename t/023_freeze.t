@@ -0,0 +1,34 @@
+use strict;
+use Test::More;
+use XML::TinyXML;
+
+BEGIN {
+    if ($^O eq 'MSWin32') {
+        plan skip_all => "freezing is not available on win32";
+    } else {
+        plan tests => 13;
+    }
+}
+
+my $txml = XML::TinyXML->new();
+$txml->loadBuffer(q{<root><item id="1" kind="a&amp;b">first</item><item id="2">second</item>} .
+                  q{<group><item id="3">third</item></group><item>fourth</item></root>});
+my $plain = $txml->dump;
+
+is ($txml->freeze, XML_NOERR, "document frozen");
+ok ($txml->isReadOnly, "frozen document is read-only");
+is ($txml->freeze, XML_NOERR, "freezing twice is harmless");
+is ($txml->dump, $plain, "frozen document dumps as before");
+
+is ($txml->getNode("/item[2]")->value, "second", "lookup by position");
+is ($txml->getNode("item[\@id='2']")->value, "second", "lookup by attribute value");
+is ($txml->getNode("/item[\@kind=\"a&amp;b\"]")->value, "first", "escaped attribute value matched");
+is ($txml->getNode("/item[\@kind]")->value, "first", "lookup by attribute");
+is ($txml->getNode("/group/item")->value, "third", "nested lookup");
+ok (!$txml->getNode("/item[\@id='5']"), "no match for a missing value");
+
+my $path = "/group//item[1]";
+is ($txml->getNode($path)->value, "third", "empty components skipped");
+is ($path, "/group//item[1]", "path left untouched");
+
+is ($txml->getNode("/item")->value("changed"), "first", "frozen node not modified");
@@ -0,0 +1,44 @@
+use strict;
+use Test::More;
+use XML::TinyXML;
+
+BEGIN {
+    if ($^O eq 'MSWin32') {
+        plan skip_all => "publishing is not available on win32";
+    } else {
+        plan tests => 14;
+    }
+}
+
+use_ok("XML::TinyXML::Publisher");
+
+my $publisher = XML::TinyXML::Publisher->new();
+ok ($publisher, "publisher created");
+is ($publisher->pin, undef, "nothing to pin before publishing");
+is ($publisher->version, 0, "no version published yet");
+
+sub config {
+    my $value = shift;
+    my $txml = XML::TinyXML->new();
+    $txml->loadBuffer("<config><value>$value</value></config>");
+    return $txml;
+}
+
+my $txml = config(1);
+is ($publisher->publish($txml), XML_NOERR, "first version published");
+is ($txml->countRootNodes, 0, "document moved into the publisher");
+is ($publisher->version, 1, "version number");
+
+my $first = $publisher->pin;
+is ($first->getNode("/value")->value, 1, "first version pinned");
+ok ($first->isReadOnly, "pinned version is read-only");
+
+is ($publisher->publish(config(2)), XML_NOERR, "second version published");
+is ($publisher->pin->getNode("/value")->value, 2, "new readers get the second version");
+is ($first->getNode("/value")->value, 1, "pinned version still available");
+undef($first);
+
+my $second = $publisher->pin;
+undef($publisher);
+is ($second->getNode("/value")->value, 2, "pinned version outlives the publisher");
+is ($second->dump, config(2)->dump, "pinned version dumped");
@@ -0,0 +1,69 @@
+use strict;
+use Test::More tests => 40;
+use XML::TinyXML;
+use XML::TinyXML::Selector;
+
+my $txml = XML::TinyXML->new();
+$txml->loadFile("./t/t.xml");
+
+# node-sets
+my ($root) = $txml->xpath("/");
+is ($root, $txml, "the root is the document itself");
+my @set = $txml->xpath("/xml/*");
+is (scalar(@set), 5, "'*' selects only elements");
+is (join(",", map { $_->name } @set), "hello,foo,parent,parent,qtest", "children in document order");
+@set = $txml->xpath("/xml/node()");
+is (scalar(@set), 6, "node() selects the comment too");
+is ($set[0]->type, "COMMENT", "comment first");
+is (scalar($txml->xpath("//parent"))->path, $set[3]->path, "scalar context returns the first node");
+is (scalar(@{[ $txml->xpath("//parent") ]}), 2, "unprefixed names match any namespace");
+is (scalar(@{[ $txml->xpath("//bar:parent") ]}), 1, "prefixed names match the prefix");
+is ($txml->xpath("//parent[\@attr='val']/blah")->value, "SECOND", "attribute predicate");
+is ($txml->xpath("/xml/parent[2]/blah/..")->attributes->{attr}, "val", "parent step");
+is ($txml->xpath('//qtest[@qattr=\'"qval"\']')->value, "TEST", "entities decoded in attribute values");
+
+my ($attr) = $txml->xpath('//blah/@attr');
+isa_ok ($attr, "XML::TinyXML::NodeAttribute");
+is ($attr->value, "val2", "attribute value");
+@set = $txml->xpath('//@*');
+is (scalar(@set), 3, "namespace declarations aren't attributes");
+is (join(",", $txml->xpath("//hello/text() | //blah/text()")), "world,SECOND", "text nodes returned as strings");
+
+# axes
+is (join(",", map { $_->name } $txml->xpath("//blah/ancestor::*")), "xml,parent", "ancestor axis in document order");
+is ($txml->xpath("//child1/ancestor::*[1]")->name, "parent", "reverse axes count positions backwards");
+is (join(",", map { $_->name } $txml->xpath("//child1/following-sibling::*")), "child2,child3", "following-sibling");
+is (join(",", map { $_->name } $txml->xpath("//child3/preceding-sibling::*")), "child1,child2", "preceding-sibling");
+is (join(",", map { $_->name } $txml->xpath("//child2/following::*")), "child3,parent,blah,qtest", "following");
+is (join(",", map { $_->name } $txml->xpath("//child2/preceding::*")), "hello,foo,child1", "preceding");
+is (join(",", map { $_->name } $txml->xpath("//parent/*[last()]")), "child3,blah", "last()");
+is ($txml->xpath("(//parent)[2]/blah")->value, "SECOND", "predicates on filter expressions");
+
+# relative to a context node
+my $parent = $txml->getNode("/parent");
+is ($txml->xpath("count(*)", $parent), 3, "context node");
+is ($txml->xpath("string(../hello)", $parent), "world", "relative path from the context node");
+
+# core functions
+is ($txml->xpath("count(//*)"), 10, "count()");
+is ($txml->xpath("name(//*[local-name()='parent'][1])"), "bar:parent", "name() and local-name()");
+is ($txml->xpath("namespace-uri(//child1)"), "bar://child", "namespace-uri()");
+is ($txml->xpath("concat(//hello, '-', 1 div 4)"), "world-0.25", "concat() and number formatting");
+is ($txml->xpath("substring('12345', 1.5, 2.6)"), "234", "substring()");
+is ($txml->xpath("normalize-space('  a   b  ')"), "a b", "normalize-space()");
+is ($txml->xpath("translate('--aaa--', 'abc-', 'ABC')"), "AAA", "translate()");
+is ($txml->xpath("string-length(//hello)"), 5, "string-length()");
+is ($txml->xpath("round(-2.5) + floor(1.5) + ceiling(1.2)"), 1, "number functions");
+ok ($txml->xpath("//parent/\@attr = 'val' and not(//nothing)"), "boolean expressions");
+is ($txml->xpath("string(1 div 0)"), "Infinity", "infinity");
+
+# errors
+is ($txml->xpath("//parent["), undef, "syntax error");
+is ($txml->xpath("bogus()"), undef, "unknown function");
+
+# selector
+my $selector = XML::TinyXML::Selector->new($txml, "XPath", native => 1);
+@set = $selector->select("//parent[blah='SECOND'] | //hello");
+is (join(",", map { $_->name } @set), "hello,parent", "native selector");
+my ($child) = $selector->select("child::*", $parent);
+is ($child->name, "child1", "native selector with a context node");
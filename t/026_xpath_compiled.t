@@ -0,0 +1,33 @@
+use strict;
+use Test::More tests => 12;
+use XML::TinyXML;
+use XML::TinyXML::XPath;
+
+my $txml = XML::TinyXML->new();
+$txml->loadFile("./t/t.xml");
+
+my $xpath = XML::TinyXML::XPath->new("//parent/*[last()]");
+isa_ok ($xpath, "XML::TinyXML::XPath");
+is ($xpath->string, "//parent/*[last()]", "expression text");
+is (join(",", map { $_->name } $xpath->evaluate($txml)), "child3,blah", "compiled expression");
+is (join(",", map { $_->name } $xpath->evaluate($txml)), "child3,blah", "evaluated twice");
+is (join(",", map { $_->name } $txml->xpath($xpath)), "child3,blah", "passed to xpath()");
+
+# the same expression against another document
+my $other = XML::TinyXML->new();
+$other->loadBuffer("<doc><parent><a/><b/></parent></doc>");
+is ($xpath->evaluate($other)->name, "b", "another document");
+
+# relative expressions
+my $count = XML::TinyXML::XPath->new("count(*)");
+is ($count->evaluate($txml, $txml->getNode("/parent")), 3, "context node");
+is ($count->evaluate($other, $other->getNode("/parent")), 2, "context node in another document");
+is ($count->evaluate($txml), 1, "no context node");
+
+is (XML::TinyXML::XPath->new("//parent["), undef, "malformed expression");
+
+# string expressions are cached
+my @first = map { $_->path } $txml->xpath("//blah | //hello");
+my @second = map { $_->path } $txml->xpath("//blah | //hello");
+is_deeply (\@second, \@first, "cached expression");
+is ($other->xpath("name(//blah | //b)"), "b", "cached expressions are shared by documents");
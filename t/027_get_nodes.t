@@ -0,0 +1,21 @@
+use strict;
+use Test::More tests => 10;
+use XML::TinyXML;
+
+my $txml = XML::TinyXML->new();
+$txml->loadBuffer(q{<r><a id="1"><b k="x">b1</b><b>b2</b></a><a id="2"><c/></a>} .
+                  q{<a id="3"><b k="x">b3</b><b k="y">b4</b><b k="x">b5</b></a></r>});
+
+is (join(",", map { $_->value } $txml->getNodes("/a/b")), "b1,b2,b3,b4,b5", "all matches in document order");
+is ($txml->getNode("/a/b")->value, "b1", "getNode() still returns the first one");
+is (scalar(my @a = $txml->getNodes("a")), 3, "siblings with the same name");
+is (join(",", map { $_->value } $txml->getNodes("a/b[2]")), "b2,b4", "positional predicate");
+is (join(",", map { $_->value } $txml->getNodes("a/b[\@k='x']")), "b1,b3,b5", "attribute value predicate");
+is (join(",", map { $_->value } $txml->getNodes("a[\@id='3']/b[\@k]")), "b3,b4,b5", "attribute predicate");
+is (scalar(my @c = $txml->getNodes("a/c")), 1, "branches without matches are skipped");
+is (scalar(my @none = $txml->getNodes("a/d")), 0, "no matches");
+my ($root) = $txml->getNodes("");
+is ($root->name, "r", "empty path selects the root node");
+
+$txml->allowMultipleRootNodes(1);
+is (join(",", map { $_->value } $txml->getNodes("/r/a[3]/b[\@k=\"x\"]")), "b3,b5", "multiple root nodes");
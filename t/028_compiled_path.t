@@ -0,0 +1,23 @@
+use strict;
+use Test::More tests => 9;
+use XML::TinyXML;
+use XML::TinyXML::Path;
+
+my $txml = XML::TinyXML->new();
+$txml->loadBuffer(q{<config><server name="a"><port>1</port></server><server name="b&amp;c"><port>2</port></server>} .
+                  q{<db><host>h</host><opt k="1"/><opt k="2"/><opt k="3" v="x"/></db></config>});
+
+my $path = XML::TinyXML::Path->new("/server[\@name='b&amp;c']/port");
+isa_ok ($path, "XML::TinyXML::Path");
+is ($path->string, "/server[\@name='b&amp;c']/port", "path text");
+is ($txml->getNode($path)->value, "2", "entities decoded in predicates");
+is ($txml->getNode($path)->value, "2", "compiled path looked up twice");
+is ($txml->getNode(XML::TinyXML::Path->new("db/opt[3]"))->attributes->{v}, "x", "positional predicate");
+is ($txml->getNode(XML::TinyXML::Path->new("db/opt[\@v]"))->attributes->{k}, "3", "attribute predicate");
+ok (!$txml->getNode(XML::TinyXML::Path->new("db/nothing")), "no match");
+
+my $other = XML::TinyXML->new();
+$other->loadBuffer(q{<config><server name="b&amp;c"><port>3</port></server></config>});
+is ($other->getNode($path)->value, "3", "another document");
+
+is (XML::TinyXML::Path->new("server[\@name='b&c']"), undef, "unknown entities");
@@ -0,0 +1,46 @@
+use strict;
+use Test::More;
+use XML::TinyXML;
+use File::Temp qw(tempdir);
+
+BEGIN {
+    if ($^O eq 'MSWin32') {
+        plan skip_all => "snapshots are not available on win32";
+    } else {
+        plan tests => 11;
+    }
+}
+
+my $txml = XML::TinyXML->new();
+$txml->loadBuffer("<root><a><a1/><a2/></a><b/><c><c1/></c></root>");
+
+XmlNumberNodes($txml->{_ctx});
+my $a = $txml->getNode("/a");
+my $a2 = $txml->getNode("/a/a2");
+my $c1 = $txml->getNode("/c/c1");
+ok (XmlIsAncestor($txml->getRootNode(0)->{_node}, $a2->{_node}), "the root contains everything");
+ok (XmlIsAncestor($a->{_node}, $a2->{_node}), "ancestor");
+ok (!XmlIsAncestor($a->{_node}, $c1->{_node}), "not an ancestor");
+ok (XmlCompareNodes($a2->{_node}, $c1->{_node}) < 0, "document order");
+
+# the numbers are assigned again after the structure changes
+$txml->getNode("/b")->addChildNode(XML::TinyXML::Node->new("b1"));
+$a2->addChildNode(XML::TinyXML::Node->new("a3"));
+XmlNumberNodes($txml->{_ctx});
+my $b1 = $txml->getNode("/b/b1");
+ok (XmlCompareNodes($b1->{_node}, $c1->{_node}) < 0, "new node numbered");
+ok (XmlIsAncestor($a->{_node}, $txml->getNode("/a/a2/a3")->{_node}), "moved node numbered");
+
+# and xpath() numbers them by itself
+is (join(",", map { $_->name } $txml->xpath("//*[not(*)] | //a")), "a,a1,a3,b1,c1", "xpath() after changes");
+$txml->getNode("/c")->addChildNode($txml->getNode("/a"));
+is (join(",", map { $_->name } $txml->xpath("//*[not(*)] | //a")), "b1,c1,a,a1,a3", "xpath() after moving a branch");
+
+# read-only documents are numbered when frozen or saved to a snapshot
+my $dir = tempdir(CLEANUP => 1);
+is ($txml->saveSnapshot("$dir/doc.snap"), XML_NOERR, "snapshot saved");
+my $loaded = XML::TinyXML->new();
+$loaded->loadSnapshot("$dir/doc.snap");
+is (join(",", map { $_->name } $loaded->xpath("//c/descendant::* | //b1")), "b1,c1,a,a1,a2,a3", "snapshot");
+$txml->freeze;
+is (join(",", map { $_->name } $txml->xpath("//c/descendant::* | //b1")), "b1,c1,a,a1,a2,a3", "frozen document");
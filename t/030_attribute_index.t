@@ -0,0 +1,49 @@
+use strict;
+use Test::More tests => 22;
+use XML::TinyXML;
+use XML::TinyXML::Path;
+
+my $txml = XML::TinyXML->new();
+$txml->loadBuffer(q{<root><item id="a" kind="x">first</item><item id="b" kind="y">second</item>} .
+                  q{<group><item id="c" kind="x">third</item></group><item kind="x">fourth</item></root>});
+
+is ($txml->getNodeByAttribute("id", "b"), undef, "nothing indexed by default");
+is ($txml->indexAttributes, XML_NOERR, "index built");
+ok (XmlIsIndexed($txml->{_ctx}, "id"), "id indexed by default");
+ok (!XmlIsIndexed($txml->{_ctx}, "kind"), "other attributes are not");
+is ($txml->getNodeByAttribute("id", "b")->value, "second", "lookup by id");
+is ($txml->getNodeByAttribute("id", "c")->value, "third", "nested node");
+is ($txml->getNodeByAttribute("id", "z"), undef, "missing value");
+
+# the index follows the changes
+my $item = $txml->getNode("/item[\@id='a']");
+$item->getAttribute(0)->value("d");
+is ($txml->getNodeByAttribute("id", "a"), undef, "changed value dropped");
+is ($txml->getNodeByAttribute("id", "d")->value, "first", "changed value indexed");
+$item->removeAttribute(0);
+is ($txml->getNodeByAttribute("id", "d"), undef, "removed attribute dropped");
+$item->addAttributes(id => "e");
+is ($txml->getNodeByAttribute("id", "e")->value, "first", "added attribute indexed");
+my $group = $txml->getNode("/group");
+my $child = XML::TinyXML::Node->new("item", "fifth", { id => "f" });
+$group->addChildNode($child);
+is ($txml->getNodeByAttribute("id", "f")->value, "fifth", "added branch indexed");
+$txml->getNode("/item[\@kind='y']")->addChildNode($group);
+is ($txml->getNodeByAttribute("id", "f")->parent->parent->value, "second", "moved branch still indexed");
+$txml->getNodeByAttribute("id", "c")->cleanAttributes;
+is ($txml->getNodeByAttribute("id", "c"), undef, "cleared attributes dropped");
+
+# other attributes, used by getNode() and by the native XPath id() too
+is ($txml->indexAttributes("kind", "id"), XML_NOERR, "index rebuilt");
+is ($txml->getNodeByAttribute("kind", "x")->value, "first", "first node in document order");
+is ($txml->getNode("/item[\@kind='x'][1]")->value, "first", "getNode() predicate");
+is ($txml->getNode("/item[\@kind=\"x\"]")->value, "first", "getNode() predicate");
+is ($txml->getNode(XML::TinyXML::Path->new("/item[\@kind='y']"))->value, "second", "compiled path predicate");
+is (join(",", map { $_->value } $txml->xpath("id('b e')")), "first,second", "XPath id()");
+
+$txml->dropIndex;
+is ($txml->getNodeByAttribute("id", "b"), undef, "index dropped");
+
+$txml->indexAttributes;
+$txml->removeBranch(0);
+is ($txml->getNodeByAttribute("id", "b"), undef, "removed branch dropped");
@@ -0,0 +1,62 @@
+use strict;
+use Test::More tests => 24;
+use XML::TinyXML;
+use XML::TinyXML::NodeSet;
+use XML::TinyXML::Selector;
+
+my $txml = XML::TinyXML->new();
+$txml->loadBuffer(q{<items><item id="1" size="big"/><item id="2" color="red"/>} .
+                  q{<item id="3" size="big" color="red"/><item id="4" size="big"/></items>});
+
+my @big = grep { $_->attributes->{size} } $txml->getNodes("/item");
+my @red = grep { $_->attributes->{color} } $txml->getNodes("/item");
+my $ids = sub { join(",", map { $_->attributes->{id} } @_) };
+
+# nodes are added out of order and twice
+my $big = XML::TinyXML::NodeSet->new($txml, reverse(@big), $big[0]);
+my $red = XML::TinyXML::NodeSet->new($txml, @red);
+isa_ok ($big, "XML::TinyXML::NodeSet");
+is ($big->count, 3, "duplicates dropped");
+is ($ids->($big->nodes), "1,3,4", "nodes in document order");
+is ($ids->($big->union($red)->nodes), "1,2,3,4", "union");
+is ($ids->($big->intersection($red)->nodes), "3", "intersection");
+is ($ids->($big->difference($red)->nodes), "1,4", "difference");
+is ($ids->($big->range(2)->nodes), "3,4", "range up to the end");
+is ($ids->($big->range(1, 2)->nodes), "1,3", "range");
+is ($big->range(5)->count, 0, "empty range");
+is ($big->item(3)->attributes->{id}, "4", "item");
+ok (!$big->item(4), "item out of range");
+ok ($big->contains($red[1]), "contains");
+ok (!$big->contains($red[0]), "doesn't contain");
+
+my $other = XML::TinyXML->new();
+$other->loadBuffer(q{<items><item id="5"/></items>});
+is ($big->add($other->getNode("/item")), 1, "nodes of other documents are refused");
+
+# the order is kept up to date while the document changes
+$txml->getNode("/item[1]")->addChildNode(XML::TinyXML::Node->new("sub"));
+is ($ids->(XML::TinyXML::NodeSet->new($txml, reverse($txml->getNodes("/item")))->nodes), "1,2,3,4",
+    "sorted after a change");
+
+my $selector = XML::TinyXML::Selector->new($txml, "XPath");
+is ($ids->($selector->select("//item[\@size and \@color]")), "3", "'and' predicates select the intersection");
+is ($ids->($selector->select("//item[\@color or \@size]")), "1,2,3,4", "'or' predicates select the union");
+
+# a set already in order follows the nodes moved after it has been built
+my $all = XML::TinyXML::NodeSet->new($txml, $txml->getNodes("/item"));
+is ($ids->($all->nodes), "1,2,3,4", "set built in order");
+my $first = $txml->getNode("/item[1]");
+$txml->getRootNode(0)->addChildNode($first);
+is ($ids->($all->nodes), "2,3,4,1", "moved node");
+ok ($all->contains($first), "moved node still contained");
+
+# nodes of a frozen document belong to it as well
+my $frozen = XML::TinyXML->new();
+$frozen->loadBuffer(q{<items><item id="1" size="big"/><item id="2"/><item id="3" size="big"/></items>});
+$frozen->freeze;
+my $set = XML::TinyXML::NodeSet->new($frozen);
+is ($set->add($frozen->getNode("/item[3]"), $frozen->getNode("/item[1]")), 0, "frozen nodes added");
+is ($ids->($set->nodes), "1,3", "frozen nodes in document order");
+ok ($set->contains($frozen->getNode("/item[1]")), "frozen node contained");
+$selector = XML::TinyXML::Selector->new($frozen, "XPath");
+is ($ids->($selector->select("//item[\@size='big']")), "1,3", "predicates on a frozen document");
@@ -0,0 +1,38 @@
+use strict;
+use Test::More tests => 13;
+use XML::TinyXML;
+use XML::TinyXML::XPath;
+use XML::TinyXML::XPath::Batch;
+
+my $txml = XML::TinyXML->new();
+$txml->loadFile("./t/t.xml");
+
+my @exprs = ("/xml/hello/text()",
+             "//parent[\@attr='val']/blah",
+             "//parent/\@attr | //blah/\@attr",
+             "/xml/*[name() = 'qtest' or name() = 'hello']",
+             "//parent/*[last()]",
+             "count(//*)",
+             "child::*");
+my $batch = XML::TinyXML::XPath::Batch->new(@exprs, XML::TinyXML::XPath->new("/"));
+isa_ok ($batch, "XML::TinyXML::XPath::Batch");
+is (scalar($batch->strings), 8, "all the expressions compiled");
+
+my @values = $batch->evaluate($txml);
+is (scalar(@values), 8, "one value for each expression");
+is_deeply ($values[0], [ "world" ], "text()");
+is ($values[1]->[0]->value, "SECOND", "attribute predicate");
+is (join(",", map { $_->value } @{$values[2]}), "val,val2", "union in document order");
+is (join(",", map { $_->name } @{$values[3]}), "hello,qtest", "boolean predicate");
+is (join(",", map { $_->name } @{$values[4]}), "child3,blah", "positional predicates evaluated on their own");
+is ($values[5], 10, "other values returned as scalars");
+is ($values[7]->[0], $txml, "the root");
+
+# the same values returned by xpath(), relative to a context node too
+my $parent = $txml->getNode("/parent");
+@values = $batch->evaluate($txml, $parent);
+is (join(",", map { $_->name } @{$values[6]}), join(",", map { $_->name } $txml->xpath("child::*", $parent)),
+    "relative paths start from the context node");
+is ($values[1]->[0]->value, "SECOND", "absolute paths start from the root");
+
+ok (!XML::TinyXML::XPath::Batch->new("/xml", "//parent["), "malformed expression");
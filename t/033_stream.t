@@ -0,0 +1,55 @@
+use strict;
+use Test::More tests => 15;
+use XML::TinyXML;
+
+my $txml = XML::TinyXML->new();
+
+my @names;
+my $res = $txml->streamFile("./t/t.xml", "//parent/*", sub { push(@names, $_[0]->name) });
+is ($res, XML_NOERR, "streamFile");
+is (join(",", @names), "child1,child2,child3,blah", "elements passed in document order");
+is ($txml->countRootNodes, 0, "the document is left empty");
+
+my @values;
+$txml->streamFile("./t/t.xml", "/xml/parent[\@attr='val']", sub {
+    my $node = shift;
+    push(@values, $node->getChildNodeByName("blah")->value, $node->getChildNodeByName("blah")->attributes->{attr});
+});
+is_deeply (\@values, [ "SECOND", "val2" ], "subtree of the matching element");
+
+my $buf = "<items><item id='1'><item id='1.1'/></item><item id='2' type='cd'/>" .
+          "<group><item id='3'/><item id='4' type='cd'/></group><!-- done --></items>";
+
+my @ids;
+$res = $txml->streamBuffer($buf, "//item", sub { push(@ids, $_[0]->attributes->{id}) });
+is ($res, XML_NOERR, "streamBuffer");
+is (join(",", @ids), "1.1,1,2,3,4", "inner matches are passed first");
+
+@ids = ();
+$txml->streamBuffer($buf, "//item[2]", sub { push(@ids, $_[0]->attributes->{id}) });
+is (join(",", @ids), "2,4", "positional predicate");
+
+@ids = ();
+$txml->streamBuffer($buf, "/items/descendant::item[\@type='cd']", sub { push(@ids, $_[0]->attributes->{id}) });
+is (join(",", @ids), "2,4", "attribute predicate");
+
+@ids = ();
+$txml->streamBuffer($buf, "//item[\@id!='1'][1]", sub { push(@ids, $_[0]->attributes->{id}) });
+is (join(",", @ids), "1.1,2,3", "position among the siblings passing the previous predicates");
+
+@ids = ();
+$txml->streamBuffer($buf, "//item[1][\@id!='1']", sub { push(@ids, $_[0]->attributes->{id}) });
+is (join(",", @ids), "1.1,3", "predicates applied in order");
+
+@ids = ();
+$txml->streamBuffer($buf, "/items/*[2]/*", sub { push(@ids, $_[0]->attributes->{id}) });
+is (join(",", @ids), "", "no match");
+
+# the callback can stop the parser by dying
+@ids = ();
+eval { $txml->streamBuffer($buf, "//item", sub { push(@ids, $_[0]->attributes->{id}); die "enough\n" if (@ids == 2) }) };
+is ($@, "enough\n", "error propagated");
+is (join(",", @ids), "1.1,1", "parsing stopped");
+
+is ($txml->streamBuffer($buf, "//item[last()]", sub { }), XML_BADARGS, "unsupported predicate");
+is ($txml->streamBuffer($buf, "/items/../item", sub { }), XML_BADARGS, "unsupported axis");
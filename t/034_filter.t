@@ -0,0 +1,22 @@
+use strict;
+use Test::More tests => 11;
+use XML::TinyXML;
+use XML::TinyXML::Filter;
+
+my $filter = XML::TinyXML::Filter->new();
+isa_ok ($filter, "XML::TinyXML::Filter");
+is ($filter->add("hello", "/xml/hello", "//nothing"), 0, "paths added");
+is ($filter->add("blah", "//parent[\@attr='val']/blah"), 0, "attribute predicate");
+is ($filter->add("children", "//parent/child1", "//parent/*"), 0, "shared steps");
+is ($filter->add("none", "//parent[\@attr='none']", "/hello"), 0, "paths not matching");
+is ($filter->add("bad", "//parent[2]", "//parent[", "/xml/.."), 3, "unsupported paths rejected");
+is ($filter->count, 7, "count");
+
+my $txml = XML::TinyXML->new();
+$txml->loadFile("./t/t.xml");
+is (join(",", $filter->match($txml)), "hello,blah,children", "match a document");
+is (join(",", $filter->matchFile("./t/t.xml")), "hello,blah,children", "match while parsing");
+
+my $buf = "<xml><parent attr='none'><child1/></parent></xml>";
+is (join(",", $filter->matchBuffer($buf)), "children,none", "match a buffer");
+is (join(",", $filter->matchBuffer("<xml><parent>")), "", "nothing matched");
@@ -0,0 +1,38 @@
+use strict;
+use Config;
+use Test::More;
+use XML::TinyXML;
+use Encode;
+
+BEGIN {
+    if (!$Config{useithreads}) {
+        plan skip_all => "perl built without threads";
+    } elsif (!XML::TinyXML->new->hasIconv) {
+        plan skip_all => "Iconv functionalities disabled at compile time";
+    } else {
+        plan tests => 2;
+    }
+}
+
+use threads;
+
+# the raw context is used so that the threads don't release it
+# when destroying their copy of the perl objects
+my $body = join("", map { "<item id=\"$_\">caf\x{e9} $_</item>" } 1..2000);
+my $ctx = XmlCreateContext();
+XmlParseBuffer($ctx, encode("UTF-8", "<root>$body</root>"));
+XmlSetOutputEncoding($ctx, "UTF-16");
+XmlFreeze($ctx);
+my $expected = XmlDump($ctx);
+like ($expected, qr/^(\xff\xfe|\xfe\xff)/, "converted dump");
+
+# the converter kept in the context can only be used by one dump at a time
+# (the others would reset or close it while it is converting)
+my @threads = map {
+    threads->create(sub { scalar(grep { XmlDump($ctx) ne $expected } 1..50) })
+} 1..4;
+my $mismatches = 0;
+$mismatches += $_->join foreach (@threads);
+is ($mismatches, 0, "concurrent converted dumps");
+
+XmlDestroyContext($ctx);
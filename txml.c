@@ -10,10 +10,28 @@
 #include "stdlib.h"
 #include "unistd.h"
 #include "ctype.h"
+#include "stdint.h"
+#include "limits.h"
 #ifdef USE_ICONV
 #include "iconv.h"
 #endif
 #include "errno.h"
+#ifndef WIN32
+#include "fcntl.h"
+#include "sys/uio.h"
+#include "sys/mman.h"
+#include "time.h"
+#include "sched.h"
+#endif
+#ifdef USE_PTHREADS
+#include "pthread.h"
+#endif
+#ifdef USE_ZLIB
+#include "zlib.h"
+#endif
+#ifdef USE_ZSTD
+#include "zstd.h"
+#endif
 
 #define XML_ELEMENT_NONE   0
 #define XML_ELEMENT_START  1
@@ -21,6 +39,22 @@
 #define XML_ELEMENT_END    3
 #define XML_ELEMENT_UNIQUE 4
 
+// state of the numbering of the nodes (see XmlNumberNodes())
+#define XML_ORDER_STALE 0
+#define XML_ORDER_BUSY 1 // being numbered by another thread
+#define XML_ORDER_VALID 2
+
+typedef struct __XmlAttributeIndex XmlAttributeIndex;
+static void XmlIndexClear(XmlAttributeIndex *index);
+static void XmlIndexBranch(XmlAttributeIndex *index, XmlNode *node, int add);
+static void XmlIndexUpdate(XmlNodeAttribute *attr, int add);
+
+typedef struct __XmlStream XmlStream;
+typedef struct __XmlFilterRun XmlFilterRun;
+static XmlErr XmlStreamStart(TXml *xml, XmlNode *node);
+static XmlErr XmlStreamEnd(TXml *xml, XmlNode *node);
+static int XmlStreamKeeping(TXml *xml);
+
 //
 // INTERNAL HELPERS
 //
@@ -40,21 +74,20 @@ detect_encoding(char *buffer) {
         buffer[2] == (char)0xbf) 
     {
         return ENCODING_UTF8;
+    } else if (buffer[0] == (char)0xff &&
+               buffer[1] == (char)0xfe &&
+               buffer[2] == (char)0x00 &&
+               buffer[3] == (char)0x00)
+    {
+        return ENCODING_UTF32LE; //utf-32le (must be checked before utf-16le)
     } else if (buffer[0] == (char)0xff && 
-               buffer[1] == (char)0xfe && 
-               buffer[3] != (char)0x00)
+               buffer[1] == (char)0xfe)
     {
         return ENCODING_UTF16LE; // utf-16le
     } else if (buffer[0] == (char)0xfe && 
                buffer[1] == (char)0xff)
     {
         return ENCODING_UTF16BE; // utf-16be
-    } else if (buffer[0] == (char)0xff &&
-               buffer[1] == (char)0xfe &&
-               buffer[2] == (char)0x00 &&
-               buffer[3] == (char)0x00)
-    {
-        return ENCODING_UTF32LE; //utf-32le
     } else if (buffer[0] == 0 &&
                buffer[1] == 0 &&
                buffer[2] == (char)0xfe &&
@@ -72,129 +105,107 @@ detect_encoding(char *buffer) {
 
 int errno;
 
+// decodes the character (or entity) at string[*i] into out, leaving *i on
+// the last byte consumed. Character references above 0x7f are encoded in
+// utf-8 if 'utf8' is set (the document is in utf-8), as a single byte otherwise.
+// Returns the number of bytes stored in out (at most 2, never more than
+// the bytes consumed) or -1 if the entity is unknown
+static int
+dexmlizeChar(char *string, size_t *i, char *out, int utf8)
+{
+    if (string[*i] != '&') {
+        *out = string[*i];
+        return 1;
+    }
+    if (string[*i+1] == '#') {
+        char *marker;
+        long code;
+        *i+=2;
+        marker = &string[*i];
+        *out = 0;
+        if (string[*i] >= '0' && string[*i] <= '9' &&
+            string[*i+1] >= '0' && string[*i+1] <= '9')
+        {
+            *i+=2;
+            if (string[*i] >= '0' && string[*i] <= '9' && string[*i+1] == ';')
+                (*i)++;
+            else if (string[*i] == ';')
+                ; // do nothing
+            else
+                return -1;
+            code = strtol(marker, NULL, 0);
+            if (utf8 && code > 0x7f) { // at most 3 digits, so below 0x800
+                out[0] = (char)(0xc0 | (code >> 6));
+                out[1] = (char)(0x80 | (code & 0x3f));
+                return 2;
+            }
+            *out = (char)code;
+        }
+    } else if (strncmp(&string[*i], "&amp;", 5) == 0) {
+        *i+=4;
+        *out = '&';
+    } else if (strncmp(&string[*i], "&lt;", 4) == 0) {
+        *i+=3;
+        *out = '<';
+    } else if (strncmp(&string[*i], "&gt;", 4) == 0) {
+        *i+=3;
+        *out = '>';
+    } else if (strncmp(&string[*i], "&quot;", 6) == 0) {
+        *i+=5;
+        *out = '"';
+    } else if (strncmp(&string[*i], "&apos;", 6) == 0) {
+        *i+=5;
+        *out = '\'';
+    } else {
+        return -1;
+    }
+    return 1;
+}
+
 static char *
-dexmlize(char *string)
+dexmlize(char *string, int utf8)
 {
-    int i, p = 0;
-    int len = strlen(string);
+    size_t i, p = 0;
+    size_t len;
     char *unescaped = NULL;
 
     if (string) {
+        len = strlen(string);
         unescaped = (char *)calloc(1, len+1); // inlude null-byte
         for (i = 0; i < len; i++) {
-            switch (string[i]) {
-                case '&':
-                    if (string[i+1] == '#') {
-                        char *marker;
-                        i+=2;
-                        marker = &string[i];
-                        if (string[i] >= '0' && string[i] <= '9' &&
-                            string[i+1] >= '0' && string[i+1] <= '9')
-                        {
-                            char chr = 0;
-                            i+=2;
-                            if (string[i] >= '0' && string[i] <= '9' && string[i+1] == ';')
-                                i++;
-                            else if (string[i] == ';')
-                                ; // do nothing
-                            else
-                                return NULL;
-                            chr = (char)strtol(marker, NULL, 0);
-                            unescaped[p] = chr;
-                        }
-                    } else if (strncmp(&string[i], "&amp;", 5) == 0) {
-                        i+=4;
-                        unescaped[p] = '&';
-                    } else if (strncmp(&string[i], "&lt;", 4) == 0) {
-                        i+=3;
-                        unescaped[p] = '<';
-                    } else if (strncmp(&string[i], "&gt;", 4) == 0) {
-                        i+=3;
-                        unescaped[p] = '>';
-                    } else if (strncmp(&string[i], "&quot;", 6) == 0) {
-                        i+=5;
-                        unescaped[p] = '"';
-                    } else if (strncmp(&string[i], "&apos;", 6) == 0) {
-                        i+=5;
-                        unescaped[p] = '\'';
-                    } else {
-                        return NULL;
-                    }
-                    p++;
-                    break;
-                default:
-                    unescaped[p] = string[i];
-                    p++;
+            int n = dexmlizeChar(string, &i, &unescaped[p], utf8);
+            if (n < 0) {
+                free(unescaped);
+                return NULL;
             }
+            p += n;
         }
     }
     return unescaped;
 }
 
-static char *
-xmlize(char *string)
+// compares value with the first len bytes of the escaped string
+// (as dexmlize() would decode them) without copying any of them.
+// Paths are expected in utf-8
+static int
+dexmlizeMatch(char *value, char *escaped, size_t len)
 {
-    int i, p = 0;
-    int len;
-    int bufsize;
-    char *escaped = NULL;
-
-    len = strlen(string);
-    if (string) {
-        bufsize = len+1;
-        escaped = (char *)calloc(1, bufsize); // inlude null-byte
-        for (i = 0; i < len; i++) {
-            switch (string[i]) {
-                case '&':
-                    bufsize += 5;
-                    escaped = realloc(escaped, bufsize);
-                    memset(escaped+p, 0, bufsize-p);
-                    strcpy(&escaped[p], "&amp;");
-                    p += 5;
-                    break;
-                case '<':
-                    bufsize += 4;
-                    escaped = realloc(escaped, bufsize);
-                    memset(escaped+p, 0, bufsize-p);
-                    strcpy(&escaped[p], "&lt;");
-                    p += 4;
-                    break;
-                case '>':
-                    bufsize += 4;
-                    escaped = realloc(escaped, bufsize);
-                    memset(escaped+p, 0, bufsize-p);
-                    strcpy(&escaped[p], "&gt;");
-                    p += 4;
-                    break;
-                case '"':
-                    bufsize += 6;
-                    escaped = realloc(escaped, bufsize);
-                    memset(escaped+p, 0, bufsize-p);
-                    strcpy(&escaped[p], "&quot;");
-                    p += 6;
-                    break;
-                case '\'':
-                    bufsize += 6;
-                    escaped = realloc(escaped, bufsize);
-                    memset(escaped+p, 0, bufsize-p);
-                    strcpy(&escaped[p], "&apos;");
-                    p += 6;
-                    break;
-/*
-                    bufsize += 5;
-                    escaped = realloc(escaped, bufsize);
-                    memset(escaped+p, 0, bufsize-p);
-                    sprintf(&escaped[p], "&#%02d;", string[i]);
-                    p += 5;
-                    break;
-*/
-                default:
-                    escaped[p] = string[i];
-                    p++;
-            }
+    size_t i;
+    char chr[2];
+    int n, k;
+
+    for (i = 0; i < len; i++) {
+        n = dexmlizeChar(escaped, &i, chr, 1);
+        if (n < 0 || i >= len)
+            return 0;
+        if (!chr[0]) // the decoded string would end here
+            break;
+        for (k = 0; k < n; k++) {
+            if (*value++ != chr[k])
+                return 0;
         }
     }
-    return escaped;
+    return (*value == 0);
 }
 
 // reimplementing strcasestr since it's not present on all systems
@@ -225,6 +236,65 @@ static char *txml_strcasestr (char *h, char *n)
    return NULL; 
 }
 
+// checks that 'string' is well-formed utf-8 (rejecting overlong forms,
+// surrogates and anything above U+10FFFF).
+// Runs of ascii characters are skipped 8 bytes at a time
+static int
+utf8_is_valid(char *string)
+{
+    unsigned char *s = (unsigned char *)string;
+    size_t len = strlen(string);
+    size_t i = 0;
+
+    while (i < len) {
+        unsigned char c;
+        unsigned char min = 0x80, max = 0xbf; // allowed range for the 2nd byte
+        int follow;
+
+        while (i + 8 <= len) {
+            uint64_t word;
+            memcpy(&word, s + i, sizeof(word));
+            if (word & 0x8080808080808080ULL)
+                break;
+            i += 8;
+        }
+        if (i == len)
+            break;
+        c = s[i];
+        if (c < 0x80) {
+            i++;
+            continue;
+        } else if (c >= 0xc2 && c <= 0xdf) {
+            follow = 1;
+        } else if (c >= 0xe0 && c <= 0xef) {
+            follow = 2;
+            if (c == 0xe0)
+                min = 0xa0; // overlong
+            else if (c == 0xed)
+                max = 0x9f; // surrogates
+        } else if (c >= 0xf0 && c <= 0xf4) {
+            follow = 3;
+            if (c == 0xf0)
+                min = 0x90; // overlong
+            else if (c == 0xf4)
+                max = 0x8f; // above U+10FFFF
+        } else {
+            return 0;
+        }
+        if (i + follow >= len)
+            return 0; // truncated sequence
+        if (s[i+1] < min || s[i+1] > max)
+            return 0;
+        while (follow-- > 1) {
+            if ((s[i+2] & 0xc0) != 0x80)
+                return 0;
+            i++;
+        }
+        i += 2;
+    }
+    return 1;
+}
+
 //
 // TXML IMPLEMENTATION
 //
@@ -238,6 +308,7 @@ XmlCreateContext()
     xml->cNode = NULL;
     xml->ignoreWhiteSpaces = 1; // defaults to old behaviour (all blanks are not taken into account)
     xml->ignoreBlanks = 1; // defaults to old behaviour (all blanks are not taken into account)
+    xml->lockTimeout = 5000; // about as long as the old behaviour (5 retries one second apart)
     TAILQ_INIT(&xml->rootElements);
     xml->head = NULL;
     // default is UTF-8
@@ -250,13 +321,30 @@ void
 XmlResetContext(TXml *xml)
 {
     XmlNode *rNode, *tmp;
+#ifndef WIN32
+    if (xml->snapshot) { // the whole tree lives in the mapped image
+        munmap(xml->snapshot, xml->snapshotSize);
+        xml->snapshot = NULL;
+        xml->snapshotSize = 0;
+        TAILQ_INIT(&xml->rootElements);
+    }
+#endif
     TAILQ_FOREACH_SAFE(rNode, &xml->rootElements, siblings, tmp) {
         TAILQ_REMOVE(&xml->rootElements, rNode, siblings);
         XmlDestroyNode(rNode);
     }
+    xml->readOnly = 0;
+    xml->cNode = NULL; // could be left pointing into the old tree by a failed parse
+    xml->numbered = XML_ORDER_STALE;
+    if (xml->index) // the list of indexed attributes is kept
+        XmlIndexClear(xml->index);
     if(xml->head)
         free(xml->head);
     xml->head = NULL;
+    if (xml->dumpCacheBuf)
+        free(xml->dumpCacheBuf);
+    xml->dumpCacheBuf = NULL;
+    xml->dumpCacheLen = 0;
 }
 
 TXml *
@@ -271,6 +359,345 @@ XmlGetContext(XmlNode *node)
     return NULL; // should never arrive here
 }
 
+//
+// NUMBERING
+//
+// The nodes are numbered in pre-order, so that a node contains all the ones
+// numbered from its own number up to its number plus the size of its subtree.
+// Changing the structure of a document only marks its numbers as stale
+// (values and attributes don't count), they are assigned again by the
+// next XmlNumberNodes() call.
+//
+// a branch has been attached to (or detached from) parent : if parent belongs
+// to a document its structure changed, and the branch must be (un)indexed
+static void
+XmlBranchMoved(XmlNode *parent, XmlNode *branch, int attached)
+{
+    TXml *xml = XmlGetContext(parent);
+    if (!xml)
+        return;
+    xml->numbered = XML_ORDER_STALE;
+    if (xml->index)
+        XmlIndexBranch(xml->index, branch, attached);
+}
+
+static unsigned long
+XmlNumberBranch(XmlNode *node, unsigned long order, unsigned int depth)
+{
+    XmlNode *child;
+    unsigned long next = order + 1;
+
+    node->order = order;
+    node->depth = depth;
+    TAILQ_FOREACH(child, &node->children, siblings)
+        next = XmlNumberBranch(child, next, depth + 1);
+    node->descendants = next - order - 1;
+    return next;
+}
+
+void
+XmlNumberNodes(TXml *xml)
+{
+    XmlNode *rNode;
+    unsigned long order = 1;
+#ifndef WIN32
+    int state = XML_ORDER_STALE;
+
+    if (__atomic_load_n(&xml->numbered, __ATOMIC_ACQUIRE) == XML_ORDER_VALID)
+        return;
+    // readers of the same document can get here at once : the first one
+    // numbers the nodes while the others wait for it to finish
+    if (!__atomic_compare_exchange_n(&xml->numbered, &state, XML_ORDER_BUSY, 0,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+    {
+        while (__atomic_load_n(&xml->numbered, __ATOMIC_ACQUIRE) != XML_ORDER_VALID)
+            sched_yield();
+        return;
+    }
+#else
+    if (xml->numbered == XML_ORDER_VALID)
+        return;
+#endif
+
+    TAILQ_FOREACH(rNode, &xml->rootElements, siblings)
+        order = XmlNumberBranch(rNode, order, 0);
+    xml->numbering++;
+
+#ifndef WIN32
+    __atomic_store_n(&xml->numbered, XML_ORDER_VALID, __ATOMIC_RELEASE);
+#else
+    xml->numbered = XML_ORDER_VALID;
+#endif
+}
+
+int
+XmlIsAncestor(XmlNode *ancestor, XmlNode *node)
+{
+    return (node->order > ancestor->order &&
+            node->order <= ancestor->order + ancestor->descendants);
+}
+
+int
+XmlCompareNodes(XmlNode *a, XmlNode *b)
+{
+    if (a->order == b->order)
+        return 0;
+    return a->order < b->order ? -1 : 1;
+}
+
+//
+// ATTRIBUTE INDEX
+//
+// Hash table of the attributes having one of the indexed names, keyed by
+// their name and value. Entries refer to the attributes themselves, so they
+// must be dropped before an attribute is changed or released.
+//
+typedef struct __XmlIndexEntry {
+    XmlNodeAttribute *attr;
+    unsigned int hash;
+    struct __XmlIndexEntry *next;
+} XmlIndexEntry;
+
+struct __XmlAttributeIndex {
+    char **names;
+    unsigned int numNames;
+    XmlIndexEntry **buckets;
+    size_t numBuckets; // always a power of 2
+    size_t count;
+};
+
+static unsigned int
+XmlIndexHash(char *name, size_t nameLen, char *value, size_t valueLen)
+{
+    unsigned int hash = 2166136261u; // FNV-1a
+    size_t i;
+    for (i = 0; i < nameLen; i++) {
+        hash ^= (unsigned char)name[i];
+        hash *= 16777619u;
+    }
+    hash *= 16777619u; // for the separator
+    for (i = 0; i < valueLen; i++) {
+        hash ^= (unsigned char)value[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static int
+XmlIndexHasName(XmlAttributeIndex *index, char *name, size_t nameLen)
+{
+    unsigned int i;
+    for (i = 0; i < index->numNames; i++) {
+        if (strncmp(index->names[i], name, nameLen) == 0 && index->names[i][nameLen] == 0)
+            return 1;
+    }
+    return 0;
+}
+
+static void
+XmlIndexGrow(XmlAttributeIndex *index)
+{
+    size_t numBuckets = index->numBuckets * 2;
+    XmlIndexEntry **buckets = (XmlIndexEntry **)calloc(numBuckets, sizeof(XmlIndexEntry *));
+    size_t i;
+
+    if (!buckets) // the index keeps working, just slower
+        return;
+    for (i = 0; i < index->numBuckets; i++) {
+        XmlIndexEntry *entry = index->buckets[i];
+        while (entry) {
+            XmlIndexEntry *next = entry->next;
+            entry->next = buckets[entry->hash & (numBuckets - 1)];
+            buckets[entry->hash & (numBuckets - 1)] = entry;
+            entry = next;
+        }
+    }
+    free(index->buckets);
+    index->buckets = buckets;
+    index->numBuckets = numBuckets;
+}
+
+static void
+XmlIndexAdd(XmlAttributeIndex *index, XmlNodeAttribute *attr)
+{
+    XmlIndexEntry *entry;
+
+    if (!attr->value || !XmlIndexHasName(index, attr->name, strlen(attr->name)))
+        return;
+    entry = (XmlIndexEntry *)malloc(sizeof(XmlIndexEntry));
+    if (!entry)
+        return;
+    if (index->count >= index->numBuckets)
+        XmlIndexGrow(index);
+    entry->attr = attr;
+    entry->hash = XmlIndexHash(attr->name, strlen(attr->name), attr->value, strlen(attr->value));
+    entry->next = index->buckets[entry->hash & (index->numBuckets - 1)];
+    index->buckets[entry->hash & (index->numBuckets - 1)] = entry;
+    index->count++;
+}
+
+static void
+XmlIndexRemove(XmlAttributeIndex *index, XmlNodeAttribute *attr)
+{
+    XmlIndexEntry **prev;
+
+    if (!attr->value || !XmlIndexHasName(index, attr->name, strlen(attr->name)))
+        return;
+    prev = &index->buckets[XmlIndexHash(attr->name, strlen(attr->name), attr->value, strlen(attr->value)) &
+                           (index->numBuckets - 1)];
+    while (*prev) {
+        XmlIndexEntry *entry = *prev;
+        if (entry->attr == attr) {
+            *prev = entry->next;
+            free(entry);
+            index->count--;
+            return;
+        }
+        prev = &entry->next;
+    }
+}
+
+static void
+XmlIndexBranch(XmlAttributeIndex *index, XmlNode *node, int add)
+{
+    XmlNodeAttribute *attr;
+    XmlNode *child;
+
+    TAILQ_FOREACH(attr, &node->attributes, list) {
+        if (add)
+            XmlIndexAdd(index, attr);
+        else
+            XmlIndexRemove(index, attr);
+    }
+    TAILQ_FOREACH(child, &node->children, siblings)
+        XmlIndexBranch(index, child, add);
+}
+
+// (un)index an attribute, if its node belongs to a document being indexed
+static void
+XmlIndexUpdate(XmlNodeAttribute *attr, int add)
+{
+    TXml *xml = attr->node ? XmlGetContext(attr->node) : NULL;
+    if (!xml || !xml->index)
+        return;
+    if (add)
+        XmlIndexAdd(xml->index, attr);
+    else
+        XmlIndexRemove(xml->index, attr);
+}
+
+static void
+XmlIndexClear(XmlAttributeIndex *index)
+{
+    size_t i;
+    for (i = 0; i < index->numBuckets; i++) {
+        while (index->buckets[i]) {
+            XmlIndexEntry *entry = index->buckets[i];
+            index->buckets[i] = entry->next;
+            free(entry);
+        }
+    }
+    index->count = 0;
+}
+
+void
+XmlDropIndex(TXml *xml)
+{
+    unsigned int i;
+
+    if (!xml->index)
+        return;
+    XmlIndexClear(xml->index);
+    for (i = 0; i < xml->index->numNames; i++)
+        free(xml->index->names[i]);
+    free(xml->index->names);
+    free(xml->index->buckets);
+    free(xml->index);
+    xml->index = NULL;
+}
+
+XmlErr
+XmlIndexAttributes(TXml *xml, char **names, unsigned int count)
+{
+    static char *defaultNames[] = { "id" };
+    XmlAttributeIndex *index;
+    XmlNode *rNode;
+    unsigned int i;
+
+    if (!names || !count) {
+        names = defaultNames;
+        count = 1;
+    }
+    XmlDropIndex(xml);
+    index = (XmlAttributeIndex *)calloc(1, sizeof(XmlAttributeIndex));
+    if (!index)
+        return XML_MEMORY_ERR;
+    index->numBuckets = 64;
+    index->buckets = (XmlIndexEntry **)calloc(index->numBuckets, sizeof(XmlIndexEntry *));
+    index->names = (char **)calloc(count, sizeof(char *));
+    xml->index = index; // so that XmlDropIndex() can release it on errors
+    if (!index->buckets || !index->names) {
+        XmlDropIndex(xml);
+        return XML_MEMORY_ERR;
+    }
+    for (i = 0; i < count; i++) {
+        index->names[i] = strdup(names[i]);
+        if (!index->names[i]) {
+            XmlDropIndex(xml);
+            return XML_MEMORY_ERR;
+        }
+        index->numNames++;
+    }
+    TAILQ_FOREACH(rNode, &xml->rootElements, siblings)
+        XmlIndexBranch(index, rNode, 1);
+    return XML_NOERR;
+}
+
+int
+XmlIsIndexed(TXml *xml, char *name)
+{
+    return (xml->index && XmlIndexHasName(xml->index, name, strlen(name)));
+}
+
+// find the first node in document order having the given attribute with the given
+// (already decoded) value. If parent is not NULL, only its children named nodeName count
+static XmlNode *
+XmlIndexLookup(TXml *xml, char *name, size_t nameLen, char *value, size_t valueLen,
+               XmlNode *parent, char *nodeName, size_t nodeNameLen)
+{
+    XmlIndexEntry *entry;
+    XmlNode *found = NULL;
+    unsigned int hash = XmlIndexHash(name, nameLen, value, valueLen);
+
+    XmlNumberNodes(xml);
+    for (entry = xml->index->buckets[hash & (xml->index->numBuckets - 1)]; entry; entry = entry->next) {
+        XmlNodeAttribute *attr = entry->attr;
+        XmlNode *node = attr->node;
+        if (entry->hash != hash)
+            continue;
+        if (strncmp(attr->name, name, nameLen) != 0 || attr->name[nameLen] != 0)
+            continue;
+        if (strncmp(attr->value, value, valueLen) != 0 || attr->value[valueLen] != 0)
+            continue;
+        if (parent && (node->parent != parent || strncmp(node->name, nodeName, nodeNameLen) != 0 ||
+                       node->name[nodeNameLen] != 0))
+        {
+            continue;
+        }
+        if (!found || node->order < found->order)
+            found = node;
+    }
+    return found;
+}
+
+XmlNode *
+XmlGetNodeByAttribute(TXml *xml, char *name, char *value)
+{
+    if (!xml || !name || !value || !XmlIsIndexed(xml, name))
+        return NULL;
+    return XmlIndexLookup(xml, name, strlen(name), value, strlen(value), NULL, NULL, 0);
+}
+
 void
 XmlSetDocumentEncoding(TXml *xml, char *encoding)
 {
@@ -287,6 +714,11 @@ void
 XmlDestroyContext(TXml *xml)
 {
     XmlResetContext(xml);
+    XmlDropIndex(xml);
+#ifdef USE_ICONV
+    if (xml->outputConverter)
+        iconv_close((iconv_t)xml->outputConverter);
+#endif
     free(xml);
 }
 
@@ -330,9 +762,7 @@ XmlCreateNode(char *name, char *value, XmlNode *parent)
 
     node->name = strdup(name);
 
-    if (parent)
-        XmlAddChildNode(parent, node);
-    else
+    if (!parent || XmlAddChildNode(parent, node) != XML_NOERR)
         XmlSetNodePath(node, NULL);
 
     if(value && strlen(value) > 0)
@@ -350,6 +780,9 @@ XmlDestroyNode(XmlNode *node)
     XmlNamespace *ns, *nsTmp;
     XmlNamespaceSet *item, *itemTmp;
 
+    if (node->readOnly) // released together with the snapshot it belongs to
+        return;
+
     TAILQ_FOREACH_SAFE(attr, &node->attributes, list, attrTmp) {
         TAILQ_REMOVE(&node->attributes, attr, list);
         if(attr->name)
@@ -383,15 +816,29 @@ XmlDestroyNode(XmlNode *node)
     free(node);
 }
 
+void
+XmlInvalidateNode(XmlNode *node)
+{
+    // if a branch is not clean, none of its ancestors is
+    // (and read-only nodes are never cached)
+    while (node && node->cacheState == XML_CACHE_CLEAN) {
+        node->cacheState = XML_CACHE_DIRTY;
+        node = node->parent;
+    }
+}
+
 XmlErr
 XmlSetNodeValue(XmlNode *node, char *val)
 {
     if(!val)
         return XML_BADARGS;
+    if(node->readOnly)
+        return XML_UPDATE_ERR;
 
     if(node->value)
         free(node->value);
     node->value = strdup(val);
+    XmlInvalidateNode(node);
     return XML_NOERR;
 }
 
@@ -412,6 +859,8 @@ XmlRemoveChildNode(XmlNode *parent, XmlNode *child)
     TAILQ_FOREACH_SAFE(p, &parent->children, siblings, tmp) {
         if (p == child) {
             TAILQ_REMOVE(&parent->children, p, siblings);
+            XmlInvalidateNode(parent);
+            XmlBranchMoved(parent, p, 0);
             p->parent = NULL;
             XmlSetNodePath(p, NULL);
             break;
@@ -533,6 +982,8 @@ XmlAddChildNode(XmlNode *parent, XmlNode *child)
     TXml *srcCtx, *dstCtx;
     if(!child)
         return XML_BADARGS;
+    if(parent->readOnly || child->readOnly)
+        return XML_UPDATE_ERR;
 
     // now we can update the parent
     if (child->parent)
@@ -540,6 +991,10 @@ XmlAddChildNode(XmlNode *parent, XmlNode *child)
 
     TAILQ_INSERT_TAIL(&parent->children, child, siblings);
     child->parent = parent;
+    // the cached output of the child (if any) was relative to its old position
+    child->cacheState = XML_CACHE_NONE;
+    XmlInvalidateNode(parent);
+    XmlBranchMoved(parent, child, 1);
 
     // udate/propagate the default namespace (if any) to the newly attached node 
     // (and all its descendants)
@@ -566,6 +1021,8 @@ XmlAddRootNode(TXml *xml, XmlNode *node)
 {
     if(!node)
         return XML_BADARGS;
+    if(xml->readOnly || node->readOnly)
+        return XML_UPDATE_ERR;
 
     if (!TAILQ_EMPTY(&xml->rootElements) && !xml->allowMultipleRootNodes) {
         return XML_MROOT_ERR;
@@ -573,6 +1030,10 @@ XmlAddRootNode(TXml *xml, XmlNode *node)
 
     TAILQ_INSERT_TAIL(&xml->rootElements, node, siblings);
     node->context = xml;
+    xml->numbered = XML_ORDER_STALE;
+    if (xml->index)
+        XmlIndexBranch(xml->index, node, 1);
+    node->cacheState = XML_CACHE_NONE;
     XmlUpdateKnownNamespaces(node);
     return XML_NOERR;
 }
@@ -584,6 +1045,8 @@ XmlAddAttribute(XmlNode *node, char *name, char *val)
 
     if(!name || !node)
         return XML_BADARGS;
+    if(node->readOnly)
+        return XML_UPDATE_ERR;
 
     attr = (XmlNodeAttribute *)calloc(1, sizeof(XmlNodeAttribute));
     attr->name = strdup(name);
@@ -591,6 +1054,8 @@ XmlAddAttribute(XmlNode *node, char *name, char *val)
     attr->node = node;
 
     TAILQ_INSERT_TAIL(&node->attributes, attr, list);
+    XmlInvalidateNode(node);
+    XmlIndexUpdate(attr, 1);
     return XML_NOERR;
 }
 
@@ -600,12 +1065,16 @@ XmlRemoveAttribute(XmlNode *node, unsigned long index)
     XmlNodeAttribute *attr, *tmp;
     int count = 0;
 
+    if (node->readOnly)
+        return XML_UPDATE_ERR;
     TAILQ_FOREACH_SAFE(attr, &node->attributes, list, tmp) {
         if (count++ == index) {
+            XmlIndexUpdate(attr, 0);
             TAILQ_REMOVE(&node->attributes, attr, list);
             free(attr->name);
             free(attr->value);
             free(attr);
+            XmlInvalidateNode(node);
             return XML_NOERR;
         }
     }
@@ -619,12 +1088,56 @@ XmlClearAttributes(XmlNode *node)
     unsigned int nAttrs = 0;
     int i;
 
+    if (node->readOnly)
+        return;
     TAILQ_FOREACH_SAFE(attr, &node->attributes, list, tmp) {
+        XmlIndexUpdate(attr, 0);
         TAILQ_REMOVE(&node->attributes, attr, list);
         free(attr->name);
         free(attr->value);
         free(attr);
     }
+    XmlInvalidateNode(node);
+}
+
+XmlErr
+XmlSetAttributeValue(XmlNodeAttribute *attr, char *value)
+{
+    char *copy;
+
+    if (!attr || !value)
+        return XML_BADARGS;
+    if (attr->node && attr->node->readOnly)
+        return XML_UPDATE_ERR;
+    copy = strdup(value);
+    if (!copy)
+        return XML_MEMORY_ERR;
+    XmlIndexUpdate(attr, 0);
+    free(attr->value);
+    attr->value = copy;
+    XmlIndexUpdate(attr, 1);
+    XmlInvalidateNode(attr->node);
+    return XML_NOERR;
+}
+
+XmlErr
+XmlSetAttributeName(XmlNodeAttribute *attr, char *name)
+{
+    char *copy;
+
+    if (!attr || !name)
+        return XML_BADARGS;
+    if (attr->node && attr->node->readOnly)
+        return XML_UPDATE_ERR;
+    copy = strdup(name);
+    if (!copy)
+        return XML_MEMORY_ERR;
+    XmlIndexUpdate(attr, 0);
+    free(attr->name);
+    attr->name = copy;
+    XmlIndexUpdate(attr, 1);
+    XmlInvalidateNode(attr->node);
+    return XML_NOERR;
 }
 
 XmlNodeAttribute
@@ -651,6 +1164,29 @@ XmlNodeAttribute
     return NULL;
 }
 
+static int
+XmlIsUtf8(TXml *xml)
+{
+    return (strcasecmp(xml->documentEncoding, "utf-8") == 0 ||
+            strcasecmp(xml->documentEncoding, "utf8") == 0);
+}
+
+// if requested, refuse malformed utf-8 in what ends up in the tree
+static XmlErr
+XmlCheckUtf8(TXml *xml, char *string)
+{
+    if (!xml->validateUtf8 || !string)
+        return XML_NOERR;
+    // documents declaring a different encoding are not our business
+    if (!XmlIsUtf8(xml))
+        return XML_NOERR;
+    if (!utf8_is_valid(string)) {
+        fprintf(stderr, "Invalid utf-8 sequence in '%s'\n", string);
+        return XML_BAD_CHARS;
+    }
+    return XML_NOERR;
+}
+
 static XmlErr
 XmlExtraNodeHandler(TXml *xml, char *content, char type)
 {
@@ -658,6 +1194,12 @@ XmlExtraNodeHandler(TXml *xml, char *content, char type)
     XmlErr res = XML_NOERR;
     char fakeName[256];
 
+    res = XmlCheckUtf8(xml, content);
+    if (res != XML_NOERR)
+        return res;
+    if (xml->stream && !XmlStreamKeeping(xml)) // not part of a matching subtree
+        return XML_NOERR;
+
     sprintf(fakeName, "_fakenode_%d_", type);
     newNode = XmlCreateNode(fakeName, content, xml->cNode);
     newNode->type = type;
@@ -697,8 +1239,22 @@ XmlStartHandler(TXml *xml, char *element, char **attr_names, char **attr_values)
     if(!element || strlen(element) == 0)
         return XML_BADARGS;
 
+    res = XmlCheckUtf8(xml, element);
+    if (res != XML_NOERR)
+        return res;
+    if(attr_names && attr_values) {
+        for (offset = 0; attr_names[offset] != NULL; offset++) {
+            res = XmlCheckUtf8(xml, attr_names[offset]);
+            if (res == XML_NOERR)
+                res = XmlCheckUtf8(xml, attr_values[offset]);
+            if (res != XML_NOERR)
+                return res;
+        }
+        offset = 0;
+    }
+
     // unescape read element to be used as nodename
-    nodename = dexmlize(element);
+    nodename = dexmlize(element, XmlIsUtf8(xml));
     if (!nodename)
         return XML_BAD_CHARS;
 
@@ -755,6 +1311,8 @@ XmlStartHandler(TXml *xml, char *element, char **attr_names, char **attr_values)
         }
     }
     xml->cNode = newNode;
+    if (xml->stream)
+        res = XmlStreamStart(xml, newNode);
 
 _start_done:
     return res;
@@ -763,10 +1321,13 @@ _start_done:
 static XmlErr
 XmlEndHandler(TXml *xml, char *element)
 {
-    XmlNode *parent;
+    XmlNode *parent, *node;
     if(xml->cNode) {
-        parent = xml->cNode->parent;
+        node = xml->cNode;
+        parent = node->parent;
         xml->cNode = parent;
+        if (xml->stream)
+            return XmlStreamEnd(xml, node);
         return XML_NOERR;
     }
     return XML_GENERIC_ERR;
@@ -814,8 +1375,13 @@ XmlValueHandler(TXml *xml, char *text)
             }
         }
 
+        if (XmlCheckUtf8(xml, text) != XML_NOERR)
+            return XML_BAD_CHARS;
+        if (xml->stream && !XmlStreamKeeping(xml)) // nobody will look at it
+            return XML_NOERR;
+
         if(xml->cNode)  {
-            char *rtext = dexmlize(text);
+            char *rtext = dexmlize(text, XmlIsUtf8(xml));
             if (!rtext)
                 return XML_BAD_CHARS;
             XmlSetNodeValue(xml->cNode, rtext);
@@ -1078,8 +1644,8 @@ XmlParseBuffer(TXml *xml, char *buf)
                             if(*p == quote) {
                                 char *dexmlized;
                                 char *tmpVal = (char *)malloc(p-mark+2);
-                                int i, j=0;
-                                for (i = 0; i < p-mark; i++) {
+                                size_t i, j=0;
+                                for (i = 0; i < (size_t)(p-mark); i++) {
                                     if ( mark[i] == quote && mark[i+1] == mark[i] )
                                         i++;
                                     tmpVal[j++] = mark[i]; 
@@ -1091,7 +1657,7 @@ XmlParseBuffer(TXml *xml, char *buf)
                                 attrs[nAttrs-1] = tmpAttr;
                                 attrs[nAttrs] = NULL;
                                 values = (char **)realloc(values, sizeof(char *)*(nAttrs+1));
-                                dexmlized = dexmlize(tmpVal);
+                                dexmlized = dexmlize(tmpVal, XmlIsUtf8(xml));
                                 free(tmpVal);
                                 values[nAttrs-1] = dexmlized;
                                 values[nAttrs] = NULL;
@@ -1225,27 +1791,69 @@ __exit:
 }
 #endif // #ifdef WIN32
 
+// waits for 'ms' milliseconds (used to back off while waiting for a lock)
+static void
+XmlSleepMs(int ms)
+{
+#ifdef WIN32
+    Sleep(ms);
+#else
+    struct timespec ts;
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (ms % 1000) * 1000000L;
+    while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+        ;
+#endif
+}
+
+#define XML_LOCK_MAX_DELAY 50 // ms
+
+// acquires an advisory lock on the whole file, shared (for reading) or
+// exclusive (for writing), so that it's respected by other processes as well.
+// If the lock is held by someone else, polls it with an increasing delay
+// for up to 'timeout' milliseconds (0 means not to wait at all and a
+// negative value to wait as long as needed).
+// NOTE: on win32 the lock is always exclusive
 static XmlErr
-XmlFileLock(FILE *file)
+XmlFileLock(FILE *file, int exclusive, int timeout)
 {
-    int tries = 0;
-    if(file) {
+    int waited = 0;
+    int delay = 1;
+
+    if(!file)
+        return XML_GENERIC_ERR;
+    for (;;) {
 #ifdef WIN32
-        while(W32LockFile(file) != 0) {
+        if (W32LockFile(file) == 0)
+            return XML_NOERR;
 #else
-        while(ftrylockfile(file) != 0) {
+        struct flock fl;
+        memset(&fl, 0, sizeof(fl));
+        fl.l_type = exclusive ? F_WRLCK : F_RDLCK;
+        fl.l_whence = SEEK_SET; // l_start and l_len are 0: the whole file
+        if (fcntl(fileno(file), timeout < 0 ? F_SETLKW : F_SETLK, &fl) == 0)
+            return XML_NOERR;
+        if (errno == EINTR)
+            continue;
+        if (errno == ENOLCK) // the filesystem doesn't support locking
+            return XML_NOERR;
+        if (errno != EACCES && errno != EAGAIN) {
+            fprintf(stderr, "Can't lock xml file: %s\n", strerror(errno));
+            return XML_GENERIC_ERR;
+        }
 #endif
-    // warning("can't obtain a lock on xml file %s... waiting (%d)", xmlFile, tries);
-            tries++;
-            if(tries>5) {
-                fprintf(stderr, "sticky lock on xml file!!!");
-                return XML_GENERIC_ERR;
-            }
-            sleep(1);
+        if (timeout >= 0 && waited >= timeout) {
+            fprintf(stderr, "Timeout waiting for a lock on xml file (%d ms)\n", waited);
+            return XML_GENERIC_ERR;
         }
-        return XML_NOERR;
+        if (timeout >= 0 && delay > timeout - waited)
+            delay = timeout - waited;
+        XmlSleepMs(delay);
+        waited += delay;
+        delay *= 2;
+        if (delay > XML_LOCK_MAX_DELAY)
+            delay = XML_LOCK_MAX_DELAY;
     }
-    return XML_GENERIC_ERR;
 }
 
 static XmlErr
@@ -1255,19 +1863,526 @@ XmlFileUnlock(FILE *file)
 #ifdef WIN32
         if(W32UnlockFile(file) == 0)
 #else
-        funlockfile(file);
-
+        struct flock fl;
+        fflush(file); // write out what's buffered while we still own the lock
+        memset(&fl, 0, sizeof(fl));
+        fl.l_type = F_UNLCK;
+        fl.l_whence = SEEK_SET;
+        fcntl(fileno(file), F_SETLK, &fl);
 #endif
         return XML_NOERR;
     }
     return XML_GENERIC_ERR;
 }
 
-XmlErr
-XmlParseFile(TXml *xml, char *path)
+// opens 'path' for writing. The file is not truncated until
+// XmlTruncateLocked() is called (once the lock has been acquired),
+// otherwise readers holding a shared lock would see it emptied
+static FILE *
+XmlOpenForWriting(char *path)
 {
-    FILE *inFile;
-    char *buffer;
+#ifdef WIN32
+    return fopen(path, "w+");
+#else
+    FILE *file;
+    int fd = open(path, O_RDWR|O_CREAT, 0666);
+    if (fd == -1)
+        return NULL;
+    file = fdopen(fd, "w+"); // fdopen() never truncates
+    if (!file)
+        close(fd);
+    return file;
+#endif
+}
+
+static XmlErr
+XmlTruncateLocked(FILE *file)
+{
+#ifndef WIN32
+    if (ftruncate(fileno(file), 0) != 0) {
+        fprintf(stderr, "Can't truncate xml file: %s\n", strerror(errno));
+        return XML_GENERIC_ERR;
+    }
+#endif
+    return XML_NOERR;
+}
+
+// UNICODE INPUT
+//
+// UTF-16 and UTF-32 documents are converted to UTF-8 while they are read,
+// one chunk at a time, straight into the buffer handed to the parser
+// (so neither iconv nor a second copy of the whole document are needed).
+// Runs of ascii characters, by far the most common ones in xml markup,
+// are detected 8 bytes at a time and just narrowed.
+//
+#define XML_READ_CHUNK 65536
+
+static size_t
+XmlEncodeUtf8(unsigned int cp, char *out)
+{
+    if (cp < 0x80) {
+        out[0] = (char)cp;
+        return 1;
+    } else if (cp < 0x800) {
+        out[0] = (char)(0xc0 | (cp >> 6));
+        out[1] = (char)(0x80 | (cp & 0x3f));
+        return 2;
+    } else if (cp < 0x10000) {
+        out[0] = (char)(0xe0 | (cp >> 12));
+        out[1] = (char)(0x80 | ((cp >> 6) & 0x3f));
+        out[2] = (char)(0x80 | (cp & 0x3f));
+        return 3;
+    }
+    out[0] = (char)(0xf0 | (cp >> 18));
+    out[1] = (char)(0x80 | ((cp >> 12) & 0x3f));
+    out[2] = (char)(0x80 | ((cp >> 6) & 0x3f));
+    out[3] = (char)(0x80 | (cp & 0x3f));
+    return 4;
+}
+
+// converts as many complete characters as available in 'in'.
+// 'out' must have room for at least len*3/2 bytes.
+// What's left unconsumed (a truncated character) must be passed again
+// together with the following chunk
+static XmlErr
+XmlTranscodeToUtf8(int encoding, unsigned char *in, size_t len,
+    char *out, size_t *consumed, size_t *produced)
+{
+    int unit = (encoding == ENCODING_UTF16LE || encoding == ENCODING_UTF16BE) ? 2 : 4;
+    int bigEndian = (encoding == ENCODING_UTF16BE || encoding == ENCODING_UTF32BE);
+    int low = bigEndian ? unit - 1 : 0; // offset of the least significant byte
+    unsigned char maskBytes[8];
+    uint64_t asciiMask;
+    size_t i = 0, o = 0;
+    int k;
+
+    // all bits which must be zero for a unit to hold an ascii character
+    for (k = 0; k < 8; k++)
+        maskBytes[k] = (k % unit == low) ? 0x80 : 0xff;
+    memcpy(&asciiMask, maskBytes, sizeof(asciiMask));
+
+    while (i < len) {
+        unsigned int cp;
+
+        while (i + 8 <= len) {
+            uint64_t word;
+            memcpy(&word, in + i, sizeof(word));
+            if (word & asciiMask)
+                break;
+            for (k = low; k < 8; k += unit)
+                out[o++] = (char)in[i+k];
+            i += 8;
+        }
+        if (i + unit > len)
+            break;
+
+        if (unit == 2) {
+            cp = bigEndian ? (in[i] << 8) | in[i+1] : (in[i+1] << 8) | in[i];
+            if (cp >= 0xd800 && cp <= 0xdbff) { // high surrogate
+                unsigned int lowSurrogate;
+                if (i + 4 > len)
+                    break; // wait for the rest of the pair
+                lowSurrogate = bigEndian ? (in[i+2] << 8) | in[i+3] : (in[i+3] << 8) | in[i+2];
+                if (lowSurrogate < 0xdc00 || lowSurrogate > 0xdfff)
+                    return XML_BAD_CHARS;
+                cp = 0x10000 + ((cp - 0xd800) << 10) + (lowSurrogate - 0xdc00);
+                i += 2;
+            } else if (cp >= 0xdc00 && cp <= 0xdfff) {
+                return XML_BAD_CHARS;
+            }
+        } else {
+            cp = bigEndian
+               ? ((unsigned int)in[i] << 24) | (in[i+1] << 16) | (in[i+2] << 8) | in[i+3]
+               : ((unsigned int)in[i+3] << 24) | (in[i+2] << 16) | (in[i+1] << 8) | in[i];
+            if (cp > 0x10ffff || (cp >= 0xd800 && cp <= 0xdfff))
+                return XML_BAD_CHARS;
+        }
+        if (cp == 0) // would truncate the document
+            return XML_BAD_CHARS;
+        i += unit;
+        o += XmlEncodeUtf8(cp, out + o);
+    }
+    *consumed = i;
+    *produced = o;
+    return XML_NOERR;
+}
+
+// reads the rest of a UTF-16/UTF-32 file converting it to UTF-8.
+// 'pending' holds the bytes already read past the BOM
+static XmlErr
+XmlReadUnicodeFile(FILE *inFile, int encoding, char *pending, size_t pendingLen,
+    size_t sizeHint, char **outBuffer)
+{
+    unsigned char *chunk;
+    char *out;
+    size_t outLen = 0;
+    size_t outSize;
+    size_t chunkLen = pendingLen;
+    int eof = 0;
+
+    chunk = (unsigned char *)malloc(XML_READ_CHUNK);
+    if (!chunk)
+        return XML_MEMORY_ERR;
+    // start assuming mostly ascii content (the buffer will grow if needed)
+    if (encoding == ENCODING_UTF16LE || encoding == ENCODING_UTF16BE)
+        outSize = sizeHint / 2 + 1;
+    else
+        outSize = sizeHint / 4 + 1;
+    out = (char *)malloc(outSize);
+    if (!out) {
+        free(chunk);
+        return XML_MEMORY_ERR;
+    }
+    memcpy(chunk, pending, pendingLen);
+
+    while (!eof || chunkLen > 0) {
+        size_t consumed = 0, produced = 0;
+        XmlErr rc;
+
+        if (!eof) {
+            size_t rb = fread(chunk + chunkLen, 1, XML_READ_CHUNK - chunkLen, inFile);
+            if (rb < XML_READ_CHUNK - chunkLen) {
+                if (ferror(inFile)) {
+                    fprintf(stderr, "Can't read file: %s\n", strerror(errno));
+                    free(chunk);
+                    free(out);
+                    return XML_GENERIC_ERR;
+                }
+                eof = 1;
+            }
+            chunkLen += rb;
+        }
+
+        if (outSize - outLen < chunkLen / 2 * 3 + 4 + 1) {
+            size_t newSize = outSize * 2;
+            char *newOut;
+            while (newSize - outLen < chunkLen / 2 * 3 + 4 + 1)
+                newSize *= 2;
+            newOut = (char *)realloc(out, newSize);
+            if (!newOut) {
+                free(chunk);
+                free(out);
+                return XML_MEMORY_ERR;
+            }
+            out = newOut;
+            outSize = newSize;
+        }
+
+        rc = XmlTranscodeToUtf8(encoding, chunk, chunkLen, out + outLen, &consumed, &produced);
+        outLen += produced;
+        if (rc == XML_NOERR && eof && consumed < chunkLen)
+            rc = XML_BAD_CHARS; // truncated character at the end of the file
+        if (rc != XML_NOERR) {
+            fprintf(stderr, "Invalid %s sequence at offset %lu\n",
+                (encoding == ENCODING_UTF16LE || encoding == ENCODING_UTF16BE) ? "UTF-16" : "UTF-32",
+                (unsigned long)outLen);
+            free(chunk);
+            free(out);
+            return rc;
+        }
+        // keep the incomplete character (if any) for the next round
+        memmove(chunk, chunk + consumed, chunkLen - consumed);
+        chunkLen -= consumed;
+    }
+    free(chunk);
+    out[outLen] = 0;
+    *outBuffer = out;
+    return XML_NOERR;
+}
+
+// converts a whole UTF-16/UTF-32 buffer (starting with its BOM) to UTF-8
+static XmlErr
+XmlTranscodeBuffer(int encoding, char **buffer, size_t *len)
+{
+    size_t bomLen = (encoding == ENCODING_UTF16LE || encoding == ENCODING_UTF16BE) ? 2 : 4;
+    size_t consumed = 0, produced = 0;
+    char *out;
+    XmlErr rc;
+
+    out = (char *)malloc(*len / 2 * 3 + 4 + 1);
+    if (!out)
+        return XML_MEMORY_ERR;
+    rc = XmlTranscodeToUtf8(encoding, (unsigned char *)*buffer + bomLen, *len - bomLen,
+        out, &consumed, &produced);
+    if (rc == XML_NOERR && consumed < *len - bomLen)
+        rc = XML_BAD_CHARS; // truncated character at the end of the buffer
+    if (rc != XML_NOERR) {
+        free(out);
+        return rc;
+    }
+    out[produced] = 0;
+    free(*buffer);
+    *buffer = out;
+    *len = produced;
+    return XML_NOERR;
+}
+
+//
+// COMPRESSED INPUT
+//
+// gzip and zstd files are recognized by their magic number. The compressed
+// data is read in chunks and inflated straight into the buffer handed to
+// the parser, so neither a temporary file nor a copy of the whole
+// compressed file is needed.
+//
+static int
+XmlDetectCompression(unsigned char *magic, size_t len)
+{
+    if (len >= 2 && magic[0] == 0x1f && magic[1] == 0x8b)
+        return XML_COMPRESSION_GZIP;
+    if (len >= 4 && magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd)
+        return XML_COMPRESSION_ZSTD;
+    return XML_COMPRESSION_NONE;
+}
+
+#if defined(USE_ZLIB) || defined(USE_ZSTD)
+// make room for at least XML_READ_CHUNK more bytes (plus the padding
+// used to detect the encoding of the decompressed data)
+static XmlErr
+XmlReserveChunk(char **buf, size_t *size, size_t len)
+{
+    size_t newSize = *size;
+    char *newBuf;
+
+    if (*size - len >= XML_READ_CHUNK + 4)
+        return XML_NOERR;
+    while (newSize - len < XML_READ_CHUNK + 4)
+        newSize *= 2;
+    newBuf = (char *)realloc(*buf, newSize);
+    if (!newBuf)
+        return XML_MEMORY_ERR;
+    *buf = newBuf;
+    *size = newSize;
+    return XML_NOERR;
+}
+
+// fills 'chunk' with the next piece of the file. Returns -1 on errors
+static int
+XmlReadChunk(FILE *inFile, unsigned char *chunk, size_t *chunkLen, int *eof)
+{
+    *chunkLen = fread(chunk, 1, XML_READ_CHUNK, inFile);
+    if (*chunkLen < XML_READ_CHUNK) {
+        if (ferror(inFile)) {
+            fprintf(stderr, "Can't read file: %s\n", strerror(errno));
+            return -1;
+        }
+        *eof = 1;
+    }
+    return 0;
+}
+#endif
+
+#ifdef USE_ZLIB
+static XmlErr
+XmlInflateFile(FILE *inFile, unsigned char *chunk, size_t chunkLen,
+    char **out, size_t *outSize, size_t *outLen)
+{
+    z_stream zs;
+    int zrc = Z_OK;
+    int eof = 0;
+
+    memset(&zs, 0, sizeof(zs));
+    if (inflateInit2(&zs, 15 + 16) != Z_OK) // expect a gzip header
+        return XML_MEMORY_ERR;
+    zs.next_in = chunk;
+    zs.avail_in = chunkLen;
+    for (;;) {
+        if (zs.avail_in == 0 && !eof) {
+            if (XmlReadChunk(inFile, chunk, &chunkLen, &eof) != 0) {
+                inflateEnd(&zs);
+                return XML_GENERIC_ERR;
+            }
+            zs.next_in = chunk;
+            zs.avail_in = chunkLen;
+        }
+        if (zrc == Z_STREAM_END) {
+            if (zs.avail_in == 0 && eof)
+                break;
+            if (zs.avail_in == 0)
+                continue;
+            inflateReset(&zs); // another gzip member follows (as in 'cat a.gz b.gz')
+        }
+        if (XmlReserveChunk(out, outSize, *outLen) != XML_NOERR) {
+            inflateEnd(&zs);
+            return XML_MEMORY_ERR;
+        }
+        zs.next_out = (Bytef *)*out + *outLen;
+        zs.avail_out = XML_READ_CHUNK;
+        zrc = inflate(&zs, Z_NO_FLUSH);
+        *outLen += XML_READ_CHUNK - zs.avail_out;
+        if (zrc == Z_BUF_ERROR && zs.avail_in == 0 && eof) {
+            fprintf(stderr, "Unexpected end of gzip data\n");
+            inflateEnd(&zs);
+            return XML_GENERIC_ERR;
+        }
+        if (zrc != Z_OK && zrc != Z_STREAM_END && zrc != Z_BUF_ERROR) {
+            fprintf(stderr, "Can't inflate gzip data: %s\n", zs.msg ? zs.msg : "unknown error");
+            inflateEnd(&zs);
+            return zrc == Z_MEM_ERROR ? XML_MEMORY_ERR : XML_GENERIC_ERR;
+        }
+    }
+    inflateEnd(&zs);
+    return XML_NOERR;
+}
+#endif
+
+#ifdef USE_ZSTD
+static XmlErr
+XmlZstdDecompressFile(FILE *inFile, unsigned char *chunk, size_t chunkLen,
+    char **out, size_t *outSize, size_t *outLen)
+{
+    ZSTD_DStream *ds;
+    ZSTD_inBuffer in;
+    size_t zrc = 1;
+    int eof = 0;
+
+    ds = ZSTD_createDStream();
+    if (!ds)
+        return XML_MEMORY_ERR;
+    ZSTD_initDStream(ds);
+    in.src = chunk;
+    in.size = chunkLen;
+    in.pos = 0;
+    for (;;) {
+        ZSTD_outBuffer ob;
+
+        if (in.pos == in.size && !eof) {
+            if (XmlReadChunk(inFile, chunk, &chunkLen, &eof) != 0) {
+                ZSTD_freeDStream(ds);
+                return XML_GENERIC_ERR;
+            }
+            in.size = chunkLen;
+            in.pos = 0;
+        }
+        if (in.pos == in.size && eof && zrc == 0)
+            break; // the last frame is complete
+        if (XmlReserveChunk(out, outSize, *outLen) != XML_NOERR) {
+            ZSTD_freeDStream(ds);
+            return XML_MEMORY_ERR;
+        }
+        ob.dst = *out + *outLen;
+        ob.size = XML_READ_CHUNK;
+        ob.pos = 0;
+        zrc = ZSTD_decompressStream(ds, &ob, &in);
+        if (ZSTD_isError(zrc)) {
+            fprintf(stderr, "Can't decompress zstd data: %s\n", ZSTD_getErrorName(zrc));
+            ZSTD_freeDStream(ds);
+            return XML_GENERIC_ERR;
+        }
+        *outLen += ob.pos;
+        if (zrc != 0 && in.pos == in.size && eof && ob.pos < ob.size) {
+            fprintf(stderr, "Unexpected end of zstd data\n");
+            ZSTD_freeDStream(ds);
+            return XML_GENERIC_ERR;
+        }
+    }
+    ZSTD_freeDStream(ds);
+    return XML_NOERR;
+}
+#endif
+
+// decompresses the rest of the file. 'pending' holds the bytes already
+// read (including the magic number). The output is zero-padded so that its
+// encoding can be detected as for plain files
+static XmlErr
+XmlReadCompressedFile(FILE *inFile, int compression, char *pending, size_t pendingLen,
+    size_t sizeHint, char **outBuffer, size_t *outLen)
+{
+#if defined(USE_ZLIB) || defined(USE_ZSTD)
+    unsigned char *chunk;
+    char *out;
+    size_t outSize;
+    size_t len = 0;
+    XmlErr rc = XML_GENERIC_ERR;
+
+    chunk = (unsigned char *)malloc(XML_READ_CHUNK);
+    if (!chunk)
+        return XML_MEMORY_ERR;
+    memcpy(chunk, pending, pendingLen);
+    // xml usually shrinks a lot, start with a few times the compressed size
+    outSize = sizeHint * 4 + XML_READ_CHUNK + 4;
+    out = (char *)malloc(outSize);
+    if (!out) {
+        free(chunk);
+        return XML_MEMORY_ERR;
+    }
+    switch(compression) {
+#ifdef USE_ZLIB
+        case XML_COMPRESSION_GZIP:
+            rc = XmlInflateFile(inFile, chunk, pendingLen, &out, &outSize, &len);
+            break;
+#endif
+#ifdef USE_ZSTD
+        case XML_COMPRESSION_ZSTD:
+            rc = XmlZstdDecompressFile(inFile, chunk, pendingLen, &out, &outSize, &len);
+            break;
+#endif
+        default:
+            fprintf(stderr, "Support for %s compressed files has not been compiled in\n",
+                compression == XML_COMPRESSION_GZIP ? "gzip" : "zstd");
+            break;
+    }
+    free(chunk);
+    if (rc != XML_NOERR) {
+        free(out);
+        return rc;
+    }
+    memset(out + len, 0, 4);
+    *outBuffer = out;
+    *outLen = len;
+    return XML_NOERR;
+#else
+    fprintf(stderr, "Support for %s compressed files has not been compiled in\n",
+        compression == XML_COMPRESSION_GZIP ? "gzip" : "zstd");
+    return XML_GENERIC_ERR;
+#endif
+}
+
+// map a whole file (to be released using XmlUnmapFile()). The file is mapped
+// over an anonymous region one page bigger, so that the data is always
+// followed by zeros and can be handed to XmlParseBuffer() as it is
+static XmlErr
+XmlMapFile(FILE *file, off_t size, char **buf, size_t *mapLen)
+{
+#ifdef WIN32
+    return XML_GENERIC_ERR;
+#else
+    size_t pageSize = getpagesize();
+    size_t len;
+    char *map;
+
+    if ((uint64_t)size >= (uint64_t)SIZE_MAX - 2 * pageSize)
+        return XML_MEMORY_ERR;
+    len = (size_t)size + pageSize - (size_t)size % pageSize + pageSize;
+    map = (char *)mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED)
+        return XML_MEMORY_ERR;
+    if (mmap(map, (size_t)size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_FIXED, fileno(file), 0) == MAP_FAILED) {
+        munmap(map, len);
+        return XML_GENERIC_ERR;
+    }
+#ifdef MADV_SEQUENTIAL
+    madvise(map, (size_t)size, MADV_SEQUENTIAL);
+#endif
+    *buf = map;
+    *mapLen = len;
+    return XML_NOERR;
+#endif
+}
+
+static void
+XmlUnmapFile(char *buf, size_t mapLen)
+{
+#ifndef WIN32
+    munmap(buf, mapLen);
+#endif
+}
+
+XmlErr
+XmlParseFile(TXml *xml, char *path)
+{
+    FILE *inFile;
+    char *buffer;
     XmlErr err;
     struct stat fileStat;
     int rc = 0;
@@ -1290,38 +2405,94 @@ XmlParseFile(TXml *xml, char *path)
             char *out;
             size_t rb, cb, ilen, olen;
             char *encoding_from = NULL;
+            char bom[4] = { 0, 0, 0, 0 };
+            int encoding;
+            int compression;
+            size_t mapLen = 0;
 
-            if(XmlFileLock(inFile) != XML_NOERR) {
+            if(XmlFileLock(inFile, 0, xml->lockTimeout) != XML_NOERR) {
                 fprintf(stderr, "Can't lock %s for opening ", path);
-                return -1;
-            }
-            olen = ilen = fileStat.st_size;
-            buffer = (char *)malloc(ilen+1);
-            rb = fread(buffer, 1, ilen, inFile);
-            if (ilen != rb) {
-                fprintf(stderr, "Can't read %s content", path);
-                return -1;
+                fclose(inFile);
+                return XML_GENERIC_ERR;
             }
-            buffer[ilen] = 0;
-            switch(detect_encoding(buffer)) {
-                case ENCODING_UTF16LE:
-                    encoding_from = "UTF-16LE";
-                    break;
-                case ENCODING_UTF16BE:
-                    encoding_from = "UTF-16BE";
-                    break;
-                case ENCODING_UTF32LE:
-                    encoding_from = "UTF-32LE";
-                    break;
-                case ENCODING_UTF32BE:
-                    encoding_from = "UTF-32BE";
-                    break;
-                case ENCODING_UTF7:
-                    encoding_from = "UTF-7";
-                    olen = ilen*2; // we need a bigger output buffer
-                    break;
+            // look at the first bytes to find out the encoding (or the compression)
+            rb = fread(bom, 1, sizeof(bom), inFile);
+            compression = XmlDetectCompression((unsigned char *)bom, rb);
+            encoding = detect_encoding(bom);
+            if (encoding == ENCODING_UTF32LE && rb < sizeof(bom))
+                encoding = ENCODING_UTF16LE; // the zeros were just our padding
+            if (compression != XML_COMPRESSION_NONE) {
+                err = XmlReadCompressedFile(inFile, compression, bom, rb,
+                    fileStat.st_size, &buffer, &ilen);
+                if (err != XML_NOERR) {
+                    fprintf(stderr, "Can't decompress %s\n", path);
+                    XmlFileUnlock(inFile);
+                    fclose(inFile);
+                    return err;
+                }
+                // the decompressed document can still be in any encoding
+                encoding = detect_encoding(buffer);
+                if (encoding == ENCODING_UTF32LE && ilen < 4)
+                    encoding = ENCODING_UTF16LE;
+                if (encoding == ENCODING_UTF16LE || encoding == ENCODING_UTF16BE ||
+                    encoding == ENCODING_UTF32LE || encoding == ENCODING_UTF32BE)
+                {
+                    err = XmlTranscodeBuffer(encoding, &buffer, &ilen);
+                    if (err != XML_NOERR) {
+                        fprintf(stderr, "Can't convert %s to utf8\n", path);
+                        free(buffer);
+                        XmlFileUnlock(inFile);
+                        fclose(inFile);
+                        return err;
+                    }
+                }
+                olen = ilen;
+            } else if (encoding == ENCODING_UTF16LE || encoding == ENCODING_UTF16BE ||
+                encoding == ENCODING_UTF32LE || encoding == ENCODING_UTF32BE)
+            {
+                size_t bomLen = (encoding == ENCODING_UTF16LE || encoding == ENCODING_UTF16BE) ? 2 : 4;
+                err = XmlReadUnicodeFile(inFile, encoding, bom + bomLen, rb - bomLen,
+                    fileStat.st_size, &buffer);
+                if (err != XML_NOERR) {
+                    fprintf(stderr, "Can't convert %s to utf8\n", path);
+                    XmlFileUnlock(inFile);
+                    fclose(inFile);
+                    return err;
+                }
+            } else if (xml->stream && encoding != ENCODING_UTF7 &&
+                       XmlMapFile(inFile, fileStat.st_size, &buffer, &mapLen) == XML_NOERR)
+            {
+                // streamed documents are parsed straight from the page cache
+                olen = ilen = (size_t)fileStat.st_size;
+            } else {
+                if ((uint64_t)fileStat.st_size >= (uint64_t)SIZE_MAX) {
+                    fprintf(stderr, "%s is too big to be loaded in memory\n", path);
+                    XmlFileUnlock(inFile);
+                    fclose(inFile);
+                    return XML_MEMORY_ERR;
+                }
+                olen = ilen = (size_t)fileStat.st_size;
+                buffer = (char *)malloc(ilen+1);
+                if (!buffer) {
+                    XmlFileUnlock(inFile);
+                    fclose(inFile);
+                    return XML_MEMORY_ERR;
+                }
+                memcpy(buffer, bom, rb);
+                if (rb < ilen)
+                    rb += fread(buffer + rb, 1, ilen - rb, inFile);
+                if (ilen != rb) {
+                    fprintf(stderr, "Can't read %s content", path);
+                    free(buffer);
+                    XmlFileUnlock(inFile);
+                    fclose(inFile);
+                    return XML_GENERIC_ERR;
+                }
+                buffer[ilen] = 0;
             }
-            if (encoding_from) {
+            if (encoding == ENCODING_UTF7) {
+                encoding_from = "UTF-7";
+                olen = ilen*2; // we need a bigger output buffer
 #ifdef USE_ICONV
                 ich = iconv_open ("UTF-8", encoding_from);
                 if (ich == (iconv_t)(-1)) {
@@ -1329,7 +2500,7 @@ XmlParseFile(TXml *xml, char *path)
                     free(buffer);
                     XmlFileUnlock(inFile);
                     fclose(inFile);
-                    return -1;
+                    return XML_GENERIC_ERR;
                 }
                 out = (char *)calloc(1, olen);
                 iconvIn = buffer;
@@ -1341,7 +2512,7 @@ XmlParseFile(TXml *xml, char *path)
                     free(out);
                     XmlFileUnlock(inFile);
                     fclose(inFile);
-                    return -1;
+                    return XML_GENERIC_ERR;
                 }
                 free(buffer); // release initial buffer
                 buffer = out; // point to the converted buffer
@@ -1352,425 +2523,3668 @@ XmlParseFile(TXml *xml, char *path)
                 free(buffer);
                 XmlFileUnlock(inFile);
                 fclose(inFile);
-                return -1;
+                return XML_GENERIC_ERR;
 #endif
             }
             err = XmlParseBuffer(xml, buffer);
-            free(buffer); // release either the initial or the converted buffer
+            if (mapLen)
+                XmlUnmapFile(buffer, mapLen);
+            else
+                free(buffer); // release either the initial or the converted buffer
             XmlFileUnlock(inFile);
             fclose(inFile);
         } else {
             fprintf(stderr, "Can't open xmlfile %s\n", path);
-            return -1;
+            return XML_GENERIC_ERR;
         }
     } else {
         fprintf(stderr, "Can't stat xmlfile %s\n", path);
-        return -1;
+        return XML_GENERIC_ERR;
     }
-    return XML_NOERR;
+    return err;
 }
 
-char *
-XmlDumpBranch(TXml *xml, XmlNode *rNode, unsigned int depth)
+//
+// BULK LOADING
+//
+// Files are picked in order by a pool of workers (the calling thread being
+// one of them), each one reading and parsing a file at a time. While some
+// workers are waiting for the disk the others keep parsing, so with enough
+// threads there are always reads in flight.
+//
+#define XML_LOAD_MAX_THREADS 256
+
+typedef struct __XmlLoadBatch {
+    TXml **xmls;
+    char **paths;
+    XmlErr *results;
+    int count;
+    int next; // next file to be picked by a worker
+#ifdef USE_PTHREADS
+    pthread_mutex_t lock;
+#endif
+} XmlLoadBatch;
+
+static void *
+XmlLoadWorker(void *priv)
 {
-    unsigned int i, n;
-    char *out = NULL;
-    int outOffset = 0;
-    char *startTag;
-    int startOffset = 0;
-    char *endTag;
-    int endOffset = 0;
-    char *childDump;
-    int childOffset = 0;
-    char *value = NULL;
-    int nameLen = 0;
-    int nsNameLen = 0;
-    XmlNodeAttribute *attr;
-    XmlNode *child;
-    unsigned long nAttrs;
+    XmlLoadBatch *batch = (XmlLoadBatch *)priv;
 
+    for (;;) {
+        int i;
+#ifdef USE_PTHREADS
+        pthread_mutex_lock(&batch->lock);
+#endif
+        i = batch->next++;
+#ifdef USE_PTHREADS
+        pthread_mutex_unlock(&batch->lock);
+#endif
+        if (i >= batch->count)
+            break;
+        batch->results[i] = XmlParseFile(batch->xmls[i], batch->paths[i]);
+    }
+    return NULL;
+}
 
-    if (rNode->value) {
-        if (rNode->type == XML_NODETYPE_SIMPLE) {
-            value = xmlize(rNode->value);
-        } else {
-            value = strdup(rNode->value);
+XmlErr
+XmlParseFiles(TXml **xmls, char **paths, int count, int numThreads, XmlErr *results)
+{
+    XmlLoadBatch batch;
+    XmlErr err = XML_NOERR;
+    int i;
+#ifdef USE_PTHREADS
+    pthread_t threads[XML_LOAD_MAX_THREADS];
+    int started = 0;
+#endif
+
+    if (!xmls || !paths || count < 0)
+        return XML_BADARGS;
+    batch.xmls = xmls;
+    batch.paths = paths;
+    batch.results = results ? results : (XmlErr *)malloc((count + 1) * sizeof(XmlErr));
+    if (!batch.results)
+        return XML_MEMORY_ERR;
+    batch.count = count;
+    batch.next = 0;
+#ifdef USE_PTHREADS
+    if (numThreads > count)
+        numThreads = count;
+    if (numThreads > XML_LOAD_MAX_THREADS)
+        numThreads = XML_LOAD_MAX_THREADS;
+    pthread_mutex_init(&batch.lock, NULL);
+    while (started < numThreads - 1) {
+        if (pthread_create(&threads[started], NULL, XmlLoadWorker, &batch) != 0)
+            break; // we'll do with the threads we got
+        started++;
+    }
+#endif
+    XmlLoadWorker(&batch);
+#ifdef USE_PTHREADS
+    for (i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    pthread_mutex_destroy(&batch.lock);
+#endif
+    for (i = 0; i < count; i++) {
+        if (batch.results[i] != XML_NOERR) {
+            err = batch.results[i];
+            break;
         }
     }
+    if (!results)
+        free(batch.results);
+    return err;
+}
 
-    if(rNode->name)
-        nameLen = (unsigned int)strlen(rNode->name);
-    else
+//
+// STREAMING READER
+//
+// While streaming, the handlers of the parser keep a frame for each open
+// element, telling which steps of the path it matched, which descendant
+// steps are active below it and how many of its children passed each
+// positional predicate so far. An element is selected when it matches the
+// last step: it's handed to the callback once its end tag is parsed, while
+// any element ending outside of a selected subtree is released right away.
+//
+#define XML_STREAM_ATTR_EXISTS    0
+#define XML_STREAM_ATTR_EQUAL     1
+#define XML_STREAM_ATTR_DIFFERENT 2
+#define XML_STREAM_POSITION       3
+
+typedef struct __XmlStreamPredicate {
+    int type;
+    char *name;     // attribute name
+    char *value;    // attribute value (for comparisons)
+    unsigned long position;
+    int counter;    // counter used by positional predicates
+} XmlStreamPredicate;
+
+typedef struct __XmlStreamStep {
+    int deep;       // reached from any ancestor (descendant axis)
+    char *prefix;
+    char *name;     // NULL for '*'
+    XmlStreamPredicate *predicates;
+    int numPredicates;
+} XmlStreamStep;
+
+struct __XmlStreamPath {
+    XmlStreamStep *steps;
+    int count;
+    int counters;   // number of positional predicates
+};
+
+struct __XmlStream {
+    XmlStreamPath *path;
+    XmlStreamCallback callback;
+    void *priv;
+    unsigned int depth; // frame 0 is the document itself
+    unsigned int size;
+    char *matched;      // per frame, count + 1 flags : the element matched the first n steps
+    char *active;       // per frame, count flags : a descendant step can be matched below it
+    unsigned long *counters; // per frame, the positional counters of its children
+    char *selected;     // per frame : the element is part of a selected subtree
+    int stopped;        // the callback asked to stop
+    XmlFilterRun *filter; // matching a filter instead of a path (see XmlFilterBuffer())
+};
+
+#define XML_STREAM_IS_NAME_CHAR(__c) \
+    (isalnum((unsigned char)(__c)) || (__c) == '_' || (__c) == '-' || (__c) == '.' || ((__c) & 0x80))
+
+#define XML_STREAM_SKIP_BLANKS(__p) \
+    while (*(__p) == ' ' || *(__p) == '\t' || *(__p) == '\r' || *(__p) == '\n') (__p)++;
+
+// copy a name (up to the first character not allowed in names) to the strings
+// of the path, returning a pointer past its end (NULL if there is no valid name)
+static char *
+XmlStreamCopyName(char *p, int prefixed, char **name, char **strings)
+{
+    char *start = p;
+    if (!isalpha((unsigned char)*p) && *p != '_' && !(*p & 0x80))
         return NULL;
+    while (XML_STREAM_IS_NAME_CHAR(*p) || (prefixed && *p == ':'))
+        p++;
+    memcpy(*strings, start, p - start);
+    (*strings)[p - start] = 0;
+    *name = *strings;
+    *strings += p - start + 1;
+    return p;
+}
 
-    /* First check if this is a special node (a comment or a CDATA) */
-    if(rNode->type == XML_NODETYPE_COMMENT) {
-        out = malloc(strlen(value)+depth+9);
-        *out = 0;
-        if (xml->ignoreBlanks) {
-            for(n = 0; n < depth; n++)
-                out[n] = '\t';
-            sprintf(out+depth, "<!--%s-->\n", value);
-        } else {
-            sprintf(out+depth, "<!--%s-->", value);
+static char *
+XmlStreamParsePredicate(char *p, XmlStreamPath *path, XmlStreamPredicate *predicate, char **strings)
+{
+    XML_STREAM_SKIP_BLANKS(p);
+    if (isdigit((unsigned char)*p)) {
+        char *end;
+        predicate->type = XML_STREAM_POSITION;
+        predicate->position = strtoul(p, &end, 10);
+        if (predicate->position == 0)
+            return NULL; // would never match
+        predicate->counter = path->counters++;
+        p = end;
+    } else if (*p == '@') {
+        // attribute names are stored with their prefix
+        p = XmlStreamCopyName(p + 1, 1, &predicate->name, strings);
+        if (!p)
+            return NULL;
+        XML_STREAM_SKIP_BLANKS(p);
+        predicate->type = XML_STREAM_ATTR_EXISTS;
+        if (*p == '=' || (*p == '!' && *(p+1) == '=')) {
+            char quote;
+            char *end;
+            predicate->type = (*p == '=') ? XML_STREAM_ATTR_EQUAL : XML_STREAM_ATTR_DIFFERENT;
+            p += (*p == '=') ? 1 : 2;
+            XML_STREAM_SKIP_BLANKS(p);
+            quote = *p;
+            if (quote != '\'' && quote != '"')
+                return NULL;
+            end = strchr(p + 1, quote);
+            if (!end)
+                return NULL;
+            memcpy(*strings, p + 1, end - p - 1);
+            (*strings)[end - p - 1] = 0;
+            predicate->value = *strings;
+            *strings += end - p;
+            p = end + 1;
         }
-        return out;
-    } else if(rNode->type == XML_NODETYPE_CDATA) {
-        out = malloc(strlen(value)+depth+14);
-        *out = 0;
-        if (xml->ignoreBlanks) {
-            for(n = 0; n < depth; n++)
-                out[n] = '\t';
-            sprintf(out+depth, "<![CDATA[%s]]>\n", value);
-        } else {
-            sprintf(out+depth, "<![CDATA[%s]]>", value);
-        }
-        return out;
-    }
-
-    childDump = (char *)calloc(1, 1);
-
-    if (rNode->ns && rNode->ns->name)
-        nsNameLen = (unsigned int)strlen(rNode->ns->name)+1;
-    startTag = (char *)calloc(1, depth+nameLen+nsNameLen+7); // :/<>\n
-    endTag = (char *)calloc(1, depth+nameLen+nsNameLen+7);
-
-    if (xml->ignoreBlanks) {
-        for(startOffset = 0; startOffset < depth; startOffset++)
-            startTag[startOffset] = '\t';
-    }
-    startTag[startOffset++] = '<';
-    if (rNode->ns && rNode->ns->name) {
-        // TODO - optimize
-        strcpy(startTag + startOffset, rNode->ns->name);
-        startOffset += nsNameLen;
-        startTag[startOffset-1] = ':';
-    }
-    memcpy(startTag + startOffset, rNode->name, nameLen);
-    startOffset += nameLen;
-    nAttrs = XmlCountAttributes(rNode);
-    if(nAttrs>0) {
-        for(i = 0; i < nAttrs; i++) {
-            attr = XmlGetAttribute(rNode, i);
-            if(attr) {
-                int anLen, avLen;
-                char *attr_value;
-
-                attr_value = xmlize(attr->value);
-                anLen = strlen(attr->name);
-                avLen = strlen (attr_value);
-                startTag = (char *)realloc(startTag, startOffset + anLen + avLen + 8);
-                sprintf(startTag + startOffset, " %s=\"%s\"", attr->name, attr_value);
-                startOffset += anLen + avLen + 4;
-                if (attr_value)
-                    free(attr_value);
-            }
+    } else {
+        return NULL;
+    }
+    XML_STREAM_SKIP_BLANKS(p);
+    if (*p != ']')
+        return NULL;
+    return p + 1;
+}
+
+static char *
+XmlStreamParseStep(char *p, XmlStreamPath *path, XmlStreamStep *step, char **strings)
+{
+    int descendant = 0;
+
+    if (strncmp(p, "child::", 7) == 0) {
+        p += 7;
+    } else if (strncmp(p, "descendant::", 12) == 0) {
+        descendant = 1;
+        step->deep = 1;
+        p += 12;
+    }
+    if (*p == '*') {
+        p++;
+    } else {
+        p = XmlStreamCopyName(p, 0, &step->name, strings);
+        if (!p)
+            return NULL;
+        if (*p == ':') {
+            step->prefix = step->name;
+            step->name = NULL;
+            if (*(p+1) == '*')
+                p += 2;
+            else if (!(p = XmlStreamCopyName(p + 1, 0, &step->name, strings)))
+                return NULL;
         }
     }
-    if((value && *value) || !TAILQ_EMPTY(&rNode->children)) {
-        if(!TAILQ_EMPTY(&rNode->children)) {
-            if (xml->ignoreBlanks) {
-                strcpy(startTag + startOffset, ">\n");
-                startOffset += 2;
-                for(endOffset = 0; endOffset < depth; endOffset++)
-                    endTag[endOffset] = '\t';
-            } else {
-                startTag[startOffset++] = '>';
-            }
-            TAILQ_FOREACH(child, &rNode->children, siblings) {
-                char *childBuff = XmlDumpBranch(xml, child, depth+1); /* let's recurse */
-                if(childBuff) {
-                    int childBuffLen = strlen(childBuff);
-                    childDump = (char *)realloc(childDump, childOffset+childBuffLen+1);
-                    // ensure copying the null-terminating byte as well
-                    memcpy(childDump + childOffset, childBuff, childBuffLen + 1);
-                    childOffset += childBuffLen;
-                    free(childBuff);
-                }
-            }
-        } else {
-            // TODO - allow to specify a flag to determine if we want white spaces or not
-            startTag[startOffset++] = '>';
-        }
-        startTag[startOffset] = 0; // ensure null-terminating the start-tag
-        strcpy(endTag + endOffset, "</");
-        endOffset += 2;
-        if (rNode->ns && rNode->ns->name) {
-            // TODO - optimize
-            strcpy(endTag + endOffset, rNode->ns->name);
-            endOffset += nsNameLen;
-            endTag[endOffset-1] = ':';
-        }
-        sprintf(endTag + endOffset, "%s>", rNode->name);
-        endOffset += nameLen + 1;
-        if (xml->ignoreBlanks)
-            endTag[endOffset++] = '\n';
-        endTag[endOffset] = 0; // ensure null-terminating
-        out = (char *)malloc(depth+strlen(startTag)+strlen(endTag)+
-            (value?strlen(value)+1:1)+strlen(childDump)+3);
-        strcpy(out, startTag);
-        outOffset += startOffset;
-        if(value && *value) { // skip also if value is an empty string (not only if it's a null pointer)
-            if(!TAILQ_EMPTY(&rNode->children)) {
-                if (xml->ignoreBlanks) {
-                    for(; outOffset < depth; outOffset++)
-                        out[outOffset] = '\t';
-                }
-                if (value) {
-                    sprintf(out + outOffset, "%s", value);
-                    outOffset += strlen(value);
-                    if (xml->ignoreBlanks)
-                        out[outOffset++] = '\n';
-                }
-            }
-            else {
-                if (value)
-                    strcpy(out + outOffset, value);
-                    outOffset += strlen(value);
+    step->numPredicates = 0;
+    while (*p == '[') {
+        XmlStreamPredicate *predicate = &step->predicates[step->numPredicates++];
+        p = XmlStreamParsePredicate(p + 1, path, predicate, strings);
+        if (!p)
+            return NULL;
+        if (descendant && predicate->type == XML_STREAM_POSITION) {
+            // the position among all the descendants can't be told by a single frame
+            return NULL;
+        }
+    }
+    return p;
+}
+
+XmlStreamPath *
+XmlCompileStreamPath(char *path)
+{
+    XmlStreamPath *compiled;
+    XmlStreamPredicate *predicates;
+    char *strings;
+    char *p;
+    int numSteps = 0, numPredicates = 0;
+
+    if (!path)
+        return NULL;
+    // each '/' and '[' can't start more than a step or a predicate
+    for (p = path; *p; p++) {
+        if (*p == '/')
+            numSteps++;
+        else if (*p == '[')
+            numPredicates++;
+    }
+    numSteps++; // the path could be relative to the document
+    compiled = (XmlStreamPath *)calloc(1, sizeof(XmlStreamPath) +
+                                          numSteps * sizeof(XmlStreamStep) +
+                                          numPredicates * sizeof(XmlStreamPredicate) +
+                                          strlen(path) + 1);
+    if (!compiled)
+        return NULL;
+    compiled->steps = (XmlStreamStep *)(compiled + 1);
+    predicates = (XmlStreamPredicate *)(compiled->steps + numSteps);
+    strings = (char *)(predicates + numPredicates);
+
+    p = path;
+    XML_STREAM_SKIP_BLANKS(p);
+    while (*p) {
+        XmlStreamStep *step = &compiled->steps[compiled->count];
+        if (*p == '/') {
+            p++;
+            if (*p == '/') {
+                step->deep = 1;
+                p++;
             }
+        } else if (compiled->count) {
+            break;
         }
-        memcpy(out + outOffset, childDump, childOffset);
-        outOffset += childOffset;
-        strcpy(out + outOffset, endTag);
+        step->predicates = predicates;
+        p = XmlStreamParseStep(p, compiled, step, &strings);
+        if (!p)
+            break;
+        predicates += step->numPredicates;
+        compiled->count++;
+        XML_STREAM_SKIP_BLANKS(p);
     }
-    else {
-        strcpy(startTag + startOffset, "/>");
-        startOffset += 2;
-        if (xml->ignoreBlanks)
-            startTag[startOffset++] = '\n';
-        startTag[startOffset] = 0;
-        out = strdup(startTag);
+    if (!p || *p || !compiled->count) {
+        fprintf(stderr, "Bad (or not streamable) path '%s'\n", path);
+        free(compiled);
+        return NULL;
     }
-    free(startTag);
-    free(endTag);
-    free(childDump);
-    if (value)
-        free(value);
-    return out;
+    return compiled;
 }
 
-char *
-XmlDump(TXml *xml, int *outlen)
+void
+XmlDestroyStreamPath(XmlStreamPath *path)
 {
-    char *dump;
-    XmlNode *rNode;
-    char *branch;
-    unsigned int i;
-#ifdef USE_ICONV
-    int doConversion = 0;
-#endif
-    char head[256]; // should be enough
-    int hLen;
-    unsigned int offset;
+    free(path);
+}
 
-    memset(head, 0, sizeof(head));
-    if (xml->head) {
-        int quote;
-        char *start, *end, *encoding;
-        char *initial = strdup(xml->head);
-        start = strstr(initial, "encoding=");
-        if (start) {
-            *start = 0;
-            encoding = start+9;
-            if (*encoding == '"' || *encoding == '\'') {
-                quote = *encoding;
-                encoding++;
-                end = (char *)strchr(encoding, quote);
-                if (!end) {
-                    /* TODO - Error Messages */
-                } else if ((end-encoding) >= sizeof(xml->outputEncoding)) {
-                    /* TODO - Error Messages */
-                }
-                *end = 0;
-                // check if document encoding matches
-                if (strncasecmp(encoding, xml->documentEncoding, end-encoding) != 0) {
-                    /* TODO - Error Messages */
-                } 
-                if (strncasecmp(encoding, xml->outputEncoding, end-encoding) != 0) {
-#ifdef USE_ICONV
-                    snprintf(head, sizeof(head), "%sencoding=\"%s\"%s",
-                        initial, xml->outputEncoding, ++end);
-                    doConversion = 1;
-#else
-                    fprintf(stderr, "Iconv missing: will not convert output to %s\n", xml->outputEncoding);
-                    snprintf(head, sizeof(head), "%s", xml->head);
-#endif
-                } else {
-                    snprintf(head, sizeof(head), "%s", xml->head);
+static int
+XmlStreamMatchStep(XmlStreamStep *step, XmlNode *node, unsigned long *counters)
+{
+    int i;
+
+    if (step->name && strcmp(node->name, step->name) != 0)
+        return 0;
+    if (step->prefix) {
+        if (!node->ns || !node->ns->name || strcmp(node->ns->name, step->prefix) != 0)
+            return 0;
+    }
+    for (i = 0; i < step->numPredicates; i++) {
+        XmlStreamPredicate *predicate = &step->predicates[i];
+        XmlNodeAttribute *attr;
+        switch(predicate->type) {
+            case XML_STREAM_POSITION:
+                if (++counters[predicate->counter] != predicate->position)
+                    return 0;
+                break;
+            case XML_STREAM_ATTR_EXISTS:
+                if (!XmlGetAttributeByName(node, predicate->name))
+                    return 0;
+                break;
+            default:
+                attr = XmlGetAttributeByName(node, predicate->name);
+                if (!attr)
+                    return 0;
+                if ((strcmp(attr->value ? attr->value : "", predicate->value) == 0) !=
+                    (predicate->type == XML_STREAM_ATTR_EQUAL))
+                {
+                    return 0;
                 }
+                break;
+        }
+    }
+    return 1;
+}
 
-            }
-        } else {
-#ifdef USE_ICONV
-            if (xml->outputEncoding && strcasecmp(xml->outputEncoding, "utf-8") != 0) {
-                doConversion = 1;
-                fprintf(stderr, "Iconv missing: will not convert output to %s\n", xml->outputEncoding);
-            }
-            snprintf(head, sizeof(head), "xml version=\"1.0\" encoding=\"%s\"", 
-                xml->outputEncoding?xml->outputEncoding:"utf-8");
-#else
-            if (xml->outputEncoding && strcasecmp(xml->outputEncoding, "utf-8") != 0) {
-                fprintf(stderr, "Iconv missing: will not convert output to %s\n", xml->outputEncoding);
-            }
-            snprintf(head, sizeof(head), "xml version=\"1.0\" encoding=\"utf-8\"");
-#endif
+static XmlErr
+XmlStreamGrow(XmlStream *stream)
+{
+    XmlStreamPath *path = stream->path;
+    unsigned int size = stream->size ? stream->size * 2 : 32;
+    char *matched, *active, *selected;
+    unsigned long *counters;
+
+    matched = realloc(stream->matched, size * (path->count + 1));
+    if (!matched)
+        return XML_MEMORY_ERR;
+    stream->matched = matched;
+    active = realloc(stream->active, size * path->count);
+    if (!active)
+        return XML_MEMORY_ERR;
+    stream->active = active;
+    selected = realloc(stream->selected, size);
+    if (!selected)
+        return XML_MEMORY_ERR;
+    stream->selected = selected;
+    if (path->counters) {
+        counters = realloc(stream->counters, size * path->counters * sizeof(unsigned long));
+        if (!counters)
+            return XML_MEMORY_ERR;
+        stream->counters = counters;
+    }
+    stream->size = size;
+    return XML_NOERR;
+}
+
+// prepare the frame of an element (or of the document itself, at depth 0)
+static void
+XmlStreamPushFrame(XmlStream *stream)
+{
+    XmlStreamPath *path = stream->path;
+    unsigned int d = stream->depth;
+    memset(stream->matched + d * (path->count + 1), 0, path->count + 1);
+    memset(stream->active + d * path->count, 0, path->count);
+    if (path->counters)
+        memset(stream->counters + d * path->counters, 0, path->counters * sizeof(unsigned long));
+    stream->selected[d] = 0;
+}
+
+static XmlErr XmlFilterStart(XmlFilterRun *run, XmlNode *node);
+static int XmlFilterEnd(XmlFilterRun *run);
+
+static XmlErr
+XmlStreamStart(TXml *xml, XmlNode *node)
+{
+    XmlStream *stream = xml->stream;
+    XmlStreamPath *path = stream->path;
+    char *parentMatched, *parentActive, *matched, *active;
+    int k;
+
+    if (stream->filter)
+        return XmlFilterStart(stream->filter, node);
+    if (stream->depth + 1 >= stream->size && XmlStreamGrow(stream) != XML_NOERR)
+        return XML_MEMORY_ERR;
+    stream->depth++;
+    XmlStreamPushFrame(stream);
+    parentMatched = stream->matched + (stream->depth - 1) * (path->count + 1);
+    parentActive = stream->active + (stream->depth - 1) * path->count;
+    matched = parentMatched + path->count + 1;
+    active = parentActive + path->count;
+    for (k = 0; k < path->count; k++) {
+        XmlStreamStep *step = &path->steps[k];
+        if ((step->deep ? parentActive[k] : parentMatched[k]) &&
+            XmlStreamMatchStep(step, node, stream->counters + (stream->depth - 1) * path->counters))
+        {
+            matched[k + 1] = 1;
         }
-        free(initial);
+    }
+    for (k = 0; k < path->count; k++)
+        active[k] = parentActive[k] || (matched[k] && path->steps[k].deep);
+    stream->selected[stream->depth] = stream->selected[stream->depth - 1] || matched[path->count];
+    return XML_NOERR;
+}
+
+// release an element which ended outside of a selected subtree
+static void
+XmlStreamRelease(TXml *xml, XmlNode *node)
+{
+    if (node->parent) {
+        XmlRemoveChildNode(node->parent, node);
     } else {
-#ifdef USE_ICONV
-        if (xml->outputEncoding && strcasecmp(xml->outputEncoding, "utf-8") != 0) {
-            doConversion = 1;
+        TAILQ_REMOVE(&xml->rootElements, node, siblings);
+        if (xml->index)
+            XmlIndexBranch(xml->index, node, 0);
+        xml->numbered = XML_ORDER_STALE;
+    }
+    XmlDestroyNode(node);
+}
+
+static XmlErr
+XmlStreamEnd(TXml *xml, XmlNode *node)
+{
+    XmlStream *stream = xml->stream;
+    XmlStreamPath *path = stream->path;
+    unsigned int d = stream->depth;
+
+    if (stream->filter) {
+        if (!XmlFilterEnd(stream->filter))
+            stream->stopped = 1; // nothing else can match
+        XmlStreamRelease(xml, node);
+    } else {
+        if (d == 0)
+            return XML_GENERIC_ERR;
+        stream->depth--;
+        if (stream->matched[d * (path->count + 1) + path->count]) {
+            if (stream->callback(xml, node, stream->priv) != 0)
+                stream->stopped = 1;
         }
-        snprintf(head, sizeof(head), "xml version=\"1.0\" encoding=\"%s\"", 
-            xml->outputEncoding?xml->outputEncoding:"utf-8");
-#else
-        if (xml->outputEncoding && strcasecmp(xml->outputEncoding, "utf-8") != 0) {
-            fprintf(stderr, "Iconv missing: will not convert output to %s\n", xml->outputEncoding);
+        if (!stream->selected[d - 1]) // nobody will need it anymore
+            XmlStreamRelease(xml, node);
+    }
+    // stop the parser (XmlStreamParse() doesn't report it as an error)
+    return stream->stopped ? XML_GENERIC_ERR : XML_NOERR;
+}
+
+static int
+XmlStreamKeeping(TXml *xml)
+{
+    if (xml->stream->filter)
+        return 0;
+    return xml->stream->selected[xml->stream->depth];
+}
+
+static XmlErr
+XmlStreamParse(TXml *xml, char *buf, char *file, XmlStream *stream)
+{
+    XmlErr err;
+
+    if (xml->stream)
+        return XML_BADARGS;
+    xml->stream = stream;
+    err = buf ? XmlParseBuffer(xml, buf) : XmlParseFile(xml, file);
+    xml->stream = NULL;
+    if (stream->stopped)
+        err = XML_NOERR;
+    XmlResetContext(xml); // drop whatever is left of the elements still open
+    return err;
+}
+
+static XmlErr
+XmlStreamRun(TXml *xml, char *buf, char *file, XmlStreamPath *path,
+             XmlStreamCallback callback, void *priv)
+{
+    XmlStream stream;
+    XmlErr err;
+
+    if (!xml || !path || !callback)
+        return XML_BADARGS;
+    memset(&stream, 0, sizeof(stream));
+    stream.path = path;
+    stream.callback = callback;
+    stream.priv = priv;
+    err = XmlStreamGrow(&stream);
+    if (err == XML_NOERR) {
+        XmlStreamPushFrame(&stream);
+        stream.matched[0] = 1; // the document matches an empty path
+        if (path->steps[0].deep)
+            stream.active[0] = 1;
+        err = XmlStreamParse(xml, buf, file, &stream);
+    }
+    if (stream.matched)
+        free(stream.matched);
+    if (stream.active)
+        free(stream.active);
+    if (stream.counters)
+        free(stream.counters);
+    if (stream.selected)
+        free(stream.selected);
+    return err;
+}
+
+XmlErr
+XmlStreamBuffer(TXml *xml, char *buf, XmlStreamPath *path, XmlStreamCallback callback, void *priv)
+{
+    if (!buf)
+        return XML_BADARGS;
+    return XmlStreamRun(xml, buf, NULL, path, callback, priv);
+}
+
+XmlErr
+XmlStreamFile(TXml *xml, char *path, XmlStreamPath *spath, XmlStreamCallback callback, void *priv)
+{
+    if (!path)
+        return XML_BADARGS;
+    return XmlStreamRun(xml, NULL, path, spath, callback, priv);
+}
+
+//
+// SUBSCRIPTION FILTERS
+//
+// All the paths added to a filter are merged into a single automaton :
+// each step leads from a state to another one, and the steps testing the
+// same name with the same predicates are shared by all the paths starting
+// with them. Steps testing a name are kept in a hash table keyed by their
+// source state and by the name, so following them doesn't depend on how
+// many paths leave a state, while wildcard steps are listed by state.
+// Matching works as XmlStreamBuffer() does, but keeping for each open element
+// the list of the states it reached instead of a flag for each step.
+// The filter is never modified while matching, so any number of documents
+// can be matched against it at the same time.
+//
+typedef struct __XmlFilterEdge {
+    XmlStreamStep *step; // points into one of the compiled paths
+    int from;
+    int to;
+    unsigned int hash;
+    struct __XmlFilterEdge *next; // next in the same bucket (or in the wildcards of the state)
+} XmlFilterEdge;
+
+typedef struct __XmlFilterState {
+    XmlFilterEdge *wildcards; // steps leaving this state without testing a name
+    int deep;                 // some step leaves this state through the descendant axis
+    unsigned long *ids;       // subscriptions accepted in this state
+    size_t numIds;
+} XmlFilterState;
+
+struct __XmlFilter {
+    XmlFilterState *states;
+    size_t numStates;
+    size_t sizeStates;
+    size_t accepting;         // states with any subscription
+    XmlFilterEdge **buckets;
+    size_t numBuckets;        // always a power of 2
+    size_t numEdges;
+    XmlStreamPath **paths;
+    size_t numPaths;
+};
+
+struct __XmlFilterRun {
+    XmlFilter *filter;
+    int *active;              // the states reached by the open elements, frame after frame
+    size_t numActive;
+    size_t sizeActive;
+    size_t *frames;           // where the states of each open element start in 'active'
+    size_t *deepFrames;       // where the states added by each open element start in 'deep'
+    unsigned int depth;
+    unsigned int sizeFrames;
+    int *deep;                // states whose descendant steps can be followed
+    size_t numDeep;
+    char *isDeep;             // per state : already in 'deep'
+    unsigned long *stamps;    // per state : the last element which reached it
+    unsigned long stamp;
+    char *accepted;           // per state : its subscriptions have been reported
+    size_t pending;           // accepting states not reached yet
+    unsigned long *ids;
+    size_t numIds;
+    size_t sizeIds;
+};
+
+static unsigned int
+XmlFilterHash(int from, int deep, char *name)
+{
+    unsigned int hash = 2166136261u; // FNV-1a
+    while (*name) {
+        hash ^= (unsigned char)*name++;
+        hash *= 16777619u;
+    }
+    return hash ^ ((unsigned int)from * 2654435761u) ^ (unsigned int)deep;
+}
+
+static int
+XmlFilterStringEqual(char *a, char *b)
+{
+    if (!a || !b)
+        return a == b;
+    return strcmp(a, b) == 0;
+}
+
+static int
+XmlFilterStepEqual(XmlStreamStep *a, XmlStreamStep *b)
+{
+    int i;
+    if (a->deep != b->deep || a->numPredicates != b->numPredicates ||
+        !XmlFilterStringEqual(a->name, b->name) || !XmlFilterStringEqual(a->prefix, b->prefix))
+    {
+        return 0;
+    }
+    for (i = 0; i < a->numPredicates; i++) {
+        if (a->predicates[i].type != b->predicates[i].type ||
+            !XmlFilterStringEqual(a->predicates[i].name, b->predicates[i].name) ||
+            !XmlFilterStringEqual(a->predicates[i].value, b->predicates[i].value))
+        {
+            return 0;
         }
-        snprintf(head, sizeof(head), "xml version=\"1.0\" encoding=\"utf-8\"");
-#endif
     }
-    hLen = strlen(head);
-    dump = malloc(hLen+6);
-    sprintf(dump, "<?%s?>\n", head);
-    offset = hLen +5;
-    TAILQ_FOREACH(rNode, &xml->rootElements, siblings) {
-        branch = XmlDumpBranch(xml, rNode, 0);
-        if(branch) {
-            int bLen = strlen(branch);
-            dump = (char *)realloc(dump, offset + bLen + 1);
-            // ensure copying the null-terminating byte as well
-            memcpy(dump + offset, branch, bLen + 1); 
-            offset += bLen;
-            free(branch);
+    return 1;
+}
+
+static int
+XmlFilterNewState(XmlFilter *filter)
+{
+    if (filter->numStates == filter->sizeStates) {
+        size_t size = filter->sizeStates ? filter->sizeStates * 2 : 64;
+        XmlFilterState *states = realloc(filter->states, size * sizeof(XmlFilterState));
+        if (!states)
+            return -1;
+        filter->states = states;
+        filter->sizeStates = size;
+    }
+    memset(&filter->states[filter->numStates], 0, sizeof(XmlFilterState));
+    return (int)filter->numStates++;
+}
+
+static XmlErr
+XmlFilterGrowBuckets(XmlFilter *filter)
+{
+    size_t numBuckets = filter->numBuckets ? filter->numBuckets * 2 : 256;
+    XmlFilterEdge **buckets = calloc(numBuckets, sizeof(XmlFilterEdge *));
+    size_t i;
+
+    if (!buckets)
+        return XML_MEMORY_ERR;
+    for (i = 0; i < filter->numBuckets; i++) {
+        XmlFilterEdge *edge = filter->buckets[i];
+        while (edge) {
+            XmlFilterEdge *next = edge->next;
+            edge->next = buckets[edge->hash & (numBuckets - 1)];
+            buckets[edge->hash & (numBuckets - 1)] = edge;
+            edge = next;
+        }
+    }
+    if (filter->buckets)
+        free(filter->buckets);
+    filter->buckets = buckets;
+    filter->numBuckets = numBuckets;
+    return XML_NOERR;
+}
+
+// find the state reached from 'from' through 'step', adding it if needed
+static int
+XmlFilterFollow(XmlFilter *filter, int from, XmlStreamStep *step)
+{
+    XmlFilterEdge *edge;
+    XmlFilterEdge **list;
+    unsigned int hash = 0;
+    int to;
+
+    if (step->name) {
+        if (filter->numEdges >= filter->numBuckets && XmlFilterGrowBuckets(filter) != XML_NOERR)
+            return -1;
+        hash = XmlFilterHash(from, step->deep, step->name);
+        list = &filter->buckets[hash & (filter->numBuckets - 1)];
+    } else {
+        list = &filter->states[from].wildcards;
+    }
+    for (edge = *list; edge; edge = edge->next) {
+        if (edge->from == from && XmlFilterStepEqual(edge->step, step))
+            return edge->to;
+    }
+    to = XmlFilterNewState(filter);
+    if (to < 0)
+        return -1;
+    if (!step->name) // the states could have been moved
+        list = &filter->states[from].wildcards;
+    edge = calloc(1, sizeof(XmlFilterEdge));
+    if (!edge)
+        return -1;
+    edge->step = step;
+    edge->from = from;
+    edge->to = to;
+    edge->hash = hash;
+    edge->next = *list;
+    *list = edge;
+    if (step->name)
+        filter->numEdges++;
+    if (step->deep)
+        filter->states[from].deep = 1;
+    return to;
+}
+
+XmlFilter *
+XmlCreateFilter()
+{
+    XmlFilter *filter = calloc(1, sizeof(XmlFilter));
+    if (!filter)
+        return NULL;
+    if (XmlFilterNewState(filter) != 0) { // the document itself
+        free(filter);
+        return NULL;
+    }
+    return filter;
+}
+
+void
+XmlDestroyFilter(XmlFilter *filter)
+{
+    size_t i;
+    for (i = 0; i < filter->numBuckets; i++) {
+        while (filter->buckets[i]) {
+            XmlFilterEdge *edge = filter->buckets[i];
+            filter->buckets[i] = edge->next;
+            free(edge);
+        }
+    }
+    for (i = 0; i < filter->numStates; i++) {
+        while (filter->states[i].wildcards) {
+            XmlFilterEdge *edge = filter->states[i].wildcards;
+            filter->states[i].wildcards = edge->next;
+            free(edge);
         }
+        if (filter->states[i].ids)
+            free(filter->states[i].ids);
+    }
+    for (i = 0; i < filter->numPaths; i++)
+        XmlDestroyStreamPath(filter->paths[i]);
+    if (filter->paths)
+        free(filter->paths);
+    if (filter->buckets)
+        free(filter->buckets);
+    free(filter->states);
+    free(filter);
+}
+
+XmlErr
+XmlFilterAdd(XmlFilter *filter, char *path, unsigned long id)
+{
+    XmlStreamPath *compiled;
+    XmlStreamPath **paths;
+    XmlFilterState *state;
+    unsigned long *ids;
+    size_t i;
+    int s = 0;
+
+    if (!filter || !path)
+        return XML_BADARGS;
+    compiled = XmlCompileStreamPath(path);
+    if (!compiled)
+        return XML_BADARGS;
+    if (compiled->counters) {
+        // positions would need counters for each state reached by each element
+        fprintf(stderr, "Positional predicates can't be used in filters ('%s')\n", path);
+        XmlDestroyStreamPath(compiled);
+        return XML_BADARGS;
+    }
+    paths = realloc(filter->paths, (filter->numPaths + 1) * sizeof(XmlStreamPath *));
+    if (!paths) {
+        XmlDestroyStreamPath(compiled);
+        return XML_MEMORY_ERR;
+    }
+    filter->paths = paths;
+    filter->paths[filter->numPaths++] = compiled; // the steps are shared with the edges
+    for (i = 0; i < (size_t)compiled->count; i++) {
+        s = XmlFilterFollow(filter, s, &compiled->steps[i]);
+        if (s < 0)
+            return XML_MEMORY_ERR;
+    }
+    state = &filter->states[s];
+    for (i = 0; i < state->numIds; i++) {
+        if (state->ids[i] == id)
+            return XML_NOERR;
+    }
+    ids = realloc(state->ids, (state->numIds + 1) * sizeof(unsigned long));
+    if (!ids)
+        return XML_MEMORY_ERR;
+    if (!state->numIds)
+        filter->accepting++;
+    state->ids = ids;
+    state->ids[state->numIds++] = id;
+    return XML_NOERR;
+}
+
+size_t
+XmlFilterCount(XmlFilter *filter)
+{
+    return filter->numPaths;
+}
+
+static XmlErr
+XmlFilterInitRun(XmlFilterRun *run, XmlFilter *filter)
+{
+    size_t numStates = filter->numStates;
+
+    memset(run, 0, sizeof(XmlFilterRun));
+    run->filter = filter;
+    run->pending = filter->accepting;
+    run->sizeFrames = 32;
+    run->sizeActive = 64;
+    run->frames = malloc(run->sizeFrames * sizeof(size_t));
+    run->deepFrames = malloc(run->sizeFrames * sizeof(size_t));
+    run->active = malloc(run->sizeActive * sizeof(int));
+    // a state is never twice in 'deep'
+    run->deep = malloc(numStates * sizeof(int));
+    run->isDeep = calloc(numStates, 1);
+    run->stamps = calloc(numStates, sizeof(unsigned long));
+    run->accepted = calloc(numStates, 1);
+    if (!run->frames || !run->deepFrames || !run->active || !run->deep ||
+        !run->isDeep || !run->stamps || !run->accepted)
+    {
+        return XML_MEMORY_ERR;
+    }
+    run->frames[0] = 0;
+    run->deepFrames[0] = 0;
+    run->active[run->numActive++] = 0; // the document
+    if (filter->states[0].deep) {
+        run->deep[run->numDeep++] = 0;
+        run->isDeep[0] = 1;
+    }
+    return XML_NOERR;
+}
+
+static void
+XmlFilterClearRun(XmlFilterRun *run)
+{
+    if (run->frames)
+        free(run->frames);
+    if (run->deepFrames)
+        free(run->deepFrames);
+    if (run->active)
+        free(run->active);
+    if (run->deep)
+        free(run->deep);
+    if (run->isDeep)
+        free(run->isDeep);
+    if (run->stamps)
+        free(run->stamps);
+    if (run->accepted)
+        free(run->accepted);
+    if (run->ids)
+        free(run->ids);
+}
+
+static XmlErr
+XmlFilterReach(XmlFilterRun *run, int s)
+{
+    XmlFilterState *state = &run->filter->states[s];
+
+    if (run->stamps[s] == run->stamp) // already reached by this element
+        return XML_NOERR;
+    run->stamps[s] = run->stamp;
+    if (run->numActive == run->sizeActive) {
+        int *active = realloc(run->active, run->sizeActive * 2 * sizeof(int));
+        if (!active)
+            return XML_MEMORY_ERR;
+        run->active = active;
+        run->sizeActive *= 2;
+    }
+    run->active[run->numActive++] = s;
+    if (state->numIds && !run->accepted[s]) {
+        if (run->numIds + state->numIds > run->sizeIds) {
+            size_t size = run->sizeIds ? run->sizeIds * 2 : 64;
+            unsigned long *ids;
+            while (size < run->numIds + state->numIds)
+                size *= 2;
+            ids = realloc(run->ids, size * sizeof(unsigned long));
+            if (!ids)
+                return XML_MEMORY_ERR;
+            run->ids = ids;
+            run->sizeIds = size;
+        }
+        memcpy(run->ids + run->numIds, state->ids, state->numIds * sizeof(unsigned long));
+        run->numIds += state->numIds;
+        run->accepted[s] = 1;
+        run->pending--;
+    }
+    return XML_NOERR;
+}
+
+// follow the steps leaving state 's' through the child or the descendant axis
+static XmlErr
+XmlFilterSteps(XmlFilterRun *run, int s, int deep, XmlNode *node)
+{
+    XmlFilter *filter = run->filter;
+    XmlFilterEdge *edge;
+    XmlErr err;
+
+    if (filter->numBuckets) {
+        unsigned int hash = XmlFilterHash(s, deep, node->name);
+        for (edge = filter->buckets[hash & (filter->numBuckets - 1)]; edge; edge = edge->next) {
+            if (edge->hash == hash && edge->from == s && edge->step->deep == deep &&
+                XmlStreamMatchStep(edge->step, node, NULL))
+            {
+                err = XmlFilterReach(run, edge->to);
+                if (err != XML_NOERR)
+                    return err;
+            }
+        }
+    }
+    for (edge = filter->states[s].wildcards; edge; edge = edge->next) {
+        if (edge->step->deep == deep && XmlStreamMatchStep(edge->step, node, NULL)) {
+            err = XmlFilterReach(run, edge->to);
+            if (err != XML_NOERR)
+                return err;
+        }
+    }
+    return XML_NOERR;
+}
+
+static XmlErr
+XmlFilterStart(XmlFilterRun *run, XmlNode *node)
+{
+    size_t first = run->numActive;
+    size_t i, parent = run->frames[run->depth];
+    XmlErr err;
+
+    if (run->depth + 1 == run->sizeFrames) {
+        size_t *frames = realloc(run->frames, run->sizeFrames * 2 * sizeof(size_t));
+        if (!frames)
+            return XML_MEMORY_ERR;
+        run->frames = frames;
+        frames = realloc(run->deepFrames, run->sizeFrames * 2 * sizeof(size_t));
+        if (!frames)
+            return XML_MEMORY_ERR;
+        run->deepFrames = frames;
+        run->sizeFrames *= 2;
+    }
+    run->stamp++;
+    for (i = parent; i < first; i++) {
+        err = XmlFilterSteps(run, run->active[i], 0, node);
+        if (err != XML_NOERR)
+            return err;
+    }
+    for (i = 0; i < run->numDeep; i++) {
+        err = XmlFilterSteps(run, run->deep[i], 1, node);
+        if (err != XML_NOERR)
+            return err;
+    }
+    run->depth++;
+    run->frames[run->depth] = first;
+    run->deepFrames[run->depth] = run->numDeep;
+    for (i = first; i < run->numActive; i++) {
+        int s = run->active[i];
+        if (run->filter->states[s].deep && !run->isDeep[s]) {
+            run->deep[run->numDeep++] = s;
+            run->isDeep[s] = 1;
+        }
+    }
+    return XML_NOERR;
+}
+
+// returns 0 once all the subscriptions have been matched
+static int
+XmlFilterEnd(XmlFilterRun *run)
+{
+    if (run->depth) {
+        while (run->numDeep > run->deepFrames[run->depth])
+            run->isDeep[run->deep[--run->numDeep]] = 0;
+        run->numActive = run->frames[run->depth];
+        run->depth--;
+    }
+    return run->pending > 0;
+}
+
+// nothing can be matched below the current element
+#define XmlFilterIsStuck(__run) \
+    ((__run)->numActive == (__run)->frames[(__run)->depth] && !(__run)->numDeep)
+
+static XmlErr
+XmlFilterVisit(XmlFilterRun *run, XmlNode *node)
+{
+    XmlNode *child;
+    XmlErr err;
+
+    if (node->type != XML_NODETYPE_SIMPLE)
+        return XML_NOERR;
+    err = XmlFilterStart(run, node);
+    if (err != XML_NOERR)
+        return err;
+    if (!XmlFilterIsStuck(run)) {
+        TAILQ_FOREACH(child, &node->children, siblings) {
+            if (!run->pending)
+                break;
+            err = XmlFilterVisit(run, child);
+            if (err != XML_NOERR)
+                return err;
+        }
+    }
+    XmlFilterEnd(run);
+    return XML_NOERR;
+}
+
+static int
+XmlFilterCompareIds(const void *a, const void *b)
+{
+    unsigned long x = *(unsigned long *)a, y = *(unsigned long *)b;
+    return (x > y) - (x < y);
+}
+
+// hand the matched ids to the caller, sorted and without duplicates
+static void
+XmlFilterResult(XmlFilterRun *run, unsigned long **ids, size_t *count)
+{
+    size_t i, kept = 0;
+
+    if (run->numIds) {
+        qsort(run->ids, run->numIds, sizeof(unsigned long), XmlFilterCompareIds);
+        for (i = 0; i < run->numIds; i++) {
+            if (!kept || run->ids[i] != run->ids[kept - 1])
+                run->ids[kept++] = run->ids[i];
+        }
+    }
+    *ids = run->ids;
+    *count = kept;
+    run->ids = NULL;
+}
+
+XmlErr
+XmlFilterDocument(XmlFilter *filter, TXml *xml, unsigned long **ids, size_t *count)
+{
+    XmlFilterRun run;
+    XmlNode *node;
+    XmlErr err;
+
+    if (!filter || !xml || !ids || !count)
+        return XML_BADARGS;
+    err = XmlFilterInitRun(&run, filter);
+    if (err == XML_NOERR) {
+        TAILQ_FOREACH(node, &xml->rootElements, siblings) {
+            if (!run.pending)
+                break;
+            err = XmlFilterVisit(&run, node);
+            if (err != XML_NOERR)
+                break;
+        }
+    }
+    if (err == XML_NOERR)
+        XmlFilterResult(&run, ids, count);
+    XmlFilterClearRun(&run);
+    return err;
+}
+
+static XmlErr
+XmlFilterParse(XmlFilter *filter, TXml *xml, char *buf, char *file, unsigned long **ids, size_t *count)
+{
+    XmlFilterRun run;
+    XmlStream stream;
+    XmlErr err;
+
+    if (!filter || !xml || !ids || !count)
+        return XML_BADARGS;
+    err = XmlFilterInitRun(&run, filter);
+    if (err == XML_NOERR) {
+        memset(&stream, 0, sizeof(stream));
+        stream.filter = &run;
+        err = XmlStreamParse(xml, buf, file, &stream);
+    }
+    if (err == XML_NOERR)
+        XmlFilterResult(&run, ids, count);
+    XmlFilterClearRun(&run);
+    return err;
+}
+
+XmlErr
+XmlFilterBuffer(XmlFilter *filter, TXml *xml, char *buf, unsigned long **ids, size_t *count)
+{
+    if (!buf)
+        return XML_BADARGS;
+    return XmlFilterParse(filter, xml, buf, NULL, ids, count);
+}
+
+XmlErr
+XmlFilterFile(XmlFilter *filter, TXml *xml, char *path, unsigned long **ids, size_t *count)
+{
+    if (!path)
+        return XML_BADARGS;
+    return XmlFilterParse(filter, xml, NULL, path, ids, count);
+}
+
+//
+// SERIALIZER
+//
+// The tree is serialized as a sequence of fragments handed to an XmlEmitter.
+// Every fragment is either a static string or points directly to the
+// strings stored in the tree (names, values, attributes), so fragments stay
+// valid for the whole duration of a dump. This allows XmlDumpFd() to pass
+// them to writev() without copying anything, while XmlDumpBranch() and
+// XmlDump() just append them to a growing buffer.
+//
+typedef struct __XmlEmitter {
+    int (*emit)(struct __XmlEmitter *emitter, char *data, size_t len);
+    int err;
+} XmlEmitter;
+
+#define XML_EMIT(__e, __data, __len) do { \
+    if (!(__e)->err && (__len) > 0) \
+        (__e)->err = (__e)->emit((__e), (__data), (__len)); \
+} while (0)
+
+#define XML_EMIT_STATIC(__e, __str) XML_EMIT(__e, (char *)(__str), sizeof(__str)-1)
+
+static char XmlTabs[] = "\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t";
+
+static void
+XmlEmitTabs(XmlEmitter *e, unsigned int depth)
+{
+    while (depth > 0) {
+        unsigned int n = depth < sizeof(XmlTabs)-1 ? depth : sizeof(XmlTabs)-1;
+        XML_EMIT(e, XmlTabs, n);
+        depth -= n;
+    }
+}
+
+// emits 'string' escaping xml special chars on the fly.
+// Runs of plain characters are emitted as they are (pointing to the original
+// string), only the entities are taken from static storage
+static void
+XmlEmitEscaped(XmlEmitter *e, char *string)
+{
+    char *p = string;
+    char *mark = string;
+    char *entity;
+    size_t entityLen;
+
+    for (;;) {
+        switch (*p) {
+            case 0:
+                XML_EMIT(e, mark, p - mark);
+                return;
+            case '&':
+                entity = "&amp;";
+                entityLen = 5;
+                break;
+            case '<':
+                entity = "&lt;";
+                entityLen = 4;
+                break;
+            case '>':
+                entity = "&gt;";
+                entityLen = 4;
+                break;
+            case '"':
+                entity = "&quot;";
+                entityLen = 6;
+                break;
+            case '\'':
+                entity = "&apos;";
+                entityLen = 6;
+                break;
+            default:
+                p++;
+                continue;
+        }
+        XML_EMIT(e, mark, p - mark);
+        XML_EMIT(e, entity, entityLen);
+        mark = ++p;
+    }
+}
+
+static void
+XmlEmitNodeName(XmlEmitter *e, XmlNode *node)
+{
+    if (node->ns && node->ns->name) {
+        XML_EMIT(e, node->ns->name, strlen(node->ns->name));
+        XML_EMIT_STATIC(e, ":");
+    }
+    XML_EMIT(e, node->name, strlen(node->name));
+}
+
+// emits everything preceding the children of rNode
+// (the whole node if it's a comment, a cdata or an empty element)
+static void
+XmlEmitBranchStart(TXml *xml, XmlEmitter *e, XmlNode *rNode, unsigned int depth)
+{
+    XmlNodeAttribute *attr;
+    char *value = rNode->value;
+    int hasChildren = !TAILQ_EMPTY(&rNode->children);
+
+    if (xml->ignoreBlanks)
+        XmlEmitTabs(e, depth);
+
+    /* First check if this is a special node (a comment or a CDATA) */
+    if (rNode->type == XML_NODETYPE_COMMENT) {
+        XML_EMIT_STATIC(e, "<!--");
+        if (value)
+            XML_EMIT(e, value, strlen(value));
+        XML_EMIT_STATIC(e, "-->");
+        if (xml->ignoreBlanks)
+            XML_EMIT_STATIC(e, "\n");
+        return;
+    } else if (rNode->type == XML_NODETYPE_CDATA) {
+        XML_EMIT_STATIC(e, "<![CDATA[");
+        if (value)
+            XML_EMIT(e, value, strlen(value));
+        XML_EMIT_STATIC(e, "]]>");
+        if (xml->ignoreBlanks)
+            XML_EMIT_STATIC(e, "\n");
+        return;
+    }
+
+    XML_EMIT_STATIC(e, "<");
+    XmlEmitNodeName(e, rNode);
+    TAILQ_FOREACH(attr, &rNode->attributes, list) {
+        XML_EMIT_STATIC(e, " ");
+        XML_EMIT(e, attr->name, strlen(attr->name));
+        XML_EMIT_STATIC(e, "=\"");
+        XmlEmitEscaped(e, attr->value);
+        XML_EMIT_STATIC(e, "\"");
+    }
+    // skip also if value is an empty string (not only if it's a null pointer)
+    if (hasChildren) {
+        if (xml->ignoreBlanks)
+            XML_EMIT_STATIC(e, ">\n");
+        else
+            XML_EMIT_STATIC(e, ">");
+        if (value && *value) {
+            XmlEmitEscaped(e, value);
+            if (xml->ignoreBlanks)
+                XML_EMIT_STATIC(e, "\n");
+        }
+    } else if (value && *value) {
+        // TODO - allow to specify a flag to determine if we want white spaces or not
+        XML_EMIT_STATIC(e, ">");
+        XmlEmitEscaped(e, value);
+    } else {
+        XML_EMIT_STATIC(e, "/>");
+        if (xml->ignoreBlanks)
+            XML_EMIT_STATIC(e, "\n");
+    }
+}
+
+// emits everything following the children of rNode (the closing tag, if any)
+static void
+XmlEmitBranchEnd(TXml *xml, XmlEmitter *e, XmlNode *rNode, unsigned int depth)
+{
+    int hasChildren = !TAILQ_EMPTY(&rNode->children);
+
+    if (rNode->type != XML_NODETYPE_SIMPLE)
+        return;
+    if (!hasChildren && !(rNode->value && *rNode->value))
+        return; // empty element, already closed by XmlEmitBranchStart()
+
+    if (hasChildren && xml->ignoreBlanks)
+        XmlEmitTabs(e, depth);
+    XML_EMIT_STATIC(e, "</");
+    XmlEmitNodeName(e, rNode);
+    XML_EMIT_STATIC(e, ">");
+    if (xml->ignoreBlanks)
+        XML_EMIT_STATIC(e, "\n");
+}
+
+static void
+XmlEmitBranch(TXml *xml, XmlEmitter *e, XmlNode *rNode, unsigned int depth)
+{
+    XmlNode *child;
+
+    XmlEmitBranchStart(xml, e, rNode, depth);
+    if (rNode->type == XML_NODETYPE_SIMPLE) {
+        TAILQ_FOREACH(child, &rNode->children, siblings)
+            XmlEmitBranch(xml, e, child, depth+1); /* let's recurse */
+    }
+    XmlEmitBranchEnd(xml, e, rNode, depth);
+}
+
+// collects fragments into a single, null-terminated, memory buffer
+typedef struct __XmlBufferEmitter {
+    XmlEmitter e;
+    char *buf;
+    size_t len;
+    size_t size;
+} XmlBufferEmitter;
+
+static int
+XmlBufferEmit(XmlEmitter *e, char *data, size_t len)
+{
+    XmlBufferEmitter *be = (XmlBufferEmitter *)e;
+    if (be->len + len + 1 > be->size) {
+        size_t newSize = be->size ? be->size : 256;
+        char *newBuf;
+        while (be->len + len + 1 > newSize)
+            newSize *= 2;
+        newBuf = (char *)realloc(be->buf, newSize);
+        if (!newBuf)
+            return XML_MEMORY_ERR;
+        be->buf = newBuf;
+        be->size = newSize;
+    }
+    memcpy(be->buf + be->len, data, len);
+    be->len += len;
+    be->buf[be->len] = 0;
+    return XML_NOERR;
+}
+
+static void
+XmlBufferEmitterInit(XmlBufferEmitter *be)
+{
+    memset(be, 0, sizeof(XmlBufferEmitter));
+    be->e.emit = XmlBufferEmit;
+}
+
+// returns the collected buffer (or NULL if anything went wrong)
+static char *
+XmlBufferEmitterRelease(XmlBufferEmitter *be)
+{
+    if (be->e.err || !be->buf) {
+        if (be->buf)
+            free(be->buf);
+        be->buf = NULL;
+        if (!be->e.err) // nothing has been emitted, still return an empty string
+            return (char *)calloc(1, 1);
+    }
+    return be->buf;
+}
+
+char *
+XmlDumpBranchSize(TXml *xml, XmlNode *rNode, unsigned int depth, size_t *outlen)
+{
+    XmlBufferEmitter be;
+    char *dump;
+
+    if(!rNode->name)
+        return NULL;
+
+    XmlBufferEmitterInit(&be);
+    XmlEmitBranch(xml, &be.e, rNode, depth);
+    dump = XmlBufferEmitterRelease(&be);
+    if (dump && outlen)
+        *outlen = be.len;
+    return dump;
+}
+
+char *
+XmlDumpBranch(TXml *xml, XmlNode *rNode, unsigned int depth)
+{
+    return XmlDumpBranchSize(xml, rNode, depth, NULL);
+}
+
+// fills 'head' with the content of the <?xml ... ?> section to dump
+// and returns 1 if the output needs to be converted to a different encoding
+static int
+XmlDumpHead(TXml *xml, char *head, size_t headSize)
+{
+    int doConversion = 0;
+
+    memset(head, 0, headSize);
+    if (xml->head) {
+        int quote;
+        char *start, *end, *encoding;
+        char *initial = strdup(xml->head);
+        start = strstr(initial, "encoding=");
+        if (start) {
+            *start = 0;
+            encoding = start+9;
+            snprintf(head, headSize, "%s", xml->head);
+            if (*encoding == '"' || *encoding == '\'') {
+                quote = *encoding;
+                encoding++;
+                end = (char *)strchr(encoding, quote);
+                if (!end) {
+                    /* TODO - Error Messages */
+                    free(initial);
+                    return 0;
+                }
+                *end = 0;
+                // check if document encoding matches
+                if (strncasecmp(encoding, xml->documentEncoding, end-encoding) != 0) {
+                    /* TODO - Error Messages */
+                } 
+                if (strncasecmp(encoding, xml->outputEncoding, end-encoding) != 0) {
+#ifdef USE_ICONV
+                    snprintf(head, headSize, "%sencoding=\"%s\"%s",
+                        initial, xml->outputEncoding, ++end);
+                    doConversion = 1;
+#else
+                    fprintf(stderr, "Iconv missing: will not convert output to %s\n", xml->outputEncoding);
+#endif
+                }
+            }
+        } else {
+#ifdef USE_ICONV
+            if (strcasecmp(xml->outputEncoding, "utf-8") != 0)
+                doConversion = 1;
+            snprintf(head, headSize, "xml version=\"1.0\" encoding=\"%s\"", xml->outputEncoding);
+#else
+            if (strcasecmp(xml->outputEncoding, "utf-8") != 0)
+                fprintf(stderr, "Iconv missing: will not convert output to %s\n", xml->outputEncoding);
+            snprintf(head, headSize, "xml version=\"1.0\" encoding=\"utf-8\"");
+#endif
+        }
+        free(initial);
+    } else {
+#ifdef USE_ICONV
+        if (strcasecmp(xml->outputEncoding, "utf-8") != 0)
+            doConversion = 1;
+        snprintf(head, headSize, "xml version=\"1.0\" encoding=\"%s\"", xml->outputEncoding);
+#else
+        if (strcasecmp(xml->outputEncoding, "utf-8") != 0)
+            fprintf(stderr, "Iconv missing: will not convert output to %s\n", xml->outputEncoding);
+        snprintf(head, headSize, "xml version=\"1.0\" encoding=\"utf-8\"");
+#endif
+    }
+    return doConversion;
+}
+
+// DUMP CACHE
+//
+// When xml->dumpCache is set, the serialized root elements are kept in
+// xml->dumpCacheBuf. Each node remembers where its branch is located in
+// there (relative to its parent, so that a clean branch stays valid
+// wherever its parent ends up in the next buffer) and the mutators mark
+// the modified node and all its ancestors as dirty.
+// Rebuilding the cache copies clean branches from the old buffer as they
+// are and serializes again only the nodes along the modified paths.
+//
+static void
+XmlCacheBranch(TXml *xml, XmlBufferEmitter *be, XmlNode *rNode,
+    char *oldStart, unsigned int depth, size_t parentStart)
+{
+    size_t start = be->len;
+
+    if (oldStart && rNode->cacheState == XML_CACHE_CLEAN) {
+        XML_EMIT(&be->e, oldStart, rNode->cacheLen);
+    } else {
+        XmlNode *child;
+        // children can be found in the old buffer only if we were there as well
+        if (rNode->cacheState == XML_CACHE_NONE)
+            oldStart = NULL;
+        XmlEmitBranchStart(xml, &be->e, rNode, depth);
+        if (rNode->type == XML_NODETYPE_SIMPLE) {
+            TAILQ_FOREACH(child, &rNode->children, siblings) {
+                XmlCacheBranch(xml, be, child,
+                    oldStart ? oldStart + child->cacheOffset : NULL, depth+1, start);
+            }
+        }
+        XmlEmitBranchEnd(xml, &be->e, rNode, depth);
+        rNode->cacheLen = be->len - start;
+        rNode->cacheState = XML_CACHE_CLEAN;
+    }
+    rNode->cacheOffset = start - parentStart;
+}
+
+static XmlErr
+XmlUpdateDumpCache(TXml *xml)
+{
+    XmlBufferEmitter be;
+    XmlNode *rNode;
+    char *oldBuf = xml->dumpCacheBuf;
+    size_t offset = 0;
+
+    if (oldBuf && xml->dumpCacheBlanks == xml->ignoreBlanks) {
+        // check if the cached root elements are still all there (and in order)
+        TAILQ_FOREACH(rNode, &xml->rootElements, siblings) {
+            if (rNode->cacheState != XML_CACHE_CLEAN || rNode->cacheOffset != offset)
+                break;
+            offset += rNode->cacheLen;
+        }
+        if (!rNode && offset == xml->dumpCacheLen)
+            return XML_NOERR;
+    } else {
+        oldBuf = NULL; // the output format has changed, nothing can be reused
+    }
+
+    XmlBufferEmitterInit(&be);
+    if (xml->dumpCacheLen) { // the size will likely stay about the same
+        be.buf = (char *)malloc(xml->dumpCacheLen + 1);
+        if (be.buf)
+            be.size = xml->dumpCacheLen + 1;
+    }
+    TAILQ_FOREACH(rNode, &xml->rootElements, siblings)
+        XmlCacheBranch(xml, &be, rNode, oldBuf ? oldBuf + rNode->cacheOffset : NULL, 0, 0);
+    if (be.e.err) {
+        // the cached positions are now unreliable, start over next time
+        TAILQ_FOREACH(rNode, &xml->rootElements, siblings)
+            rNode->cacheState = XML_CACHE_NONE;
+        if (be.buf)
+            free(be.buf);
+        if (xml->dumpCacheBuf)
+            free(xml->dumpCacheBuf);
+        xml->dumpCacheBuf = NULL;
+        xml->dumpCacheLen = 0;
+        return be.e.err;
+    }
+    if (xml->dumpCacheBuf)
+        free(xml->dumpCacheBuf);
+    xml->dumpCacheBuf = be.buf;
+    xml->dumpCacheLen = be.len;
+    xml->dumpCacheBlanks = xml->ignoreBlanks;
+    return XML_NOERR;
+}
+
+// PARALLEL DUMP
+//
+// When xml->dumpThreads is greater than 1, the children of the root
+// elements are serialized by a pool of threads, each one into its own
+// buffer. The caller emits the buffers in document order as soon as they
+// are completed, so the output is exactly the same of a sequential dump.
+// The buffers must stay around until the emitter is done with them
+// (XmlDumpFd() hands them to writev()), hence XmlReleaseDumpPool() has to be
+// called only once the output has been flushed.
+//
+#ifdef USE_PTHREADS
+#define XML_DUMP_MAX_THREADS 64
+
+typedef struct __XmlDumpTask {
+    XmlNode *node;
+    XmlBufferEmitter be;
+    int done;
+} XmlDumpTask;
+
+typedef struct __XmlDumpPool {
+    TXml *xml;
+    XmlDumpTask *tasks;
+    int count;
+    int next; // next task to be picked by a worker
+    pthread_mutex_t lock;
+    pthread_cond_t cond; // signaled each time a task is completed
+    pthread_t threads[XML_DUMP_MAX_THREADS];
+    int numThreads;
+} XmlDumpPool;
+
+static void *
+XmlDumpWorker(void *priv)
+{
+    XmlDumpPool *pool = (XmlDumpPool *)priv;
+
+    for (;;) {
+        XmlDumpTask *task;
+        pthread_mutex_lock(&pool->lock);
+        if (pool->next >= pool->count) {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        task = &pool->tasks[pool->next++];
+        pthread_mutex_unlock(&pool->lock);
+
+        XmlEmitBranch(pool->xml, &task->be.e, task->node, 1);
+
+        pthread_mutex_lock(&pool->lock);
+        task->done = 1;
+        pthread_cond_broadcast(&pool->cond);
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return NULL;
+}
+
+static void
+XmlReleaseDumpPool(XmlDumpPool *pool)
+{
+    int i;
+
+    if (!pool)
+        return;
+    // make idle workers exit (in case the caller stopped early)
+    pthread_mutex_lock(&pool->lock);
+    pool->next = pool->count;
+    pthread_mutex_unlock(&pool->lock);
+    for (i = 0; i < pool->numThreads; i++)
+        pthread_join(pool->threads[i], NULL);
+    for (i = 0; i < pool->count; i++) {
+        if (pool->tasks[i].be.buf)
+            free(pool->tasks[i].be.buf);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->cond);
+    free(pool->tasks);
+    free(pool);
+}
+
+// returns NULL if the document should rather be dumped sequentially
+static XmlDumpPool *
+XmlStartDumpPool(TXml *xml)
+{
+    XmlDumpPool *pool;
+    XmlNode *rNode, *child;
+    int count = 0;
+    int numThreads = xml->dumpThreads;
+
+    if (numThreads < 2 || xml->dumpCache)
+        return NULL;
+    if (numThreads > XML_DUMP_MAX_THREADS)
+        numThreads = XML_DUMP_MAX_THREADS;
+
+    TAILQ_FOREACH(rNode, &xml->rootElements, siblings) {
+        if (rNode->type == XML_NODETYPE_SIMPLE) {
+            TAILQ_FOREACH(child, &rNode->children, siblings)
+                count++;
+        }
+    }
+    if (count < 2) // nothing to split
+        return NULL;
+    if (numThreads > count)
+        numThreads = count;
+
+    pool = (XmlDumpPool *)calloc(1, sizeof(XmlDumpPool));
+    if (!pool)
+        return NULL;
+    pool->tasks = (XmlDumpTask *)calloc(count, sizeof(XmlDumpTask));
+    if (!pool->tasks) {
+        free(pool);
+        return NULL;
+    }
+    pool->xml = xml;
+    pool->count = 0;
+    TAILQ_FOREACH(rNode, &xml->rootElements, siblings) {
+        if (rNode->type == XML_NODETYPE_SIMPLE) {
+            TAILQ_FOREACH(child, &rNode->children, siblings) {
+                XmlDumpTask *task = &pool->tasks[pool->count++];
+                task->node = child;
+                XmlBufferEmitterInit(&task->be);
+            }
+        }
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+    for (pool->numThreads = 0; pool->numThreads < numThreads; pool->numThreads++) {
+        if (pthread_create(&pool->threads[pool->numThreads], NULL, XmlDumpWorker, pool) != 0)
+            break;
+    }
+    if (!pool->numThreads) {
+        XmlReleaseDumpPool(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+// emits the branches serialized by the pool, in document order
+static void
+XmlEmitPooledDocument(TXml *xml, XmlEmitter *e, XmlDumpPool *pool)
+{
+    XmlNode *rNode, *child;
+    int i = 0;
+
+    TAILQ_FOREACH(rNode, &xml->rootElements, siblings) {
+        XmlEmitBranchStart(xml, e, rNode, 0);
+        if (rNode->type == XML_NODETYPE_SIMPLE) {
+            TAILQ_FOREACH(child, &rNode->children, siblings) {
+                XmlDumpTask *task = &pool->tasks[i++];
+                pthread_mutex_lock(&pool->lock);
+                while (!task->done)
+                    pthread_cond_wait(&pool->cond, &pool->lock);
+                pthread_mutex_unlock(&pool->lock);
+                if (task->be.e.err && !e->err)
+                    e->err = task->be.e.err;
+                XML_EMIT(e, task->be.buf, task->be.len);
+            }
+        }
+        XmlEmitBranchEnd(xml, e, rNode, 0);
+        if (e->err)
+            return;
+    }
+}
+#else
+typedef struct __XmlDumpPool XmlDumpPool;
+#define XmlStartDumpPool(__xml) NULL
+#define XmlReleaseDumpPool(__pool)
+#endif
+
+static void
+XmlEmitDocument(TXml *xml, XmlEmitter *e, char *head, XmlDumpPool *pool)
+{
+    XmlNode *rNode;
+
+    XML_EMIT_STATIC(e, "<?");
+    XML_EMIT(e, head, strlen(head));
+    XML_EMIT_STATIC(e, "?>\n");
+    if (xml->dumpCache && !xml->readOnly && XmlUpdateDumpCache(xml) == XML_NOERR) {
+        XML_EMIT(e, xml->dumpCacheBuf, xml->dumpCacheLen);
+        return;
+    }
+#ifdef USE_PTHREADS
+    if (pool) {
+        XmlEmitPooledDocument(xml, e, pool);
+        return;
+    }
+#endif
+    TAILQ_FOREACH(rNode, &xml->rootElements, siblings)
+        XmlEmitBranch(xml, e, rNode, 0);
+}
+
+#ifdef USE_ICONV
+// OUTPUT CONVERSION
+//
+// Fragments are collected in a small input buffer which is converted
+// through iconv each time it fills up, passing the result to the next
+// emitter (which must copy it, since the output buffer is reused).
+// The iconv handle is kept in the context and reused by the following
+// dumps, as long as the encodings don't change. Only one dump at a time
+// can own it (documents can be dumped by many threads at once), the others
+// open a private one.
+//
+#define XML_CONV_CHUNK 16384
+
+typedef struct __XmlConvEmitter {
+    XmlEmitter e;
+    XmlEmitter *next;
+    TXml *xml;
+    iconv_t ich;
+    int shared; // ich is the one kept in the context
+    size_t inLen;
+    char in[XML_CONV_CHUNK];
+    char out[XML_CONV_CHUNK*4];
+} XmlConvEmitter;
+
+// takes the converter kept in the context (setting *shared)
+// or opens a private one if another dump is using it
+static iconv_t
+XmlOutputConverter(TXml *xml, int *shared)
+{
+    iconv_t ich;
+
+    *shared = 0;
+    if (__atomic_test_and_set(&xml->outputConverterBusy, __ATOMIC_ACQUIRE)) {
+        ich = iconv_open(xml->outputEncoding, xml->documentEncoding);
+        if (ich == (iconv_t)(-1))
+            fprintf(stderr, "Can't init iconv: %s\n", strerror(errno));
+        return ich;
+    }
+    ich = (iconv_t)xml->outputConverter;
+    if (ich && strcmp(xml->outputConverterFrom, xml->documentEncoding) == 0 &&
+        strcmp(xml->outputConverterTo, xml->outputEncoding) == 0)
+    {
+        iconv(ich, NULL, NULL, NULL, NULL); // reset the conversion state
+        *shared = 1;
+        return ich;
+    }
+    if (ich)
+        iconv_close(ich);
+    xml->outputConverter = NULL;
+    ich = iconv_open(xml->outputEncoding, xml->documentEncoding);
+    if (ich == (iconv_t)(-1)) {
+        fprintf(stderr, "Can't init iconv: %s\n", strerror(errno));
+        __atomic_clear(&xml->outputConverterBusy, __ATOMIC_RELEASE);
+        return (iconv_t)(-1);
+    }
+    xml->outputConverter = (void *)ich;
+    snprintf(xml->outputConverterFrom, sizeof(xml->outputConverterFrom), "%s", xml->documentEncoding);
+    snprintf(xml->outputConverterTo, sizeof(xml->outputConverterTo), "%s", xml->outputEncoding);
+    *shared = 1;
+    return ich;
+}
+
+// converts what has been collected so far. Unless 'final' is set,
+// an incomplete multibyte sequence at the end is kept for the next round
+static int
+XmlConvFlush(XmlConvEmitter *ce, int final)
+{
+    char *inPtr = ce->in;
+    size_t inLeft = ce->inLen;
+
+    for (;;) {
+        char *outPtr = ce->out;
+        size_t outLeft = sizeof(ce->out);
+        size_t cb = iconv(ce->ich, inLeft ? &inPtr : NULL, &inLeft, &outPtr, &outLeft);
+        int convErr = (cb == (size_t)-1) ? errno : 0;
+
+        XML_EMIT(ce->next, ce->out, sizeof(ce->out) - outLeft);
+        if (ce->next->err)
+            return ce->next->err;
+        if (!convErr) {
+            if (final && inLeft == 0 && inPtr) {
+                inPtr = NULL; // one more round to flush the shift state (if any)
+                continue;
+            }
+            break;
+        }
+        if (convErr == E2BIG)
+            continue;
+        if (convErr == EINVAL && !final)
+            break; // incomplete sequence, wait for more data
+        fprintf(stderr, "Error from iconv: %s\n", strerror(convErr));
+        return XML_GENERIC_ERR;
+    }
+    if (inLeft)
+        memmove(ce->in, inPtr, inLeft);
+    ce->inLen = inLeft;
+    return XML_NOERR;
+}
+
+static int
+XmlConvEmit(XmlEmitter *e, char *data, size_t len)
+{
+    XmlConvEmitter *ce = (XmlConvEmitter *)e;
+
+    while (len > 0) {
+        size_t n = sizeof(ce->in) - ce->inLen;
+        if (n > len)
+            n = len;
+        memcpy(ce->in + ce->inLen, data, n);
+        ce->inLen += n;
+        data += n;
+        len -= n;
+        if (ce->inLen == sizeof(ce->in)) {
+            int rc = XmlConvFlush(ce, 0);
+            if (rc != XML_NOERR)
+                return rc;
+        }
+    }
+    return XML_NOERR;
+}
+
+static XmlConvEmitter *
+XmlConvEmitterCreate(TXml *xml, XmlEmitter *next)
+{
+    XmlConvEmitter *ce = (XmlConvEmitter *)malloc(sizeof(XmlConvEmitter));
+
+    if (!ce)
+        return NULL;
+    ce->ich = XmlOutputConverter(xml, &ce->shared);
+    if (ce->ich == (iconv_t)(-1)) {
+        free(ce);
+        return NULL;
+    }
+    ce->e.emit = XmlConvEmit;
+    ce->e.err = XML_NOERR;
+    ce->next = next;
+    ce->xml = xml;
+    ce->inLen = 0;
+    return ce;
+}
+
+// gives the converter back to the context (or closes it if private)
+static void
+XmlConvEmitterDestroy(XmlConvEmitter *ce)
+{
+    if (ce->shared)
+        __atomic_clear(&ce->xml->outputConverterBusy, __ATOMIC_RELEASE);
+    else
+        iconv_close(ce->ich);
+    free(ce);
+}
+
+static void
+XmlConvEmitterFinish(XmlConvEmitter *ce)
+{
+    if (!ce->e.err)
+        ce->e.err = XmlConvFlush(ce, 1);
+}
+#endif
+
+//
+// COMPRESSED OUTPUT
+//
+// Works like the output conversion: fragments are collected in an input
+// buffer which is compressed each time it fills up, passing the compressed
+// data to the next emitter (which must copy it).
+//
+#define XML_COMPRESS_CHUNK 65536
+
+typedef struct __XmlCompressEmitter {
+    XmlEmitter e;
+    XmlEmitter *next;
+    int compression;
+#ifdef USE_ZLIB
+    z_stream zs;
+#endif
+#ifdef USE_ZSTD
+    ZSTD_CStream *cs;
+#endif
+    size_t inLen;
+    char in[XML_COMPRESS_CHUNK];
+    char out[XML_COMPRESS_CHUNK];
+} XmlCompressEmitter;
+
+// compresses what has been collected so far. If 'final' is set
+// the compressed stream is terminated
+static int
+XmlCompressFlush(XmlCompressEmitter *ze, int final)
+{
+#ifdef USE_ZLIB
+    if (ze->compression == XML_COMPRESSION_GZIP) {
+        int zrc;
+        ze->zs.next_in = (Bytef *)ze->in;
+        ze->zs.avail_in = ze->inLen;
+        do {
+            ze->zs.next_out = (Bytef *)ze->out;
+            ze->zs.avail_out = sizeof(ze->out);
+            zrc = deflate(&ze->zs, final ? Z_FINISH : Z_NO_FLUSH);
+            if (zrc == Z_STREAM_ERROR) {
+                fprintf(stderr, "Can't compress xml dump\n");
+                return XML_GENERIC_ERR;
+            }
+            XML_EMIT(ze->next, ze->out, sizeof(ze->out) - ze->zs.avail_out);
+            if (ze->next->err)
+                return ze->next->err;
+        } while (ze->zs.avail_out == 0 || (final && zrc != Z_STREAM_END));
+    }
+#endif
+#ifdef USE_ZSTD
+    if (ze->compression == XML_COMPRESSION_ZSTD) {
+        ZSTD_inBuffer in;
+        size_t zrc;
+        in.src = ze->in;
+        in.size = ze->inLen;
+        in.pos = 0;
+        do {
+            ZSTD_outBuffer ob;
+            ob.dst = ze->out;
+            ob.size = sizeof(ze->out);
+            ob.pos = 0;
+            if (in.pos < in.size)
+                zrc = ZSTD_compressStream(ze->cs, &ob, &in);
+            else
+                zrc = final ? ZSTD_endStream(ze->cs, &ob) : 0;
+            if (ZSTD_isError(zrc)) {
+                fprintf(stderr, "Can't compress xml dump: %s\n", ZSTD_getErrorName(zrc));
+                return XML_GENERIC_ERR;
+            }
+            XML_EMIT(ze->next, ze->out, ob.pos);
+            if (ze->next->err)
+                return ze->next->err;
+        } while (in.pos < in.size || (final && zrc != 0));
+    }
+#endif
+    ze->inLen = 0;
+    return XML_NOERR;
+}
+
+static int
+XmlCompressEmit(XmlEmitter *e, char *data, size_t len)
+{
+    XmlCompressEmitter *ze = (XmlCompressEmitter *)e;
+
+    while (len > 0) {
+        size_t n = sizeof(ze->in) - ze->inLen;
+        if (n > len)
+            n = len;
+        memcpy(ze->in + ze->inLen, data, n);
+        ze->inLen += n;
+        data += n;
+        len -= n;
+        if (ze->inLen == sizeof(ze->in)) {
+            int rc = XmlCompressFlush(ze, 0);
+            if (rc != XML_NOERR)
+                return rc;
+        }
+    }
+    return XML_NOERR;
+}
+
+static XmlCompressEmitter *
+XmlCompressEmitterCreate(int compression, XmlEmitter *next)
+{
+    XmlCompressEmitter *ze;
+
+    if (!XmlHasCompression(compression) || compression == XML_COMPRESSION_NONE) {
+        fprintf(stderr, "Support for %s compression has not been compiled in\n",
+            compression == XML_COMPRESSION_GZIP ? "gzip" :
+            compression == XML_COMPRESSION_ZSTD ? "zstd" : "this kind of");
+        return NULL;
+    }
+    ze = (XmlCompressEmitter *)calloc(1, sizeof(XmlCompressEmitter));
+    if (!ze)
+        return NULL;
+    ze->e.emit = XmlCompressEmit;
+    ze->e.err = XML_NOERR;
+    ze->next = next;
+    ze->compression = compression;
+#ifdef USE_ZLIB
+    if (compression == XML_COMPRESSION_GZIP &&
+        deflateInit2(&ze->zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+        free(ze);
+        return NULL;
+    }
+#endif
+#ifdef USE_ZSTD
+    if (compression == XML_COMPRESSION_ZSTD) {
+        ze->cs = ZSTD_createCStream();
+        if (!ze->cs || ZSTD_isError(ZSTD_initCStream(ze->cs, 3))) {
+            if (ze->cs)
+                ZSTD_freeCStream(ze->cs);
+            free(ze);
+            return NULL;
+        }
+    }
+#endif
+    return ze;
+}
+
+// terminates the compressed stream and releases the emitter
+static int
+XmlCompressEmitterFinish(XmlCompressEmitter *ze)
+{
+    int rc;
+
+    if (!ze->e.err)
+        ze->e.err = XmlCompressFlush(ze, 1);
+    rc = ze->e.err;
+#ifdef USE_ZLIB
+    if (ze->compression == XML_COMPRESSION_GZIP)
+        deflateEnd(&ze->zs);
+#endif
+#ifdef USE_ZSTD
+    if (ze->compression == XML_COMPRESSION_ZSTD)
+        ZSTD_freeCStream(ze->cs);
+#endif
+    free(ze);
+    return rc;
+}
+
+char *
+XmlDumpSize(TXml *xml, size_t *outlen)
+{
+    char *dump;
+    XmlBufferEmitter be;
+    XmlDumpPool *pool;
+    int doConversion;
+    char head[256]; // should be enough
+
+    doConversion = XmlDumpHead(xml, head, sizeof(head));
+    XmlBufferEmitterInit(&be);
+    pool = XmlStartDumpPool(xml);
+#ifdef USE_ICONV
+    if (doConversion) {
+        // the output is converted chunk by chunk while being produced
+        XmlConvEmitter *ce = XmlConvEmitterCreate(xml, &be.e);
+        if (!ce) {
+            XmlReleaseDumpPool(pool);
+            return NULL;
+        }
+        XmlEmitDocument(xml, &ce->e, head, pool);
+        XmlConvEmitterFinish(ce);
+        if (ce->e.err && !be.e.err)
+            be.e.err = ce->e.err;
+        XmlConvEmitterDestroy(ce);
+    } else
+#endif
+    XmlEmitDocument(xml, &be.e, head, pool);
+    XmlReleaseDumpPool(pool);
+    dump = XmlBufferEmitterRelease(&be);
+    if (!dump)
+        return NULL;
+    if (outlen) // check if we need to report the output size
+        *outlen = be.len;
+    return(dump);
+}
+
+char *
+XmlDump(TXml *xml, int *outlen)
+{
+    size_t len = 0;
+    char *dump = XmlDumpSize(xml, &len);
+
+    if (dump && outlen) { // check if we need to report the output size
+        if (len > INT_MAX) {
+            fprintf(stderr, "Xml dump too big (%lu bytes), use XmlDumpSize() instead\n",
+                (unsigned long)len);
+            free(dump);
+            return NULL;
+        }
+        *outlen = (int)len;
+    }
+    return(dump);
+}
+
+#ifndef WIN32
+// write the whole buffer, retrying on short writes and EINTR
+static int
+XmlWriteAll(int fd, char *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t wb = write(fd, buf, len);
+        if (wb < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += wb;
+        len -= wb;
+    }
+    return 0;
+}
+
+// writes fragments out as they come (used when they can't be batched)
+typedef struct __XmlFdEmitter {
+    XmlEmitter e;
+    int fd;
+} XmlFdEmitter;
+
+static int
+XmlFdEmit(XmlEmitter *e, char *data, size_t len)
+{
+    if (XmlWriteAll(((XmlFdEmitter *)e)->fd, data, len) != 0) {
+        fprintf(stderr, "Can't write xml dump: %s\n", strerror(errno));
+        return XML_GENERIC_ERR;
+    }
+    return XML_NOERR;
+}
+
+// batches fragments into an iovec array and flushes them through writev()
+#define XML_IOV_BATCH 512
+
+typedef struct __XmlIovEmitter {
+    XmlEmitter e;
+    int fd;
+    int cnt;
+    struct iovec iov[XML_IOV_BATCH];
+} XmlIovEmitter;
+
+static int
+XmlIovFlush(XmlIovEmitter *ie)
+{
+    struct iovec *iov = ie->iov;
+    int cnt = ie->cnt;
+
+    while (cnt > 0) {
+        ssize_t wb = writev(ie->fd, iov, cnt);
+        if (wb < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "Can't write xml dump: %s\n", strerror(errno));
+            return XML_GENERIC_ERR;
+        }
+        // skip what has been written (handling short writes)
+        while (cnt > 0 && (size_t)wb >= iov->iov_len) {
+            wb -= iov->iov_len;
+            iov++;
+            cnt--;
+        }
+        if (cnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + wb;
+            iov->iov_len -= wb;
+        }
+    }
+    ie->cnt = 0;
+    return XML_NOERR;
+}
+
+static int
+XmlIovEmit(XmlEmitter *e, char *data, size_t len)
+{
+    XmlIovEmitter *ie = (XmlIovEmitter *)e;
+    if (ie->cnt) { // merge with the previous fragment if contiguous
+        struct iovec *last = &ie->iov[ie->cnt-1];
+        if ((char *)last->iov_base + last->iov_len == data) {
+            last->iov_len += len;
+            return XML_NOERR;
+        }
+    }
+    if (ie->cnt == XML_IOV_BATCH) {
+        int rc = XmlIovFlush(ie);
+        if (rc != XML_NOERR)
+            return rc;
+    }
+    ie->iov[ie->cnt].iov_base = data;
+    ie->iov[ie->cnt].iov_len = len;
+    ie->cnt++;
+    return XML_NOERR;
+}
+
+static XmlErr
+XmlDumpFdCompressed(TXml *xml, int fd, int compression)
+{
+    XmlIovEmitter ie;
+    XmlFdEmitter fe;
+    XmlEmitter *e;
+    XmlCompressEmitter *ze = NULL;
+    XmlDumpPool *pool;
+    XmlErr rc;
+    int doConversion;
+    char head[256];
+
+    doConversion = XmlDumpHead(xml, head, sizeof(head));
+#ifndef USE_ICONV
+    doConversion = 0;
+#endif
+    if (!doConversion && compression == XML_COMPRESSION_NONE) {
+        memset(&ie, 0, sizeof(ie));
+        ie.e.emit = XmlIovEmit;
+        ie.fd = fd;
+        pool = XmlStartDumpPool(xml);
+        XmlEmitDocument(xml, &ie.e, head, pool);
+        if (!ie.e.err)
+            ie.e.err = XmlIovFlush(&ie);
+        // the iovecs may point to the buffers of the pool until flushed
+        XmlReleaseDumpPool(pool);
+        return ie.e.err;
+    }
+
+    // the output must be converted and/or compressed, which can't be done
+    // in place. The resulting chunks are written out as soon as they are ready
+    fe.e.emit = XmlFdEmit;
+    fe.e.err = XML_NOERR;
+    fe.fd = fd;
+    e = &fe.e;
+    if (compression != XML_COMPRESSION_NONE) {
+        ze = XmlCompressEmitterCreate(compression, e);
+        if (!ze)
+            return XML_GENERIC_ERR;
+        e = &ze->e;
+    }
+#ifdef USE_ICONV
+    if (doConversion) {
+        XmlConvEmitter *ce = XmlConvEmitterCreate(xml, e);
+        if (!ce) {
+            if (ze)
+                XmlCompressEmitterFinish(ze);
+            return XML_GENERIC_ERR;
+        }
+        pool = XmlStartDumpPool(xml);
+        XmlEmitDocument(xml, &ce->e, head, pool);
+        XmlConvEmitterFinish(ce);
+        XmlReleaseDumpPool(pool);
+        rc = ce->e.err;
+        XmlConvEmitterDestroy(ce);
+    } else
+#endif
+    {
+        pool = XmlStartDumpPool(xml);
+        XmlEmitDocument(xml, e, head, pool);
+        XmlReleaseDumpPool(pool);
+        rc = e->err;
+    }
+    if (ze) {
+        if (rc != XML_NOERR)
+            ze->e.err = rc; // don't bother terminating the stream
+        rc = XmlCompressEmitterFinish(ze);
+    }
+    return rc;
+}
+
+XmlErr
+XmlDumpFd(TXml *xml, int fd)
+{
+    return XmlDumpFdCompressed(xml, fd, xml->compression);
+}
+
+// copy 'src' to 'dst' without pulling the whole file into memory.
+// (copy_file_range() lets the kernel do it without going through userspace)
+static int
+XmlCopyFile(char *src, char *dst)
+{
+    int in, out;
+    int rc = 0;
+    char chunk[65536];
+    ssize_t rb;
+    struct stat fileStat;
+
+    in = open(src, O_RDONLY);
+    if (in == -1)
+        return -1;
+    if (fstat(in, &fileStat) != 0) {
+        close(in);
+        return -1;
+    }
+    out = open(dst, O_WRONLY|O_CREAT|O_TRUNC, fileStat.st_mode & 0777);
+    if (out == -1) {
+        close(in);
+        return -1;
+    }
+#if defined(_GNU_SOURCE) && defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+    for (;;) {
+        ssize_t cb = copy_file_range(in, NULL, out, NULL, 1<<30, 0);
+        if (cb == 0) {
+            close(in);
+            return close(out);
+        }
+        if (cb < 0) {
+            if (errno == EINTR)
+                continue;
+            // not supported for this pair of files, use plain read/write
+            // (from the current offset, nothing got lost so far)
+            if (errno != ENOSYS && errno != EXDEV && errno != EINVAL && errno != EOPNOTSUPP) {
+                rc = -1;
+                goto _copy_done;
+            }
+            break;
+        }
+    }
+#endif
+    while ((rb = read(in, chunk, sizeof(chunk))) != 0) {
+        if (rb < 0) {
+            if (errno == EINTR)
+                continue;
+            rc = -1;
+            break;
+        }
+        if (XmlWriteAll(out, chunk, rb) != 0) {
+            rc = -1;
+            break;
+        }
+    }
+_copy_done:
+    close(in);
+    if (close(out) != 0)
+        rc = -1;
+    return rc;
+}
+
+// flush the directory entry so that a rename() survives a crash as well
+static void
+XmlSyncDirectory(char *path)
+{
+    int fd;
+    char *dir = strdup(path);
+    char *slash = strrchr(dir, '/');
+    if (slash) {
+        if (slash == dir) // the root directory
+            slash++;
+        *slash = 0;
+    } else {
+        strcpy(dir, ".");
+    }
+    fd = open(dir, O_RDONLY);
+    if (fd != -1) {
+        fsync(fd);
+        close(fd);
+    }
+    free(dir);
+}
+
+// files named *.gz or *.zst are compressed even if xml->compression is not set
+static int
+XmlSaveCompression(TXml *xml, char *xmlFile)
+{
+    size_t len = strlen(xmlFile);
+
+    if (xml->compression != XML_COMPRESSION_NONE)
+        return xml->compression;
+    if (len > 3 && strcmp(xmlFile + len - 3, ".gz") == 0)
+        return XML_COMPRESSION_GZIP;
+    if (len > 4 && strcmp(xmlFile + len - 4, ".zst") == 0)
+        return XML_COMPRESSION_ZSTD;
+    return XML_COMPRESSION_NONE;
+}
+
+static XmlErr
+XmlSaveAtomic(TXml *xml, char *xmlFile)
+{
+    struct stat fileStat;
+    char *tmpPath = NULL;
+    char *backupPath = NULL;
+    int fd = -1;
+    int tries;
+    int exists;
+
+    exists = (stat(xmlFile, &fileStat) == 0);
+
+    // the temporary file must live in the same directory (and so on the same
+    // filesystem) of the target, otherwise rename() can't replace it atomically
+    tmpPath = (char *)malloc(strlen(xmlFile)+32);
+    for (tries = 0; tries < 16 && fd == -1; tries++) {
+        sprintf(tmpPath, "%s.%d.%d.tmp", xmlFile, (int)getpid(), tries);
+        fd = open(tmpPath, O_WRONLY|O_CREAT|O_EXCL,
+                  exists ? (fileStat.st_mode & 0777) : 0666);
+        if (fd == -1 && errno != EEXIST)
+            break;
+    }
+    if (fd == -1) {
+        fprintf(stderr, "Can't create temporary file %s: %s\n", tmpPath, strerror(errno));
+        free(tmpPath);
+        return XML_OPEN_FILE_ERR;
+    }
+    // O_CREAT doesn't apply the mode to an existing inode and umask may have
+    // masked some bits: keep the permissions of the file we are replacing
+    if (exists)
+        fchmod(fd, fileStat.st_mode & 07777);
+
+    if (XmlDumpFdCompressed(xml, fd, XmlSaveCompression(xml, xmlFile)) != XML_NOERR || fsync(fd) != 0) {
+        fprintf(stderr, "Can't write %s: %s\n", tmpPath, strerror(errno));
+        close(fd);
+        unlink(tmpPath);
+        free(tmpPath);
+        return XML_GENERIC_ERR;
+    }
+    if (close(fd) != 0) {
+        fprintf(stderr, "Can't write %s: %s\n", tmpPath, strerror(errno));
+        unlink(tmpPath);
+        free(tmpPath);
+        return XML_GENERIC_ERR;
+    }
+
+    if (exists && fileStat.st_size > 0) { /* backup old profiles */
+        backupPath = (char *)malloc(strlen(xmlFile)+5);
+        sprintf(backupPath, "%s.bck", xmlFile);
+        if (unlink(backupPath) != 0 && errno != ENOENT) {
+            fprintf(stderr, "Can't remove old backup file %s: %s\n", backupPath, strerror(errno));
+        } else if (link(xmlFile, backupPath) != 0 && XmlCopyFile(xmlFile, backupPath) != 0) {
+            fprintf(stderr, "Can't create backup file %s: %s\n", backupPath, strerror(errno));
+            unlink(tmpPath);
+            free(tmpPath);
+            free(backupPath);
+            return XML_GENERIC_ERR;
+        }
+        free(backupPath);
+    }
+
+    if (rename(tmpPath, xmlFile) != 0) {
+        fprintf(stderr, "Can't rename %s to %s: %s\n", tmpPath, xmlFile, strerror(errno));
+        unlink(tmpPath);
+        free(tmpPath);
+        return XML_GENERIC_ERR;
+    }
+    XmlSyncDirectory(xmlFile);
+    free(tmpPath);
+    return XML_NOERR;
+}
+#endif
+
+// STREAMING WRITER
+//
+// XmlWriter produces a document on the fly, without building any tree.
+// Output goes through the same emitter used by XmlDump() (so escaping and
+// pretty-printing are the same) into a fixed-size buffer which is handed to
+// the sink each time it fills up. Without a sink the whole document is kept
+// in memory and can be obtained through XmlWriterBuffer().
+//
+#define XML_WRITER_BUFSIZE 65536
+
+typedef struct __XmlWriterElement {
+    char *name; // qualified name (prefix:name) needed to emit the end tag
+    int hasChildren;
+    int hasText;
+} XmlWriterElement;
+
+struct __XmlWriter {
+    XmlBufferEmitter be;
+    XmlWriterSink sink;
+    void *priv;
+    int fd;
+    int pretty;
+    int startOpen; // the start tag of the current element is still open
+    XmlWriterElement *stack;
+    unsigned int depth;
+    unsigned int stackSize;
+};
+
+static int
+XmlWriterFlushBuffer(XmlWriter *writer)
+{
+    if (writer->sink && writer->be.len) {
+        if (writer->sink(writer->priv, writer->be.buf, writer->be.len) != 0)
+            return XML_GENERIC_ERR;
+        writer->be.len = 0;
+    }
+    return XML_NOERR;
+}
+
+static int
+XmlWriterEmit(XmlEmitter *e, char *data, size_t len)
+{
+    XmlWriter *writer = (XmlWriter *)e;
+
+    if (writer->sink && writer->be.len + len > XML_WRITER_BUFSIZE) {
+        int rc = XmlWriterFlushBuffer(writer);
+        if (rc != XML_NOERR)
+            return rc;
+        // too big to be buffered, pass it through
+        if (len >= XML_WRITER_BUFSIZE)
+            return writer->sink(writer->priv, data, len) == 0 ? XML_NOERR : XML_GENERIC_ERR;
+    }
+    return XmlBufferEmit(e, data, len);
+}
+
+XmlWriter *
+XmlCreateWriter(XmlWriterSink sink, void *priv, int pretty)
+{
+    XmlWriter *writer = (XmlWriter *)calloc(1, sizeof(XmlWriter));
+    if (!writer)
+        return NULL;
+    XmlBufferEmitterInit(&writer->be);
+    writer->be.e.emit = XmlWriterEmit;
+    writer->sink = sink;
+    writer->priv = priv;
+    writer->fd = -1;
+    writer->pretty = pretty;
+    return writer;
+}
+
+XmlWriter *
+XmlCreateBufferWriter(int pretty)
+{
+    return XmlCreateWriter(NULL, NULL, pretty);
+}
+
+#ifndef WIN32
+static int
+XmlWriterFdSink(void *priv, char *data, size_t len)
+{
+    XmlWriter *writer = (XmlWriter *)priv;
+    if (XmlWriteAll(writer->fd, data, len) != 0) {
+        fprintf(stderr, "Can't write xml output: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+XmlWriter *
+XmlCreateFdWriter(int fd, int pretty)
+{
+    XmlWriter *writer = XmlCreateWriter(XmlWriterFdSink, NULL, pretty);
+    if (writer) {
+        writer->priv = writer;
+        writer->fd = fd;
+    }
+    return writer;
+}
+#endif
+
+void
+XmlDestroyWriter(XmlWriter *writer)
+{
+    XmlWriterFlush(writer);
+    while (writer->depth > 0)
+        free(writer->stack[--writer->depth].name);
+    if (writer->stack)
+        free(writer->stack);
+    if (writer->be.buf)
+        free(writer->be.buf);
+    free(writer);
+}
+
+XmlErr
+XmlWriterFlush(XmlWriter *writer)
+{
+    if (!writer->be.e.err)
+        writer->be.e.err = XmlWriterFlushBuffer(writer);
+    return writer->be.e.err;
+}
+
+char *
+XmlWriterBuffer(XmlWriter *writer)
+{
+    if (writer->sink) // everything has been (or will be) passed to the sink
+        return NULL;
+    return writer->be.buf ? writer->be.buf : "";
+}
+
+// prepares the current element to receive a child (an element, a comment or a cdata)
+static void
+XmlWriterStartChild(XmlWriter *writer)
+{
+    XmlWriterElement *parent;
+
+    if (!writer->depth)
+        return;
+    parent = &writer->stack[writer->depth-1];
+    if (writer->startOpen) {
+        XML_EMIT_STATIC(&writer->be.e, ">");
+        writer->startOpen = 0;
+        if (writer->pretty)
+            XML_EMIT_STATIC(&writer->be.e, "\n");
+    } else if (writer->pretty && parent->hasText && !parent->hasChildren) {
+        XML_EMIT_STATIC(&writer->be.e, "\n");
+    }
+    parent->hasChildren = 1;
+}
+
+XmlErr
+XmlWriterStartDocument(XmlWriter *writer)
+{
+    XML_EMIT_STATIC(&writer->be.e, "<?xml version=\"1.0\" encoding=\"utf-8\"?>\n");
+    return writer->be.e.err;
+}
+
+XmlErr
+XmlWriterStartElementNS(XmlWriter *writer, XmlNamespace *ns, char *name)
+{
+    XmlWriterElement *element;
+    size_t nameLen;
+
+    if (!name || !*name)
+        return XML_BADARGS;
+    if (writer->be.e.err)
+        return writer->be.e.err;
+
+    if (writer->depth == writer->stackSize) {
+        unsigned int newSize = writer->stackSize ? writer->stackSize * 2 : 16;
+        XmlWriterElement *newStack = (XmlWriterElement *)realloc(writer->stack,
+            newSize * sizeof(XmlWriterElement));
+        if (!newStack)
+            return XML_MEMORY_ERR;
+        writer->stack = newStack;
+        writer->stackSize = newSize;
+    }
+
+    element = &writer->stack[writer->depth];
+    memset(element, 0, sizeof(XmlWriterElement));
+    nameLen = strlen(name) + 1;
+    if (ns && ns->name)
+        nameLen += strlen(ns->name) + 1;
+    element->name = (char *)malloc(nameLen);
+    if (!element->name)
+        return XML_MEMORY_ERR;
+    if (ns && ns->name)
+        snprintf(element->name, nameLen, "%s:%s", ns->name, name);
+    else
+        snprintf(element->name, nameLen, "%s", name);
+
+    XmlWriterStartChild(writer);
+    if (writer->pretty)
+        XmlEmitTabs(&writer->be.e, writer->depth);
+    XML_EMIT_STATIC(&writer->be.e, "<");
+    XML_EMIT(&writer->be.e, element->name, nameLen-1);
+    writer->depth++;
+    writer->startOpen = 1;
+    return writer->be.e.err;
+}
+
+XmlErr
+XmlWriterStartElement(XmlWriter *writer, char *name)
+{
+    return XmlWriterStartElementNS(writer, NULL, name);
+}
+
+XmlErr
+XmlWriterAttribute(XmlWriter *writer, char *name, char *value)
+{
+    if (!writer->startOpen || !name || !*name) {
+        fprintf(stderr, "Attributes can be only added right after an element has been started\n");
+        return XML_BADARGS;
+    }
+    XML_EMIT_STATIC(&writer->be.e, " ");
+    XML_EMIT(&writer->be.e, name, strlen(name));
+    XML_EMIT_STATIC(&writer->be.e, "=\"");
+    if (value)
+        XmlEmitEscaped(&writer->be.e, value);
+    XML_EMIT_STATIC(&writer->be.e, "\"");
+    return writer->be.e.err;
+}
+
+XmlErr
+XmlWriterNamespace(XmlWriter *writer, XmlNamespace *ns)
+{
+    XmlErr rc;
+    char *attrName;
+    size_t nameLen;
+
+    if (!ns || !ns->uri)
+        return XML_BADARGS;
+    if (!ns->name) // default namespace
+        return XmlWriterAttribute(writer, "xmlns", ns->uri);
+    nameLen = strlen(ns->name) + 7;
+    attrName = (char *)malloc(nameLen);
+    if (!attrName)
+        return XML_MEMORY_ERR;
+    snprintf(attrName, nameLen, "xmlns:%s", ns->name);
+    rc = XmlWriterAttribute(writer, attrName, ns->uri);
+    free(attrName);
+    return rc;
+}
+
+XmlErr
+XmlWriterText(XmlWriter *writer, char *text)
+{
+    XmlWriterElement *element;
+
+    if (!writer->depth) {
+        fprintf(stderr, "Text can be only written inside an element\n");
+        return XML_BADARGS;
+    }
+    if (!text || !*text) // an empty value still produces an empty element
+        return writer->be.e.err;
+    element = &writer->stack[writer->depth-1];
+    if (writer->startOpen) {
+        XML_EMIT_STATIC(&writer->be.e, ">");
+        writer->startOpen = 0;
+    }
+    XmlEmitEscaped(&writer->be.e, text);
+    if (writer->pretty && element->hasChildren)
+        XML_EMIT_STATIC(&writer->be.e, "\n");
+    element->hasText = 1;
+    return writer->be.e.err;
+}
+
+XmlErr
+XmlWriterCData(XmlWriter *writer, char *data)
+{
+    if (!writer->depth) {
+        fprintf(stderr, "A CDATA section can be only written inside an element\n");
+        return XML_BADARGS;
+    }
+    XmlWriterStartChild(writer);
+    if (writer->pretty)
+        XmlEmitTabs(&writer->be.e, writer->depth);
+    XML_EMIT_STATIC(&writer->be.e, "<![CDATA[");
+    if (data)
+        XML_EMIT(&writer->be.e, data, strlen(data));
+    XML_EMIT_STATIC(&writer->be.e, "]]>");
+    if (writer->pretty)
+        XML_EMIT_STATIC(&writer->be.e, "\n");
+    return writer->be.e.err;
+}
+
+XmlErr
+XmlWriterComment(XmlWriter *writer, char *comment)
+{
+    XmlWriterStartChild(writer);
+    if (writer->pretty)
+        XmlEmitTabs(&writer->be.e, writer->depth);
+    XML_EMIT_STATIC(&writer->be.e, "<!--");
+    if (comment)
+        XML_EMIT(&writer->be.e, comment, strlen(comment));
+    XML_EMIT_STATIC(&writer->be.e, "-->");
+    if (writer->pretty)
+        XML_EMIT_STATIC(&writer->be.e, "\n");
+    return writer->be.e.err;
+}
+
+XmlErr
+XmlWriterEndElement(XmlWriter *writer)
+{
+    XmlWriterElement *element;
+
+    if (!writer->depth) {
+        fprintf(stderr, "No element to end\n");
+        return XML_BADARGS;
+    }
+    element = &writer->stack[--writer->depth];
+    if (writer->startOpen) {
+        XML_EMIT_STATIC(&writer->be.e, "/>");
+        writer->startOpen = 0;
+    } else {
+        if (writer->pretty && element->hasChildren)
+            XmlEmitTabs(&writer->be.e, writer->depth);
+        XML_EMIT_STATIC(&writer->be.e, "</");
+        XML_EMIT(&writer->be.e, element->name, strlen(element->name));
+        XML_EMIT_STATIC(&writer->be.e, ">");
+    }
+    if (writer->pretty)
+        XML_EMIT_STATIC(&writer->be.e, "\n");
+    free(element->name);
+    element->name = NULL;
+    return writer->be.e.err;
+}
+
+XmlErr
+XmlSave(TXml *xml, char *xmlFile)
+{
+    size_t rb;
+    struct stat fileStat;
+    FILE *saveFile = NULL;
+    char *dump = NULL;
+    size_t dumpLen = 0;
+    char *backup = NULL;
+    char *backupPath = NULL;
+    FILE *backupFile = NULL;
+#ifndef WIN32
+    int compression;
+
+    if (xml->atomicSave)
+        return XmlSaveAtomic(xml, xmlFile);
+#endif
+
+    if (stat(xmlFile, &fileStat) == 0) {
+        if(fileStat.st_size>0) { /* backup old profiles */
+            saveFile = fopen(xmlFile, "r");
+            if(!saveFile) {
+                fprintf(stderr, "Can't open %s for reading !!", xmlFile);
+                return XML_GENERIC_ERR;
+            }
+            if(XmlFileLock(saveFile, 0, xml->lockTimeout) != XML_NOERR) {
+                fprintf(stderr, "Can't lock %s for reading ", xmlFile);
+                fclose(saveFile);
+                return XML_GENERIC_ERR;
+            }
+            backup = (char *)malloc(fileStat.st_size+1);
+            rb = fread(backup, 1, fileStat.st_size, saveFile);
+            if (rb != fileStat.st_size) {
+                fprintf(stderr, "Can't read %s content", xmlFile);
+                return -1;
+            }
+            backup[fileStat.st_size] = 0;
+            XmlFileUnlock(saveFile);
+            fclose(saveFile);
+            backupPath = (char *)malloc(strlen(xmlFile)+5);
+            sprintf(backupPath, "%s.bck", xmlFile);
+            backupFile = XmlOpenForWriting(backupPath);
+            if(backupFile) {
+                if(XmlFileLock(backupFile, 1, xml->lockTimeout) != XML_NOERR ||
+                   XmlTruncateLocked(backupFile) != XML_NOERR)
+                {
+                    fprintf(stderr, "Can't lock %s for writing ", backupPath);
+                    fclose(backupFile);
+                    free(backupPath);
+                    free(backup);
+                    return XML_GENERIC_ERR;
+                }
+                fwrite(backup, 1, fileStat.st_size, backupFile);
+                XmlFileUnlock(backupFile);
+                fclose(backupFile);
+            }
+            else {
+                fprintf(stderr, "Can't open backup file (%s) for writing! ", backupPath);
+                free(backupPath);
+                free(backup);
+                return XML_GENERIC_ERR;
+            }
+            free(backupPath);
+            free(backup);
+        } /* end of backup */
+    }
+#ifndef WIN32
+    compression = XmlSaveCompression(xml, xmlFile);
+    if (compression != XML_COMPRESSION_NONE) {
+        // compressed while being written out
+        XmlErr rc;
+        saveFile = XmlOpenForWriting(xmlFile);
+        if(!saveFile) {
+            fprintf(stderr, "Can't open output file %s", xmlFile);
+            return XML_GENERIC_ERR;
+        }
+        if(XmlFileLock(saveFile, 1, xml->lockTimeout) != XML_NOERR ||
+           XmlTruncateLocked(saveFile) != XML_NOERR)
+        {
+            fprintf(stderr, "Can't lock %s for writing ", xmlFile);
+            fclose(saveFile);
+            return XML_GENERIC_ERR;
+        }
+        rc = XmlDumpFdCompressed(xml, fileno(saveFile), compression);
+        XmlFileUnlock(saveFile);
+        fclose(saveFile);
+        return rc;
+    }
+#endif
+    dump = XmlDumpSize(xml, &dumpLen);
+     if(dump && dumpLen) {
+        saveFile = XmlOpenForWriting(xmlFile);
+        if(saveFile) {
+            if(XmlFileLock(saveFile, 1, xml->lockTimeout) != XML_NOERR ||
+               XmlTruncateLocked(saveFile) != XML_NOERR)
+            {
+                fprintf(stderr, "Can't lock %s for writing ", xmlFile);
+                fclose(saveFile);
+                free(dump);
+                return XML_GENERIC_ERR;
+            }
+            fwrite(dump, 1, dumpLen, saveFile);
+            free(dump);
+            XmlFileUnlock(saveFile);
+            fclose(saveFile);
+        }
+        else {
+            fprintf(stderr, "Can't open output file %s", xmlFile);
+            if(!saveFile) {
+                free(dump);
+                return XML_GENERIC_ERR;
+            }
+        }
+    }
+    return XML_NOERR;
+}
+
+#ifndef WIN32
+//
+// SNAPSHOTS
+//
+// A snapshot is an image of the tree, laid out exactly as the library keeps
+// it in memory : the header is followed by the arrays of nodes, attributes,
+// namespaces and namespace sets and by the (deduplicated) strings.
+// All the pointers in the image are stored as if it was mapped at the
+// address recorded in the header, so if mmap() honours it the tree can be
+// used in place without touching a single page. Otherwise the image is
+// mapped privately and relocated before being made read-only again.
+//
+#define XML_SNAPSHOT_MAGIC "TXMLSNAP"
+#define XML_SNAPSHOT_VERSION 2
+#define XML_SNAPSHOT_BYTEORDER 0x01020304
+#define XML_SNAPSHOT_ALIGN(__n) (((__n) + 15) & ~((size_t)15))
+#if UINTPTR_MAX > 0xffffffff
+#define XML_SNAPSHOT_BASE ((uintptr_t)0x200000000000ULL)
+#else
+#define XML_SNAPSHOT_BASE ((uintptr_t)0) // no preferred address, always relocated
+#endif
+
+typedef struct __XmlSnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t byteOrder;
+    uint32_t pointerSize;
+    uint32_t nodeSize;
+    uint32_t attributeSize;
+    uint32_t namespaceSize;
+    uint32_t namespaceSetSize;
+    uint32_t unused;
+    uint64_t size; // of the whole image
+    uint64_t base; // address the pointers in the image refer to
+    // offsets of the sections from the beginning of the image
+    uint64_t nodes;
+    uint64_t numNodes;
+    uint64_t attributes;
+    uint64_t numAttributes;
+    uint64_t namespaces;
+    uint64_t numNamespaces;
+    uint64_t namespaceSets;
+    uint64_t numNamespaceSets;
+    uint64_t strings;
+    uint64_t stringsSize;
+    uint64_t head; // 0 if the document has no head
+    char documentEncoding[64];
+    struct nodelistHead rootElements;
+} XmlSnapshotHeader;
+
+// maps the namespaces of the document to their copies in the image
+typedef struct __XmlSnapshotNsMap {
+    XmlNamespace **keys;
+    XmlNamespace **values;
+    size_t size; // always a power of 2
+    size_t count;
+} XmlSnapshotNsMap;
+
+typedef struct __XmlSnapshotBuilder {
+    char *image;
+    size_t imageSize; // as mapped (the image itself can be smaller)
+    XmlSnapshotHeader *header;
+    XmlNode *nodes;
+    size_t numNodes;
+    XmlNodeAttribute *attributes;
+    size_t numAttributes;
+    XmlNamespace *namespaces;
+    size_t numNamespaces;
+    XmlNamespaceSet *namespaceSets;
+    size_t numNamespaceSets;
+    char *strings;
+    size_t stringsSize;
+    size_t maxStrings; // number of strings referenced by the tree
+    size_t maxStringsSize; // their size if none of them is a duplicate
+    char **stringTable; // open addressing set of the strings already copied
+    size_t stringTableSize;
+    XmlSnapshotNsMap nsMap;
+} XmlSnapshotBuilder;
+
+#define XML_SNAPSHOT_HASH_PTR(__p) ((size_t)(((uintptr_t)(__p) >> 3) * 2654435761U))
+
+static XmlNamespace **
+XmlSnapshotNsSlot(XmlSnapshotNsMap *map, XmlNamespace *ns)
+{
+    size_t i = XML_SNAPSHOT_HASH_PTR(ns) & (map->size - 1);
+    while (map->keys[i] && map->keys[i] != ns)
+        i = (i + 1) & (map->size - 1);
+    return &map->keys[i];
+}
+
+// returns 1 if ns wasn't known yet, 0 if it was, -1 on memory errors
+static int
+XmlSnapshotNsAdd(XmlSnapshotNsMap *map, XmlNamespace *ns)
+{
+    XmlNamespace **slot;
+
+    if ((map->count + 1) * 2 > map->size) {
+        XmlSnapshotNsMap grown;
+        size_t i;
+        grown.size = map->size ? map->size * 2 : 64;
+        grown.count = map->count;
+        grown.keys = (XmlNamespace **)calloc(grown.size, sizeof(XmlNamespace *));
+        grown.values = (XmlNamespace **)calloc(grown.size, sizeof(XmlNamespace *));
+        if (!grown.keys || !grown.values) {
+            free(grown.keys);
+            free(grown.values);
+            return -1;
+        }
+        for (i = 0; i < map->size; i++) {
+            if (map->keys[i]) {
+                slot = XmlSnapshotNsSlot(&grown, map->keys[i]);
+                *slot = map->keys[i];
+                grown.values[slot - grown.keys] = map->values[i];
+            }
+        }
+        free(map->keys);
+        free(map->values);
+        *map = grown;
+    }
+    slot = XmlSnapshotNsSlot(map, ns);
+    if (*slot)
+        return 0;
+    *slot = ns;
+    map->count++;
+    return 1;
+}
+
+static XmlErr
+XmlSnapshotCountNamespace(XmlSnapshotBuilder *b, XmlNamespace *ns)
+{
+    int rc;
+    if (!ns)
+        return XML_NOERR;
+    rc = XmlSnapshotNsAdd(&b->nsMap, ns);
+    if (rc < 0)
+        return XML_MEMORY_ERR;
+    if (rc) {
+        b->numNamespaces++;
+        b->maxStrings += 2;
+        b->maxStringsSize += (ns->name ? strlen(ns->name) + 1 : 0) + (ns->uri ? strlen(ns->uri) + 1 : 0);
+    }
+    return XML_NOERR;
+}
+
+#define XML_SNAPSHOT_COUNT_STRING(__b, __s) do {\
+    if (__s) {\
+        (__b)->maxStrings++;\
+        (__b)->maxStringsSize += strlen(__s) + 1;\
+    }\
+} while (0)
+
+// first pass : find out how big the image can be
+static XmlErr
+XmlSnapshotCount(XmlSnapshotBuilder *b, XmlNode *node)
+{
+    XmlNode *child;
+    XmlNodeAttribute *attr;
+    XmlNamespace *ns;
+    XmlNamespaceSet *item;
+
+    b->numNodes++;
+    XML_SNAPSHOT_COUNT_STRING(b, node->path);
+    XML_SNAPSHOT_COUNT_STRING(b, node->name);
+    XML_SNAPSHOT_COUNT_STRING(b, node->value);
+    TAILQ_FOREACH(attr, &node->attributes, list) {
+        b->numAttributes++;
+        XML_SNAPSHOT_COUNT_STRING(b, attr->name);
+        XML_SNAPSHOT_COUNT_STRING(b, attr->value);
+    }
+    TAILQ_FOREACH(ns, &node->namespaces, list) {
+        if (XmlSnapshotCountNamespace(b, ns) != XML_NOERR)
+            return XML_MEMORY_ERR;
+    }
+    TAILQ_FOREACH(item, &node->knownNamespaces, next) {
+        b->numNamespaceSets++;
+        if (XmlSnapshotCountNamespace(b, item->ns) != XML_NOERR)
+            return XML_MEMORY_ERR;
+    }
+    if (XmlSnapshotCountNamespace(b, node->ns) != XML_NOERR ||
+        XmlSnapshotCountNamespace(b, node->cns) != XML_NOERR ||
+        XmlSnapshotCountNamespace(b, node->hns) != XML_NOERR)
+    {
+        return XML_MEMORY_ERR;
+    }
+    TAILQ_FOREACH(child, &node->children, siblings) {
+        if (XmlSnapshotCount(b, child) != XML_NOERR)
+            return XML_MEMORY_ERR;
+    }
+    return XML_NOERR;
+}
+
+// copies a string in the image (or returns the copy made earlier)
+static char *
+XmlSnapshotString(XmlSnapshotBuilder *b, char *str)
+{
+    size_t hash = 2166136261U; // FNV-1a
+    size_t len, i;
+    char *copy;
+
+    if (!str)
+        return NULL;
+    for (len = 0; str[len]; len++)
+        hash = (hash ^ (unsigned char)str[len]) * 16777619U;
+    i = hash & (b->stringTableSize - 1);
+    while (b->stringTable[i]) {
+        if (strcmp(b->stringTable[i], str) == 0)
+            return b->stringTable[i];
+        i = (i + 1) & (b->stringTableSize - 1);
+    }
+    copy = b->strings + b->stringsSize;
+    memcpy(copy, str, len + 1);
+    b->stringsSize += len + 1;
+    b->stringTable[i] = copy;
+    return copy;
+}
+
+static XmlNamespace *
+XmlSnapshotNamespace(XmlSnapshotBuilder *b, XmlNamespace *ns)
+{
+    XmlNamespace **slot;
+    XmlNamespace **value;
+
+    if (!ns)
+        return NULL;
+    slot = XmlSnapshotNsSlot(&b->nsMap, ns); // all of them have been added while counting
+    value = &b->nsMap.values[slot - b->nsMap.keys];
+    if (!*value) {
+        *value = &b->namespaces[b->numNamespaces++];
+        (*value)->name = XmlSnapshotString(b, ns->name);
+        (*value)->uri = XmlSnapshotString(b, ns->uri);
+    }
+    return *value;
+}
+
+// second pass : copy the branch in the image (in pre-order)
+static XmlNode *
+XmlSnapshotCopyNode(XmlSnapshotBuilder *b, XmlNode *node, XmlNode *parent)
+{
+    XmlNode *copy = &b->nodes[b->numNodes++];
+    XmlNode *child;
+    XmlNodeAttribute *attr;
+    XmlNamespace *ns;
+    XmlNamespaceSet *item;
+
+    copy->path = XmlSnapshotString(b, node->path);
+    copy->name = XmlSnapshotString(b, node->name);
+    copy->value = XmlSnapshotString(b, node->value);
+    copy->parent = parent;
+    copy->type = node->type;
+    copy->cacheState = XML_CACHE_NONE;
+    copy->readOnly = 1;
+    // the copies are made in pre-order, so the nodes of the image are numbered already
+    copy->order = b->numNodes;
+    copy->depth = parent ? parent->depth + 1 : 0;
+    TAILQ_INIT(&copy->children);
+    TAILQ_INIT(&copy->attributes);
+    TAILQ_INIT(&copy->knownNamespaces);
+    TAILQ_INIT(&copy->namespaces);
+
+    TAILQ_FOREACH(ns, &node->namespaces, list) {
+        XmlNamespace *nsCopy = XmlSnapshotNamespace(b, ns);
+        TAILQ_INSERT_TAIL(&copy->namespaces, nsCopy, list);
+    }
+    copy->ns = XmlSnapshotNamespace(b, node->ns);
+    copy->cns = XmlSnapshotNamespace(b, node->cns);
+    copy->hns = XmlSnapshotNamespace(b, node->hns);
+    TAILQ_FOREACH(item, &node->knownNamespaces, next) {
+        XmlNamespaceSet *itemCopy = &b->namespaceSets[b->numNamespaceSets++];
+        itemCopy->ns = XmlSnapshotNamespace(b, item->ns);
+        TAILQ_INSERT_TAIL(&copy->knownNamespaces, itemCopy, next);
+    }
+    TAILQ_FOREACH(attr, &node->attributes, list) {
+        XmlNodeAttribute *attrCopy = &b->attributes[b->numAttributes++];
+        attrCopy->name = XmlSnapshotString(b, attr->name);
+        attrCopy->value = XmlSnapshotString(b, attr->value);
+        attrCopy->node = copy;
+        TAILQ_INSERT_TAIL(&copy->attributes, attrCopy, list);
+    }
+    TAILQ_FOREACH(child, &node->children, siblings) {
+        XmlNode *childCopy = XmlSnapshotCopyNode(b, child, copy);
+        TAILQ_INSERT_TAIL(&copy->children, childCopy, siblings);
+    }
+    copy->descendants = b->numNodes - copy->order;
+    return copy;
+}
+
+typedef struct __XmlSnapshotReloc {
+    uintptr_t lo; // the range the pointers must fall in
+    uintptr_t hi;
+    uintptr_t delta; // added to all of them (modulo the size of a pointer)
+} XmlSnapshotReloc;
+
+// with a null delta the pointers are only checked (the image can be read-only)
+#define XML_SNAPSHOT_FIX(__p, __r) do {\
+    if (__p) {\
+        uintptr_t __a = (uintptr_t)(__p);\
+        if (__a < (__r)->lo || __a >= (__r)->hi)\
+            return XML_GENERIC_ERR;\
+        if ((__r)->delta)\
+            (__p) = (void *)(__a + (__r)->delta);\
+    }\
+} while (0)
+
+#define XML_SNAPSHOT_FIX_HEAD(__h, __r) do {\
+    XML_SNAPSHOT_FIX((__h)->tqh_first, __r);\
+    XML_SNAPSHOT_FIX((__h)->tqh_last, __r);\
+} while (0)
+
+#define XML_SNAPSHOT_FIX_ENTRY(__e, __r) do {\
+    XML_SNAPSHOT_FIX((__e)->tqe_next, __r);\
+    XML_SNAPSHOT_FIX((__e)->tqe_prev, __r);\
+} while (0)
+
+// moves all the pointers in the image, checking that none of them points
+// outside of it (the sections have already been checked by the caller)
+static XmlErr
+XmlSnapshotRelocate(char *image, XmlSnapshotReloc *r)
+{
+    XmlSnapshotHeader *header = (XmlSnapshotHeader *)image;
+    XmlNode *node = (XmlNode *)(image + header->nodes);
+    XmlNodeAttribute *attr = (XmlNodeAttribute *)(image + header->attributes);
+    XmlNamespace *ns = (XmlNamespace *)(image + header->namespaces);
+    XmlNamespaceSet *item = (XmlNamespaceSet *)(image + header->namespaceSets);
+    uint64_t i;
+
+    XML_SNAPSHOT_FIX_HEAD(&header->rootElements, r);
+    for (i = 0; i < header->numNodes; i++, node++) {
+        XML_SNAPSHOT_FIX(node->path, r);
+        XML_SNAPSHOT_FIX(node->name, r);
+        XML_SNAPSHOT_FIX(node->parent, r);
+        XML_SNAPSHOT_FIX(node->value, r);
+        XML_SNAPSHOT_FIX_HEAD(&node->children, r);
+        XML_SNAPSHOT_FIX_HEAD(&node->attributes, r);
+        XML_SNAPSHOT_FIX(node->ns, r);
+        XML_SNAPSHOT_FIX(node->cns, r);
+        XML_SNAPSHOT_FIX(node->hns, r);
+        XML_SNAPSHOT_FIX_HEAD(&node->knownNamespaces, r);
+        XML_SNAPSHOT_FIX_HEAD(&node->namespaces, r);
+        XML_SNAPSHOT_FIX_ENTRY(&node->siblings, r);
+        if (node->context) // always NULL in a snapshot
+            return XML_GENERIC_ERR;
+    }
+    for (i = 0; i < header->numAttributes; i++, attr++) {
+        XML_SNAPSHOT_FIX(attr->name, r);
+        XML_SNAPSHOT_FIX(attr->value, r);
+        XML_SNAPSHOT_FIX(attr->node, r);
+        XML_SNAPSHOT_FIX_ENTRY(&attr->list, r);
+    }
+    for (i = 0; i < header->numNamespaces; i++, ns++) {
+        XML_SNAPSHOT_FIX(ns->name, r);
+        XML_SNAPSHOT_FIX(ns->uri, r);
+        XML_SNAPSHOT_FIX_ENTRY(&ns->list, r);
+    }
+    for (i = 0; i < header->numNamespaceSets; i++, item++) {
+        XML_SNAPSHOT_FIX(item->ns, r);
+        XML_SNAPSHOT_FIX_ENTRY(&item->next, r);
+    }
+    return XML_NOERR;
+}
+
+static void
+XmlSnapshotBuilderFree(XmlSnapshotBuilder *b)
+{
+    if (b->image)
+        munmap(b->image, b->imageSize);
+    if (b->stringTable)
+        free(b->stringTable);
+    if (b->nsMap.keys)
+        free(b->nsMap.keys);
+    if (b->nsMap.values)
+        free(b->nsMap.values);
+}
+
+// builds the image in memory, with the pointers referring to the preferred
+// base address of snapshots (or to the image itself, if inPlace is set)
+static XmlErr
+XmlSnapshotBuild(TXml *xml, XmlSnapshotBuilder *b, int inPlace)
+{
+    XmlSnapshotHeader layout;
+    XmlSnapshotHeader *header;
+    XmlSnapshotReloc r;
+    XmlNode *rNode;
+    size_t size;
+
+    memset(&layout, 0, sizeof(layout));
+    TAILQ_FOREACH(rNode, &xml->rootElements, siblings) {
+        if (XmlSnapshotCount(b, rNode) != XML_NOERR)
+            return XML_MEMORY_ERR;
+    }
+    XML_SNAPSHOT_COUNT_STRING(b, xml->head);
+
+    header = &layout; // just to compute the offsets of the sections
+    header->nodes = XML_SNAPSHOT_ALIGN(sizeof(XmlSnapshotHeader));
+    header->attributes = XML_SNAPSHOT_ALIGN(header->nodes + b->numNodes * sizeof(XmlNode));
+    header->namespaces = XML_SNAPSHOT_ALIGN(header->attributes + b->numAttributes * sizeof(XmlNodeAttribute));
+    header->namespaceSets = XML_SNAPSHOT_ALIGN(header->namespaces + b->numNamespaces * sizeof(XmlNamespace));
+    header->strings = XML_SNAPSHOT_ALIGN(header->namespaceSets + b->numNamespaceSets * sizeof(XmlNamespaceSet));
+    size = header->strings + b->maxStringsSize;
+
+    // mapped rather than malloc()ed, so that frozen documents can be protected
+    b->image = (char *)mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (b->image == MAP_FAILED)
+        b->image = NULL;
+    else
+        b->imageSize = size;
+    for (b->stringTableSize = 64; b->stringTableSize < b->maxStrings * 2; b->stringTableSize *= 2)
+        ;
+    b->stringTable = (char **)calloc(b->stringTableSize, sizeof(char *));
+    if (!b->image || !b->stringTable) {
+        fprintf(stderr, "Can't allocate %lu bytes for the snapshot\n", (unsigned long)size);
+        return XML_MEMORY_ERR;
+    }
+    b->header = (XmlSnapshotHeader *)b->image;
+    *b->header = layout;
+    header = b->header;
+    b->nodes = (XmlNode *)(b->image + header->nodes);
+    b->attributes = (XmlNodeAttribute *)(b->image + header->attributes);
+    b->namespaces = (XmlNamespace *)(b->image + header->namespaces);
+    b->namespaceSets = (XmlNamespaceSet *)(b->image + header->namespaceSets);
+    b->strings = b->image + header->strings;
+
+    memcpy(header->magic, XML_SNAPSHOT_MAGIC, sizeof(header->magic));
+    header->version = XML_SNAPSHOT_VERSION;
+    header->byteOrder = XML_SNAPSHOT_BYTEORDER;
+    header->pointerSize = sizeof(void *);
+    header->nodeSize = sizeof(XmlNode);
+    header->attributeSize = sizeof(XmlNodeAttribute);
+    header->namespaceSize = sizeof(XmlNamespace);
+    header->namespaceSetSize = sizeof(XmlNamespaceSet);
+    header->base = inPlace ? (uintptr_t)b->image : XML_SNAPSHOT_BASE;
+    header->numNodes = b->numNodes;
+    header->numAttributes = b->numAttributes;
+    header->numNamespaces = b->numNamespaces;
+    header->numNamespaceSets = b->numNamespaceSets;
+    snprintf(header->documentEncoding, sizeof(header->documentEncoding), "%s", xml->documentEncoding);
+
+    // counted again while copying
+    b->numNodes = b->numAttributes = b->numNamespaces = b->numNamespaceSets = 0;
+    if (xml->head)
+        header->head = XmlSnapshotString(b, xml->head) - b->image;
+    TAILQ_INIT(&header->rootElements);
+    TAILQ_FOREACH(rNode, &xml->rootElements, siblings) {
+        XmlNode *copy = XmlSnapshotCopyNode(b, rNode, NULL);
+        TAILQ_INSERT_TAIL(&header->rootElements, copy, siblings);
+    }
+
+    header->stringsSize = b->stringsSize;
+    header->size = header->strings + b->stringsSize;
+    if (inPlace)
+        return XML_NOERR;
+
+    r.lo = (uintptr_t)b->image;
+    r.hi = r.lo + header->size;
+    r.delta = header->base - r.lo;
+    return XmlSnapshotRelocate(b->image, &r);
+}
+
+XmlErr
+XmlSaveSnapshot(TXml *xml, char *path)
+{
+    XmlSnapshotBuilder b;
+    char *tmpPath;
+    int fd = -1;
+    int tries;
+    XmlErr rc;
+
+    memset(&b, 0, sizeof(b));
+    rc = XmlSnapshotBuild(xml, &b, 0);
+    if (rc != XML_NOERR) {
+        XmlSnapshotBuilderFree(&b);
+        return rc;
+    }
+
+    // processes may have the current snapshot mapped, and truncating it
+    // would make them crash : the new one replaces it through rename()
+    tmpPath = (char *)malloc(strlen(path)+32);
+    for (tries = 0; tries < 16 && fd == -1; tries++) {
+        sprintf(tmpPath, "%s.%d.%d.tmp", path, (int)getpid(), tries);
+        fd = open(tmpPath, O_WRONLY|O_CREAT|O_EXCL, 0666);
+        if (fd == -1 && errno != EEXIST)
+            break;
+    }
+    if (fd == -1) {
+        fprintf(stderr, "Can't create temporary file %s: %s\n", tmpPath, strerror(errno));
+        XmlSnapshotBuilderFree(&b);
+        free(tmpPath);
+        return XML_OPEN_FILE_ERR;
+    }
+    if (XmlWriteAll(fd, b.image, b.header->size) != 0 || fsync(fd) != 0) {
+        fprintf(stderr, "Can't write %s: %s\n", tmpPath, strerror(errno));
+        close(fd);
+        unlink(tmpPath);
+        XmlSnapshotBuilderFree(&b);
+        free(tmpPath);
+        return XML_GENERIC_ERR;
+    }
+    if (close(fd) != 0) { // the descriptor is released anyway
+        fprintf(stderr, "Can't write %s: %s\n", tmpPath, strerror(errno));
+        unlink(tmpPath);
+        XmlSnapshotBuilderFree(&b);
+        free(tmpPath);
+        return XML_GENERIC_ERR;
+    }
+    XmlSnapshotBuilderFree(&b);
+    if (rename(tmpPath, path) != 0) {
+        fprintf(stderr, "Can't rename %s to %s: %s\n", tmpPath, path, strerror(errno));
+        unlink(tmpPath);
+        free(tmpPath);
+        return XML_GENERIC_ERR;
+    }
+    free(tmpPath);
+    return XML_NOERR;
+}
+
+// checks that a section lies within the image
+#define XML_SNAPSHOT_SECTION_OK(__h, __off, __num, __size) \
+    ((__off) >= sizeof(XmlSnapshotHeader) && (__off) <= (__h)->size && \
+     (__num) <= ((__h)->size - (__off)) / (__size))
+
+static XmlErr
+XmlSnapshotCheckHeader(XmlSnapshotHeader *header, struct stat *st)
+{
+    if (memcmp(header->magic, XML_SNAPSHOT_MAGIC, sizeof(header->magic)) != 0)
+        return XML_GENERIC_ERR;
+    if (header->version != XML_SNAPSHOT_VERSION ||
+        header->byteOrder != XML_SNAPSHOT_BYTEORDER ||
+        header->pointerSize != sizeof(void *) ||
+        header->nodeSize != sizeof(XmlNode) ||
+        header->attributeSize != sizeof(XmlNodeAttribute) ||
+        header->namespaceSize != sizeof(XmlNamespace) ||
+        header->namespaceSetSize != sizeof(XmlNamespaceSet))
+    {
+        return XML_GENERIC_ERR;
+    }
+    if (header->size != (uint64_t)st->st_size || header->size > SIZE_MAX)
+        return XML_GENERIC_ERR;
+    if (!XML_SNAPSHOT_SECTION_OK(header, header->nodes, header->numNodes, sizeof(XmlNode)) ||
+        !XML_SNAPSHOT_SECTION_OK(header, header->attributes, header->numAttributes, sizeof(XmlNodeAttribute)) ||
+        !XML_SNAPSHOT_SECTION_OK(header, header->namespaces, header->numNamespaces, sizeof(XmlNamespace)) ||
+        !XML_SNAPSHOT_SECTION_OK(header, header->namespaceSets, header->numNamespaceSets, sizeof(XmlNamespaceSet)) ||
+        !XML_SNAPSHOT_SECTION_OK(header, header->strings, header->stringsSize, 1))
+    {
+        return XML_GENERIC_ERR;
+    }
+    if (header->head && (header->head < header->strings || header->head >= header->size))
+        return XML_GENERIC_ERR;
+    if (!memchr(header->documentEncoding, 0, sizeof(header->documentEncoding)))
+        return XML_GENERIC_ERR;
+    return XML_NOERR;
+}
+
+// replaces the document with the tree in the image (which is munmap()ed
+// by XmlResetContext())
+static void
+XmlSnapshotInstall(TXml *xml, char *map, size_t mapSize)
+{
+    XmlSnapshotHeader *image = (XmlSnapshotHeader *)map;
+
+    XmlResetContext(xml);
+    xml->snapshot = map;
+    xml->snapshotSize = mapSize;
+    if (TAILQ_EMPTY(&image->rootElements)) {
+        TAILQ_INIT(&xml->rootElements);
+    } else {
+        // the root elements still point back to the head in the image,
+        // which stays consistent since the document can't be modified
+        xml->rootElements.tqh_first = image->rootElements.tqh_first;
+        xml->rootElements.tqh_last = image->rootElements.tqh_last;
+    }
+    if (image->head)
+        xml->head = strdup(map + image->head);
+    XmlSetDocumentEncoding(xml, image->documentEncoding);
+    xml->readOnly = 1;
+    xml->numbered = XML_ORDER_VALID; // see XmlSnapshotCopyNode()
+    if (xml->index) {
+        XmlNode *rNode;
+        TAILQ_FOREACH(rNode, &xml->rootElements, siblings)
+            XmlIndexBranch(xml->index, rNode, 1);
+    }
+}
+
+XmlErr
+XmlLoadSnapshot(TXml *xml, char *path)
+{
+    XmlSnapshotHeader header;
+    XmlSnapshotReloc r;
+    struct stat st;
+    void *map;
+    ssize_t rb;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        fprintf(stderr, "Can't open snapshot %s: %s\n", path, strerror(errno));
+        return XML_OPEN_FILE_ERR;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(header) ||
+        (rb = pread(fd, &header, sizeof(header), 0)) != sizeof(header) ||
+        XmlSnapshotCheckHeader(&header, &st) != XML_NOERR)
+    {
+        fprintf(stderr, "%s is not a valid snapshot\n", path);
+        close(fd);
+        return XML_GENERIC_ERR;
+    }
+
+    r.lo = header.base;
+    r.hi = r.lo + header.size;
+    r.delta = 0;
+    map = mmap((void *)(uintptr_t)header.base, header.size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map != MAP_FAILED && map != (void *)(uintptr_t)header.base) {
+        // the preferred address is taken, the image must be relocated
+        munmap(map, header.size);
+        map = mmap(NULL, header.size, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED)
+            r.delta = (uintptr_t)map - r.lo;
+    }
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Can't map snapshot %s: %s\n", path, strerror(errno));
+        return XML_MEMORY_ERR;
     }
-    if (outlen) // check if we need to report the output size
-        *outlen = strlen(dump);
-#ifdef USE_ICONV
-    if (doConversion) {
-        iconv_t ich;
-        size_t ilen, olen, cb;
-        char *out;
-        char *iconvIn;
-        char *iconvOut;
-        ilen = strlen(dump);
-        // the most expensive conversion would be from ascii to utf-32/ucs-4
-        // ( 4 bytes for each char )
-        olen = ilen * 4; 
-        // we still don't know how big the output buffer is going to be
-        // we will update outlen later once iconv tell us the size
-        if (outlen) 
-            *outlen = olen;
-        out = (char *)calloc(1, olen);
-        ich = iconv_open (xml->outputEncoding, xml->documentEncoding);
-        if (ich == (iconv_t)(-1)) {
-            free(dump);
-            free(out);
-            fprintf(stderr, "Can't init iconv: %s\n", strerror(errno));
-            return NULL;
-        }
-        iconvIn = dump;
-        iconvOut = out;
-        cb = iconv(ich, &iconvIn, &ilen, &iconvOut, &olen);
-        if (cb == -1) {
-            free(dump);
-            free(out);
-            fprintf(stderr, "Error from iconv: %s\n", strerror(errno));
-            return NULL;
-        }
-        iconv_close(ich);
-        free(dump); // release the old buffer (in the original encoding)
-        dump = out;
-        if (outlen) // update the outputsize if we have to
-            *outlen -= olen;
+    // the pointers are checked even if the image needs no relocation
+    if (XmlSnapshotRelocate((char *)map, &r) != XML_NOERR) {
+        fprintf(stderr, "%s is not a valid snapshot\n", path);
+        munmap(map, header.size);
+        return XML_GENERIC_ERR;
     }
-#endif
-    return(dump);
+    if (r.delta)
+        mprotect(map, header.size, PROT_READ);
+
+    XmlSnapshotInstall(xml, (char *)map, header.size);
+    return XML_NOERR;
 }
 
 XmlErr
-XmlSave(TXml *xml, char *xmlFile)
+XmlFreeze(TXml *xml)
 {
-    size_t rb;
-    struct stat fileStat;
-    FILE *saveFile = NULL;
-    char *dump = NULL;
-    int dumpLen = 0;
-    char *backup = NULL;
-    char *backupPath = NULL;
-    FILE *backupFile = NULL;
+    XmlSnapshotBuilder b;
+    size_t used;
+    XmlErr rc;
 
+    if (xml->readOnly) // already frozen (or loaded from a snapshot)
+        return XML_NOERR;
 
-    if (stat(xmlFile, &fileStat) == 0) {
-        if(fileStat.st_size>0) { /* backup old profiles */
-            saveFile = fopen(xmlFile, "r");
-            if(!saveFile) {
-                fprintf(stderr, "Can't open %s for reading !!", xmlFile);
-                return XML_GENERIC_ERR;
-            }
-            if(XmlFileLock(saveFile) != XML_NOERR) {
-                fprintf(stderr, "Can't lock %s for reading ", xmlFile);
-                return XML_GENERIC_ERR;
-            }
-            backup = (char *)malloc(fileStat.st_size+1);
-            rb = fread(backup, 1, fileStat.st_size, saveFile);
-            if (rb != fileStat.st_size) {
-                fprintf(stderr, "Can't read %s content", xmlFile);
-                return -1;
-            }
-            backup[fileStat.st_size] = 0;
-            XmlFileUnlock(saveFile);
-            fclose(saveFile);
-            backupPath = (char *)malloc(strlen(xmlFile)+5);
-            sprintf(backupPath, "%s.bck", xmlFile);
-            backupFile = fopen(backupPath, "w+");
-            if(backupFile) {
-                if(XmlFileLock(backupFile) != XML_NOERR) {
-                    fprintf(stderr, "Can't lock %s for writing ", backupPath);
-                    free(backupPath);
-                    free(backup);
-                    return XML_GENERIC_ERR;
-                }
-                fwrite(backup, 1, fileStat.st_size, backupFile);
-                XmlFileUnlock(backupFile);
-                fclose(backupFile);
-            }
-            else {
-                fprintf(stderr, "Can't open backup file (%s) for writing! ", backupPath);
-                free(backupPath);
-                free(backup);
-                return XML_GENERIC_ERR;
-            }
-            free(backupPath);
-            free(backup);
-        } /* end of backup */
+    memset(&b, 0, sizeof(b));
+    rc = XmlSnapshotBuild(xml, &b, 1);
+    if (rc != XML_NOERR) {
+        XmlSnapshotBuilderFree(&b);
+        return rc;
     }
-    dump = XmlDump(xml, &dumpLen);
-     if(dump && dumpLen) {
-        saveFile = fopen(xmlFile, "w+");
-        if(saveFile) {
-            if(XmlFileLock(saveFile) != XML_NOERR) {
-                fprintf(stderr, "Can't lock %s for writing ", xmlFile);
-                free(dump);
-                return XML_GENERIC_ERR;
-            }
-            fwrite(dump, 1, dumpLen, saveFile);
-            free(dump);
-            XmlFileUnlock(saveFile);
-            fclose(saveFile);
-        }
-        else {
-            fprintf(stderr, "Can't open output file %s", xmlFile);
-            if(!saveFile) {
-                free(dump);
-                return XML_GENERIC_ERR;
-            }
-        }
+    // give back the pages reserved for the strings which were duplicates
+    used = b.header->size + getpagesize() - 1;
+    used -= used % getpagesize();
+    if (used < b.imageSize) {
+        munmap(b.image + used, b.imageSize - used);
+        b.imageSize = used;
+    }
+    mprotect(b.image, b.imageSize, PROT_READ);
+    XmlSnapshotInstall(xml, b.image, b.imageSize);
+    b.image = NULL; // owned by the context now
+    XmlSnapshotBuilderFree(&b);
+    return XML_NOERR;
+}
+
+//
+// PUBLISHING
+//
+// Readers pin the current version by bumping its reference count. Loading
+// the pointer and bumping the count must look atomic to the writer, which
+// could otherwise release the version in between : readers announce
+// themselves in one of two counters (selected by the epoch) while doing it.
+// XmlPublish() flips the epoch and waits for the readers which announced
+// themselves in the previous one before dropping its own reference to the
+// replaced version. Readers never wait, the writer only waits for the pins
+// in progress (not for the versions still pinned, which are released by
+// the last XmlUnpin()).
+//
+struct __XmlPublisher {
+    TXml *current;
+    unsigned long version;
+    int epoch;
+    int readers[2];
+    char publishing; // serializes XmlPublish() calls
+};
+
+XmlPublisher *
+XmlCreatePublisher()
+{
+    return (XmlPublisher *)calloc(1, sizeof(XmlPublisher));
+}
+
+void
+XmlDestroyPublisher(XmlPublisher *pub)
+{
+    XmlPublish(pub, NULL); // the current version lives until it's unpinned
+    free(pub);
+}
+
+XmlErr
+XmlPublish(XmlPublisher *pub, TXml *xml)
+{
+    TXml *old;
+    int epoch;
+
+    if (xml) {
+        // readers must not modify the document, not even the dump cache
+        XmlErr rc = XmlFreeze(xml);
+        if (rc != XML_NOERR)
+            return rc;
+        xml->pins = 1; // held by the publisher
     }
+
+    while (__atomic_test_and_set(&pub->publishing, __ATOMIC_ACQUIRE))
+        sched_yield();
+    old = __atomic_exchange_n(&pub->current, xml, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&pub->version, 1, __ATOMIC_SEQ_CST);
+    epoch = pub->epoch; // only changed here
+    __atomic_store_n(&pub->epoch, !epoch, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&pub->readers[epoch], __ATOMIC_SEQ_CST))
+        sched_yield();
+    __atomic_clear(&pub->publishing, __ATOMIC_RELEASE);
+
+    XmlUnpin(old);
     return XML_NOERR;
 }
 
+TXml *
+XmlPin(XmlPublisher *pub)
+{
+    TXml *xml;
+    int epoch;
+
+    for (;;) {
+        epoch = __atomic_load_n(&pub->epoch, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&pub->readers[epoch], 1, __ATOMIC_SEQ_CST);
+        // if the epoch has been flipped meanwhile, the writer could have
+        // already checked the counter we used
+        if (__atomic_load_n(&pub->epoch, __ATOMIC_SEQ_CST) == epoch)
+            break;
+        __atomic_sub_fetch(&pub->readers[epoch], 1, __ATOMIC_SEQ_CST);
+    }
+    xml = __atomic_load_n(&pub->current, __ATOMIC_SEQ_CST);
+    if (xml)
+        __atomic_add_fetch(&xml->pins, 1, __ATOMIC_SEQ_CST);
+    __atomic_sub_fetch(&pub->readers[epoch], 1, __ATOMIC_SEQ_CST);
+    return xml;
+}
+
+void
+XmlUnpin(TXml *xml)
+{
+    if (xml && __atomic_sub_fetch(&xml->pins, 1, __ATOMIC_ACQ_REL) == 0)
+        XmlDestroyContext(xml);
+}
+
+unsigned long
+XmlPublisherVersion(XmlPublisher *pub)
+{
+    return __atomic_load_n(&pub->version, __ATOMIC_SEQ_CST);
+}
+#endif
+
 unsigned long
 XmlCountAttributes(XmlNode *node)
 {
@@ -1813,10 +6227,15 @@ XmlRemoveBranch(TXml *xml, unsigned long index)
 {
     int count = 0;
     XmlNode *branch, *tmp;
+    if (xml->readOnly)
+        return XML_UPDATE_ERR;
     TAILQ_FOREACH_SAFE(branch, &xml->rootElements, siblings, tmp) {
         if (count++ == index) {
             TAILQ_REMOVE(&xml->rootElements, branch, siblings);
+            if (xml->index)
+                XmlIndexBranch(xml->index, branch, 0);
             XmlDestroyNode(branch);
+            xml->numbered = XML_ORDER_STALE;
             return XML_NOERR;
         }
     }
@@ -1839,179 +6258,421 @@ XmlNode
     return NULL;
 }
 
-/* XXX - if multiple children shares the same name, only the first is returned */
+// Path lookups never copy nor modify the strings they get and don't allocate
+// any memory, so that they can be used concurrently on read-only documents.
+// A name can be followed by a predicate selecting either the n-th child with
+// that name (name[n], 1-based) or the children having an attribute, possibly
+// with the given value (name[@attr] or name[@attr='value']).
+typedef struct __XmlPathStep {
+    char *name;
+    size_t nameLen;
+    int hasIndex;
+    long index; // 0-based (only if hasIndex)
+    char *attrName;
+    size_t attrNameLen;
+    char *attrVal;
+    size_t attrValLen;
+    int decoded; // attrVal has been already dexmlized (by XmlCompilePath())
+} XmlPathStep;
+
+static void
+XmlParsePathStep(char *name, size_t nameLen, XmlPathStep *step)
+{
+    char *p;
+
+    memset(step, 0, sizeof(XmlPathStep));
+    if (nameLen && name[nameLen-1] == ']' && (p = memchr(name, '[', nameLen))) {
+        char *predicate = p + 1;
+        size_t predicateLen = name + nameLen - 1 - predicate; // without the ']'
+        char *end;
+
+        nameLen = p - name;
+        step->index = strtol(predicate, &end, 10);
+        if (end != predicate && end <= predicate + predicateLen) {
+            step->hasIndex = 1;
+            step->index--;
+        } else if (*predicate == '@') {
+            step->index = 0;
+            step->attrName = predicate + 1;
+            step->attrNameLen = predicateLen - 1;
+            step->attrVal = memchr(step->attrName, '=', step->attrNameLen);
+            if (step->attrVal) {
+                step->attrNameLen = step->attrVal - step->attrName;
+                step->attrVal++;
+                step->attrValLen = predicate + predicateLen - step->attrVal;
+                if (step->attrValLen && (*step->attrVal == '\'' || *step->attrVal == '"')) {
+                    char *quote = memchr(step->attrVal + 1, *step->attrVal, step->attrValLen - 1);
+                    step->attrVal++;
+                    step->attrValLen = quote ? (size_t)(quote - step->attrVal) : step->attrValLen - 1;
+                }
+            }
+        } else { // unknown predicates select the first node
+            step->hasIndex = 1;
+            step->index = 0;
+        }
+    }
+    step->name = name;
+    step->nameLen = nameLen;
+}
+
+// checks the name and the attribute predicate (the index is up to the caller)
+static int
+XmlMatchPathStep(XmlNode *node, XmlPathStep *step)
+{
+    XmlNodeAttribute *attr;
+
+    if (strncmp(node->name, step->name, step->nameLen) != 0 || node->name[step->nameLen] != 0)
+        return 0;
+    if (!step->attrName)
+        return 1;
+    TAILQ_FOREACH(attr, &node->attributes, list) {
+        if (strncmp(attr->name, step->attrName, step->attrNameLen) == 0 && attr->name[step->attrNameLen] == 0)
+            break;
+    }
+    // if the attr value doesn't match, let's skip to next matching node
+    if (!attr)
+        return 0;
+    if (!step->attrVal)
+        return 1;
+    return step->decoded ? strcmp(attr->value, step->attrVal) == 0
+                         : dexmlizeMatch(attr->value, step->attrVal, step->attrValLen);
+}
+
+// returns the node selected by step among node and its following siblings
+static XmlNode *
+XmlFindPathStep(XmlNode *node, XmlPathStep *step)
+{
+    long i = step->index;
+    for (; node; node = TAILQ_NEXT(node, siblings)) {
+        if (!XmlMatchPathStep(node, step))
+            continue;
+        if (i == 0)
+            return node;
+        i--;
+    }
+    return NULL;
+}
+
+static XmlNode *
+XmlGetChildNodeByNameLen(XmlNode *node, char *name, size_t nameLen)
+{
+    XmlPathStep step;
+
+    XmlParsePathStep(name, nameLen, &step);
+    return XmlFindPathStep(TAILQ_FIRST(&node->children), &step);
+}
+
+// returns the child of node selected by step, through the index of the document
+// if the step looks for an indexed attribute value (which doesn't need decoding)
+static XmlNode *
+XmlGetChildNodeByStep(TXml *xml, XmlNode *node, XmlPathStep *step)
+{
+    if (xml->index && step->attrVal &&
+        XmlIndexHasName(xml->index, step->attrName, step->attrNameLen) &&
+        (step->decoded || !memchr(step->attrVal, '&', step->attrValLen)))
+    {
+        return XmlIndexLookup(xml, step->attrName, step->attrNameLen, step->attrVal, step->attrValLen,
+                              node, step->name, step->nameLen);
+    }
+    return XmlFindPathStep(TAILQ_FIRST(&node->children), step);
+}
+
+/* XXX - if multiple children shares the same name, only the first is returned
+ *       (use XmlPathIteratorNext() to get all of them) */
 XmlNode
 *XmlGetChildNodeByName(XmlNode *node, char *name)
 {
-    XmlNode *child;
-    unsigned int i = 0;
-    char *attrName = NULL;
-    char *attrVal = NULL;
-    char *nodeName = NULL;
-    int nameLen = 0;
-    char *p;
+    if(!node || !name)
+        return NULL;
+    return XmlGetChildNodeByNameLen(node, name, strlen(name));
+}
 
-    if(!node)
+// returns the next non-empty component of path (and its length)
+static char *
+XmlNextPathComponent(char *path, size_t *len)
+{
+    while (*path == '/')
+        path++;
+    if (!*path)
         return NULL;
+    *len = strcspn(path, "/");
+    return path;
+}
 
-    nodeName = strdup(name); // make a copy to avoid changing the provided buffer
-    nameLen = strlen(nodeName);
+// returns the component preceding the one starting at 'component' (and its length)
+static char *
+XmlPrevPathComponent(char *path, char *component, size_t *len)
+{
+    char *end = component;
+    char *start;
+    while (end > path && end[-1] == '/')
+        end--;
+    start = end;
+    while (start > path && start[-1] != '/')
+        start--;
+    *len = end - start;
+    return start;
+}
 
-    if (nodeName[nameLen-1] == ']') {
-        p = strchr(nodeName, '[');
-        *p = 0;
-        p++;
-        if (sscanf(p, "%d]", &i) == 1) {
-            i--;
-        } else if (*p == '@') {
-            p++;
-            p[strlen(p)-1] = 0;
-            attrName = p;
-            attrVal = strchr(p, '=');
-            if (attrVal) {
-                *attrVal = 0;
-                attrVal++;
-                if (*attrVal == '\'' || *attrVal == '"') {
-                    char quote = *attrVal;
-                    int n, j=0;
-                    // inplace dequoting
-                    attrVal++;
-                    for (n = 0; attrVal[n] != 0; n++) {
-                        if (attrVal[n] == quote) {
-                            if (n && attrVal[n-1] == quote) { // quote escaping (XXX - perhaps out of spec)
-                                if (j)
-                                    j--;
-                            } else {
-                                attrVal[n] = 0;
-                                break;
-                            }
-                        }
-                        if (j != n)
-                            attrVal[j] = attrVal[n];
-                        j++;
-                    }
+void
+XmlPathIteratorInit(XmlPathIterator *iterator, TXml *xml, char *path)
+{
+    iterator->xml = xml;
+    iterator->path = path;
+    XmlPathIteratorReset(iterator);
+}
 
-                }
+void
+XmlPathIteratorReset(XmlPathIterator *iterator)
+{
+    iterator->node = NULL;
+    iterator->component = NULL;
+    iterator->componentLen = 0;
+    iterator->done = 0;
+}
+
+XmlNode *
+XmlPathIteratorNext(XmlPathIterator *iterator)
+{
+    TXml *xml = iterator->xml;
+    char *first;
+    size_t firstLen = 0;
+    char *component;
+    size_t componentLen;
+    XmlNode *parent;    // the node matched by the previous component (NULL above the root nodes)
+    XmlNode *candidate; // the first sibling which could match the current component
+    int advance;        // looking for another match among the siblings of the last one
+    XmlPathStep step;
+
+    if (iterator->done || !xml || !iterator->path)
+        return NULL;
+
+    first = XmlNextPathComponent(iterator->path, &firstLen);
+    if (!iterator->node) { // first call
+        if (xml->allowMultipleRootNodes) {
+            if (!first)
+                goto done;
+            parent = NULL;
+            candidate = TAILQ_FIRST(&xml->rootElements);
+        } else {
+            parent = XmlGetBranch(xml, 0);
+            if (!parent)
+                goto done;
+            if (!first) { // the path selects the root node itself
+                iterator->node = parent;
+                return parent;
             }
+            candidate = TAILQ_FIRST(&parent->children);
         }
+        component = first;
+        componentLen = firstLen;
+        advance = 0;
+    } else {
+        if (!iterator->component) // the root node was the only match
+            goto done;
+        component = iterator->component;
+        componentLen = iterator->componentLen;
+        parent = iterator->node->parent;
+        candidate = TAILQ_NEXT(iterator->node, siblings);
+        advance = 1;
     }
 
-    TAILQ_FOREACH(child, &node->children, siblings) {
-        if(strcmp(child->name, nodeName) == 0) {
-            if (attrName) {
-                XmlNodeAttribute *attr = XmlGetAttributeByName(child, attrName);
-                if (attr) {
-                    if (attrVal) {
-                        char *dexmlized = dexmlize(attrVal);
-                        if (strcmp(attr->value, dexmlized) != 0) {
-                            free(dexmlized);
-                            continue; // the attr value doesn't match .. let's skip to next matching node
-                        }
-                        free(dexmlized);
-                    }
-                    free(nodeName);
-                    return child;
+    for (;;) {
+        XmlNode *match = NULL;
+        long i;
+
+        XmlParsePathStep(component, componentLen, &step);
+        // a positional predicate selects at most one node among the siblings
+        if (!advance || !step.hasIndex) {
+            i = step.hasIndex ? step.index : 0;
+            for (; candidate; candidate = TAILQ_NEXT(candidate, siblings)) {
+                if (!XmlMatchPathStep(candidate, &step))
+                    continue;
+                if (i == 0) {
+                    match = candidate;
+                    break;
                 }
-            } else if (i == 0) {
-                free(nodeName);
-                return child;
-            } else {
-                i--;
+                if (step.hasIndex)
+                    i--;
+            }
+        }
+
+        if (match) {
+            size_t nextLen = 0;
+            char *next = XmlNextPathComponent(component + componentLen, &nextLen);
+            if (!next) {
+                iterator->node = match;
+                iterator->component = component;
+                iterator->componentLen = componentLen;
+                return match;
             }
+            // descend
+            parent = match;
+            candidate = TAILQ_FIRST(&match->children);
+            component = next;
+            componentLen = nextLen;
+            advance = 0;
+        } else {
+            // no more matches among these siblings, go back to the previous component
+            if (component == first || !parent)
+                goto done;
+            component = XmlPrevPathComponent(iterator->path, component, &componentLen);
+            candidate = TAILQ_NEXT(parent, siblings);
+            parent = parent->parent;
+            advance = 1;
         }
     }
-    free(nodeName);
+
+done:
+    iterator->done = 1;
     return NULL;
 }
 
 XmlNode *
 XmlGetNode(TXml *xml, char *path)
 {
-    char *buff, *walk;
     char *tag;
-    unsigned long i = 0;
+    size_t tagLen = 0;
     XmlNode *cNode = NULL;
     XmlNode *wNode = NULL;
-//#ifndef WIN32
-    char *brkb;
-//#endif
+
     if(!path)
         return NULL;
 
-    buff = strdup(path);
-    walk = buff;
-
+    tag = XmlNextPathComponent(path, &tagLen);
     // check if we are allowing multiple rootnodes to determine
     // if it's included in the path or not
     if (xml->allowMultipleRootNodes) {
-        /* skip leading slashes '/' */
-        while(*walk == '/')
-            walk++;
-
         /* select the root node */
-#ifndef WIN32
-        tag  = strtok_r(walk, "/", &brkb);
-#else
-        tag = strtok(walk, "/");
-#endif
-        if(!tag) {
-            free(buff);
+        if(!tag)
             return NULL;
-        }
 
-        for(i = 0; i < XmlCountBranches(xml); i++) {
-            wNode = XmlGetBranch(xml, i);
-            if(strcmp(wNode->name, tag) == 0) {
+        TAILQ_FOREACH(wNode, &xml->rootElements, siblings) {
+            if(strncmp(wNode->name, tag, tagLen) == 0 && wNode->name[tagLen] == 0) {
                 cNode = wNode;
                 break;
             }
         }
         /* now cNode points to the root node ... let's find requested node */
-#ifndef WIN32
-        tag = strtok_r(NULL, "/", &brkb);
-#else
-        tag = strtok(NULL, "/");
-#endif
+        tag = XmlNextPathComponent(tag + tagLen, &tagLen);
     } else { // no multiple rootnodes
         cNode = XmlGetBranch(xml, 0);
-        // TODO - this could be done in a cleaner and more efficient way
-        if (*walk != '/') {
-            buff = malloc(strlen(walk)+2);
-            sprintf(buff, "/%s", walk);
-            free(walk);
-            walk = buff;
-        }
-#ifndef WIN32
-        tag = strtok_r(walk, "/", &brkb);
-#else
-        tag = strtok(walk, "/");
-#endif
     }
 
-    if(!cNode) {
-        free(buff);
+    if(!cNode)
         return NULL;
-    }
 
     while(tag) {
-        XmlNode *tmp;
-        wNode = XmlGetChildNodeByName(cNode, tag);
-        if(!wNode) {
-            free(buff);
+        XmlPathStep step;
+        XmlParsePathStep(tag, tagLen, &step);
+        wNode = XmlGetChildNodeByStep(xml, cNode, &step);
+        if(!wNode)
             return NULL;
-        }
         cNode = wNode; // update current node
-#ifndef WIN32
-        tag = strtok_r(NULL, "/", &brkb);
-#else
-        tag = strtok(NULL, "/");
-#endif
+        tag = XmlNextPathComponent(tag + tagLen, &tagLen);
     }
 
-    free(buff);
     return cNode;
 }
 
+struct __XmlCompiledPath {
+    XmlPathStep *steps;
+    int count;
+};
+
+XmlCompiledPath *
+XmlCompilePath(char *path)
+{
+    XmlCompiledPath *compiled;
+    char *component;
+    size_t componentLen = 0;
+    char *strings;
+    int count = 0;
+
+    if (!path)
+        return NULL;
+
+    for (component = XmlNextPathComponent(path, &componentLen); component;
+         component = XmlNextPathComponent(component + componentLen, &componentLen))
+    {
+        count++;
+    }
+
+    // the steps and their strings are kept in the same block of memory
+    compiled = (XmlCompiledPath *)calloc(1, sizeof(XmlCompiledPath) +
+                                            count * sizeof(XmlPathStep) + strlen(path) + 1);
+    if (!compiled)
+        return NULL;
+    compiled->steps = (XmlPathStep *)(compiled + 1);
+    strings = (char *)(compiled->steps + count);
+
+    for (component = XmlNextPathComponent(path, &componentLen); component;
+         component = XmlNextPathComponent(component + componentLen, &componentLen))
+    {
+        XmlPathStep *step = &compiled->steps[compiled->count++];
+        XmlParsePathStep(component, componentLen, step);
+
+        memcpy(strings, step->name, step->nameLen);
+        step->name = strings;
+        strings += step->nameLen + 1;
+
+        if (step->attrName) {
+            memcpy(strings, step->attrName, step->attrNameLen);
+            step->attrName = strings;
+            strings += step->attrNameLen + 1;
+        }
+
+        if (step->attrVal) {
+            size_t i;
+            char *value = strings;
+            // entities are decoded once here instead of at each comparison
+            for (i = 0; i < step->attrValLen; i++) {
+                int n = dexmlizeChar(step->attrVal, &i, strings, 1);
+                if (n < 0 || i >= step->attrValLen) {
+                    fprintf(stderr, "Bad entity in path '%s'\n", path);
+                    free(compiled);
+                    return NULL;
+                }
+                strings += n;
+            }
+            strings++;
+            step->attrVal = value;
+            step->attrValLen = strlen(value);
+            step->decoded = 1;
+        }
+    }
+    return compiled;
+}
+
+XmlNode *
+XmlGetNodeCompiled(TXml *xml, XmlCompiledPath *compiled)
+{
+    XmlNode *node;
+    int i = 0;
+
+    if (!xml || !compiled)
+        return NULL;
+
+    if (xml->allowMultipleRootNodes) {
+        if (!compiled->count)
+            return NULL;
+        node = XmlFindPathStep(TAILQ_FIRST(&xml->rootElements), &compiled->steps[i++]);
+    } else {
+        node = XmlGetBranch(xml, 0);
+    }
+
+    for (; node && i < compiled->count; i++)
+        node = XmlGetChildNodeByStep(xml, node, &compiled->steps[i]);
+
+    return node;
+}
+
+void
+XmlDestroyCompiledPath(XmlCompiledPath *compiled)
+{
+    free(compiled);
+}
+
 XmlNode
 *XmlGetBranch(TXml *xml, unsigned long index)
 {
@@ -2031,10 +6692,18 @@ XmlSubstBranch(TXml *xml, unsigned long index, XmlNode *newBranch)
 {
     XmlNode *branch, *tmp;
     int cnt = 0;
+    if (xml->readOnly || newBranch->readOnly)
+        return XML_UPDATE_ERR;
     TAILQ_FOREACH_SAFE(branch, &xml->rootElements, siblings, tmp) {
         if (cnt++ == index) {
             TAILQ_INSERT_BEFORE(branch, newBranch, siblings);
             TAILQ_REMOVE(&xml->rootElements, branch, siblings);
+            newBranch->cacheState = XML_CACHE_NONE;
+            xml->numbered = XML_ORDER_STALE;
+            if (xml->index) {
+                XmlIndexBranch(xml->index, branch, 0);
+                XmlIndexBranch(xml->index, newBranch, 1);
+            }
             return XML_NOERR;
         }
     }
@@ -2066,7 +6735,7 @@ XmlDestroyNamespace(XmlNamespace *ns)
 XmlNamespace *
 XmlAddNamespace(XmlNode *node, char *nsName, char *nsUri) {
     XmlNamespace *newNS = NULL;
-    if (!node || !nsUri)
+    if (!node || !nsUri || node->readOnly)
         return NULL;
 
     if ((newNS = XmlCreateNamespace(nsName, nsUri)))
@@ -2118,6 +6787,8 @@ XmlErr
 XmlSetNodeCNamespace(XmlNode *node, XmlNamespace *ns) {
     if (!node || !ns)
         return XML_BADARGS;
+    if (node->readOnly)
+        return XML_UPDATE_ERR;
     
     node->cns = ns;
     return XML_NOERR;
@@ -2127,8 +6798,11 @@ XmlErr
 XmlSetNodeNamespace(XmlNode *node, XmlNamespace *ns) {
     if (!node || !ns)
         return XML_BADARGS;
+    if (node->readOnly)
+        return XML_UPDATE_ERR;
     
     node->ns = ns;
+    XmlInvalidateNode(node);
     return XML_NOERR;
 }
 
@@ -102,6 +102,18 @@ typedef struct __XmlNode {
     TAILQ_HEAD(,__XmlNamespace) namespaces; 
     TAILQ_ENTRY(__XmlNode) siblings;
     struct __TXml *context; // set only if rootnode (otherwise it's always NULL)
+    // position of this branch in the dump cache of the context (if enabled)
+    size_t cacheOffset; // relative to the beginning of the parent branch
+    size_t cacheLen;
+#define XML_CACHE_NONE 0  // never serialized (or moved since then)
+#define XML_CACHE_DIRTY 1 // modified since last serialized
+#define XML_CACHE_CLEAN 2
+    char cacheState;
+    char readOnly; // the node belongs to a snapshot and can't be modified
+    // position in document order, valid only after XmlNumberNodes()
+    unsigned long order; // pre-order number (the first root element is 1)
+    unsigned long descendants; // number of nodes in the subtree (excluding this one)
+    unsigned int depth; // 0 for the root elements
 } XmlNode;
 
 TAILQ_HEAD(nodelistHead, __XmlNode);
@@ -116,8 +128,33 @@ typedef struct __TXml {
     int allowMultipleRootNodes;
     int ignoreWhiteSpaces;
     int ignoreBlanks;
+    int atomicSave; // XmlSave() writes a temporary file and rename()s it in place
+    int dumpCache; // keep the serialized document around and only re-serialize modified branches
+    char *dumpCacheBuf;
+    size_t dumpCacheLen;
+    int dumpCacheBlanks; // value of ignoreBlanks when dumpCacheBuf has been built
+    int dumpThreads; // serialize the children of the root elements on this many threads
+    void *outputConverter; // iconv handle reused by all dumps needing the same conversion
+    char outputConverterFrom[64];
+    char outputConverterTo[64];
+    char outputConverterBusy; // a dump is using outputConverter
+    int validateUtf8; // make the parser refuse malformed utf-8 (with XML_BAD_CHARS)
+    int compression; // compress the output of XmlDumpFd() and XmlSave() (one of XML_COMPRESSION_XXX)
+    int lockTimeout; // ms to wait for the lock on a file being loaded or saved (< 0 waits forever)
+    void *snapshot; // image mapped by XmlLoadSnapshot() (if any)
+    size_t snapshotSize;
+    int readOnly; // the document can't be modified (see XmlLoadSnapshot())
+    int pins; // references to a published document (see XmlPublish())
+    int numbered; // state of the numbering of the nodes (see XmlNumberNodes())
+    unsigned long numbering; // increased each time the nodes are numbered again
+    struct __XmlAttributeIndex *index; // nodes by attribute value (see XmlIndexAttributes())
+    struct __XmlStream *stream; // path matched while parsing (see XmlStreamBuffer())
 } TXml;
 
+#define XML_COMPRESSION_NONE 0
+#define XML_COMPRESSION_GZIP 1
+#define XML_COMPRESSION_ZSTD 2
+
 /***
     @brief access next sibling of a node (if any)
     @arg pointer to a valid XmlNode structure
@@ -216,12 +253,47 @@ unsigned long XmlCountChildren(XmlNode *node);
     @return the number of attributes that are set for queried node
  */
 unsigned long XmlCountAttributes(XmlNode *node);
+/***
+    @brief number the nodes of a document in document order (filling the order,
+           descendants and depth members of all the nodes).
+           The nodes are numbered again only if the structure of the document changed
+           since the last call, so this can be called before each use of the numbers.
+           Read-only documents are numbered once for all when frozen (or loaded from a snapshot).
+           Many threads can call this at once on a document which is not being modified
+    @arg the xml context pointer
+ */
+void XmlNumberNodes(TXml *xml);
+/***
+    @brief check if a node is inside another one in constant time
+           (both must belong to a document numbered by XmlNumberNodes())
+    @arg the supposed ancestor
+    @arg the node
+    @return 1 if the first node is an ancestor of the second one, 0 otherwise
+ */
+int XmlIsAncestor(XmlNode *ancestor, XmlNode *node);
+/***
+    @brief compare the position of two nodes in document order
+           (both must belong to a document numbered by XmlNumberNodes())
+    @arg the first node
+    @arg the second node
+    @return a negative number if the first node comes first, a positive one
+            if it comes after the second one, 0 if they are the same node
+ */
+int XmlCompareNodes(XmlNode *a, XmlNode *b);
+/***
+    @brief get the document a node belongs to
+    @arg the node
+    @return the xml context holding the node, NULL if the node is not attached to a document
+ */
+TXml *XmlGetContext(XmlNode *node);
 /***
     @brief Returns the XmlNode at specified path
     @arg the xml context pointer
     @arg the path that references requested node. 
         This must be of formatted as a slash '/' separated list
         of node names ( ex. "tag_A/tag_B/tag_C" )
+        Each name can be followed by a predicate (see XmlGetChildNodeByName()).
+        The path is not modified and no memory is allocated
     @return the node at specified path
  */
 XmlNode *XmlGetNode(TXml *xml, char *path);
@@ -243,15 +315,88 @@ XmlNode *XmlGetChildNode(XmlNode *node,unsigned long index);
 /***
     @brief get the first child of an XmlNode whose name is 'name'
     @arg the parent node
-    @arg the name of the desired child node
+    @arg the name of the desired child node, optionally followed by a predicate :
+         "name[n]" selects the n-th child with that name (starting from 1),
+         "name[@attr]" or "name[@attr='value']" the first one having the attribute.
+         The name is not modified and no memory is allocated
     @return the requested child node
  */
 XmlNode *XmlGetChildNodeByName(XmlNode *node,char *name);
 
+/**
+    @type XmlCompiledPath
+    @brief A path parsed once to be looked up many times (opaque)
+*/
+typedef struct __XmlCompiledPath XmlCompiledPath;
+
+/***
+    @brief parse a path (as accepted by XmlGetNode()) once, decoding the entities
+           in its predicates, to be used by XmlGetNodeCompiled()
+    @arg the path
+    @return a newly allocated XmlCompiledPath (to be released using XmlDestroyCompiledPath()),
+            NULL if the path contains unknown entities or on errors
+*/
+XmlCompiledPath *XmlCompilePath(char *path);
+/***
+    @brief Returns the XmlNode at a compiled path (see XmlGetNode()).
+           No memory is allocated, and the compiled path is not modified
+           so it can be used by many threads at once
+    @arg the xml context pointer
+    @arg the path compiled by XmlCompilePath()
+    @return the node at specified path
+*/
+XmlNode *XmlGetNodeCompiled(TXml *xml, XmlCompiledPath *compiled);
+/***
+    @brief release a compiled path
+    @arg pointer to a valid XmlCompiledPath
+*/
+void XmlDestroyCompiledPath(XmlCompiledPath *compiled);
+
+/**
+    @type XmlPathIterator
+    @brief Iterates over all the nodes matching a path (see XmlGetNode()).
+           It's meant to be allocated by the caller (usually on the stack)
+*/
+typedef struct __XmlPathIterator {
+    TXml *xml;
+    char *path;
+    XmlNode *node;       // the last match
+    char *component;     // the path component matched by node
+    size_t componentLen;
+    int done;
+} XmlPathIterator;
+
+/***
+    @brief prepare an iterator over all the nodes matching a path
+    @arg pointer to the XmlPathIterator to initialize
+    @arg the xml context pointer
+    @arg the path, as accepted by XmlGetNode().
+         Each component matches all the children with that name, unless
+         restricted by a predicate : "name[n]" still matches only the n-th one while
+         "name[@attr]" and "name[@attr='value']" match all the ones having the attribute.
+         The path is not copied, so it must stay valid while the iterator is in use
+*/
+void XmlPathIteratorInit(XmlPathIterator *iterator, TXml *xml, char *path);
+/***
+    @brief get the next node matching the path of an iterator.
+           Nodes are returned in document order and no memory is allocated.
+           The document must not be modified while iterating
+    @arg pointer to a valid XmlPathIterator
+    @return the next matching node, NULL when there are no more matches
+*/
+XmlNode *XmlPathIteratorNext(XmlPathIterator *iterator);
+/***
+    @brief restart an iterator from the first match
+    @arg pointer to a valid XmlPathIterator
+*/
+void XmlPathIteratorReset(XmlPathIterator *iterator);
+
 /***
     @brief parse a string buffer containing an xml profile and fills internal structures appropriately
     @arg the null terminated string buffer containing the xml profile
     @return true if buffer is parsed successfully , false otherwise)
+    If xml->validateUtf8 is set, names, values, attributes and comments of utf-8 documents
+    are checked to be well-formed and XML_BAD_CHARS is returned if they aren't
 */
 XmlErr XmlParseBuffer(TXml *xml,char *buf);
 
@@ -259,19 +404,330 @@ XmlErr XmlParseBuffer(TXml *xml,char *buf);
     @brief parse an xml file containing the profile and fills internal structures appropriately
     @arg a null terminating string representing the path to the xml file
     @return an XmlErr error status (XML_NOERR if buffer was parsed successfully)
+    gzip and zstd compressed files are recognized by their magic number and
+    decompressed while being read (if support for them has been compiled in)
+    The file is read holding a shared advisory lock, waiting for it up to
+    xml->lockTimeout milliseconds if some other process is writing the file
 */
 XmlErr XmlParseFile(TXml *xml,char *path);
 
+/***
+    @brief load a batch of xml files, each one into its own context.
+           Files are read and parsed on a pool of threads, so that reading
+           some files overlaps with parsing the others
+    @arg array of valid xml contexts (one for each file)
+    @arg array of null terminated strings representing the paths of the files
+    @arg number of files
+    @arg number of threads to use (files are loaded one after the other
+         if less than 2 or if pthreads support has not been compiled in)
+    @arg if not NULL, the result of XmlParseFile() for each file is stored here
+    @return XML_NOERR if all the files have been loaded, the first error encountered otherwise
+*/
+XmlErr XmlParseFiles(TXml **xmls, char **paths, int count, int numThreads, XmlErr *results);
+
+/***
+    @type XmlStreamPath
+    @brief A forward-only path matched against the elements while they are parsed
+           (see XmlStreamBuffer())
+*/
+typedef struct __XmlStreamPath XmlStreamPath;
+
+/***
+    @brief compile a path to be matched while parsing a document.
+           Only the XPath subset which can be decided when an element starts is accepted :
+           a sequence of child ('/') and descendant ('//') steps, each one testing the name
+           of the element ('name', 'prefix:name', 'prefix:*' or '*', optionally preceded by
+           the 'child::' or 'descendant::' axis) and followed by any number of predicates
+           among [@attr], [@attr='value'], [@attr!='value'] and [n] (the position among the
+           preceding siblings passing the same test, as in "//item[2]")
+    @arg the path (for instance "/catalog//item[@type='book'][1]")
+    @return a newly allocated XmlStreamPath (to be released using XmlDestroyStreamPath()),
+            NULL if the path is malformed or uses unsupported features
+*/
+XmlStreamPath *XmlCompileStreamPath(char *path);
+
+/***
+    @brief release a path compiled by XmlCompileStreamPath()
+    @arg pointer to a valid XmlStreamPath
+*/
+void XmlDestroyStreamPath(XmlStreamPath *path);
+
+/***
+    @brief callback receiving the elements matched while streaming a document
+    @arg the xml context being parsed
+    @arg the matching element, complete with its whole subtree. It's released as soon
+         as the callback returns, so it must not be kept (nor removed from the document)
+    @arg the private pointer given to XmlStreamBuffer() or XmlStreamFile()
+    @return 0 to go on parsing, anything else to stop
+*/
+typedef int (*XmlStreamCallback)(TXml *xml, XmlNode *node, void *priv);
+
+/***
+    @brief parse a document handing the elements matching a path to a callback
+           as soon as their end tag is parsed. Elements which don't match (and aren't
+           part of a matching subtree) are released as soon as they end, so the memory
+           used doesn't depend on the size of the document but only on its depth
+           and on the size of the matching subtrees.
+           When a matching element contains other matching ones, the inner ones are
+           handed to the callback first.
+           The context is left empty once done
+    @arg pointer to a valid xml context
+    @arg the null terminated string buffer containing the document
+    @arg the path compiled by XmlCompileStreamPath()
+    @arg the callback receiving the matching elements
+    @arg private pointer passed to the callback
+    @return an XmlErr error status (XML_NOERR if buffer was parsed successfully or
+            the callback stopped the parsing)
+*/
+XmlErr XmlStreamBuffer(TXml *xml, char *buf, XmlStreamPath *path, XmlStreamCallback callback, void *priv);
+
+/***
+    @brief same as XmlStreamBuffer() but the document is read from a file (as XmlParseFile() does).
+           Uncompressed utf-8 files are mmap()ed instead of being loaded in memory,
+           so they are read only once and straight from the page cache
+    @arg pointer to a valid xml context
+    @arg the path of the file
+    @arg the path compiled by XmlCompileStreamPath()
+    @arg the callback receiving the matching elements
+    @arg private pointer passed to the callback
+    @return an XmlErr error status (XML_NOERR if the file was parsed successfully or
+            the callback stopped the parsing)
+*/
+XmlErr XmlStreamFile(TXml *xml, char *path, XmlStreamPath *spath, XmlStreamCallback callback, void *priv);
+
+/***
+    @type XmlFilter
+    @brief A set of subscriptions, each one made of a path and an id, matched all
+           together against documents. The paths are merged into a single automaton,
+           so matching a document costs about the same regardless of the number of
+           subscriptions. A filter is not modified while matching, so it can be used
+           by many threads at once (but not while adding subscriptions to it)
+*/
+typedef struct __XmlFilter XmlFilter;
+
+/***
+    @brief create an empty filter
+    @return a pointer to a new XmlFilter (to be released using XmlDestroyFilter()),
+            NULL on errors
+*/
+XmlFilter *XmlCreateFilter();
+
+/***
+    @brief release a filter and all its subscriptions
+    @arg pointer to a valid XmlFilter
+*/
+void XmlDestroyFilter(XmlFilter *filter);
+
+/***
+    @brief add a subscription to a filter
+    @arg pointer to a valid XmlFilter
+    @arg the path, with the syntax accepted by XmlCompileStreamPath()
+         except for positional predicates
+    @arg the id reported when a document matches the path
+         (the same id can be used by many paths)
+    @return XML_NOERR on success, XML_BADARGS if the path is malformed
+            or not supported, XML_MEMORY_ERR otherwise
+*/
+XmlErr XmlFilterAdd(XmlFilter *filter, char *path, unsigned long id);
+
+/***
+    @brief get the number of paths added to a filter
+    @arg pointer to a valid XmlFilter
+    @return the number of paths
+*/
+size_t XmlFilterCount(XmlFilter *filter);
+
+/***
+    @brief find the subscriptions matching a document, walking its tree once.
+           The walk stops as soon as all the subscriptions matched, and doesn't
+           descend into the branches where no path can match anymore
+    @arg pointer to a valid XmlFilter
+    @arg pointer to a valid xml context
+    @arg here will be stored the ids of the matching subscriptions, sorted and
+         without duplicates (to be released using free())
+    @arg here will be stored the number of ids
+    @return XML_NOERR on success, error code otherwise
+*/
+XmlErr XmlFilterDocument(XmlFilter *filter, TXml *xml, unsigned long **ids, size_t *count);
+
+/***
+    @brief find the subscriptions matching a document while parsing it, without
+           building its tree (see XmlStreamBuffer()). Parsing stops as soon as
+           all the subscriptions matched. The context is left empty once done
+    @arg pointer to a valid XmlFilter
+    @arg pointer to a valid xml context (used for parsing)
+    @arg the null terminated string buffer containing the document
+    @arg here will be stored the ids of the matching subscriptions, sorted and
+         without duplicates (to be released using free())
+    @arg here will be stored the number of ids
+    @return XML_NOERR on success, error code otherwise
+*/
+XmlErr XmlFilterBuffer(XmlFilter *filter, TXml *xml, char *buf, unsigned long **ids, size_t *count);
+
+/***
+    @brief same as XmlFilterBuffer() but the document is read from a file (see XmlStreamFile())
+    @arg pointer to a valid XmlFilter
+    @arg pointer to a valid xml context (used for parsing)
+    @arg the path of the file
+    @arg here will be stored the ids of the matching subscriptions, sorted and
+         without duplicates (to be released using free())
+    @arg here will be stored the number of ids
+    @return XML_NOERR on success, error code otherwise
+*/
+XmlErr XmlFilterFile(XmlFilter *filter, TXml *xml, char *path, unsigned long **ids, size_t *count);
+
 char *XmlDumpBranch(TXml *xml,XmlNode *rNode,unsigned int depth);
+
+/***
+    @brief same as XmlDumpBranch() but also reports the length of the dump
+    @arg pointer to a valid xml context
+    @arg the node to dump
+    @arg the indentation level of the node
+    @arg if not NULL, here will be stored the bytelength of the returned buffer
+    @return a null terminated string containing the xml representation of the branch
+*/
+char *XmlDumpBranchSize(TXml *xml, XmlNode *rNode, unsigned int depth, size_t *outlen);
 /***
     @brief dump the entire xml configuration tree that reflects the status of internal structures
     @arg pointer to a valid xml context
     @arg if not NULL, here will be stored the bytelength of the returned buffer
     @return a null terminated string containing the xml representation of the configuration tree.
     The memory allocated for the dump-string must be freed by the user when no more needed
+    If xml->dumpCache is set, only the branches modified since the previous dump are serialized again
+    If xml->dumpThreads is greater than 1 (and the dump cache is disabled), the children of the
+    root elements are serialized in parallel
+    NOTE: NULL is returned if the size of the dump doesn't fit in 'outlen' (2GB),
+          use XmlDumpSize() for bigger documents
 */
 char *XmlDump(TXml *xml, int *outlen);
 
+/***
+    @brief same as XmlDump() but the bytelength of the dump is reported as a size_t
+    @arg pointer to a valid xml context
+    @arg if not NULL, here will be stored the bytelength of the returned buffer
+    @return a null terminated string containing the xml representation of the document
+*/
+char *XmlDumpSize(TXml *xml, size_t *outlen);
+
+#ifndef WIN32
+/***
+    @brief dump the entire xml document straight to a file descriptor
+           Names, values and attributes are handed to writev() directly from
+           the tree, so the document is never copied into an intermediate
+           buffer (unless the output needs to be converted to a different encoding)
+    @arg pointer to a valid xml context
+    @arg a file descriptor opened for writing (a file, a pipe or a socket)
+    @return XML_NOERR on success, error code otherwise
+    If xml->compression is set, the output is compressed on the fly
+*/
+XmlErr XmlDumpFd(TXml *xml, int fd);
+
+/***
+    @brief save a binary image of the parsed document, which can be loaded back
+           through XmlLoadSnapshot() much faster than parsing the xml again.
+           Snapshots are meant as a cache : they can be loaded only on hosts with
+           the same architecture and by the same version of the library.
+           The file is replaced atomically, so processes still using the previous
+           snapshot are not affected
+    @arg pointer to a valid xml context
+    @arg the path of the snapshot file
+    @return XML_NOERR on success, error code otherwise
+*/
+XmlErr XmlSaveSnapshot(TXml *xml, char *path);
+
+/***
+    @brief load a snapshot saved by XmlSaveSnapshot(), replacing the current document.
+           The snapshot is mmap()ed read-only and the tree is used in place, so loading
+           costs about the same regardless of the size of the document and the memory
+           is shared by all the processes loading the same snapshot.
+           The document can be queried and dumped through the usual functions, but it
+           can't be modified (XML_UPDATE_ERR is returned by functions modifying it)
+           until the context is reset (or a new document is parsed into it)
+    @arg pointer to a valid xml context
+    @arg the path of the snapshot file
+    @return XML_NOERR on success, error code otherwise
+*/
+XmlErr XmlLoadSnapshot(TXml *xml, char *path);
+
+/***
+    @brief freeze the document : the tree is compacted into a single read-only
+           block of memory (as if it was loaded from a snapshot) and can't be
+           modified anymore until the context is reset.
+           Lookups (XmlGetNode(), XmlGetChildNodeByName(), XmlGetAttributeByName(), ...)
+           don't modify anything and don't allocate memory, so once frozen the
+           document can be queried by any number of threads without locking.
+           Nodes obtained before freezing are released and must not be used anymore
+    @arg pointer to a valid xml context
+    @return XML_NOERR on success, error code otherwise
+*/
+XmlErr XmlFreeze(TXml *xml);
+
+/***
+    @type XmlPublisher
+    @brief Publishes versions of a document to concurrent readers : a new version
+           replaces the current one atomically, readers pin the version they are using
+           without taking any lock and each version is released when the last reader
+           holding it unpins it
+*/
+typedef struct __XmlPublisher XmlPublisher;
+
+/***
+    @brief create a new publisher (with no document published yet)
+    @return a pointer to a new XmlPublisher, NULL on errors
+*/
+XmlPublisher *XmlCreatePublisher();
+
+/***
+    @brief release a publisher. The current version is released as soon
+           as it's not pinned anymore
+    @arg pointer to a valid XmlPublisher
+*/
+void XmlDestroyPublisher(XmlPublisher *pub);
+
+/***
+    @brief publish a new version of the document, replacing the current one.
+           The document is frozen (see XmlFreeze()) and owned by the publisher
+           from then on : it must not be used (nor destroyed) by the caller anymore.
+           Readers never wait for a new version to be published, and the caller only
+           waits for the readers which are pinning the current version at the same time
+    @arg pointer to a valid XmlPublisher
+    @arg the new version of the document (NULL to withdraw the current one)
+    @return XML_NOERR on success, error code otherwise
+*/
+XmlErr XmlPublish(XmlPublisher *pub, TXml *xml);
+
+/***
+    @brief pin the current version of the document, which stays valid (and unchanged)
+           until XmlUnpin() is called, even if a new version gets published meanwhile.
+           Doesn't take any lock and never waits for the writer
+    @arg pointer to a valid XmlPublisher
+    @return the current version of the document (NULL if none has been published)
+*/
+TXml *XmlPin(XmlPublisher *pub);
+
+/***
+    @brief release a version pinned through XmlPin()
+    @arg the document returned by XmlPin()
+*/
+void XmlUnpin(TXml *xml);
+
+/***
+    @brief get the number of versions published so far
+    @arg pointer to a valid XmlPublisher
+    @return the version of the current document
+*/
+unsigned long XmlPublisherVersion(XmlPublisher *pub);
+#endif
+
+/***
+    @brief notify that a node has been modified outside of the XmlXXX functions
+           (so that the dump cache, if enabled, won't reuse its old serialized output).
+           All functions modifying a node already take care of this.
+           NOTE: changes to XmlNamespace structures are not tracked
+    @arg pointer to a valid XmlNode structure
+*/
+void XmlInvalidateNode(XmlNode *node);
+
 /***
     @brief Create a new xml context
     @return a point to a valid xml context
@@ -324,11 +780,74 @@ int XmlRemoveAttribute(XmlNode *node, unsigned long index);
 */
 void XmlClearAttributes(XmlNode *node);
 
+/***
+    @brief change the value of an attribute
+    @arg pointer to a valid XmlNodeAttribute structure
+    @arg the new value (which is copied)
+    @return XML_NOERR on success, XML_UPDATE_ERR if the node is read-only
+*/
+XmlErr XmlSetAttributeValue(XmlNodeAttribute *attr, char *value);
+
+/***
+    @brief change the name of an attribute
+    @arg pointer to a valid XmlNodeAttribute structure
+    @arg the new name (which is copied)
+    @return XML_NOERR on success, XML_UPDATE_ERR if the node is read-only
+*/
+XmlErr XmlSetAttributeName(XmlNodeAttribute *attr, char *name);
+
+/***
+    @brief index the nodes of a document by the value of some attributes.
+           The index is kept up to date when attributes are added, removed or changed
+           and when branches are added to or removed from the document, so that
+           XmlGetNodeByAttribute() can find nodes in constant time.
+           XmlGetNode() and the XPath id() function use the index as well, when available.
+           Calling it again replaces the list of indexed attributes
+    @arg the xml context pointer
+    @arg the names of the attributes to index (NULL to index only "id")
+    @arg the number of names
+    @return XML_NOERR on success, XML_MEMORY_ERR otherwise
+*/
+XmlErr XmlIndexAttributes(TXml *xml, char **names, unsigned int count);
+
+/***
+    @brief drop the index built by XmlIndexAttributes()
+    @arg the xml context pointer
+*/
+void XmlDropIndex(TXml *xml);
+
+/***
+    @brief check if an attribute is indexed (see XmlIndexAttributes())
+    @arg the xml context pointer
+    @arg the name of the attribute
+    @return 1 if the attribute is indexed, 0 otherwise
+*/
+int XmlIsIndexed(TXml *xml, char *name);
+
+/***
+    @brief find the first node (in document order) having an attribute with the given value.
+           The attribute must be indexed (see XmlIndexAttributes())
+    @arg the xml context pointer
+    @arg the name of the attribute
+    @arg the value of the attribute
+    @return the node, NULL if not found or if the attribute is not indexed
+*/
+XmlNode *XmlGetNodeByAttribute(TXml *xml, char *name, char *value);
+
 
 /***
     @brief save the configuration stored in the xml file containing the current profile
            the xml file name is obtained appending '.xml' to the category name . The xml file is stored 
            in the repository directory specified during object construction.
+           If xml->atomicSave is set, the document is written to a temporary file
+           in the same directory, synced to disk and then renamed over 'path',
+           so a crash never leaves a truncated file behind. The previous version
+           is kept as 'path.bck' through a hardlink (no data is copied unless
+           the filesystem doesn't support links).
+           The file is compressed if xml->compression is set or if 'path'
+           ends with ".gz" (gzip) or ".zst" (zstd).
+           Unless atomicSave is set, the file is written holding an exclusive
+           advisory lock, waiting for it up to xml->lockTimeout milliseconds.
     @arg pointer to a valid xml context
     @arg the path where to save the file
     @return an XmlErr error status (XML_NOERR if buffer was parsed successfully)
@@ -403,6 +922,165 @@ XmlErr XmlSetNodeCNamespace(XmlNode *node, XmlNamespace *ns);
 */ 
 XmlErr XmlSetCurrentNamespace(TXml *xml, char *nsuri);
 
+/***
+    @type XmlWriter
+    @brief Streaming writer : produces an xml document without building
+           any tree (so in constant memory). Output is collected in a
+           fixed-size buffer and passed to a sink each time it fills up
+*/
+typedef struct __XmlWriter XmlWriter;
+
+/***
+    @brief callback receiving the output of an XmlWriter
+    @arg the opaque pointer provided to XmlCreateWriter()
+    @arg pointer to the data to write (only valid for the duration of the call)
+    @arg length of the data
+    @return 0 on success, any other value to signal an error
+*/
+typedef int (*XmlWriterSink)(void *priv, char *data, size_t len);
+
+/***
+    @brief create a new streaming writer
+    @arg the sink receiving the output (if NULL the whole output will be
+         kept in memory and made available through XmlWriterBuffer())
+    @arg opaque pointer passed to the sink
+    @arg if not zero the output is indented the same way XmlDump() does
+         when ignoreBlanks is set
+    @return a pointer to a new XmlWriter, NULL on errors
+*/
+XmlWriter *XmlCreateWriter(XmlWriterSink sink, void *priv, int pretty);
+
+/***
+    @brief create a streaming writer which keeps the whole output in memory
+    @arg if not zero the output is indented
+    @return a pointer to a new XmlWriter, NULL on errors
+*/
+XmlWriter *XmlCreateBufferWriter(int pretty);
+
+#ifndef WIN32
+/***
+    @brief create a streaming writer sending its output to a file descriptor
+    @arg a file descriptor opened for writing (a file, a pipe or a socket)
+    @arg if not zero the output is indented
+    @return a pointer to a new XmlWriter, NULL on errors
+*/
+XmlWriter *XmlCreateFdWriter(int fd, int pretty);
+#endif
+
+/***
+    @brief flush pending output and release all resources used by a writer
+           (elements still open are not closed)
+    @arg pointer to a valid XmlWriter
+*/
+void XmlDestroyWriter(XmlWriter *writer);
+
+/***
+    @brief pass all the buffered output to the sink
+    @arg pointer to a valid XmlWriter
+    @return XML_NOERR on success, the first error encountered by the writer otherwise
+*/
+XmlErr XmlWriterFlush(XmlWriter *writer);
+
+/***
+    @brief access the output collected by a writer created without a sink
+    @arg pointer to a valid XmlWriter
+    @return the null-terminated output (owned by the writer),
+            NULL if the writer has a sink
+*/
+char *XmlWriterBuffer(XmlWriter *writer);
+
+/***
+    @brief write the <?xml ... ?> declaration (the output is always utf-8)
+    @arg pointer to a valid XmlWriter
+    @return XML_NOERR on success, error code otherwise
+*/
+XmlErr XmlWriterStartDocument(XmlWriter *writer);
+
+/***
+    @brief open a new element (nested in the current one, if any)
+    @arg pointer to a valid XmlWriter
+    @arg the element name
+    @return XML_NOERR on success, error code otherwise
+*/
+XmlErr XmlWriterStartElement(XmlWriter *writer, char *name);
+
+/***
+    @brief open a new element prefixed by a namespace
+    @arg pointer to a valid XmlWriter
+    @arg pointer to a valid XmlNamespace structure (can be NULL)
+    @arg the element name
+    @return XML_NOERR on success, error code otherwise
+*/
+XmlErr XmlWriterStartElementNS(XmlWriter *writer, XmlNamespace *ns, char *name);
+
+/***
+    @brief add an attribute to the element just opened
+           (before any text or child has been written to it)
+    @arg pointer to a valid XmlWriter
+    @arg the attribute name
+    @arg the attribute value (escaped on output)
+    @return XML_NOERR on success, error code otherwise
+*/
+XmlErr XmlWriterAttribute(XmlWriter *writer, char *name, char *value);
+
+/***
+    @brief declare a namespace on the element just opened
+    @arg pointer to a valid XmlWriter
+    @arg pointer to a valid XmlNamespace structure
+         (if it has no name, it will be declared as the default namespace)
+    @return XML_NOERR on success, error code otherwise
+*/
+XmlErr XmlWriterNamespace(XmlWriter *writer, XmlNamespace *ns);
+
+/***
+    @brief write text inside the current element (escaped on output)
+    @arg pointer to a valid XmlWriter
+    @arg the text
+    @return XML_NOERR on success, error code otherwise
+*/
+XmlErr XmlWriterText(XmlWriter *writer, char *text);
+
+/***
+    @brief write a CDATA section inside the current element
+    @arg pointer to a valid XmlWriter
+    @arg the data (written as it is)
+    @return XML_NOERR on success, error code otherwise
+*/
+XmlErr XmlWriterCData(XmlWriter *writer, char *data);
+
+/***
+    @brief write a comment
+    @arg pointer to a valid XmlWriter
+    @arg the comment
+    @return XML_NOERR on success, error code otherwise
+*/
+XmlErr XmlWriterComment(XmlWriter *writer, char *comment);
+
+/***
+    @brief close the current element
+    @arg pointer to a valid XmlWriter
+    @return XML_NOERR on success, error code otherwise
+*/
+XmlErr XmlWriterEndElement(XmlWriter *writer);
+
+static inline int XmlHasCompression(int compression)
+{
+    switch(compression) {
+        case XML_COMPRESSION_NONE:
+            return 1;
+#ifdef USE_ZLIB
+        case XML_COMPRESSION_GZIP:
+            return 1;
+#endif
+#ifdef USE_ZSTD
+        case XML_COMPRESSION_ZSTD:
+            return 1;
+#endif
+        default:
+            return 0;
+    }
+}
+
 static inline int XmlHasIconv()
 {
 #ifdef USE_ICONV
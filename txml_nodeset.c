@@ -0,0 +1,248 @@
+/*
+ *  txml_nodeset.c
+ *
+ *  Sets of nodes of a TXml document kept in document order
+ *
+ */
+
+#include "txml_nodeset.h"
+#include "string.h"
+#include "stdlib.h"
+
+static XmlErr
+XmlNodeSetGrow(XmlNodeSet *set, size_t count)
+{
+    XmlNode **nodes;
+    size_t size;
+
+    if (count <= set->size)
+        return XML_NOERR;
+    size = set->size ? set->size : 16;
+    while (size < count)
+        size *= 2;
+    nodes = realloc(set->nodes, size * sizeof(XmlNode *));
+    if (!nodes)
+        return XML_MEMORY_ERR;
+    set->nodes = nodes;
+    set->size = size;
+    return XML_NOERR;
+}
+
+// the nodes of frozen documents (and snapshots) don't point back to their
+// context, but they all lie in the image mapped by it
+static int
+XmlNodeSetOwns(XmlNodeSet *set, XmlNode *node)
+{
+    char *image = (char *)set->xml->snapshot;
+
+    if (!node)
+        return 0;
+    if (image)
+        return (char *)node >= image && (char *)node < image + set->xml->snapshotSize;
+    return XmlGetContext(node) == set->xml;
+}
+
+XmlNodeSet *
+XmlCreateNodeSet(TXml *xml)
+{
+    XmlNodeSet *set;
+    if (!xml)
+        return NULL;
+    set = calloc(1, sizeof(XmlNodeSet));
+    if (!set)
+        return NULL;
+    set->xml = xml;
+    set->sorted = 1;
+    set->numbering = xml->numbering;
+    return set;
+}
+
+void
+XmlDestroyNodeSet(XmlNodeSet *set)
+{
+    if (set->nodes)
+        free(set->nodes);
+    free(set);
+}
+
+// numbers the document if needed. If the nodes have been numbered again
+// since the set has been put in order, the order can't be trusted anymore
+static void
+XmlNodeSetNumber(XmlNodeSet *set)
+{
+    XmlNumberNodes(set->xml);
+    if (set->numbering != set->xml->numbering) {
+        if (set->count > 1)
+            set->sorted = 0;
+        set->numbering = set->xml->numbering;
+    }
+}
+
+XmlErr
+XmlNodeSetAdd(XmlNodeSet *set, XmlNode *node)
+{
+    XmlErr err;
+
+    if (!XmlNodeSetOwns(set, node))
+        return XML_BADARGS;
+    if (set->count && set->nodes[set->count - 1] == node)
+        return XML_NOERR;
+    err = XmlNodeSetGrow(set, set->count + 1);
+    if (err != XML_NOERR)
+        return err;
+    if (set->sorted) {
+        XmlNodeSetNumber(set);
+        if (set->sorted && set->count && set->nodes[set->count - 1]->order >= node->order)
+            set->sorted = 0;
+    }
+    set->nodes[set->count++] = node;
+    return XML_NOERR;
+}
+
+static int
+XmlNodeSetCompareItems(const void *a, const void *b)
+{
+    return XmlCompareNodes(*(XmlNode **)a, *(XmlNode **)b);
+}
+
+void
+XmlNodeSetSort(XmlNodeSet *set)
+{
+    size_t i, kept = 1;
+
+    XmlNodeSetNumber(set);
+    if (set->sorted)
+        return;
+    qsort(set->nodes, set->count, sizeof(XmlNode *), XmlNodeSetCompareItems);
+    for (i = 1; i < set->count; i++) {
+        if (set->nodes[i] != set->nodes[kept - 1])
+            set->nodes[kept++] = set->nodes[i];
+    }
+    set->count = kept;
+    set->sorted = 1;
+}
+
+size_t
+XmlNodeSetCount(XmlNodeSet *set)
+{
+    XmlNodeSetSort(set);
+    return set->count;
+}
+
+XmlNode *
+XmlNodeSetItem(XmlNodeSet *set, size_t position)
+{
+    XmlNodeSetSort(set);
+    if (position < 1 || position > set->count)
+        return NULL;
+    return set->nodes[position - 1];
+}
+
+int
+XmlNodeSetContains(XmlNodeSet *set, XmlNode *node)
+{
+    size_t lo = 0, hi;
+
+    XmlNodeSetSort(set);
+    if (!XmlNodeSetOwns(set, node))
+        return 0;
+    hi = set->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        int cmp = XmlCompareNodes(set->nodes[mid], node);
+        if (cmp == 0)
+            return set->nodes[mid] == node;
+        if (cmp < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return 0;
+}
+
+// merge two sets walking both of them once, keeping the nodes found only
+// in the first one, in both of them and/or only in the second one
+static XmlNodeSet *
+XmlNodeSetMerge(XmlNodeSet *a, XmlNodeSet *b, int onlyA, int both, int onlyB)
+{
+    XmlNodeSet *set;
+    size_t i = 0, j = 0;
+
+    if (a->xml != b->xml)
+        return NULL;
+    XmlNodeSetSort(a);
+    XmlNodeSetSort(b);
+    set = XmlCreateNodeSet(a->xml);
+    if (!set)
+        return NULL;
+    if (XmlNodeSetGrow(set, (onlyA ? a->count : 0) + (onlyB ? b->count : 0) + 1) != XML_NOERR) {
+        XmlDestroyNodeSet(set);
+        return NULL;
+    }
+    while (i < a->count || j < b->count) {
+        int cmp;
+        if (i == a->count)
+            cmp = 1;
+        else if (j == b->count)
+            cmp = -1;
+        else
+            cmp = XmlCompareNodes(a->nodes[i], b->nodes[j]);
+        if (cmp < 0) {
+            if (onlyA)
+                set->nodes[set->count++] = a->nodes[i];
+            i++;
+        } else if (cmp > 0) {
+            if (onlyB)
+                set->nodes[set->count++] = b->nodes[j];
+            j++;
+        } else {
+            if (both)
+                set->nodes[set->count++] = a->nodes[i];
+            i++;
+            j++;
+        }
+    }
+    return set;
+}
+
+XmlNodeSet *
+XmlNodeSetUnion(XmlNodeSet *a, XmlNodeSet *b)
+{
+    return XmlNodeSetMerge(a, b, 1, 1, 1);
+}
+
+XmlNodeSet *
+XmlNodeSetIntersection(XmlNodeSet *a, XmlNodeSet *b)
+{
+    return XmlNodeSetMerge(a, b, 0, 1, 0);
+}
+
+XmlNodeSet *
+XmlNodeSetDifference(XmlNodeSet *a, XmlNodeSet *b)
+{
+    return XmlNodeSetMerge(a, b, 1, 0, 0);
+}
+
+XmlNodeSet *
+XmlNodeSetRange(XmlNodeSet *set, size_t first, size_t last)
+{
+    XmlNodeSet *range;
+
+    XmlNodeSetSort(set);
+    range = XmlCreateNodeSet(set->xml);
+    if (!range)
+        return NULL;
+    if (first < 1)
+        first = 1;
+    if (!last || last > set->count)
+        last = set->count;
+    if (first > last)
+        return range;
+    if (XmlNodeSetGrow(range, last - first + 1) != XML_NOERR) {
+        XmlDestroyNodeSet(range);
+        return NULL;
+    }
+    memcpy(range->nodes, set->nodes + first - 1, (last - first + 1) * sizeof(XmlNode *));
+    range->count = last - first + 1;
+    return range;
+}
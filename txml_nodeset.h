@@ -0,0 +1,124 @@
+/*
+ *  txml_nodeset.h
+ *
+ *  Sets of nodes of a TXml document kept in document order
+ *
+ */
+
+#ifndef __TINYXML_NODESET_H__
+#define __TINYXML_NODESET_H__
+
+#include "txml.h"
+
+/**
+    @type XmlNodeSet
+    @brief Nodes of a document without duplicates, ordered by their position
+           in the document (see XmlNumberNodes()), so that sets can be combined
+           by merging them in linear time.
+           A set refers to the nodes, so it must be released (or not used anymore)
+           before they are removed from the document
+*/
+typedef struct __XmlNodeSet {
+    TXml *xml; ///< the document holding the nodes
+    XmlNode **nodes;
+    size_t count;
+    size_t size; // allocated slots
+    int sorted; // the nodes are in document order (without duplicates)
+    unsigned long numbering; // numbering of the document the order refers to (see TXml)
+} XmlNodeSet;
+
+/***
+    @brief create an empty set of nodes
+    @arg pointer to a valid xml context (the document the nodes will belong to)
+    @return a pointer to a new XmlNodeSet (to be released using XmlDestroyNodeSet()),
+            NULL on errors
+*/
+XmlNodeSet *XmlCreateNodeSet(TXml *xml);
+
+/***
+    @brief release a set (but not the nodes it refers to)
+    @arg pointer to a valid XmlNodeSet
+*/
+void XmlDestroyNodeSet(XmlNodeSet *set);
+
+/***
+    @brief add a node to a set. Adding the nodes in document order is cheaper,
+           otherwise they are sorted (and the duplicates dropped) by the
+           first function which needs the set in order
+    @arg pointer to a valid XmlNodeSet
+    @arg the node (which must belong to the document of the set)
+    @return XML_NOERR on success, XML_BADARGS if the node doesn't belong to
+            the document, XML_MEMORY_ERR otherwise
+*/
+XmlErr XmlNodeSetAdd(XmlNodeSet *set, XmlNode *node);
+
+/***
+    @brief put a set in document order and drop the duplicates.
+           The document is numbered again if its structure changed
+           since the set has been built
+    @arg pointer to a valid XmlNodeSet
+*/
+void XmlNodeSetSort(XmlNodeSet *set);
+
+/***
+    @brief get the number of nodes in a set
+    @arg pointer to a valid XmlNodeSet
+    @return the number of (distinct) nodes
+*/
+size_t XmlNodeSetCount(XmlNodeSet *set);
+
+/***
+    @brief get a node of a set
+    @arg pointer to a valid XmlNodeSet
+    @arg the position of the node in document order (starting from 1, as position() in XPath)
+    @return the node at the given position, NULL if out of range
+*/
+XmlNode *XmlNodeSetItem(XmlNodeSet *set, size_t position);
+
+/***
+    @brief check if a node belongs to a set (using a binary search)
+    @arg pointer to a valid XmlNodeSet
+    @arg the node to look for
+    @return 1 if the node is in the set, 0 otherwise
+*/
+int XmlNodeSetContains(XmlNodeSet *set, XmlNode *node);
+
+/***
+    @brief build the union of two sets of the same document ('|' or 'or' in XPath)
+    @arg pointer to a valid XmlNodeSet
+    @arg pointer to a valid XmlNodeSet
+    @return a newly allocated XmlNodeSet (to be released using XmlDestroyNodeSet()),
+            NULL if the sets belong to different documents or on memory errors
+*/
+XmlNodeSet *XmlNodeSetUnion(XmlNodeSet *a, XmlNodeSet *b);
+
+/***
+    @brief build the intersection of two sets of the same document ('and' in XPath)
+    @arg pointer to a valid XmlNodeSet
+    @arg pointer to a valid XmlNodeSet
+    @return a newly allocated XmlNodeSet (to be released using XmlDestroyNodeSet()),
+            NULL if the sets belong to different documents or on memory errors
+*/
+XmlNodeSet *XmlNodeSetIntersection(XmlNodeSet *a, XmlNodeSet *b);
+
+/***
+    @brief build the set of the nodes of the first set which are not in the second one
+    @arg pointer to a valid XmlNodeSet
+    @arg pointer to a valid XmlNodeSet
+    @return a newly allocated XmlNodeSet (to be released using XmlDestroyNodeSet()),
+            NULL if the sets belong to different documents or on memory errors
+*/
+XmlNodeSet *XmlNodeSetDifference(XmlNodeSet *a, XmlNodeSet *b);
+
+/***
+    @brief select the nodes of a set by their position in document order
+           (as a [position() >= first and position() <= last] predicate)
+    @arg pointer to a valid XmlNodeSet
+    @arg position of the first node to select (starting from 1)
+    @arg position of the last node to select (0 to select up to the end of the set)
+    @return a newly allocated XmlNodeSet (to be released using XmlDestroyNodeSet()),
+            NULL on memory errors
+*/
+XmlNodeSet *XmlNodeSetRange(XmlNodeSet *set, size_t first, size_t last);
+
+#endif
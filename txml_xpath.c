@@ -0,0 +1,3556 @@
+/*
+ *  txml_xpath.c
+ *
+ *  XPath 1.0 evaluator working directly on the TXml tree
+ *
+ */
+
+#include "txml_xpath.h"
+#include "string.h"
+#include "stdlib.h"
+#include "ctype.h"
+#include "math.h"
+#ifdef USE_PTHREADS
+#include "pthread.h"
+#endif
+
+//
+// TOKENS
+//
+#define XML_XPATH_TOK_END         0
+#define XML_XPATH_TOK_LPAREN      1
+#define XML_XPATH_TOK_RPAREN      2
+#define XML_XPATH_TOK_LBRACKET    3
+#define XML_XPATH_TOK_RBRACKET    4
+#define XML_XPATH_TOK_DOT         5
+#define XML_XPATH_TOK_DOTDOT      6
+#define XML_XPATH_TOK_AT          7
+#define XML_XPATH_TOK_COMMA       8
+#define XML_XPATH_TOK_COLONCOLON  9
+#define XML_XPATH_TOK_NAMETEST    10
+#define XML_XPATH_TOK_NODETYPE    11
+#define XML_XPATH_TOK_FUNCTION    12
+#define XML_XPATH_TOK_AXIS        13
+#define XML_XPATH_TOK_LITERAL     14
+#define XML_XPATH_TOK_NUMBER      15
+#define XML_XPATH_TOK_VARIABLE    16
+// operators
+#define XML_XPATH_TOK_SLASH       17
+#define XML_XPATH_TOK_DSLASH      18
+#define XML_XPATH_TOK_PIPE        19
+#define XML_XPATH_TOK_PLUS        20
+#define XML_XPATH_TOK_MINUS       21
+#define XML_XPATH_TOK_EQ          22
+#define XML_XPATH_TOK_NEQ         23
+#define XML_XPATH_TOK_LT          24
+#define XML_XPATH_TOK_LTE         25
+#define XML_XPATH_TOK_GT          26
+#define XML_XPATH_TOK_GTE         27
+#define XML_XPATH_TOK_AND         28
+#define XML_XPATH_TOK_OR          29
+#define XML_XPATH_TOK_MOD         30
+#define XML_XPATH_TOK_DIV         31
+#define XML_XPATH_TOK_MULTIPLY    32
+
+#define XML_XPATH_TOK_IS_OPERATOR(__t) ((__t) >= XML_XPATH_TOK_SLASH)
+
+typedef struct __XmlXPathToken {
+    int type;
+    char *start;
+    size_t len;
+    double number;
+} XmlXPathToken;
+
+//
+// SYNTAX TREE
+//
+#define XML_XPATH_OP_OR       0
+#define XML_XPATH_OP_AND      1
+#define XML_XPATH_OP_EQ       2
+#define XML_XPATH_OP_NEQ      3
+#define XML_XPATH_OP_LT       4
+#define XML_XPATH_OP_LTE      5
+#define XML_XPATH_OP_GT       6
+#define XML_XPATH_OP_GTE      7
+#define XML_XPATH_OP_ADD      8
+#define XML_XPATH_OP_SUB      9
+#define XML_XPATH_OP_MUL      10
+#define XML_XPATH_OP_DIV      11
+#define XML_XPATH_OP_MOD      12
+#define XML_XPATH_OP_NEG      13
+#define XML_XPATH_OP_UNION    14
+#define XML_XPATH_OP_PATH     15 // [left] (/ or //) steps
+#define XML_XPATH_OP_FILTER   16 // left[predicates]
+#define XML_XPATH_OP_STEP     17
+#define XML_XPATH_OP_LITERAL  18
+#define XML_XPATH_OP_NUMBER   19
+#define XML_XPATH_OP_FUNCTION 20
+
+#define XML_XPATH_AXIS_ANCESTOR           0
+#define XML_XPATH_AXIS_ANCESTOR_OR_SELF   1
+#define XML_XPATH_AXIS_ATTRIBUTE          2
+#define XML_XPATH_AXIS_CHILD              3
+#define XML_XPATH_AXIS_DESCENDANT         4
+#define XML_XPATH_AXIS_DESCENDANT_OR_SELF 5
+#define XML_XPATH_AXIS_FOLLOWING          6
+#define XML_XPATH_AXIS_FOLLOWING_SIBLING  7
+#define XML_XPATH_AXIS_NAMESPACE          8
+#define XML_XPATH_AXIS_PARENT             9
+#define XML_XPATH_AXIS_PRECEDING          10
+#define XML_XPATH_AXIS_PRECEDING_SIBLING  11
+#define XML_XPATH_AXIS_SELF               12
+
+static char *XmlXPathAxes[] = {
+    "ancestor",
+    "ancestor-or-self",
+    "attribute",
+    "child",
+    "descendant",
+    "descendant-or-self",
+    "following",
+    "following-sibling",
+    "namespace",
+    "parent",
+    "preceding",
+    "preceding-sibling",
+    "self",
+    NULL
+};
+
+// axes walking backwards in document order
+#define XML_XPATH_AXIS_IS_REVERSE(__a) ((__a) == XML_XPATH_AXIS_ANCESTOR || \
+                                        (__a) == XML_XPATH_AXIS_ANCESTOR_OR_SELF || \
+                                        (__a) == XML_XPATH_AXIS_PRECEDING || \
+                                        (__a) == XML_XPATH_AXIS_PRECEDING_SIBLING)
+
+#define XML_XPATH_TEST_NAME    0 // name, prefix:name or prefix:*
+#define XML_XPATH_TEST_ANY     1 // *
+#define XML_XPATH_TEST_NODE    2 // node()
+#define XML_XPATH_TEST_TEXT    3 // text()
+#define XML_XPATH_TEST_COMMENT 4 // comment()
+#define XML_XPATH_TEST_PI      5 // processing-instruction()
+
+#define XML_XPATH_FN_LAST             0
+#define XML_XPATH_FN_POSITION         1
+#define XML_XPATH_FN_COUNT            2
+#define XML_XPATH_FN_ID               3
+#define XML_XPATH_FN_LOCAL_NAME       4
+#define XML_XPATH_FN_NAMESPACE_URI    5
+#define XML_XPATH_FN_NAME             6
+#define XML_XPATH_FN_STRING           7
+#define XML_XPATH_FN_CONCAT           8
+#define XML_XPATH_FN_STARTS_WITH      9
+#define XML_XPATH_FN_CONTAINS         10
+#define XML_XPATH_FN_SUBSTRING_BEFORE 11
+#define XML_XPATH_FN_SUBSTRING_AFTER  12
+#define XML_XPATH_FN_SUBSTRING        13
+#define XML_XPATH_FN_STRING_LENGTH    14
+#define XML_XPATH_FN_NORMALIZE_SPACE  15
+#define XML_XPATH_FN_TRANSLATE        16
+#define XML_XPATH_FN_BOOLEAN          17
+#define XML_XPATH_FN_NOT              18
+#define XML_XPATH_FN_TRUE             19
+#define XML_XPATH_FN_FALSE            20
+#define XML_XPATH_FN_LANG             21
+#define XML_XPATH_FN_NUMBER           22
+#define XML_XPATH_FN_SUM              23
+#define XML_XPATH_FN_FLOOR            24
+#define XML_XPATH_FN_CEILING          25
+#define XML_XPATH_FN_ROUND            26
+
+static struct {
+    char *name;
+    int minArgs;
+    int maxArgs; // -1 if unbounded
+} XmlXPathFunctions[] = {
+    { "last", 0, 0 },
+    { "position", 0, 0 },
+    { "count", 1, 1 },
+    { "id", 1, 1 },
+    { "local-name", 0, 1 },
+    { "namespace-uri", 0, 1 },
+    { "name", 0, 1 },
+    { "string", 0, 1 },
+    { "concat", 2, -1 },
+    { "starts-with", 2, 2 },
+    { "contains", 2, 2 },
+    { "substring-before", 2, 2 },
+    { "substring-after", 2, 2 },
+    { "substring", 2, 3 },
+    { "string-length", 0, 1 },
+    { "normalize-space", 0, 1 },
+    { "translate", 3, 3 },
+    { "boolean", 1, 1 },
+    { "not", 1, 1 },
+    { "true", 0, 0 },
+    { "false", 0, 0 },
+    { "lang", 1, 1 },
+    { "number", 0, 1 },
+    { "sum", 1, 1 },
+    { "floor", 1, 1 },
+    { "ceiling", 1, 1 },
+    { "round", 1, 1 },
+    { NULL, 0, 0 }
+};
+
+typedef struct __XmlXPathAst {
+    int op;
+    struct __XmlXPathAst *left;
+    struct __XmlXPathAst *right;
+    struct __XmlXPathAst *next; // next step, predicate or argument in a list
+    struct __XmlXPathAst *steps; // XML_XPATH_OP_PATH
+    struct __XmlXPathAst *predicates; // XML_XPATH_OP_STEP and XML_XPATH_OP_FILTER
+    struct __XmlXPathAst *args; // XML_XPATH_OP_FUNCTION
+    int absolute;
+    int axis;
+    int test;
+    char *prefix;
+    char *name;
+    int function;
+    int nargs;
+    double number;
+    char *literal;
+} XmlXPathAst;
+
+typedef struct __XmlXPathParser {
+    char *expr;
+    XmlXPathToken *tokens;
+    size_t count;
+    size_t pos;
+    int error;
+} XmlXPathParser;
+
+typedef struct __XmlXPathContext {
+    TXml *xml;
+    XmlXPathNode node;
+    size_t position;
+    size_t size;
+} XmlXPathContext;
+
+typedef struct __XmlXPathBuffer {
+    char *data;
+    size_t len;
+    size_t size;
+} XmlXPathBuffer;
+
+static XmlErr XmlXPathEval(XmlXPathAst *ast, XmlXPathContext *ctx, XmlXPathValue *res);
+
+//
+// HELPERS
+//
+static int
+XmlXPathBufferAppend(XmlXPathBuffer *buf, const char *data, size_t len)
+{
+    if (buf->len + len + 1 > buf->size) {
+        size_t newSize = buf->size ? buf->size : 64;
+        char *newData;
+        while (newSize < buf->len + len + 1)
+            newSize *= 2;
+        newData = realloc(buf->data, newSize);
+        if (!newData)
+            return XML_MEMORY_ERR;
+        buf->data = newData;
+        buf->size = newSize;
+    }
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+    buf->data[buf->len] = 0;
+    return XML_NOERR;
+}
+
+// returns the buffer contents (an empty string if nothing has been appended)
+static char *
+XmlXPathBufferRelease(XmlXPathBuffer *buf)
+{
+    if (!buf->data)
+        return strdup("");
+    return buf->data;
+}
+
+// length of the utf-8 sequence starting at str
+static size_t
+XmlXPathCharLen(const char *str)
+{
+    unsigned char c = (unsigned char)*str;
+    size_t len = 1, i;
+    if ((c & 0xe0) == 0xc0)
+        len = 2;
+    else if ((c & 0xf0) == 0xe0)
+        len = 3;
+    else if ((c & 0xf8) == 0xf0)
+        len = 4;
+    // don't run past the end of truncated sequences
+    for (i = 1; i < len; i++) {
+        if (!str[i])
+            return i;
+    }
+    return len;
+}
+
+static size_t
+XmlXPathStrLen(const char *str)
+{
+    size_t count = 0;
+    while (*str) {
+        str += XmlXPathCharLen(str);
+        count++;
+    }
+    return count;
+}
+
+static int
+XmlXPathIsSpace(char c)
+{
+    return (c == ' ' || c == '\t' || c == '\r' || c == '\n');
+}
+
+static double
+XmlXPathStringToNumber(const char *str)
+{
+    const char *p = str;
+    const char *end;
+    int digits = 0;
+    while (XmlXPathIsSpace(*p))
+        p++;
+    end = p;
+    if (*end == '-')
+        end++;
+    while (isdigit((unsigned char)*end)) {
+        end++;
+        digits++;
+    }
+    if (*end == '.') {
+        end++;
+        while (isdigit((unsigned char)*end)) {
+            end++;
+            digits++;
+        }
+    }
+    if (!digits)
+        return NAN;
+    str = end;
+    while (XmlXPathIsSpace(*str))
+        str++;
+    if (*str)
+        return NAN;
+    return strtod(p, NULL);
+}
+
+static char *
+XmlXPathNumberToString(double number)
+{
+    char buf[512];
+    if (isnan(number))
+        return strdup("NaN");
+    if (isinf(number))
+        return strdup(number > 0 ? "Infinity" : "-Infinity");
+    if (number == 0)
+        return strdup("0"); // negative zero too
+    if (number == floor(number) && fabs(number) < 1e15) {
+        snprintf(buf, sizeof(buf), "%.0f", number);
+    } else {
+        snprintf(buf, sizeof(buf), "%.15g", number);
+        if (strchr(buf, 'e')) { // XPath numbers are never written in exponential notation
+            int exponent = (int)floor(log10(fabs(number)));
+            char *p;
+            snprintf(buf, sizeof(buf), "%.*f", exponent < 0 ? 15 - exponent : 0, number);
+            if (strchr(buf, '.')) {
+                p = buf + strlen(buf) - 1;
+                while (*p == '0')
+                    *p-- = 0;
+                if (*p == '.')
+                    *p = 0;
+            }
+        }
+    }
+    return strdup(buf);
+}
+
+//
+// NODES AND NODE-SETS
+//
+static int
+XmlXPathTypeOf(XmlNode *node)
+{
+    switch(node->type) {
+        case XML_NODETYPE_COMMENT:
+            return XML_XPATH_NODE_COMMENT;
+        case XML_NODETYPE_CDATA:
+            return XML_XPATH_NODE_TEXT;
+        default:
+            return XML_XPATH_NODE_ELEMENT;
+    }
+}
+
+// the value of an element is exposed as a text node (the first child of the element)
+static int
+XmlXPathIsValueText(XmlXPathNode *n)
+{
+    return (n->type == XML_XPATH_NODE_TEXT && n->node->type == XML_NODETYPE_SIMPLE);
+}
+
+static int
+XmlXPathHasValueText(XmlNode *node)
+{
+    return (node->type == XML_NODETYPE_SIMPLE && node->value && *node->value);
+}
+
+// namespace declarations are kept together with the attributes
+static int
+XmlXPathIsNamespaceDecl(XmlNodeAttribute *attr)
+{
+    return (strncmp(attr->name, "xmlns", 5) == 0 &&
+            (attr->name[5] == 0 || attr->name[5] == ':'));
+}
+
+static XmlErr
+XmlXPathSetAdd(XmlXPathNodeSet *set, int type, XmlNode *node, XmlNodeAttribute *attr)
+{
+    if (set->count == set->size) {
+        size_t newSize = set->size ? set->size * 2 : 16;
+        XmlXPathNode *newNodes = realloc(set->nodes, newSize * sizeof(XmlXPathNode));
+        if (!newNodes)
+            return XML_MEMORY_ERR;
+        set->nodes = newNodes;
+        set->size = newSize;
+    }
+    set->nodes[set->count].type = type;
+    set->nodes[set->count].node = node;
+    set->nodes[set->count].attr = attr;
+    set->count++;
+    return XML_NOERR;
+}
+
+static void
+XmlXPathSetClear(XmlXPathNodeSet *set)
+{
+    if (set->nodes)
+        free(set->nodes);
+    memset(set, 0, sizeof(XmlXPathNodeSet));
+}
+
+static int
+XmlXPathSameNode(const XmlXPathNode *a, const XmlXPathNode *b)
+{
+    return (a->type == b->type && a->node == b->node && a->attr == b->attr);
+}
+
+// attributes and the value of an element come right after it (in this order)
+static int
+XmlXPathRank(const XmlXPathNode *n)
+{
+    if (n->type == XML_XPATH_NODE_ATTRIBUTE)
+        return 1;
+    if (XmlXPathIsValueText((XmlXPathNode *)n))
+        return 2;
+    return 0;
+}
+
+// compare the position of two nodes in document order
+// (the document is numbered before evaluating an expression)
+static int
+XmlXPathCompareNodes(const XmlXPathNode *a, const XmlXPathNode *b)
+{
+    XmlNode *x = a->node;
+    XmlNode *y = b->node;
+
+    if (x == y) {
+        int ra = XmlXPathRank(a);
+        int rb = XmlXPathRank(b);
+        if (ra != rb)
+            return ra < rb ? -1 : 1;
+        if (a->attr != b->attr) {
+            XmlNodeAttribute *attr;
+            TAILQ_FOREACH(attr, &x->attributes, list) {
+                if (attr == a->attr)
+                    return -1;
+                if (attr == b->attr)
+                    return 1;
+            }
+        }
+        return 0;
+    }
+    if (!x) // the root comes first
+        return -1;
+    if (!y)
+        return 1;
+    return XmlCompareNodes(x, y);
+}
+
+static int
+XmlXPathCompareItems(const void *a, const void *b)
+{
+    return XmlXPathCompareNodes((const XmlXPathNode *)a, (const XmlXPathNode *)b);
+}
+
+// sort the set in document order and drop the duplicates
+static void
+XmlXPathSetSort(XmlXPathNodeSet *set)
+{
+    size_t i, kept = 1;
+    if (set->count < 2)
+        return;
+    qsort(set->nodes, set->count, sizeof(XmlXPathNode), XmlXPathCompareItems);
+    for (i = 1; i < set->count; i++) {
+        if (!XmlXPathSameNode(&set->nodes[i], &set->nodes[kept - 1]))
+            set->nodes[kept++] = set->nodes[i];
+    }
+    set->count = kept;
+}
+
+// merge two sets already in document order into dst
+static XmlErr
+XmlXPathSetMerge(XmlXPathNodeSet *dst, XmlXPathNodeSet *src)
+{
+    XmlXPathNodeSet merged = { NULL, 0, 0 };
+    size_t i = 0, j = 0;
+    XmlErr err = XML_NOERR;
+
+    if (!src->count)
+        return XML_NOERR;
+    if (!dst->count) {
+        XmlXPathSetClear(dst);
+        *dst = *src;
+        memset(src, 0, sizeof(XmlXPathNodeSet));
+        return XML_NOERR;
+    }
+    while (err == XML_NOERR && (i < dst->count || j < src->count)) {
+        XmlXPathNode *n;
+        if (j == src->count) {
+            n = &dst->nodes[i++];
+        } else if (i == dst->count) {
+            n = &src->nodes[j++];
+        } else {
+            int cmp = XmlXPathCompareNodes(&dst->nodes[i], &src->nodes[j]);
+            if (cmp == 0)
+                j++;
+            n = (cmp <= 0) ? &dst->nodes[i++] : &src->nodes[j++];
+        }
+        err = XmlXPathSetAdd(&merged, n->type, n->node, n->attr);
+    }
+    if (err != XML_NOERR) {
+        XmlXPathSetClear(&merged);
+        return err;
+    }
+    XmlXPathSetClear(dst);
+    *dst = merged;
+    return XML_NOERR;
+}
+
+// check if a contains b
+static int
+XmlXPathIsAncestor(XmlXPathNode *a, XmlXPathNode *b)
+{
+    if (a->type == XML_XPATH_NODE_ROOT)
+        return 1;
+    if (a->type != XML_XPATH_NODE_ELEMENT)
+        return 0;
+    return (b->node && (a->node == b->node || XmlIsAncestor(a->node, b->node)));
+}
+
+// check if any node of a sorted set is contained in another node of the set
+// (if so, the nodes selected from the set along the child and descendant axes need sorting)
+static int
+XmlXPathSetIsNested(XmlXPathNodeSet *set)
+{
+    size_t i;
+    for (i = 1; i < set->count; i++) {
+        if (XmlXPathIsAncestor(&set->nodes[i - 1], &set->nodes[i]))
+            return 1;
+    }
+    return 0;
+}
+
+static XmlErr
+XmlXPathNodeText(XmlNode *node, XmlXPathBuffer *buf)
+{
+    XmlNode *child;
+    XmlErr err;
+    if (node->type == XML_NODETYPE_COMMENT)
+        return XML_NOERR;
+    if (node->value && *node->value) {
+        err = XmlXPathBufferAppend(buf, node->value, strlen(node->value));
+        if (err != XML_NOERR)
+            return err;
+    }
+    TAILQ_FOREACH(child, &node->children, siblings) {
+        err = XmlXPathNodeText(child, buf);
+        if (err != XML_NOERR)
+            return err;
+    }
+    return XML_NOERR;
+}
+
+char *
+XmlXPathStringValue(TXml *xml, XmlXPathNode *n)
+{
+    XmlXPathBuffer buf = { NULL, 0, 0 };
+    XmlNode *node;
+
+    if (!xml || !n)
+        return NULL;
+    switch(n->type) {
+        case XML_XPATH_NODE_ROOT:
+            TAILQ_FOREACH(node, &xml->rootElements, siblings) {
+                if (XmlXPathNodeText(node, &buf) != XML_NOERR) {
+                    free(buf.data);
+                    return NULL;
+                }
+            }
+            return XmlXPathBufferRelease(&buf);
+        case XML_XPATH_NODE_ELEMENT:
+            if (XmlXPathNodeText(n->node, &buf) != XML_NOERR) {
+                free(buf.data);
+                return NULL;
+            }
+            return XmlXPathBufferRelease(&buf);
+        case XML_XPATH_NODE_ATTRIBUTE:
+            return strdup(n->attr->value ? n->attr->value : "");
+        default:
+            return strdup(n->node->value ? n->node->value : "");
+    }
+}
+
+//
+// VALUES
+//
+static void
+XmlXPathValueClear(XmlXPathValue *value)
+{
+    XmlXPathSetClear(&value->set);
+    if (value->string)
+        free(value->string);
+    memset(value, 0, sizeof(XmlXPathValue));
+}
+
+static void
+XmlXPathSetBoolean(XmlXPathValue *value, int boolean)
+{
+    value->type = XML_XPATH_BOOLEAN;
+    value->boolean = boolean ? 1 : 0;
+}
+
+static void
+XmlXPathSetNumber(XmlXPathValue *value, double number)
+{
+    value->type = XML_XPATH_NUMBER;
+    value->number = number;
+}
+
+// takes ownership of string
+static XmlErr
+XmlXPathSetString(XmlXPathValue *value, char *string)
+{
+    if (!string)
+        return XML_MEMORY_ERR;
+    value->type = XML_XPATH_STRING;
+    value->string = string;
+    return XML_NOERR;
+}
+
+static int
+XmlXPathToBoolean(XmlXPathValue *value)
+{
+    switch(value->type) {
+        case XML_XPATH_NODESET:
+            return value->set.count > 0;
+        case XML_XPATH_BOOLEAN:
+            return value->boolean;
+        case XML_XPATH_NUMBER:
+            return (value->number != 0 && !isnan(value->number));
+        default:
+            return (value->string[0] != 0);
+    }
+}
+
+// returns a newly allocated string
+static char *
+XmlXPathToString(TXml *xml, XmlXPathValue *value)
+{
+    switch(value->type) {
+        case XML_XPATH_NODESET:
+            if (!value->set.count)
+                return strdup("");
+            return XmlXPathStringValue(xml, &value->set.nodes[0]);
+        case XML_XPATH_BOOLEAN:
+            return strdup(value->boolean ? "true" : "false");
+        case XML_XPATH_NUMBER:
+            return XmlXPathNumberToString(value->number);
+        default:
+            return strdup(value->string);
+    }
+}
+
+static double
+XmlXPathToNumber(TXml *xml, XmlXPathValue *value)
+{
+    double number;
+    char *string;
+    switch(value->type) {
+        case XML_XPATH_BOOLEAN:
+            return value->boolean ? 1 : 0;
+        case XML_XPATH_NUMBER:
+            return value->number;
+        case XML_XPATH_STRING:
+            return XmlXPathStringToNumber(value->string);
+        default:
+            string = XmlXPathToString(xml, value);
+            if (!string)
+                return NAN;
+            number = XmlXPathStringToNumber(string);
+            free(string);
+            return number;
+    }
+}
+
+//
+// LEXER
+//
+static int
+XmlXPathIsNameStart(char c)
+{
+    return (isalpha((unsigned char)c) || c == '_' || (unsigned char)c >= 0x80);
+}
+
+static int
+XmlXPathIsNameChar(char c)
+{
+    return (XmlXPathIsNameStart(c) || isdigit((unsigned char)c) || c == '.' || c == '-');
+}
+
+static size_t
+XmlXPathScanNCName(char *str)
+{
+    size_t len = 0;
+    if (!XmlXPathIsNameStart(*str))
+        return 0;
+    while (XmlXPathIsNameChar(str[len]))
+        len++;
+    return len;
+}
+
+static int
+XmlXPathNameIs(XmlXPathToken *token, char *name)
+{
+    return (strlen(name) == token->len && strncmp(token->start, name, token->len) == 0);
+}
+
+static XmlErr
+XmlXPathTokenize(XmlXPathParser *parser)
+{
+    char *p = parser->expr;
+    char *message = "unexpected character";
+    size_t size = 0;
+
+    for (;;) {
+        XmlXPathToken token;
+        int prev = parser->count ? parser->tokens[parser->count - 1].type : -1;
+        // if there is a preceding token which isn't one of @ :: ( [ , or an operator
+        // then * is the multiply operator and names are operator names
+        int operatorExpected = (parser->count &&
+                                prev != XML_XPATH_TOK_AT &&
+                                prev != XML_XPATH_TOK_COLONCOLON &&
+                                prev != XML_XPATH_TOK_LPAREN &&
+                                prev != XML_XPATH_TOK_LBRACKET &&
+                                prev != XML_XPATH_TOK_COMMA &&
+                                !XML_XPATH_TOK_IS_OPERATOR(prev));
+
+        while (XmlXPathIsSpace(*p))
+            p++;
+        memset(&token, 0, sizeof(token));
+        token.start = p;
+        token.len = 1;
+        switch(*p) {
+            case 0:
+                token.type = XML_XPATH_TOK_END;
+                token.len = 0;
+                break;
+            case '(':
+                token.type = XML_XPATH_TOK_LPAREN;
+                break;
+            case ')':
+                token.type = XML_XPATH_TOK_RPAREN;
+                break;
+            case '[':
+                token.type = XML_XPATH_TOK_LBRACKET;
+                break;
+            case ']':
+                token.type = XML_XPATH_TOK_RBRACKET;
+                break;
+            case '@':
+                token.type = XML_XPATH_TOK_AT;
+                break;
+            case ',':
+                token.type = XML_XPATH_TOK_COMMA;
+                break;
+            case '|':
+                token.type = XML_XPATH_TOK_PIPE;
+                break;
+            case '+':
+                token.type = XML_XPATH_TOK_PLUS;
+                break;
+            case '-':
+                token.type = XML_XPATH_TOK_MINUS;
+                break;
+            case '=':
+                token.type = XML_XPATH_TOK_EQ;
+                break;
+            case '/':
+                token.type = XML_XPATH_TOK_SLASH;
+                if (p[1] == '/') {
+                    token.type = XML_XPATH_TOK_DSLASH;
+                    token.len = 2;
+                }
+                break;
+            case ':':
+                if (p[1] != ':')
+                    goto syntax_error;
+                token.type = XML_XPATH_TOK_COLONCOLON;
+                token.len = 2;
+                break;
+            case '!':
+                if (p[1] != '=')
+                    goto syntax_error;
+                token.type = XML_XPATH_TOK_NEQ;
+                token.len = 2;
+                break;
+            case '<':
+            case '>':
+                token.type = (*p == '<') ? XML_XPATH_TOK_LT : XML_XPATH_TOK_GT;
+                if (p[1] == '=') {
+                    token.type = (*p == '<') ? XML_XPATH_TOK_LTE : XML_XPATH_TOK_GTE;
+                    token.len = 2;
+                }
+                break;
+            case '"':
+            case '\'':
+            {
+                char *end = strchr(p + 1, *p);
+                if (!end) {
+                    message = "unterminated literal";
+                    goto syntax_error;
+                }
+                token.type = XML_XPATH_TOK_LITERAL;
+                token.len = end - p + 1;
+                break;
+            }
+            case '*':
+                token.type = operatorExpected ? XML_XPATH_TOK_MULTIPLY : XML_XPATH_TOK_NAMETEST;
+                break;
+            case '$':
+            {
+                size_t len = XmlXPathScanNCName(p + 1);
+                if (!len)
+                    goto syntax_error;
+                token.type = XML_XPATH_TOK_VARIABLE;
+                token.len = len + 1;
+                break;
+            }
+            default:
+                if (isdigit((unsigned char)*p) || (*p == '.' && isdigit((unsigned char)p[1]))) {
+                    char *end = p;
+                    while (isdigit((unsigned char)*end))
+                        end++;
+                    if (*end == '.') {
+                        end++;
+                        while (isdigit((unsigned char)*end))
+                            end++;
+                    }
+                    token.type = XML_XPATH_TOK_NUMBER;
+                    token.len = end - p;
+                    token.number = strtod(p, NULL);
+                } else if (*p == '.') {
+                    token.type = XML_XPATH_TOK_DOT;
+                    if (p[1] == '.') {
+                        token.type = XML_XPATH_TOK_DOTDOT;
+                        token.len = 2;
+                    }
+                } else if ((token.len = XmlXPathScanNCName(p))) {
+                    char *next;
+                    if (operatorExpected) {
+                        if (XmlXPathNameIs(&token, "and"))
+                            token.type = XML_XPATH_TOK_AND;
+                        else if (XmlXPathNameIs(&token, "or"))
+                            token.type = XML_XPATH_TOK_OR;
+                        else if (XmlXPathNameIs(&token, "mod"))
+                            token.type = XML_XPATH_TOK_MOD;
+                        else if (XmlXPathNameIs(&token, "div"))
+                            token.type = XML_XPATH_TOK_DIV;
+                        else {
+                            message = "operator expected";
+                            goto syntax_error;
+                        }
+                        break;
+                    }
+                    // QName or prefix:*
+                    if (p[token.len] == ':' && p[token.len + 1] != ':') {
+                        if (p[token.len + 1] == '*') {
+                            token.len += 2;
+                        } else {
+                            size_t len = XmlXPathScanNCName(p + token.len + 1);
+                            if (!len)
+                                goto syntax_error;
+                            token.len += len + 1;
+                        }
+                    }
+                    next = p + token.len;
+                    while (XmlXPathIsSpace(*next))
+                        next++;
+                    if (*next == '(' && token.start[token.len - 1] != '*') {
+                        if (XmlXPathNameIs(&token, "comment") ||
+                            XmlXPathNameIs(&token, "text") ||
+                            XmlXPathNameIs(&token, "processing-instruction") ||
+                            XmlXPathNameIs(&token, "node"))
+                        {
+                            token.type = XML_XPATH_TOK_NODETYPE;
+                        } else {
+                            token.type = XML_XPATH_TOK_FUNCTION;
+                        }
+                    } else if (next[0] == ':' && next[1] == ':') {
+                        token.type = XML_XPATH_TOK_AXIS;
+                    } else {
+                        token.type = XML_XPATH_TOK_NAMETEST;
+                    }
+                } else {
+                    goto syntax_error;
+                }
+                break;
+        }
+
+        if (parser->count == size) {
+            XmlXPathToken *newTokens;
+            size = size ? size * 2 : 16;
+            newTokens = realloc(parser->tokens, size * sizeof(XmlXPathToken));
+            if (!newTokens)
+                return XML_MEMORY_ERR;
+            parser->tokens = newTokens;
+        }
+        parser->tokens[parser->count++] = token;
+        if (token.type == XML_XPATH_TOK_END)
+            return XML_NOERR;
+        p += token.len;
+    }
+
+syntax_error:
+    fprintf(stderr, "XPath syntax error at offset %d in '%s' : %s\n",
+            (int)(p - parser->expr), parser->expr, message);
+    return XML_BADARGS;
+}
+
+//
+// PARSER
+//
+static XmlXPathToken *
+XmlXPathPeek(XmlXPathParser *parser)
+{
+    return &parser->tokens[parser->pos];
+}
+
+static XmlXPathToken *
+XmlXPathNext(XmlXPathParser *parser)
+{
+    XmlXPathToken *token = &parser->tokens[parser->pos];
+    if (token->type != XML_XPATH_TOK_END)
+        parser->pos++;
+    return token;
+}
+
+static void *
+XmlXPathParseError(XmlXPathParser *parser, char *message)
+{
+    if (!parser->error) { // only the first error is meaningful
+        XmlXPathToken *token = XmlXPathPeek(parser);
+        fprintf(stderr, "XPath syntax error at offset %d in '%s' : %s\n",
+                (int)(token->start - parser->expr), parser->expr, message);
+        parser->error = 1;
+    }
+    return NULL;
+}
+
+static int
+XmlXPathExpect(XmlXPathParser *parser, int type, char *message)
+{
+    if (XmlXPathPeek(parser)->type != type) {
+        XmlXPathParseError(parser, message);
+        return 0;
+    }
+    XmlXPathNext(parser);
+    return 1;
+}
+
+static void
+XmlXPathDestroyAst(XmlXPathAst *ast)
+{
+    while (ast) {
+        XmlXPathAst *next = ast->next;
+        XmlXPathDestroyAst(ast->left);
+        XmlXPathDestroyAst(ast->right);
+        XmlXPathDestroyAst(ast->steps);
+        XmlXPathDestroyAst(ast->predicates);
+        XmlXPathDestroyAst(ast->args);
+        if (ast->prefix)
+            free(ast->prefix);
+        if (ast->name)
+            free(ast->name);
+        if (ast->literal)
+            free(ast->literal);
+        free(ast);
+        ast = next;
+    }
+}
+
+static XmlXPathAst *
+XmlXPathNewAst(XmlXPathParser *parser, int op)
+{
+    XmlXPathAst *ast = calloc(1, sizeof(XmlXPathAst));
+    if (!ast)
+        return XmlXPathParseError(parser, "out of memory");
+    ast->op = op;
+    return ast;
+}
+
+static XmlXPathAst *
+XmlXPathNewStep(XmlXPathParser *parser, int axis, int test)
+{
+    XmlXPathAst *step = XmlXPathNewAst(parser, XML_XPATH_OP_STEP);
+    if (step) {
+        step->axis = axis;
+        step->test = test;
+    }
+    return step;
+}
+
+static char *
+XmlXPathTokenDup(XmlXPathParser *parser, char *start, size_t len)
+{
+    char *copy = malloc(len + 1);
+    if (!copy)
+        return XmlXPathParseError(parser, "out of memory");
+    memcpy(copy, start, len);
+    copy[len] = 0;
+    return copy;
+}
+
+static XmlXPathAst *XmlXPathParseExpr(XmlXPathParser *parser);
+
+static int
+XmlXPathParsePredicates(XmlXPathParser *parser, XmlXPathAst *owner)
+{
+    XmlXPathAst **tail = &owner->predicates;
+    while (XmlXPathPeek(parser)->type == XML_XPATH_TOK_LBRACKET) {
+        XmlXPathNext(parser);
+        *tail = XmlXPathParseExpr(parser);
+        if (!*tail)
+            return 0;
+        tail = &(*tail)->next;
+        if (!XmlXPathExpect(parser, XML_XPATH_TOK_RBRACKET, "']' expected"))
+            return 0;
+    }
+    return 1;
+}
+
+static XmlXPathAst *
+XmlXPathParseStep(XmlXPathParser *parser)
+{
+    XmlXPathToken *token = XmlXPathNext(parser);
+    XmlXPathAst *step;
+    int axis = XML_XPATH_AXIS_CHILD;
+    int i;
+
+    switch(token->type) {
+        case XML_XPATH_TOK_DOT:
+            return XmlXPathNewStep(parser, XML_XPATH_AXIS_SELF, XML_XPATH_TEST_NODE);
+        case XML_XPATH_TOK_DOTDOT:
+            return XmlXPathNewStep(parser, XML_XPATH_AXIS_PARENT, XML_XPATH_TEST_NODE);
+        case XML_XPATH_TOK_AT:
+            axis = XML_XPATH_AXIS_ATTRIBUTE;
+            token = XmlXPathNext(parser);
+            break;
+        case XML_XPATH_TOK_AXIS:
+            for (i = 0; XmlXPathAxes[i]; i++) {
+                if (XmlXPathNameIs(token, XmlXPathAxes[i]))
+                    break;
+            }
+            if (!XmlXPathAxes[i]) {
+                parser->pos--;
+                return XmlXPathParseError(parser, "unknown axis");
+            }
+            axis = i;
+            XmlXPathNext(parser); // '::'
+            token = XmlXPathNext(parser);
+            break;
+        default:
+            break;
+    }
+
+    step = XmlXPathNewStep(parser, axis, XML_XPATH_TEST_NAME);
+    if (!step)
+        return NULL;
+    if (token->type == XML_XPATH_TOK_NAMETEST) {
+        char *colon = memchr(token->start, ':', token->len);
+        if (token->len == 1 && *token->start == '*') {
+            step->test = XML_XPATH_TEST_ANY;
+        } else if (colon) {
+            step->prefix = XmlXPathTokenDup(parser, token->start, colon - token->start);
+            if (colon[1] != '*') // prefix:* leaves name unset
+                step->name = XmlXPathTokenDup(parser, colon + 1, token->len - (colon - token->start) - 1);
+        } else {
+            step->name = XmlXPathTokenDup(parser, token->start, token->len);
+        }
+    } else if (token->type == XML_XPATH_TOK_NODETYPE) {
+        if (XmlXPathNameIs(token, "node"))
+            step->test = XML_XPATH_TEST_NODE;
+        else if (XmlXPathNameIs(token, "text"))
+            step->test = XML_XPATH_TEST_TEXT;
+        else if (XmlXPathNameIs(token, "comment"))
+            step->test = XML_XPATH_TEST_COMMENT;
+        else
+            step->test = XML_XPATH_TEST_PI;
+        if (!XmlXPathExpect(parser, XML_XPATH_TOK_LPAREN, "'(' expected")) {
+            XmlXPathDestroyAst(step);
+            return NULL;
+        }
+        if (step->test == XML_XPATH_TEST_PI && XmlXPathPeek(parser)->type == XML_XPATH_TOK_LITERAL)
+            XmlXPathNext(parser);
+        if (!XmlXPathExpect(parser, XML_XPATH_TOK_RPAREN, "')' expected")) {
+            XmlXPathDestroyAst(step);
+            return NULL;
+        }
+    } else {
+        if (token->type != XML_XPATH_TOK_END)
+            parser->pos--;
+        XmlXPathDestroyAst(step);
+        return XmlXPathParseError(parser, "node test expected");
+    }
+    if (parser->error || !XmlXPathParsePredicates(parser, step)) {
+        XmlXPathDestroyAst(step);
+        return NULL;
+    }
+    return step;
+}
+
+static int
+XmlXPathCanStartStep(int type)
+{
+    return (type == XML_XPATH_TOK_NAMETEST || type == XML_XPATH_TOK_NODETYPE ||
+            type == XML_XPATH_TOK_AXIS || type == XML_XPATH_TOK_AT ||
+            type == XML_XPATH_TOK_DOT || type == XML_XPATH_TOK_DOTDOT);
+}
+
+// descendant-or-self::node()/child::x selects the same nodes as descendant::x
+// (unless positional predicates are involved) and doesn't need to visit all
+// the nodes twice and sort the result
+static void
+XmlXPathOptimizeSteps(XmlXPathAst **steps)
+{
+    while (*steps) {
+        XmlXPathAst *step = *steps;
+        XmlXPathAst *next = step->next;
+        if (next && step->axis == XML_XPATH_AXIS_DESCENDANT_OR_SELF &&
+            step->test == XML_XPATH_TEST_NODE && !step->predicates &&
+            next->axis == XML_XPATH_AXIS_CHILD && !next->predicates)
+        {
+            next->axis = XML_XPATH_AXIS_DESCENDANT;
+            step->next = NULL;
+            XmlXPathDestroyAst(step);
+            *steps = next;
+        }
+        steps = &(*steps)->next;
+    }
+}
+
+// RelativeLocationPath, appended to path->steps
+static int
+XmlXPathParseRelativePath(XmlXPathParser *parser, XmlXPathAst *path, XmlXPathAst **tail)
+{
+    for (;;) {
+        *tail = XmlXPathParseStep(parser);
+        if (!*tail)
+            return 0;
+        tail = &(*tail)->next;
+        if (XmlXPathPeek(parser)->type == XML_XPATH_TOK_DSLASH) {
+            XmlXPathNext(parser);
+            *tail = XmlXPathNewStep(parser, XML_XPATH_AXIS_DESCENDANT_OR_SELF, XML_XPATH_TEST_NODE);
+            if (!*tail)
+                return 0;
+            tail = &(*tail)->next;
+        } else if (XmlXPathPeek(parser)->type == XML_XPATH_TOK_SLASH) {
+            XmlXPathNext(parser);
+        } else {
+            break;
+        }
+    }
+    XmlXPathOptimizeSteps(&path->steps);
+    return 1;
+}
+
+static XmlXPathAst *
+XmlXPathParseFunction(XmlXPathParser *parser)
+{
+    XmlXPathToken *token = XmlXPathNext(parser);
+    XmlXPathAst *call;
+    XmlXPathAst **tail;
+    int i;
+
+    for (i = 0; XmlXPathFunctions[i].name; i++) {
+        if (XmlXPathNameIs(token, XmlXPathFunctions[i].name))
+            break;
+    }
+    if (!XmlXPathFunctions[i].name) {
+        parser->pos--;
+        return XmlXPathParseError(parser, "unknown function");
+    }
+    call = XmlXPathNewAst(parser, XML_XPATH_OP_FUNCTION);
+    if (!call)
+        return NULL;
+    call->function = i;
+    XmlXPathNext(parser); // '('
+    tail = &call->args;
+    if (XmlXPathPeek(parser)->type != XML_XPATH_TOK_RPAREN) {
+        for (;;) {
+            *tail = XmlXPathParseExpr(parser);
+            if (!*tail) {
+                XmlXPathDestroyAst(call);
+                return NULL;
+            }
+            tail = &(*tail)->next;
+            call->nargs++;
+            if (XmlXPathPeek(parser)->type != XML_XPATH_TOK_COMMA)
+                break;
+            XmlXPathNext(parser);
+        }
+    }
+    if (!XmlXPathExpect(parser, XML_XPATH_TOK_RPAREN, "')' expected")) {
+        XmlXPathDestroyAst(call);
+        return NULL;
+    }
+    if (call->nargs < XmlXPathFunctions[i].minArgs ||
+        (XmlXPathFunctions[i].maxArgs >= 0 && call->nargs > XmlXPathFunctions[i].maxArgs))
+    {
+        XmlXPathDestroyAst(call);
+        parser->pos--;
+        return XmlXPathParseError(parser, "wrong number of arguments");
+    }
+    return call;
+}
+
+static XmlXPathAst *
+XmlXPathParsePrimary(XmlXPathParser *parser)
+{
+    XmlXPathToken *token = XmlXPathPeek(parser);
+    XmlXPathAst *ast;
+
+    switch(token->type) {
+        case XML_XPATH_TOK_VARIABLE:
+            return XmlXPathParseError(parser, "variables are not supported");
+        case XML_XPATH_TOK_LPAREN:
+            XmlXPathNext(parser);
+            ast = XmlXPathParseExpr(parser);
+            if (ast && !XmlXPathExpect(parser, XML_XPATH_TOK_RPAREN, "')' expected")) {
+                XmlXPathDestroyAst(ast);
+                return NULL;
+            }
+            return ast;
+        case XML_XPATH_TOK_LITERAL:
+            XmlXPathNext(parser);
+            ast = XmlXPathNewAst(parser, XML_XPATH_OP_LITERAL);
+            if (ast) {
+                ast->literal = XmlXPathTokenDup(parser, token->start + 1, token->len - 2);
+                if (!ast->literal) {
+                    XmlXPathDestroyAst(ast);
+                    return NULL;
+                }
+            }
+            return ast;
+        case XML_XPATH_TOK_NUMBER:
+            XmlXPathNext(parser);
+            ast = XmlXPathNewAst(parser, XML_XPATH_OP_NUMBER);
+            if (ast)
+                ast->number = token->number;
+            return ast;
+        default:
+            return XmlXPathParseFunction(parser);
+    }
+}
+
+static XmlXPathAst *
+XmlXPathParsePath(XmlXPathParser *parser)
+{
+    int type = XmlXPathPeek(parser)->type;
+    XmlXPathAst *path;
+
+    if (type == XML_XPATH_TOK_VARIABLE || type == XML_XPATH_TOK_LPAREN ||
+        type == XML_XPATH_TOK_LITERAL || type == XML_XPATH_TOK_NUMBER ||
+        type == XML_XPATH_TOK_FUNCTION)
+    {
+        // FilterExpr, optionally followed by a RelativeLocationPath
+        XmlXPathAst *filter = XmlXPathParsePrimary(parser);
+        if (!filter)
+            return NULL;
+        if (XmlXPathPeek(parser)->type == XML_XPATH_TOK_LBRACKET) {
+            XmlXPathAst *primary = filter;
+            filter = XmlXPathNewAst(parser, XML_XPATH_OP_FILTER);
+            if (!filter) {
+                XmlXPathDestroyAst(primary);
+                return NULL;
+            }
+            filter->left = primary;
+            if (!XmlXPathParsePredicates(parser, filter)) {
+                XmlXPathDestroyAst(filter);
+                return NULL;
+            }
+        }
+        type = XmlXPathPeek(parser)->type;
+        if (type != XML_XPATH_TOK_SLASH && type != XML_XPATH_TOK_DSLASH)
+            return filter;
+        path = XmlXPathNewAst(parser, XML_XPATH_OP_PATH);
+        if (!path) {
+            XmlXPathDestroyAst(filter);
+            return NULL;
+        }
+        path->left = filter;
+    } else {
+        path = XmlXPathNewAst(parser, XML_XPATH_OP_PATH);
+        if (!path)
+            return NULL;
+        if (type == XML_XPATH_TOK_SLASH) {
+            path->absolute = 1;
+            XmlXPathNext(parser);
+            // a lone '/' selects the root
+            if (!XmlXPathCanStartStep(XmlXPathPeek(parser)->type))
+                return path;
+        } else if (type == XML_XPATH_TOK_DSLASH) {
+            path->absolute = 1;
+        } else if (!XmlXPathCanStartStep(type)) {
+            XmlXPathDestroyAst(path);
+            return XmlXPathParseError(parser, "expression expected");
+        } else {
+            if (!XmlXPathParseRelativePath(parser, path, &path->steps)) {
+                XmlXPathDestroyAst(path);
+                return NULL;
+            }
+            return path;
+        }
+    }
+
+    if (XmlXPathPeek(parser)->type == XML_XPATH_TOK_DSLASH) {
+        XmlXPathNext(parser);
+        path->steps = XmlXPathNewStep(parser, XML_XPATH_AXIS_DESCENDANT_OR_SELF, XML_XPATH_TEST_NODE);
+        if (!path->steps || !XmlXPathParseRelativePath(parser, path, &path->steps->next)) {
+            XmlXPathDestroyAst(path);
+            return NULL;
+        }
+    } else {
+        if (XmlXPathPeek(parser)->type == XML_XPATH_TOK_SLASH)
+            XmlXPathNext(parser);
+        if (!XmlXPathParseRelativePath(parser, path, &path->steps)) {
+            XmlXPathDestroyAst(path);
+            return NULL;
+        }
+    }
+    return path;
+}
+
+static XmlXPathAst *
+XmlXPathNewBinary(XmlXPathParser *parser, int op, XmlXPathAst *left, XmlXPathAst *right)
+{
+    XmlXPathAst *ast;
+    if (!right) {
+        XmlXPathDestroyAst(left);
+        return NULL;
+    }
+    ast = XmlXPathNewAst(parser, op);
+    if (!ast) {
+        XmlXPathDestroyAst(left);
+        XmlXPathDestroyAst(right);
+        return NULL;
+    }
+    ast->left = left;
+    ast->right = right;
+    return ast;
+}
+
+static XmlXPathAst *
+XmlXPathParseUnion(XmlXPathParser *parser)
+{
+    XmlXPathAst *ast = XmlXPathParsePath(parser);
+    while (ast && XmlXPathPeek(parser)->type == XML_XPATH_TOK_PIPE) {
+        XmlXPathNext(parser);
+        ast = XmlXPathNewBinary(parser, XML_XPATH_OP_UNION, ast, XmlXPathParsePath(parser));
+    }
+    return ast;
+}
+
+static XmlXPathAst *
+XmlXPathParseUnary(XmlXPathParser *parser)
+{
+    XmlXPathAst *ast;
+    if (XmlXPathPeek(parser)->type != XML_XPATH_TOK_MINUS)
+        return XmlXPathParseUnion(parser);
+    XmlXPathNext(parser);
+    ast = XmlXPathNewAst(parser, XML_XPATH_OP_NEG);
+    if (ast) {
+        ast->left = XmlXPathParseUnary(parser);
+        if (!ast->left) {
+            XmlXPathDestroyAst(ast);
+            return NULL;
+        }
+    }
+    return ast;
+}
+
+static XmlXPathAst *
+XmlXPathParseMultiplicative(XmlXPathParser *parser)
+{
+    XmlXPathAst *ast = XmlXPathParseUnary(parser);
+    for (;;) {
+        int type = XmlXPathPeek(parser)->type;
+        int op;
+        if (type == XML_XPATH_TOK_MULTIPLY)
+            op = XML_XPATH_OP_MUL;
+        else if (type == XML_XPATH_TOK_DIV)
+            op = XML_XPATH_OP_DIV;
+        else if (type == XML_XPATH_TOK_MOD)
+            op = XML_XPATH_OP_MOD;
+        else
+            return ast;
+        if (!ast)
+            return NULL;
+        XmlXPathNext(parser);
+        ast = XmlXPathNewBinary(parser, op, ast, XmlXPathParseUnary(parser));
+    }
+}
+
+static XmlXPathAst *
+XmlXPathParseAdditive(XmlXPathParser *parser)
+{
+    XmlXPathAst *ast = XmlXPathParseMultiplicative(parser);
+    for (;;) {
+        int type = XmlXPathPeek(parser)->type;
+        if (!ast || (type != XML_XPATH_TOK_PLUS && type != XML_XPATH_TOK_MINUS))
+            return ast;
+        XmlXPathNext(parser);
+        ast = XmlXPathNewBinary(parser, type == XML_XPATH_TOK_PLUS ? XML_XPATH_OP_ADD : XML_XPATH_OP_SUB,
+                                ast, XmlXPathParseMultiplicative(parser));
+    }
+}
+
+static XmlXPathAst *
+XmlXPathParseRelational(XmlXPathParser *parser)
+{
+    XmlXPathAst *ast = XmlXPathParseAdditive(parser);
+    for (;;) {
+        int type = XmlXPathPeek(parser)->type;
+        int op;
+        if (type == XML_XPATH_TOK_LT)
+            op = XML_XPATH_OP_LT;
+        else if (type == XML_XPATH_TOK_LTE)
+            op = XML_XPATH_OP_LTE;
+        else if (type == XML_XPATH_TOK_GT)
+            op = XML_XPATH_OP_GT;
+        else if (type == XML_XPATH_TOK_GTE)
+            op = XML_XPATH_OP_GTE;
+        else
+            return ast;
+        if (!ast)
+            return NULL;
+        XmlXPathNext(parser);
+        ast = XmlXPathNewBinary(parser, op, ast, XmlXPathParseAdditive(parser));
+    }
+}
+
+static XmlXPathAst *
+XmlXPathParseEquality(XmlXPathParser *parser)
+{
+    XmlXPathAst *ast = XmlXPathParseRelational(parser);
+    for (;;) {
+        int type = XmlXPathPeek(parser)->type;
+        if (!ast || (type != XML_XPATH_TOK_EQ && type != XML_XPATH_TOK_NEQ))
+            return ast;
+        XmlXPathNext(parser);
+        ast = XmlXPathNewBinary(parser, type == XML_XPATH_TOK_EQ ? XML_XPATH_OP_EQ : XML_XPATH_OP_NEQ,
+                                ast, XmlXPathParseRelational(parser));
+    }
+}
+
+static XmlXPathAst *
+XmlXPathParseAnd(XmlXPathParser *parser)
+{
+    XmlXPathAst *ast = XmlXPathParseEquality(parser);
+    while (ast && XmlXPathPeek(parser)->type == XML_XPATH_TOK_AND) {
+        XmlXPathNext(parser);
+        ast = XmlXPathNewBinary(parser, XML_XPATH_OP_AND, ast, XmlXPathParseEquality(parser));
+    }
+    return ast;
+}
+
+static XmlXPathAst *
+XmlXPathParseExpr(XmlXPathParser *parser)
+{
+    XmlXPathAst *ast = XmlXPathParseAnd(parser);
+    while (ast && XmlXPathPeek(parser)->type == XML_XPATH_TOK_OR) {
+        XmlXPathNext(parser);
+        ast = XmlXPathNewBinary(parser, XML_XPATH_OP_OR, ast, XmlXPathParseAnd(parser));
+    }
+    return ast;
+}
+
+static XmlXPathAst *
+XmlXPathParse(char *expr)
+{
+    XmlXPathParser parser;
+    XmlXPathAst *ast = NULL;
+
+    memset(&parser, 0, sizeof(parser));
+    parser.expr = expr;
+    if (XmlXPathTokenize(&parser) == XML_NOERR) {
+        ast = XmlXPathParseExpr(&parser);
+        if (ast && XmlXPathPeek(&parser)->type != XML_XPATH_TOK_END) {
+            XmlXPathParseError(&parser, "unexpected token");
+            XmlXPathDestroyAst(ast);
+            ast = NULL;
+        }
+    }
+    if (parser.tokens)
+        free(parser.tokens);
+    return ast;
+}
+
+//
+// AXES
+//
+static int
+XmlXPathTestNode(XmlXPathAst *step, int type, XmlNode *node, XmlNodeAttribute *attr)
+{
+    int principal = (step->axis == XML_XPATH_AXIS_ATTRIBUTE)
+                  ? XML_XPATH_NODE_ATTRIBUTE
+                  : XML_XPATH_NODE_ELEMENT;
+    switch(step->test) {
+        case XML_XPATH_TEST_NODE:
+            return 1;
+        case XML_XPATH_TEST_TEXT:
+            return (type == XML_XPATH_NODE_TEXT);
+        case XML_XPATH_TEST_COMMENT:
+            return (type == XML_XPATH_NODE_COMMENT);
+        case XML_XPATH_TEST_PI:
+            return 0;
+        case XML_XPATH_TEST_ANY:
+            return (type == principal);
+        default:
+            break;
+    }
+    if (type != principal)
+        return 0;
+    if (type == XML_XPATH_NODE_ATTRIBUTE) {
+        // attribute names are kept as they are found in the document
+        if (step->prefix) {
+            size_t len = strlen(step->prefix);
+            if (strncmp(attr->name, step->prefix, len) != 0 || attr->name[len] != ':')
+                return 0;
+            return (!step->name || strcmp(attr->name + len + 1, step->name) == 0);
+        }
+        return (strcmp(attr->name, step->name) == 0);
+    }
+    if (step->name && strcmp(node->name, step->name) != 0)
+        return 0;
+    if (step->prefix) {
+        if (!node->ns || !node->ns->name || strcmp(node->ns->name, step->prefix) != 0)
+            return 0;
+    }
+    return 1;
+}
+
+static XmlErr
+XmlXPathSelect(XmlXPathAst *step, XmlXPathNodeSet *out, int type, XmlNode *node, XmlNodeAttribute *attr)
+{
+    if (!XmlXPathTestNode(step, type, node, attr))
+        return XML_NOERR;
+    return XmlXPathSetAdd(out, type, node, attr);
+}
+
+static XmlErr
+XmlXPathSelectNode(XmlXPathAst *step, XmlXPathNodeSet *out, XmlNode *node)
+{
+    return XmlXPathSelect(step, out, XmlXPathTypeOf(node), node, NULL);
+}
+
+static XmlErr
+XmlXPathSelectParent(XmlXPathAst *step, XmlXPathNodeSet *out, XmlNode *parent)
+{
+    if (!parent)
+        return XmlXPathSelect(step, out, XML_XPATH_NODE_ROOT, NULL, NULL);
+    return XmlXPathSelect(step, out, XML_XPATH_NODE_ELEMENT, parent, NULL);
+}
+
+// the descendants of node in document order
+static XmlErr
+XmlXPathSelectDescendants(XmlXPathAst *step, XmlXPathNodeSet *out, XmlNode *node)
+{
+    XmlNode *child;
+    XmlErr err;
+    if (XmlXPathHasValueText(node)) {
+        err = XmlXPathSelect(step, out, XML_XPATH_NODE_TEXT, node, NULL);
+        if (err != XML_NOERR)
+            return err;
+    }
+    TAILQ_FOREACH(child, &node->children, siblings) {
+        err = XmlXPathSelectNode(step, out, child);
+        if (err == XML_NOERR)
+            err = XmlXPathSelectDescendants(step, out, child);
+        if (err != XML_NOERR)
+            return err;
+    }
+    return XML_NOERR;
+}
+
+// node and its descendants in reverse document order
+static XmlErr
+XmlXPathSelectSubtreeReverse(XmlXPathAst *step, XmlXPathNodeSet *out, XmlNode *node)
+{
+    XmlNode *child;
+    XmlErr err;
+    TAILQ_FOREACH_REVERSE(child, &node->children, nodelistHead, siblings) {
+        err = XmlXPathSelectSubtreeReverse(step, out, child);
+        if (err != XML_NOERR)
+            return err;
+    }
+    if (XmlXPathHasValueText(node)) {
+        err = XmlXPathSelect(step, out, XML_XPATH_NODE_TEXT, node, NULL);
+        if (err != XML_NOERR)
+            return err;
+    }
+    return XmlXPathSelectNode(step, out, node);
+}
+
+static XmlErr
+XmlXPathSelectRootElements(XmlXPathContext *ctx, XmlXPathAst *step, XmlXPathNodeSet *out, int descend)
+{
+    XmlNode *node;
+    XmlErr err = XML_NOERR;
+    TAILQ_FOREACH(node, &ctx->xml->rootElements, siblings) {
+        err = XmlXPathSelectNode(step, out, node);
+        if (err == XML_NOERR && descend)
+            err = XmlXPathSelectDescendants(step, out, node);
+        if (err != XML_NOERR)
+            break;
+    }
+    return err;
+}
+
+// collect the nodes along the axis of step (in the order of the axis)
+// which satisfy its node test
+static XmlErr
+XmlXPathSelectAxis(XmlXPathContext *ctx, XmlXPathAst *step, XmlXPathNode *c, XmlXPathNodeSet *out)
+{
+    XmlNode *node = c->node;
+    XmlNode *sibling;
+    XmlNodeAttribute *attr;
+    XmlErr err = XML_NOERR;
+    // attributes and text values don't have siblings or children of their own
+    int isTreeNode = (c->type != XML_XPATH_NODE_ROOT &&
+                      c->type != XML_XPATH_NODE_ATTRIBUTE &&
+                      !XmlXPathIsValueText(c));
+
+    switch(step->axis) {
+        case XML_XPATH_AXIS_SELF:
+            return XmlXPathSelect(step, out, c->type, c->node, c->attr);
+        case XML_XPATH_AXIS_CHILD:
+            if (c->type == XML_XPATH_NODE_ROOT)
+                return XmlXPathSelectRootElements(ctx, step, out, 0);
+            if (c->type != XML_XPATH_NODE_ELEMENT)
+                return XML_NOERR;
+            if (XmlXPathHasValueText(node))
+                err = XmlXPathSelect(step, out, XML_XPATH_NODE_TEXT, node, NULL);
+            for (sibling = TAILQ_FIRST(&node->children); sibling && err == XML_NOERR;
+                 sibling = TAILQ_NEXT(sibling, siblings))
+            {
+                err = XmlXPathSelectNode(step, out, sibling);
+            }
+            return err;
+        case XML_XPATH_AXIS_DESCENDANT_OR_SELF:
+            err = XmlXPathSelect(step, out, c->type, c->node, c->attr);
+            if (err != XML_NOERR)
+                return err;
+            // fall through
+        case XML_XPATH_AXIS_DESCENDANT:
+            if (c->type == XML_XPATH_NODE_ROOT)
+                return XmlXPathSelectRootElements(ctx, step, out, 1);
+            if (c->type != XML_XPATH_NODE_ELEMENT)
+                return XML_NOERR;
+            return XmlXPathSelectDescendants(step, out, node);
+        case XML_XPATH_AXIS_ANCESTOR_OR_SELF:
+            err = XmlXPathSelect(step, out, c->type, c->node, c->attr);
+            if (err != XML_NOERR)
+                return err;
+            // fall through
+        case XML_XPATH_AXIS_ANCESTOR:
+        case XML_XPATH_AXIS_PARENT:
+            if (c->type == XML_XPATH_NODE_ROOT)
+                return XML_NOERR;
+            if (isTreeNode)
+                node = node->parent;
+            // else the element holding the attribute (or the text) is its parent
+            for (;;) {
+                err = XmlXPathSelectParent(step, out, node);
+                if (err != XML_NOERR || !node || step->axis == XML_XPATH_AXIS_PARENT)
+                    return err;
+                node = node->parent;
+            }
+        case XML_XPATH_AXIS_ATTRIBUTE:
+            if (c->type != XML_XPATH_NODE_ELEMENT)
+                return XML_NOERR;
+            TAILQ_FOREACH(attr, &node->attributes, list) {
+                if (XmlXPathIsNamespaceDecl(attr))
+                    continue;
+                err = XmlXPathSelect(step, out, XML_XPATH_NODE_ATTRIBUTE, node, attr);
+                if (err != XML_NOERR)
+                    return err;
+            }
+            return XML_NOERR;
+        case XML_XPATH_AXIS_FOLLOWING_SIBLING:
+            if (XmlXPathIsValueText(c)) // the children of the element come after its value
+                sibling = TAILQ_FIRST(&node->children);
+            else if (isTreeNode)
+                sibling = TAILQ_NEXT(node, siblings);
+            else
+                return XML_NOERR;
+            for (; sibling && err == XML_NOERR; sibling = TAILQ_NEXT(sibling, siblings))
+                err = XmlXPathSelectNode(step, out, sibling);
+            return err;
+        case XML_XPATH_AXIS_PRECEDING_SIBLING:
+            if (!isTreeNode)
+                return XML_NOERR;
+            for (sibling = TAILQ_PREV(node, nodelistHead, siblings); sibling && err == XML_NOERR;
+                 sibling = TAILQ_PREV(sibling, nodelistHead, siblings))
+            {
+                err = XmlXPathSelectNode(step, out, sibling);
+            }
+            if (err == XML_NOERR && node->parent && XmlXPathHasValueText(node->parent))
+                err = XmlXPathSelect(step, out, XML_XPATH_NODE_TEXT, node->parent, NULL);
+            return err;
+        case XML_XPATH_AXIS_FOLLOWING:
+            if (c->type == XML_XPATH_NODE_ROOT)
+                return XML_NOERR;
+            if (!isTreeNode) {
+                // everything inside the element holding the attribute (or the text) follows it
+                if (c->type == XML_XPATH_NODE_ATTRIBUTE && XmlXPathHasValueText(node))
+                    err = XmlXPathSelect(step, out, XML_XPATH_NODE_TEXT, node, NULL);
+                for (sibling = TAILQ_FIRST(&node->children); sibling && err == XML_NOERR;
+                     sibling = TAILQ_NEXT(sibling, siblings))
+                {
+                    err = XmlXPathSelectNode(step, out, sibling);
+                    if (err == XML_NOERR)
+                        err = XmlXPathSelectDescendants(step, out, sibling);
+                }
+            }
+            for (; node && err == XML_NOERR; node = node->parent) {
+                for (sibling = TAILQ_NEXT(node, siblings); sibling && err == XML_NOERR;
+                     sibling = TAILQ_NEXT(sibling, siblings))
+                {
+                    err = XmlXPathSelectNode(step, out, sibling);
+                    if (err == XML_NOERR)
+                        err = XmlXPathSelectDescendants(step, out, sibling);
+                }
+            }
+            return err;
+        case XML_XPATH_AXIS_PRECEDING:
+            if (c->type == XML_XPATH_NODE_ROOT)
+                return XML_NOERR;
+            // the element holding an attribute (or a text) is one of its ancestors,
+            // so they are preceded by the same nodes
+            for (; node && err == XML_NOERR; node = node->parent) {
+                for (sibling = TAILQ_PREV(node, nodelistHead, siblings); sibling && err == XML_NOERR;
+                     sibling = TAILQ_PREV(sibling, nodelistHead, siblings))
+                {
+                    err = XmlXPathSelectSubtreeReverse(step, out, sibling);
+                }
+                if (err == XML_NOERR && node->parent && XmlXPathHasValueText(node->parent))
+                    err = XmlXPathSelect(step, out, XML_XPATH_NODE_TEXT, node->parent, NULL);
+            }
+            return err;
+        default: // there are no namespace nodes
+            return XML_NOERR;
+    }
+}
+
+//
+// EVALUATION
+//
+
+// filter set (in the order of the axis it has been selected from) through a predicate
+static XmlErr
+XmlXPathFilter(XmlXPathContext *ctx, XmlXPathAst *predicate, XmlXPathNodeSet *set)
+{
+    XmlXPathContext inner;
+    size_t i, kept = 0;
+
+    if (predicate->op == XML_XPATH_OP_NUMBER) { // [n] doesn't need to look at the nodes
+        double n = predicate->number;
+        if (n >= 1 && n <= (double)set->count && n == floor(n)) {
+            set->nodes[0] = set->nodes[(size_t)n - 1];
+            set->count = 1;
+        } else {
+            set->count = 0;
+        }
+        return XML_NOERR;
+    }
+
+    inner.xml = ctx->xml;
+    inner.size = set->count;
+    for (i = 0; i < set->count; i++) {
+        XmlXPathValue value;
+        int keep;
+        XmlErr err;
+
+        memset(&value, 0, sizeof(value));
+        inner.node = set->nodes[i];
+        inner.position = i + 1;
+        err = XmlXPathEval(predicate, &inner, &value);
+        if (err != XML_NOERR) {
+            XmlXPathValueClear(&value);
+            return err;
+        }
+        if (value.type == XML_XPATH_NUMBER)
+            keep = (value.number == (double)inner.position);
+        else
+            keep = XmlXPathToBoolean(&value);
+        XmlXPathValueClear(&value);
+        if (keep)
+            set->nodes[kept++] = set->nodes[i];
+    }
+    set->count = kept;
+    return XML_NOERR;
+}
+
+static XmlErr
+XmlXPathFilterAll(XmlXPathContext *ctx, XmlXPathAst *predicates, XmlXPathNodeSet *set)
+{
+    XmlErr err = XML_NOERR;
+    for (; predicates && set->count && err == XML_NOERR; predicates = predicates->next)
+        err = XmlXPathFilter(ctx, predicates, set);
+    return err;
+}
+
+// apply a location step to all the nodes of a set (in document order)
+static XmlErr
+XmlXPathEvalStep(XmlXPathContext *ctx, XmlXPathAst *step, XmlXPathNodeSet *in, XmlXPathNodeSet *out)
+{
+    XmlXPathNodeSet selected = { NULL, 0, 0 };
+    int reverse = XML_XPATH_AXIS_IS_REVERSE(step->axis);
+    int sort;
+    size_t i, j;
+    XmlErr err = XML_NOERR;
+
+    switch(step->axis) {
+        case XML_XPATH_AXIS_SELF:
+        case XML_XPATH_AXIS_ATTRIBUTE:
+            sort = 0;
+            break;
+        case XML_XPATH_AXIS_CHILD:
+        case XML_XPATH_AXIS_DESCENDANT:
+        case XML_XPATH_AXIS_DESCENDANT_OR_SELF:
+            // nodes selected from disjoint subtrees are already in document order
+            sort = XmlXPathSetIsNested(in);
+            break;
+        default:
+            sort = (in->count > 1);
+            break;
+    }
+
+    for (i = 0; i < in->count && err == XML_NOERR; i++) {
+        selected.count = 0;
+        err = XmlXPathSelectAxis(ctx, step, &in->nodes[i], &selected);
+        if (err == XML_NOERR)
+            err = XmlXPathFilterAll(ctx, step->predicates, &selected);
+        for (j = 0; j < selected.count && err == XML_NOERR; j++) {
+            XmlXPathNode *n = &selected.nodes[reverse ? selected.count - j - 1 : j];
+            err = XmlXPathSetAdd(out, n->type, n->node, n->attr);
+        }
+    }
+    XmlXPathSetClear(&selected);
+    if (err == XML_NOERR && sort)
+        XmlXPathSetSort(out);
+    return err;
+}
+
+static XmlErr
+XmlXPathEvalPath(XmlXPathAst *ast, XmlXPathContext *ctx, XmlXPathValue *res)
+{
+    XmlXPathAst *step;
+    XmlErr err;
+
+    if (ast->left) {
+        err = XmlXPathEval(ast->left, ctx, res);
+        if (err != XML_NOERR)
+            return err;
+        if (res->type != XML_XPATH_NODESET) {
+            fprintf(stderr, "XPath error : a location path can only be applied to a node-set\n");
+            return XML_BADARGS;
+        }
+    } else {
+        res->type = XML_XPATH_NODESET;
+        if (ast->absolute)
+            err = XmlXPathSetAdd(&res->set, XML_XPATH_NODE_ROOT, NULL, NULL);
+        else
+            err = XmlXPathSetAdd(&res->set, ctx->node.type, ctx->node.node, ctx->node.attr);
+        if (err != XML_NOERR)
+            return err;
+    }
+
+    for (step = ast->steps; step && res->set.count; step = step->next) {
+        XmlXPathNodeSet out = { NULL, 0, 0 };
+        err = XmlXPathEvalStep(ctx, step, &res->set, &out);
+        XmlXPathSetClear(&res->set);
+        res->set = out;
+        if (err != XML_NOERR)
+            return err;
+    }
+    return XML_NOERR;
+}
+
+static int
+XmlXPathCompareNumbers(int op, double a, double b)
+{
+    switch(op) {
+        case XML_XPATH_OP_EQ:
+            return a == b;
+        case XML_XPATH_OP_NEQ:
+            return a != b;
+        case XML_XPATH_OP_LT:
+            return a < b;
+        case XML_XPATH_OP_LTE:
+            return a <= b;
+        case XML_XPATH_OP_GT:
+            return a > b;
+        default:
+            return a >= b;
+    }
+}
+
+// compare a node-set with a value which isn't a node-set
+static XmlErr
+XmlXPathCompareSet(TXml *xml, int op, XmlXPathNodeSet *set, XmlXPathValue *other, int *result)
+{
+    int equality = (op == XML_XPATH_OP_EQ || op == XML_XPATH_OP_NEQ);
+    double number = 0;
+    size_t i;
+
+    *result = 0;
+    if (other->type == XML_XPATH_BOOLEAN) {
+        *result = XmlXPathCompareNumbers(op, set->count > 0, other->boolean);
+        return XML_NOERR;
+    }
+    if (other->type == XML_XPATH_NUMBER)
+        number = other->number;
+    else if (!equality)
+        number = XmlXPathStringToNumber(other->string);
+
+    for (i = 0; i < set->count && !*result; i++) {
+        char *string = XmlXPathStringValue(xml, &set->nodes[i]);
+        if (!string)
+            return XML_MEMORY_ERR;
+        if (other->type == XML_XPATH_STRING && equality)
+            *result = ((strcmp(string, other->string) == 0) == (op == XML_XPATH_OP_EQ));
+        else
+            *result = XmlXPathCompareNumbers(op, XmlXPathStringToNumber(string), number);
+        free(string);
+    }
+    return XML_NOERR;
+}
+
+static XmlErr
+XmlXPathCompareValues(TXml *xml, int op, XmlXPathValue *left, XmlXPathValue *right, int *result)
+{
+    *result = 0;
+    if (left->type == XML_XPATH_NODESET && right->type == XML_XPATH_NODESET) {
+        // true if the comparison is true for any couple of nodes
+        size_t i, j;
+        XmlXPathValue value;
+        XmlErr err = XML_NOERR;
+
+        memset(&value, 0, sizeof(value));
+        value.type = XML_XPATH_STRING;
+        for (i = 0; i < left->set.count && !*result && err == XML_NOERR; i++) {
+            value.string = XmlXPathStringValue(xml, &left->set.nodes[i]);
+            if (!value.string)
+                return XML_MEMORY_ERR;
+            if (op == XML_XPATH_OP_EQ || op == XML_XPATH_OP_NEQ) {
+                err = XmlXPathCompareSet(xml, op, &right->set, &value, result);
+            } else {
+                // compare numbers, with the set on the left
+                value.type = XML_XPATH_NUMBER;
+                value.number = XmlXPathStringToNumber(value.string);
+                for (j = 0; j < right->set.count && !*result; j++) {
+                    char *string = XmlXPathStringValue(xml, &right->set.nodes[j]);
+                    if (!string) {
+                        err = XML_MEMORY_ERR;
+                        break;
+                    }
+                    *result = XmlXPathCompareNumbers(op, value.number, XmlXPathStringToNumber(string));
+                    free(string);
+                }
+                value.type = XML_XPATH_STRING;
+            }
+            free(value.string);
+            value.string = NULL;
+        }
+        return err;
+    }
+    if (left->type == XML_XPATH_NODESET)
+        return XmlXPathCompareSet(xml, op, &left->set, right, result);
+    if (right->type == XML_XPATH_NODESET) {
+        // swap the operands
+        switch(op) {
+            case XML_XPATH_OP_LT:
+                op = XML_XPATH_OP_GT;
+                break;
+            case XML_XPATH_OP_LTE:
+                op = XML_XPATH_OP_GTE;
+                break;
+            case XML_XPATH_OP_GT:
+                op = XML_XPATH_OP_LT;
+                break;
+            case XML_XPATH_OP_GTE:
+                op = XML_XPATH_OP_LTE;
+                break;
+        }
+        return XmlXPathCompareSet(xml, op, &right->set, left, result);
+    }
+
+    if (op == XML_XPATH_OP_EQ || op == XML_XPATH_OP_NEQ) {
+        if (left->type == XML_XPATH_BOOLEAN || right->type == XML_XPATH_BOOLEAN) {
+            *result = XmlXPathCompareNumbers(op, XmlXPathToBoolean(left), XmlXPathToBoolean(right));
+        } else if (left->type == XML_XPATH_NUMBER || right->type == XML_XPATH_NUMBER) {
+            *result = XmlXPathCompareNumbers(op, XmlXPathToNumber(xml, left), XmlXPathToNumber(xml, right));
+        } else {
+            *result = ((strcmp(left->string, right->string) == 0) == (op == XML_XPATH_OP_EQ));
+        }
+    } else {
+        *result = XmlXPathCompareNumbers(op, XmlXPathToNumber(xml, left), XmlXPathToNumber(xml, right));
+    }
+    return XML_NOERR;
+}
+
+//
+// FUNCTIONS
+//
+
+// select the elements whose id attribute is listed in ids
+static XmlErr
+XmlXPathSelectIds(XmlNode *node, char **ids, size_t count, XmlXPathNodeSet *out)
+{
+    XmlNodeAttribute *attr;
+    XmlNode *child;
+    size_t i;
+    XmlErr err;
+
+    TAILQ_FOREACH(attr, &node->attributes, list) {
+        if (strcmp(attr->name, "id") != 0 || !attr->value)
+            continue;
+        for (i = 0; i < count; i++) {
+            if (strcmp(attr->value, ids[i]) == 0) {
+                err = XmlXPathSetAdd(out, XML_XPATH_NODE_ELEMENT, node, NULL);
+                if (err != XML_NOERR)
+                    return err;
+                break;
+            }
+        }
+        break;
+    }
+    TAILQ_FOREACH(child, &node->children, siblings) {
+        if (child->type != XML_NODETYPE_SIMPLE)
+            continue;
+        err = XmlXPathSelectIds(child, ids, count, out);
+        if (err != XML_NOERR)
+            return err;
+    }
+    return XML_NOERR;
+}
+
+// split string (modified in place) into whitespace separated tokens
+static XmlErr
+XmlXPathSplitIds(char *string, char ***ids, size_t *count, size_t *size)
+{
+    char *p = string;
+    for (;;) {
+        while (XmlXPathIsSpace(*p))
+            p++;
+        if (!*p)
+            return XML_NOERR;
+        if (*count == *size) {
+            char **newIds;
+            *size = *size ? *size * 2 : 8;
+            newIds = realloc(*ids, *size * sizeof(char *));
+            if (!newIds)
+                return XML_MEMORY_ERR;
+            *ids = newIds;
+        }
+        (*ids)[(*count)++] = p;
+        while (*p && !XmlXPathIsSpace(*p))
+            p++;
+        if (*p)
+            *p++ = 0;
+    }
+}
+
+static XmlErr
+XmlXPathFunctionId(XmlXPathContext *ctx, XmlXPathValue *arg, XmlXPathValue *res)
+{
+    char **strings = NULL;
+    size_t nstrings = 0;
+    char **ids = NULL;
+    size_t count = 0, size = 0, i;
+    XmlNode *node;
+    XmlErr err = XML_NOERR;
+
+    if (arg->type == XML_XPATH_NODESET) {
+        strings = calloc(arg->set.count ? arg->set.count : 1, sizeof(char *));
+        if (!strings)
+            return XML_MEMORY_ERR;
+        for (i = 0; i < arg->set.count && err == XML_NOERR; i++) {
+            strings[nstrings] = XmlXPathStringValue(ctx->xml, &arg->set.nodes[i]);
+            if (!strings[nstrings])
+                err = XML_MEMORY_ERR;
+            else
+                err = XmlXPathSplitIds(strings[nstrings++], &ids, &count, &size);
+        }
+    } else {
+        strings = calloc(1, sizeof(char *));
+        if (!strings)
+            return XML_MEMORY_ERR;
+        strings[0] = XmlXPathToString(ctx->xml, arg);
+        if (!strings[0])
+            err = XML_MEMORY_ERR;
+        else
+            err = XmlXPathSplitIds(strings[nstrings++], &ids, &count, &size);
+    }
+
+    res->type = XML_XPATH_NODESET;
+    if (err == XML_NOERR && count && XmlIsIndexed(ctx->xml, "id")) {
+        // ids are unique : the index gives the first node having each of them
+        for (i = 0; i < count && err == XML_NOERR; i++) {
+            node = XmlGetNodeByAttribute(ctx->xml, "id", ids[i]);
+            if (node)
+                err = XmlXPathSetAdd(&res->set, XML_XPATH_NODE_ELEMENT, node, NULL);
+        }
+        if (err == XML_NOERR)
+            XmlXPathSetSort(&res->set);
+    } else if (err == XML_NOERR && count) {
+        TAILQ_FOREACH(node, &ctx->xml->rootElements, siblings) {
+            if (node->type != XML_NODETYPE_SIMPLE)
+                continue;
+            err = XmlXPathSelectIds(node, ids, count, &res->set);
+            if (err != XML_NOERR)
+                break;
+        }
+    }
+    for (i = 0; i < nstrings; i++)
+        free(strings[i]);
+    free(strings);
+    if (ids)
+        free(ids);
+    return err;
+}
+
+// the first node of the set given as argument, or the context node
+static XmlXPathNode *
+XmlXPathFunctionNode(XmlXPathContext *ctx, XmlXPathValue *args, int nargs)
+{
+    if (!nargs)
+        return &ctx->node;
+    return args[0].set.count ? &args[0].set.nodes[0] : NULL;
+}
+
+static char *
+XmlXPathNodeName(XmlXPathNode *n, int qualified)
+{
+    char *name;
+    if (!n)
+        return strdup("");
+    switch(n->type) {
+        case XML_XPATH_NODE_ELEMENT:
+            if (qualified && n->node->ns && n->node->ns->name) {
+                name = malloc(strlen(n->node->ns->name) + strlen(n->node->name) + 2);
+                if (name)
+                    sprintf(name, "%s:%s", n->node->ns->name, n->node->name);
+                return name;
+            }
+            return strdup(n->node->name);
+        case XML_XPATH_NODE_ATTRIBUTE:
+            name = qualified ? NULL : strchr(n->attr->name, ':');
+            return strdup(name ? name + 1 : n->attr->name);
+        default:
+            return strdup("");
+    }
+}
+
+static char *
+XmlXPathNodeNamespaceUri(XmlXPathNode *n)
+{
+    XmlNamespace *ns = NULL;
+    if (n && n->type == XML_XPATH_NODE_ELEMENT) {
+        ns = XmlGetNodeNamespace(n->node);
+    } else if (n && n->type == XML_XPATH_NODE_ATTRIBUTE) {
+        // only prefixed attributes belong to a namespace
+        char *colon = strchr(n->attr->name, ':');
+        if (colon) {
+            char *prefix = strdup(n->attr->name);
+            if (!prefix)
+                return NULL;
+            prefix[colon - n->attr->name] = 0;
+            ns = XmlGetNamespaceByName(n->node, prefix);
+            free(prefix);
+        }
+    }
+    return strdup((ns && ns->uri) ? ns->uri : "");
+}
+
+static int
+XmlXPathLang(XmlXPathNode *n, char *lang)
+{
+    XmlNode *node = n->node;
+    size_t len = strlen(lang);
+    if (n->type == XML_XPATH_NODE_ROOT)
+        return 0;
+    for (; node; node = node->parent) {
+        XmlNodeAttribute *attr;
+        TAILQ_FOREACH(attr, &node->attributes, list) {
+            if (strcmp(attr->name, "xml:lang") == 0 && attr->value) {
+                return (strncasecmp(attr->value, lang, len) == 0 &&
+                        (attr->value[len] == 0 || attr->value[len] == '-'));
+            }
+        }
+    }
+    return 0;
+}
+
+static char *
+XmlXPathNormalizeSpace(char *string)
+{
+    char *in = string, *out = string;
+    while (*in) {
+        if (XmlXPathIsSpace(*in)) {
+            while (XmlXPathIsSpace(*in))
+                in++;
+            if (out != string && *in)
+                *out++ = ' ';
+        } else {
+            *out++ = *in++;
+        }
+    }
+    *out = 0;
+    return string;
+}
+
+// find the (utf-8) character chr in set and return its position, -1 if not found
+static long
+XmlXPathCharIndex(char *set, char *chr, size_t len)
+{
+    long index = 0;
+    while (*set) {
+        size_t setLen = XmlXPathCharLen(set);
+        if (setLen == len && memcmp(set, chr, len) == 0)
+            return index;
+        set += setLen;
+        index++;
+    }
+    return -1;
+}
+
+static char *
+XmlXPathTranslate(char *string, char *from, char *to)
+{
+    XmlXPathBuffer buf = { NULL, 0, 0 };
+    char *p = string;
+    while (*p) {
+        size_t len = XmlXPathCharLen(p);
+        long index = XmlXPathCharIndex(from, p, len);
+        XmlErr err = XML_NOERR;
+        if (index < 0) {
+            err = XmlXPathBufferAppend(&buf, p, len);
+        } else {
+            char *replacement = to;
+            while (index-- && *replacement)
+                replacement += XmlXPathCharLen(replacement);
+            if (*replacement) // characters without a replacement are removed
+                err = XmlXPathBufferAppend(&buf, replacement, XmlXPathCharLen(replacement));
+        }
+        if (err != XML_NOERR) {
+            free(buf.data);
+            return NULL;
+        }
+        p += len;
+    }
+    return XmlXPathBufferRelease(&buf);
+}
+
+static char *
+XmlXPathSubstring(char *string, double start, double length, int hasLength)
+{
+    XmlXPathBuffer buf = { NULL, 0, 0 };
+    double first = floor(start + 0.5); // round()
+    double last = hasLength ? first + floor(length + 0.5) : INFINITY;
+    double position = 1;
+    char *p = string;
+
+    while (*p) {
+        size_t len = XmlXPathCharLen(p);
+        // NaN never satisfies these conditions
+        if (position >= first && position < last) {
+            if (XmlXPathBufferAppend(&buf, p, len) != XML_NOERR) {
+                free(buf.data);
+                return NULL;
+            }
+        }
+        p += len;
+        position++;
+    }
+    return XmlXPathBufferRelease(&buf);
+}
+
+static double
+XmlXPathRound(double number)
+{
+    if (isnan(number) || isinf(number))
+        return number;
+    if (number < 0 && number >= -0.5)
+        return -0.0;
+    return floor(number + 0.5);
+}
+
+static XmlErr
+XmlXPathCallFunction(XmlXPathAst *ast, XmlXPathContext *ctx, XmlXPathValue *res)
+{
+    XmlXPathValue *args;
+    XmlXPathAst *arg;
+    XmlXPathNode *node;
+    char *s0 = NULL, *s1 = NULL, *s2 = NULL, *found;
+    int i, nargs = ast->nargs;
+    XmlErr err = XML_NOERR;
+    XmlXPathBuffer buf = { NULL, 0, 0 };
+
+    args = calloc(nargs ? nargs : 1, sizeof(XmlXPathValue));
+    if (!args)
+        return XML_MEMORY_ERR;
+    for (i = 0, arg = ast->args; arg && err == XML_NOERR; i++, arg = arg->next)
+        err = XmlXPathEval(arg, ctx, &args[i]);
+    if (err != XML_NOERR)
+        goto done;
+
+    switch(ast->function) {
+        case XML_XPATH_FN_COUNT:
+        case XML_XPATH_FN_SUM:
+        case XML_XPATH_FN_LOCAL_NAME:
+        case XML_XPATH_FN_NAMESPACE_URI:
+        case XML_XPATH_FN_NAME:
+            if (nargs && args[0].type != XML_XPATH_NODESET) {
+                fprintf(stderr, "XPath error : %s() expects a node-set\n",
+                        XmlXPathFunctions[ast->function].name);
+                err = XML_BADARGS;
+                goto done;
+            }
+            break;
+        default:
+            break;
+    }
+
+    // string arguments used by most of the string functions
+    switch(ast->function) {
+        case XML_XPATH_FN_TRANSLATE:
+            s2 = XmlXPathToString(ctx->xml, &args[2]);
+            if (!s2)
+                err = XML_MEMORY_ERR;
+            // fall through
+        case XML_XPATH_FN_STARTS_WITH:
+        case XML_XPATH_FN_CONTAINS:
+        case XML_XPATH_FN_SUBSTRING_BEFORE:
+        case XML_XPATH_FN_SUBSTRING_AFTER:
+            s1 = XmlXPathToString(ctx->xml, &args[1]);
+            if (!s1)
+                err = XML_MEMORY_ERR;
+            // fall through
+        case XML_XPATH_FN_SUBSTRING:
+        case XML_XPATH_FN_LANG:
+            s0 = XmlXPathToString(ctx->xml, &args[0]);
+            if (!s0)
+                err = XML_MEMORY_ERR;
+            break;
+        case XML_XPATH_FN_STRING:
+        case XML_XPATH_FN_STRING_LENGTH:
+        case XML_XPATH_FN_NORMALIZE_SPACE:
+        case XML_XPATH_FN_NUMBER:
+            // the string-value of the context node if there are no arguments
+            s0 = nargs ? XmlXPathToString(ctx->xml, &args[0])
+                       : XmlXPathStringValue(ctx->xml, &ctx->node);
+            if (!s0)
+                err = XML_MEMORY_ERR;
+            break;
+        default:
+            break;
+    }
+    if (err != XML_NOERR)
+        goto done;
+
+    switch(ast->function) {
+        case XML_XPATH_FN_LAST:
+            XmlXPathSetNumber(res, ctx->size);
+            break;
+        case XML_XPATH_FN_POSITION:
+            XmlXPathSetNumber(res, ctx->position);
+            break;
+        case XML_XPATH_FN_COUNT:
+            XmlXPathSetNumber(res, args[0].set.count);
+            break;
+        case XML_XPATH_FN_ID:
+            err = XmlXPathFunctionId(ctx, &args[0], res);
+            break;
+        case XML_XPATH_FN_LOCAL_NAME:
+        case XML_XPATH_FN_NAME:
+            node = XmlXPathFunctionNode(ctx, args, nargs);
+            err = XmlXPathSetString(res, XmlXPathNodeName(node, ast->function == XML_XPATH_FN_NAME));
+            break;
+        case XML_XPATH_FN_NAMESPACE_URI:
+            node = XmlXPathFunctionNode(ctx, args, nargs);
+            err = XmlXPathSetString(res, XmlXPathNodeNamespaceUri(node));
+            break;
+        case XML_XPATH_FN_STRING:
+            err = XmlXPathSetString(res, s0);
+            s0 = NULL;
+            break;
+        case XML_XPATH_FN_CONCAT:
+            for (i = 0; i < nargs && err == XML_NOERR; i++) {
+                s0 = XmlXPathToString(ctx->xml, &args[i]);
+                if (!s0)
+                    err = XML_MEMORY_ERR;
+                else
+                    err = XmlXPathBufferAppend(&buf, s0, strlen(s0));
+                free(s0);
+                s0 = NULL;
+            }
+            if (err == XML_NOERR)
+                err = XmlXPathSetString(res, XmlXPathBufferRelease(&buf));
+            else
+                free(buf.data);
+            break;
+        case XML_XPATH_FN_STARTS_WITH:
+            XmlXPathSetBoolean(res, strncmp(s0, s1, strlen(s1)) == 0);
+            break;
+        case XML_XPATH_FN_CONTAINS:
+            XmlXPathSetBoolean(res, strstr(s0, s1) != NULL);
+            break;
+        case XML_XPATH_FN_SUBSTRING_BEFORE:
+            found = strstr(s0, s1);
+            if (found)
+                *found = 0;
+            err = XmlXPathSetString(res, strdup(found ? s0 : ""));
+            break;
+        case XML_XPATH_FN_SUBSTRING_AFTER:
+            found = strstr(s0, s1);
+            err = XmlXPathSetString(res, strdup(found ? found + strlen(s1) : ""));
+            break;
+        case XML_XPATH_FN_SUBSTRING:
+            err = XmlXPathSetString(res,
+                XmlXPathSubstring(s0, XmlXPathToNumber(ctx->xml, &args[1]),
+                                  nargs > 2 ? XmlXPathToNumber(ctx->xml, &args[2]) : 0, nargs > 2));
+            break;
+        case XML_XPATH_FN_STRING_LENGTH:
+            XmlXPathSetNumber(res, XmlXPathStrLen(s0));
+            break;
+        case XML_XPATH_FN_NORMALIZE_SPACE:
+            err = XmlXPathSetString(res, XmlXPathNormalizeSpace(s0));
+            s0 = NULL;
+            break;
+        case XML_XPATH_FN_TRANSLATE:
+            err = XmlXPathSetString(res, XmlXPathTranslate(s0, s1, s2));
+            break;
+        case XML_XPATH_FN_BOOLEAN:
+            XmlXPathSetBoolean(res, XmlXPathToBoolean(&args[0]));
+            break;
+        case XML_XPATH_FN_NOT:
+            XmlXPathSetBoolean(res, !XmlXPathToBoolean(&args[0]));
+            break;
+        case XML_XPATH_FN_TRUE:
+            XmlXPathSetBoolean(res, 1);
+            break;
+        case XML_XPATH_FN_FALSE:
+            XmlXPathSetBoolean(res, 0);
+            break;
+        case XML_XPATH_FN_LANG:
+            XmlXPathSetBoolean(res, XmlXPathLang(&ctx->node, s0));
+            break;
+        case XML_XPATH_FN_NUMBER:
+            XmlXPathSetNumber(res, nargs ? XmlXPathToNumber(ctx->xml, &args[0])
+                                         : XmlXPathStringToNumber(s0));
+            break;
+        case XML_XPATH_FN_SUM:
+        {
+            double sum = 0;
+            size_t n;
+            for (n = 0; n < args[0].set.count; n++) {
+                s0 = XmlXPathStringValue(ctx->xml, &args[0].set.nodes[n]);
+                if (!s0) {
+                    err = XML_MEMORY_ERR;
+                    break;
+                }
+                sum += XmlXPathStringToNumber(s0);
+                free(s0);
+                s0 = NULL;
+            }
+            XmlXPathSetNumber(res, sum);
+            break;
+        }
+        case XML_XPATH_FN_FLOOR:
+            XmlXPathSetNumber(res, floor(XmlXPathToNumber(ctx->xml, &args[0])));
+            break;
+        case XML_XPATH_FN_CEILING:
+            XmlXPathSetNumber(res, ceil(XmlXPathToNumber(ctx->xml, &args[0])));
+            break;
+        case XML_XPATH_FN_ROUND:
+            XmlXPathSetNumber(res, XmlXPathRound(XmlXPathToNumber(ctx->xml, &args[0])));
+            break;
+    }
+
+done:
+    for (i = 0; i < nargs; i++)
+        XmlXPathValueClear(&args[i]);
+    free(args);
+    if (s0)
+        free(s0);
+    if (s1)
+        free(s1);
+    if (s2)
+        free(s2);
+    return err;
+}
+
+static XmlErr
+XmlXPathEval(XmlXPathAst *ast, XmlXPathContext *ctx, XmlXPathValue *res)
+{
+    XmlXPathValue left, right;
+    XmlErr err = XML_NOERR;
+    int result;
+
+    switch(ast->op) {
+        case XML_XPATH_OP_PATH:
+            return XmlXPathEvalPath(ast, ctx, res);
+        case XML_XPATH_OP_FILTER:
+            err = XmlXPathEval(ast->left, ctx, res);
+            if (err != XML_NOERR)
+                return err;
+            if (res->type != XML_XPATH_NODESET) {
+                fprintf(stderr, "XPath error : predicates can only be applied to node-sets\n");
+                return XML_BADARGS;
+            }
+            return XmlXPathFilterAll(ctx, ast->predicates, &res->set);
+        case XML_XPATH_OP_LITERAL:
+            return XmlXPathSetString(res, strdup(ast->literal));
+        case XML_XPATH_OP_NUMBER:
+            XmlXPathSetNumber(res, ast->number);
+            return XML_NOERR;
+        case XML_XPATH_OP_FUNCTION:
+            return XmlXPathCallFunction(ast, ctx, res);
+        default:
+            break;
+    }
+
+    memset(&left, 0, sizeof(left));
+    memset(&right, 0, sizeof(right));
+    err = XmlXPathEval(ast->left, ctx, &left);
+    if (err != XML_NOERR)
+        goto done;
+
+    // and/or don't evaluate the right operand if the left one is enough
+    if (ast->op == XML_XPATH_OP_OR || ast->op == XML_XPATH_OP_AND) {
+        result = XmlXPathToBoolean(&left);
+        if (result == (ast->op == XML_XPATH_OP_OR)) {
+            XmlXPathSetBoolean(res, result);
+            goto done;
+        }
+        err = XmlXPathEval(ast->right, ctx, &right);
+        if (err == XML_NOERR)
+            XmlXPathSetBoolean(res, XmlXPathToBoolean(&right));
+        goto done;
+    }
+    if (ast->op == XML_XPATH_OP_NEG) {
+        XmlXPathSetNumber(res, -XmlXPathToNumber(ctx->xml, &left));
+        goto done;
+    }
+
+    err = XmlXPathEval(ast->right, ctx, &right);
+    if (err != XML_NOERR)
+        goto done;
+
+    switch(ast->op) {
+        case XML_XPATH_OP_EQ:
+        case XML_XPATH_OP_NEQ:
+        case XML_XPATH_OP_LT:
+        case XML_XPATH_OP_LTE:
+        case XML_XPATH_OP_GT:
+        case XML_XPATH_OP_GTE:
+            err = XmlXPathCompareValues(ctx->xml, ast->op, &left, &right, &result);
+            if (err == XML_NOERR)
+                XmlXPathSetBoolean(res, result);
+            break;
+        case XML_XPATH_OP_ADD:
+            XmlXPathSetNumber(res, XmlXPathToNumber(ctx->xml, &left) + XmlXPathToNumber(ctx->xml, &right));
+            break;
+        case XML_XPATH_OP_SUB:
+            XmlXPathSetNumber(res, XmlXPathToNumber(ctx->xml, &left) - XmlXPathToNumber(ctx->xml, &right));
+            break;
+        case XML_XPATH_OP_MUL:
+            XmlXPathSetNumber(res, XmlXPathToNumber(ctx->xml, &left) * XmlXPathToNumber(ctx->xml, &right));
+            break;
+        case XML_XPATH_OP_DIV:
+            XmlXPathSetNumber(res, XmlXPathToNumber(ctx->xml, &left) / XmlXPathToNumber(ctx->xml, &right));
+            break;
+        case XML_XPATH_OP_MOD:
+            XmlXPathSetNumber(res, fmod(XmlXPathToNumber(ctx->xml, &left), XmlXPathToNumber(ctx->xml, &right)));
+            break;
+        case XML_XPATH_OP_UNION:
+            if (left.type != XML_XPATH_NODESET || right.type != XML_XPATH_NODESET) {
+                fprintf(stderr, "XPath error : the operands of '|' must be node-sets\n");
+                err = XML_BADARGS;
+                break;
+            }
+            err = XmlXPathSetMerge(&left.set, &right.set);
+            if (err == XML_NOERR) {
+                res->type = XML_XPATH_NODESET;
+                res->set = left.set;
+                memset(&left.set, 0, sizeof(XmlXPathNodeSet));
+            }
+            break;
+    }
+
+done:
+    XmlXPathValueClear(&left);
+    XmlXPathValueClear(&right);
+    return err;
+}
+
+//
+// COMPILED EXPRESSIONS
+//
+// A compiled expression is its syntax tree, which the evaluation never
+// modifies. Expressions held by a cache are reference counted, so that
+// one being evaluated survives its eviction from the cache.
+//
+#ifdef __GNUC__
+#define XML_XPATH_REF(__e) __atomic_add_fetch(&(__e)->refs, 1, __ATOMIC_RELAXED)
+#define XML_XPATH_UNREF(__e) __atomic_sub_fetch(&(__e)->refs, 1, __ATOMIC_ACQ_REL)
+#else
+#define XML_XPATH_REF(__e) (++(__e)->refs)
+#define XML_XPATH_UNREF(__e) (--(__e)->refs)
+#endif
+
+struct __XmlXPathExpr {
+    char *string;
+    XmlXPathAst *ast;
+    int refs;
+};
+
+XmlXPathExpr *
+XmlXPathCompile(char *expr)
+{
+    XmlXPathExpr *compiled;
+    if (!expr)
+        return NULL;
+    compiled = calloc(1, sizeof(XmlXPathExpr));
+    if (!compiled)
+        return NULL;
+    compiled->string = strdup(expr);
+    if (compiled->string)
+        compiled->ast = XmlXPathParse(expr);
+    if (!compiled->ast) {
+        if (compiled->string)
+            free(compiled->string);
+        free(compiled);
+        return NULL;
+    }
+    compiled->refs = 1;
+    return compiled;
+}
+
+void
+XmlXPathDestroyExpr(XmlXPathExpr *compiled)
+{
+    if (!compiled || XML_XPATH_UNREF(compiled) > 0)
+        return;
+    XmlXPathDestroyAst(compiled->ast);
+    free(compiled->string);
+    free(compiled);
+}
+
+XmlXPathValue *
+XmlXPathEvaluateCompiled(TXml *xml, XmlNode *node, XmlXPathExpr *compiled)
+{
+    XmlXPathContext ctx;
+    XmlXPathValue *value;
+    XmlErr err;
+
+    if (!xml || !compiled)
+        return NULL;
+    value = calloc(1, sizeof(XmlXPathValue));
+    if (!value)
+        return NULL;
+
+    XmlNumberNodes(xml); // node-sets are sorted using the numbers
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.xml = xml;
+    if (node) {
+        ctx.node.type = XmlXPathTypeOf(node);
+        ctx.node.node = node;
+    } else {
+        ctx.node.type = XML_XPATH_NODE_ROOT;
+    }
+    ctx.position = ctx.size = 1;
+    err = XmlXPathEval(compiled->ast, &ctx, value);
+    if (err != XML_NOERR) {
+        XmlXPathDestroyValue(value);
+        return NULL;
+    }
+    return value;
+}
+
+XmlXPathValue *
+XmlXPathEvaluate(TXml *xml, XmlNode *node, char *expr)
+{
+    XmlXPathExpr *compiled;
+    XmlXPathValue *value;
+
+    if (!xml || !expr)
+        return NULL;
+    compiled = XmlXPathCompile(expr);
+    if (!compiled)
+        return NULL;
+    value = XmlXPathEvaluateCompiled(xml, node, compiled);
+    XmlXPathDestroyExpr(compiled);
+    return value;
+}
+
+//
+// CACHE
+//
+// A hash table of the compiled expressions, which are also linked in a
+// list from the most to the least recently used one (the first evicted).
+//
+typedef struct __XmlXPathCacheEntry {
+    XmlXPathExpr *compiled;
+    unsigned long hash;
+    struct __XmlXPathCacheEntry *next; // in the same bucket
+    TAILQ_ENTRY(__XmlXPathCacheEntry) lru;
+} XmlXPathCacheEntry;
+
+struct __XmlXPathCache {
+    XmlXPathCacheEntry **buckets;
+    size_t numBuckets; // power of 2
+    size_t size;
+    size_t count;
+    TAILQ_HEAD(__XmlXPathCacheLruHead, __XmlXPathCacheEntry) lru;
+#ifdef USE_PTHREADS
+    pthread_mutex_t lock;
+#endif
+};
+
+#ifdef USE_PTHREADS
+#define XML_XPATH_CACHE_LOCK(__c) pthread_mutex_lock(&(__c)->lock)
+#define XML_XPATH_CACHE_UNLOCK(__c) pthread_mutex_unlock(&(__c)->lock)
+#else
+#define XML_XPATH_CACHE_LOCK(__c)
+#define XML_XPATH_CACHE_UNLOCK(__c)
+#endif
+
+static unsigned long
+XmlXPathHash(char *string)
+{
+    unsigned long hash = 2166136261UL; // FNV-1a
+    while (*string) {
+        hash ^= (unsigned char)*string++;
+        hash *= 16777619UL;
+    }
+    return hash;
+}
+
+XmlXPathCache *
+XmlXPathCreateCache(size_t size)
+{
+    XmlXPathCache *cache;
+    if (!size)
+        return NULL;
+    cache = calloc(1, sizeof(XmlXPathCache));
+    if (!cache)
+        return NULL;
+    cache->numBuckets = 16;
+    while (cache->numBuckets < size * 2)
+        cache->numBuckets *= 2;
+    cache->buckets = calloc(cache->numBuckets, sizeof(XmlXPathCacheEntry *));
+    if (!cache->buckets) {
+        free(cache);
+        return NULL;
+    }
+    cache->size = size;
+    TAILQ_INIT(&cache->lru);
+#ifdef USE_PTHREADS
+    pthread_mutex_init(&cache->lock, NULL);
+#endif
+    return cache;
+}
+
+static void
+XmlXPathCacheRemove(XmlXPathCache *cache, XmlXPathCacheEntry *entry)
+{
+    XmlXPathCacheEntry **link = &cache->buckets[entry->hash & (cache->numBuckets - 1)];
+    while (*link != entry)
+        link = &(*link)->next;
+    *link = entry->next;
+    TAILQ_REMOVE(&cache->lru, entry, lru);
+    cache->count--;
+    XmlXPathDestroyExpr(entry->compiled); // still alive if being evaluated
+    free(entry);
+}
+
+void
+XmlXPathDestroyCache(XmlXPathCache *cache)
+{
+    if (!cache)
+        return;
+    while (!TAILQ_EMPTY(&cache->lru))
+        XmlXPathCacheRemove(cache, TAILQ_FIRST(&cache->lru));
+#ifdef USE_PTHREADS
+    pthread_mutex_destroy(&cache->lock);
+#endif
+    free(cache->buckets);
+    free(cache);
+}
+
+// look for expr in the cache and take a reference to it (the caller must hold the lock)
+static XmlXPathExpr *
+XmlXPathCacheLookup(XmlXPathCache *cache, char *expr, unsigned long hash)
+{
+    XmlXPathCacheEntry *entry = cache->buckets[hash & (cache->numBuckets - 1)];
+    for (; entry; entry = entry->next) {
+        if (entry->hash == hash && strcmp(entry->compiled->string, expr) == 0) {
+            if (entry != TAILQ_FIRST(&cache->lru)) {
+                TAILQ_REMOVE(&cache->lru, entry, lru);
+                TAILQ_INSERT_HEAD(&cache->lru, entry, lru);
+            }
+            XML_XPATH_REF(entry->compiled);
+            return entry->compiled;
+        }
+    }
+    return NULL;
+}
+
+XmlXPathValue *
+XmlXPathCacheEvaluate(XmlXPathCache *cache, TXml *xml, XmlNode *node, char *expr)
+{
+    XmlXPathExpr *compiled, *cached;
+    XmlXPathCacheEntry *entry;
+    XmlXPathValue *value;
+    unsigned long hash;
+
+    if (!cache || !xml || !expr)
+        return NULL;
+    hash = XmlXPathHash(expr);
+    XML_XPATH_CACHE_LOCK(cache);
+    compiled = XmlXPathCacheLookup(cache, expr, hash);
+    XML_XPATH_CACHE_UNLOCK(cache);
+
+    if (!compiled) {
+        // compile without holding the lock, another thread could
+        // insert the same expression meanwhile
+        compiled = XmlXPathCompile(expr);
+        if (!compiled)
+            return NULL;
+        entry = calloc(1, sizeof(XmlXPathCacheEntry));
+        XML_XPATH_CACHE_LOCK(cache);
+        cached = XmlXPathCacheLookup(cache, expr, hash);
+        if (cached) {
+            XmlXPathDestroyExpr(compiled);
+            compiled = cached;
+            if (entry)
+                free(entry);
+        } else if (entry) {
+            if (cache->count == cache->size)
+                XmlXPathCacheRemove(cache, TAILQ_LAST(&cache->lru, __XmlXPathCacheLruHead));
+            entry->compiled = compiled;
+            entry->hash = hash;
+            entry->next = cache->buckets[hash & (cache->numBuckets - 1)];
+            cache->buckets[hash & (cache->numBuckets - 1)] = entry;
+            TAILQ_INSERT_HEAD(&cache->lru, entry, lru);
+            cache->count++;
+            XML_XPATH_REF(compiled); // one reference for the cache, one for us
+        }
+        XML_XPATH_CACHE_UNLOCK(cache);
+    }
+
+    value = XmlXPathEvaluateCompiled(xml, node, compiled);
+    XmlXPathDestroyExpr(compiled);
+    return value;
+}
+
+//
+// BATCHES
+//
+// The location paths of a batch which only walk down the tree (child,
+// descendant, descendant-or-self and self steps, and attribute ones at the
+// end, with predicates not depending on the position of the nodes) are merged
+// into a tree of states sharing their common prefixes. A state is active on a
+// node when the node has been selected by the steps leading to the state, so
+// all the paths are evaluated during a single walk of the document : the
+// children of a node are tested against the child steps leaving the states
+// active on it, while its descendant steps stay armed through its whole subtree.
+// Any other expression of the batch is evaluated on its own.
+//
+typedef struct __XmlXPathBatchState {
+    size_t id;
+    XmlXPathAst *step; // NULL for the initial states
+    struct __XmlXPathBatchState **next; // the steps leaving this state
+    size_t numNext;
+    size_t *accepts; // expressions selecting the nodes this state is active on
+    size_t numAccepts;
+} XmlXPathBatchState;
+
+struct __XmlXPathBatch {
+    XmlXPathExpr **exprs;
+    size_t count;
+    char *streamed; // the expression is evaluated by the states
+    XmlXPathBatchState **states; // by id
+    size_t numStates;
+    XmlXPathBatchState *absolute; // initial state of the absolute paths (active on the root)
+    XmlXPathBatchState *relative; // initial state of the relative paths (active on the context node)
+};
+
+static int XmlXPathAstEqual(XmlXPathAst *a, XmlXPathAst *b);
+
+static int
+XmlXPathAstListEqual(XmlXPathAst *a, XmlXPathAst *b)
+{
+    for (; a && b; a = a->next, b = b->next) {
+        if (!XmlXPathAstEqual(a, b))
+            return 0;
+    }
+    return (!a && !b);
+}
+
+static int
+XmlXPathStringEqual(char *a, char *b)
+{
+    if (!a || !b)
+        return (a == b);
+    return (strcmp(a, b) == 0);
+}
+
+// compare two syntax trees (but not the lists they belong to)
+static int
+XmlXPathAstEqual(XmlXPathAst *a, XmlXPathAst *b)
+{
+    if (!a || !b)
+        return (a == b);
+    return (a->op == b->op && a->absolute == b->absolute && a->axis == b->axis &&
+            a->test == b->test && a->function == b->function && a->nargs == b->nargs &&
+            a->number == b->number && XmlXPathStringEqual(a->prefix, b->prefix) &&
+            XmlXPathStringEqual(a->name, b->name) && XmlXPathStringEqual(a->literal, b->literal) &&
+            XmlXPathAstEqual(a->left, b->left) && XmlXPathAstEqual(a->right, b->right) &&
+            XmlXPathAstListEqual(a->steps, b->steps) &&
+            XmlXPathAstListEqual(a->predicates, b->predicates) &&
+            XmlXPathAstListEqual(a->args, b->args));
+}
+
+static int
+XmlXPathUsesPosition(XmlXPathAst *ast)
+{
+    XmlXPathAst *item;
+    if (!ast)
+        return 0;
+    if (ast->op == XML_XPATH_OP_FUNCTION &&
+        (ast->function == XML_XPATH_FN_POSITION || ast->function == XML_XPATH_FN_LAST))
+    {
+        return 1;
+    }
+    if (XmlXPathUsesPosition(ast->left) || XmlXPathUsesPosition(ast->right))
+        return 1;
+    for (item = ast->steps; item; item = item->next) {
+        if (XmlXPathUsesPosition(item))
+            return 1;
+    }
+    for (item = ast->predicates; item; item = item->next) {
+        if (XmlXPathUsesPosition(item))
+            return 1;
+    }
+    for (item = ast->args; item; item = item->next) {
+        if (XmlXPathUsesPosition(item))
+            return 1;
+    }
+    return 0;
+}
+
+// a predicate which keeps a node or not whatever its position
+// (numbers select a position, so only boolean and node-set values are allowed)
+static int
+XmlXPathIsPlainPredicate(XmlXPathAst *predicate)
+{
+    switch(predicate->op) {
+        case XML_XPATH_OP_OR:
+        case XML_XPATH_OP_AND:
+        case XML_XPATH_OP_EQ:
+        case XML_XPATH_OP_NEQ:
+        case XML_XPATH_OP_LT:
+        case XML_XPATH_OP_LTE:
+        case XML_XPATH_OP_GT:
+        case XML_XPATH_OP_GTE:
+        case XML_XPATH_OP_UNION:
+        case XML_XPATH_OP_PATH:
+        case XML_XPATH_OP_FILTER:
+            break;
+        case XML_XPATH_OP_FUNCTION:
+            switch(predicate->function) {
+                case XML_XPATH_FN_ID:
+                case XML_XPATH_FN_STARTS_WITH:
+                case XML_XPATH_FN_CONTAINS:
+                case XML_XPATH_FN_BOOLEAN:
+                case XML_XPATH_FN_NOT:
+                case XML_XPATH_FN_TRUE:
+                case XML_XPATH_FN_FALSE:
+                case XML_XPATH_FN_LANG:
+                    break;
+                default:
+                    return 0;
+            }
+            break;
+        default:
+            return 0;
+    }
+    return !XmlXPathUsesPosition(predicate);
+}
+
+static int
+XmlXPathIsStreamable(XmlXPathAst *ast)
+{
+    XmlXPathAst *step, *predicate;
+
+    if (ast->op == XML_XPATH_OP_UNION)
+        return (XmlXPathIsStreamable(ast->left) && XmlXPathIsStreamable(ast->right));
+    if (ast->op != XML_XPATH_OP_PATH || ast->left)
+        return 0;
+    for (step = ast->steps; step; step = step->next) {
+        switch(step->axis) {
+            case XML_XPATH_AXIS_CHILD:
+            case XML_XPATH_AXIS_DESCENDANT:
+            case XML_XPATH_AXIS_DESCENDANT_OR_SELF:
+            case XML_XPATH_AXIS_SELF:
+                break;
+            case XML_XPATH_AXIS_ATTRIBUTE: // attributes have no children
+                if (step->next)
+                    return 0;
+                break;
+            default:
+                return 0;
+        }
+        for (predicate = step->predicates; predicate; predicate = predicate->next) {
+            if (!XmlXPathIsPlainPredicate(predicate))
+                return 0;
+        }
+    }
+    return 1;
+}
+
+static XmlXPathBatchState *
+XmlXPathBatchNewState(XmlXPathBatch *batch, XmlXPathAst *step)
+{
+    XmlXPathBatchState *state;
+    XmlXPathBatchState **states = realloc(batch->states,
+                                          (batch->numStates + 1) * sizeof(XmlXPathBatchState *));
+    if (!states)
+        return NULL;
+    batch->states = states;
+    state = calloc(1, sizeof(XmlXPathBatchState));
+    if (!state)
+        return NULL;
+    state->id = batch->numStates;
+    state->step = step;
+    batch->states[batch->numStates++] = state;
+    return state;
+}
+
+// add the states of a path, sharing the ones of the steps
+// already found at the same place by a previous path
+static XmlErr
+XmlXPathBatchAddPath(XmlXPathBatch *batch, XmlXPathAst *ast, size_t index)
+{
+    XmlXPathBatchState *state;
+    XmlXPathAst *step;
+    size_t *accepts;
+    size_t i;
+
+    if (ast->op == XML_XPATH_OP_UNION) {
+        XmlErr err = XmlXPathBatchAddPath(batch, ast->left, index);
+        if (err != XML_NOERR)
+            return err;
+        return XmlXPathBatchAddPath(batch, ast->right, index);
+    }
+
+    state = ast->absolute ? batch->absolute : batch->relative;
+    for (step = ast->steps; step; step = step->next) {
+        XmlXPathBatchState *next = NULL;
+        for (i = 0; i < state->numNext && !next; i++) {
+            if (XmlXPathAstEqual(state->next[i]->step, step))
+                next = state->next[i];
+        }
+        if (!next) {
+            XmlXPathBatchState **nexts = realloc(state->next,
+                                                 (state->numNext + 1) * sizeof(XmlXPathBatchState *));
+            if (!nexts)
+                return XML_MEMORY_ERR;
+            state->next = nexts;
+            next = XmlXPathBatchNewState(batch, step);
+            if (!next)
+                return XML_MEMORY_ERR;
+            state->next[state->numNext++] = next;
+        }
+        state = next;
+    }
+    accepts = realloc(state->accepts, (state->numAccepts + 1) * sizeof(size_t));
+    if (!accepts)
+        return XML_MEMORY_ERR;
+    state->accepts = accepts;
+    state->accepts[state->numAccepts++] = index;
+    return XML_NOERR;
+}
+
+XmlXPathBatch *
+XmlXPathCreateBatch(XmlXPathExpr **exprs, size_t count)
+{
+    XmlXPathBatch *batch;
+    size_t i;
+
+    if (!exprs)
+        return NULL;
+    for (i = 0; i < count; i++) {
+        if (!exprs[i])
+            return NULL;
+    }
+    batch = calloc(1, sizeof(XmlXPathBatch));
+    if (!batch)
+        return NULL;
+    batch->exprs = calloc(count ? count : 1, sizeof(XmlXPathExpr *));
+    batch->streamed = calloc(count ? count : 1, sizeof(char));
+    if (!batch->exprs || !batch->streamed) {
+        XmlXPathDestroyBatch(batch);
+        return NULL;
+    }
+    batch->absolute = XmlXPathBatchNewState(batch, NULL);
+    batch->relative = batch->absolute ? XmlXPathBatchNewState(batch, NULL) : NULL;
+    if (!batch->relative) {
+        XmlXPathDestroyBatch(batch);
+        return NULL;
+    }
+    for (i = 0; i < count; i++) {
+        XML_XPATH_REF(exprs[i]);
+        batch->exprs[batch->count++] = exprs[i];
+        if (XmlXPathIsStreamable(exprs[i]->ast)) {
+            if (XmlXPathBatchAddPath(batch, exprs[i]->ast, i) != XML_NOERR) {
+                XmlXPathDestroyBatch(batch);
+                return NULL;
+            }
+            batch->streamed[i] = 1;
+        }
+    }
+    return batch;
+}
+
+void
+XmlXPathDestroyBatch(XmlXPathBatch *batch)
+{
+    size_t i;
+
+    if (!batch)
+        return;
+    for (i = 0; i < batch->numStates; i++) {
+        if (batch->states[i]->next)
+            free(batch->states[i]->next);
+        if (batch->states[i]->accepts)
+            free(batch->states[i]->accepts);
+        free(batch->states[i]);
+    }
+    if (batch->states)
+        free(batch->states);
+    for (i = 0; i < batch->count; i++)
+        XmlXPathDestroyExpr(batch->exprs[i]);
+    if (batch->exprs)
+        free(batch->exprs);
+    if (batch->streamed)
+        free(batch->streamed);
+    free(batch);
+}
+
+size_t
+XmlXPathBatchCount(XmlXPathBatch *batch)
+{
+    return batch->count;
+}
+
+// the state of a walk, batches are never modified while being evaluated
+typedef struct __XmlXPathBatchRun {
+    XmlXPathBatch *batch;
+    TXml *xml;
+    XmlNode *inject; // the context node, when the walk starts from the root
+    XmlXPathValue **values;
+    char *unsorted; // a value got some nodes out of document order
+    unsigned long *stamps; // visit during which each state has been last activated
+    unsigned long visit;
+    XmlXPathBatchState **active; // the states active on the nodes being visited (a stack)
+    size_t numActive;
+    size_t sizeActive;
+    XmlXPathBatchState **armed; // descendant steps leaving the ancestors of the node being visited
+    size_t numArmed;
+    size_t sizeArmed;
+    char *isArmed; // by state id
+} XmlXPathBatchRun;
+
+static XmlErr
+XmlXPathBatchPush(XmlXPathBatchState ***stack, size_t *count, size_t *size, XmlXPathBatchState *state)
+{
+    if (*count == *size) {
+        size_t newSize = *size ? *size * 2 : 64;
+        XmlXPathBatchState **newStack = realloc(*stack, newSize * sizeof(XmlXPathBatchState *));
+        if (!newStack)
+            return XML_MEMORY_ERR;
+        *stack = newStack;
+        *size = newSize;
+    }
+    (*stack)[(*count)++] = state;
+    return XML_NOERR;
+}
+
+// [@name = 'literal'] (the most common predicate in extraction paths) is
+// checked directly on the attributes of the node, without building node-sets
+static int
+XmlXPathBatchAttributeTest(XmlXPathAst *predicate, XmlXPathNode *n, int *match)
+{
+    XmlXPathAst *path = predicate->left;
+    XmlXPathAst *literal = predicate->right;
+    XmlXPathAst *step;
+    XmlNodeAttribute *attr;
+
+    if (predicate->op != XML_XPATH_OP_EQ)
+        return 0;
+    if (path->op == XML_XPATH_OP_LITERAL) {
+        path = predicate->right;
+        literal = predicate->left;
+    }
+    if (path->op != XML_XPATH_OP_PATH || path->left || path->absolute ||
+        literal->op != XML_XPATH_OP_LITERAL)
+    {
+        return 0;
+    }
+    step = path->steps;
+    if (!step || step->next || step->axis != XML_XPATH_AXIS_ATTRIBUTE ||
+        step->test != XML_XPATH_TEST_NAME || step->prefix || step->predicates)
+    {
+        return 0;
+    }
+    *match = 0;
+    if (n->type != XML_XPATH_NODE_ELEMENT)
+        return 1;
+    TAILQ_FOREACH(attr, &n->node->attributes, list) {
+        if (strcmp(attr->name, step->name) == 0 && !XmlXPathIsNamespaceDecl(attr) &&
+            strcmp(attr->value ? attr->value : "", literal->literal) == 0)
+        {
+            *match = 1;
+            break;
+        }
+    }
+    return 1;
+}
+
+// test a node against a step and its predicates
+static XmlErr
+XmlXPathBatchMatch(XmlXPathBatchRun *run, XmlXPathAst *step, XmlXPathNode *n, int *match)
+{
+    XmlXPathAst *predicate;
+    XmlXPathContext ctx;
+
+    *match = XmlXPathTestNode(step, n->type, n->node, n->attr);
+    if (!*match || !step->predicates)
+        return XML_NOERR;
+    ctx.xml = run->xml;
+    ctx.node = *n;
+    ctx.position = ctx.size = 1;
+    for (predicate = step->predicates; predicate && *match; predicate = predicate->next) {
+        XmlXPathValue value;
+        XmlErr err;
+
+        if (XmlXPathBatchAttributeTest(predicate, n, match))
+            continue;
+        memset(&value, 0, sizeof(value));
+        err = XmlXPathEval(predicate, &ctx, &value);
+        if (err != XML_NOERR) {
+            XmlXPathValueClear(&value);
+            return err;
+        }
+        *match = XmlXPathToBoolean(&value);
+        XmlXPathValueClear(&value);
+    }
+    return XML_NOERR;
+}
+
+// add a node to the values of the expressions accepted by state
+static XmlErr
+XmlXPathBatchEmit(XmlXPathBatchRun *run, XmlXPathBatchState *state, XmlXPathNode *n)
+{
+    size_t i;
+
+    for (i = 0; i < state->numAccepts; i++) {
+        XmlXPathNodeSet *set = &run->values[state->accepts[i]]->set;
+        XmlErr err;
+
+        if (set->count) {
+            XmlXPathNode *last = &set->nodes[set->count - 1];
+            if (XmlXPathSameNode(last, n))
+                continue;
+            // nodes are found in document order, unless they have been
+            // selected by different steps of the same expression
+            if (XmlXPathCompareNodes(n, last) < 0)
+                run->unsorted[state->accepts[i]] = 1;
+        }
+        err = XmlXPathSetAdd(set, n->type, n->node, n->attr);
+        if (err != XML_NOERR)
+            return err;
+    }
+    return XML_NOERR;
+}
+
+static XmlErr
+XmlXPathBatchActivate(XmlXPathBatchRun *run, XmlXPathBatchState *state, XmlXPathNode *n)
+{
+    size_t i;
+    XmlErr err;
+
+    if (run->stamps[state->id] == run->visit)
+        return XML_NOERR;
+    run->stamps[state->id] = run->visit;
+    err = XmlXPathBatchPush(&run->active, &run->numActive, &run->sizeActive, state);
+    if (err == XML_NOERR)
+        err = XmlXPathBatchEmit(run, state, n);
+    // the steps which can select the node itself
+    for (i = 0; i < state->numNext && err == XML_NOERR; i++) {
+        XmlXPathBatchState *next = state->next[i];
+        int match;
+
+        if (next->step->axis != XML_XPATH_AXIS_SELF &&
+            next->step->axis != XML_XPATH_AXIS_DESCENDANT_OR_SELF)
+        {
+            continue;
+        }
+        err = XmlXPathBatchMatch(run, next->step, n, &match);
+        if (err == XML_NOERR && match)
+            err = XmlXPathBatchActivate(run, next, n);
+    }
+    return err;
+}
+
+static XmlErr XmlXPathBatchVisit(XmlXPathBatchRun *run, XmlXPathNode *n, size_t first, size_t count);
+
+// activate the states selecting child, given the ones active on its parent,
+// and visit it if anything can still be found in its subtree
+static XmlErr
+XmlXPathBatchVisitChild(XmlXPathBatchRun *run, XmlXPathNode *child, size_t first, size_t count)
+{
+    size_t start = run->numActive;
+    size_t i, j;
+    int match;
+    XmlErr err = XML_NOERR;
+
+    run->visit++;
+    for (i = first; i < first + count && err == XML_NOERR; i++) {
+        XmlXPathBatchState *state = run->active[i];
+        for (j = 0; j < state->numNext && err == XML_NOERR; j++) {
+            XmlXPathBatchState *next = state->next[j];
+            if (next->step->axis != XML_XPATH_AXIS_CHILD)
+                continue;
+            err = XmlXPathBatchMatch(run, next->step, child, &match);
+            if (err == XML_NOERR && match)
+                err = XmlXPathBatchActivate(run, next, child);
+        }
+    }
+    for (i = 0; i < run->numArmed && err == XML_NOERR; i++) {
+        err = XmlXPathBatchMatch(run, run->armed[i]->step, child, &match);
+        if (err == XML_NOERR && match)
+            err = XmlXPathBatchActivate(run, run->armed[i], child);
+    }
+    if (err == XML_NOERR && child->type == XML_XPATH_NODE_ELEMENT) {
+        if (child->node == run->inject)
+            err = XmlXPathBatchActivate(run, run->batch->relative, child);
+        if (err == XML_NOERR && (run->numActive > start || run->numArmed ||
+                                 (run->inject && XmlIsAncestor(child->node, run->inject))))
+        {
+            err = XmlXPathBatchVisit(run, child, start, run->numActive - start);
+        }
+    }
+    run->numActive = start;
+    return err;
+}
+
+// n is a node on which the states active[first] ... active[first + count - 1] are active
+static XmlErr
+XmlXPathBatchVisit(XmlXPathBatchRun *run, XmlXPathNode *n, size_t first, size_t count)
+{
+    XmlNode *node = n->node;
+    XmlNode *child;
+    XmlNodeAttribute *attr;
+    size_t armed = run->numArmed;
+    size_t i, j;
+    int match;
+    XmlErr err = XML_NOERR;
+
+    if (n->type != XML_XPATH_NODE_ROOT && n->type != XML_XPATH_NODE_ELEMENT)
+        return XML_NOERR;
+
+    for (i = first; i < first + count && err == XML_NOERR; i++) {
+        XmlXPathBatchState *state = run->active[i];
+        for (j = 0; j < state->numNext && err == XML_NOERR; j++) {
+            XmlXPathBatchState *next = state->next[j];
+            switch(next->step->axis) {
+                case XML_XPATH_AXIS_ATTRIBUTE:
+                    if (n->type != XML_XPATH_NODE_ELEMENT)
+                        break;
+                    TAILQ_FOREACH(attr, &node->attributes, list) {
+                        XmlXPathNode a;
+                        if (XmlXPathIsNamespaceDecl(attr))
+                            continue;
+                        a.type = XML_XPATH_NODE_ATTRIBUTE;
+                        a.node = node;
+                        a.attr = attr;
+                        err = XmlXPathBatchMatch(run, next->step, &a, &match);
+                        if (err == XML_NOERR && match)
+                            err = XmlXPathBatchEmit(run, next, &a);
+                        if (err != XML_NOERR)
+                            break;
+                    }
+                    break;
+                case XML_XPATH_AXIS_DESCENDANT:
+                case XML_XPATH_AXIS_DESCENDANT_OR_SELF:
+                    if (run->isArmed[next->id]) // by an ancestor
+                        break;
+                    err = XmlXPathBatchPush(&run->armed, &run->numArmed, &run->sizeArmed, next);
+                    if (err == XML_NOERR)
+                        run->isArmed[next->id] = 1;
+                    break;
+                default:
+                    break;
+            }
+        }
+    }
+
+    if (n->type == XML_XPATH_NODE_ROOT) {
+        for (child = TAILQ_FIRST(&run->xml->rootElements); child && err == XML_NOERR;
+             child = TAILQ_NEXT(child, siblings))
+        {
+            XmlXPathNode c = { XmlXPathTypeOf(child), child, NULL };
+            err = XmlXPathBatchVisitChild(run, &c, first, count);
+        }
+    } else {
+        if (err == XML_NOERR && XmlXPathHasValueText(node)) {
+            XmlXPathNode text = { XML_XPATH_NODE_TEXT, node, NULL };
+            err = XmlXPathBatchVisitChild(run, &text, first, count);
+        }
+        for (child = TAILQ_FIRST(&node->children); child && err == XML_NOERR;
+             child = TAILQ_NEXT(child, siblings))
+        {
+            XmlXPathNode c = { XmlXPathTypeOf(child), child, NULL };
+            err = XmlXPathBatchVisitChild(run, &c, first, count);
+        }
+    }
+
+    while (run->numArmed > armed)
+        run->isArmed[run->armed[--run->numArmed]->id] = 0;
+    return err;
+}
+
+XmlErr
+XmlXPathBatchEvaluate(XmlXPathBatch *batch, TXml *xml, XmlNode *node, XmlXPathValue **values)
+{
+    XmlXPathBatchRun run;
+    XmlXPathNode start;
+    int absolute, relative;
+    size_t i;
+    XmlErr err = XML_NOERR;
+
+    if (!batch || !xml || !values)
+        return XML_BADARGS;
+
+    XmlNumberNodes(xml);
+    memset(&run, 0, sizeof(run));
+    run.batch = batch;
+    run.xml = xml;
+    run.values = values;
+    for (i = 0; i < batch->count; i++) {
+        if (batch->streamed[i]) {
+            values[i] = calloc(1, sizeof(XmlXPathValue));
+            if (values[i])
+                values[i]->type = XML_XPATH_NODESET;
+            else
+                err = XML_MEMORY_ERR;
+        } else {
+            values[i] = XmlXPathEvaluateCompiled(xml, node, batch->exprs[i]);
+        }
+    }
+    run.unsorted = calloc(batch->count ? batch->count : 1, sizeof(char));
+    run.stamps = calloc(batch->numStates, sizeof(unsigned long));
+    run.isArmed = calloc(batch->numStates, sizeof(char));
+    if (!run.unsorted || !run.stamps || !run.isArmed)
+        err = XML_MEMORY_ERR;
+
+    absolute = (batch->absolute->numNext || batch->absolute->numAccepts);
+    relative = (batch->relative->numNext || batch->relative->numAccepts);
+    if (err == XML_NOERR && (absolute || relative)) {
+        // walk the whole document only if there are absolute paths
+        memset(&start, 0, sizeof(start));
+        if (absolute || !node) {
+            start.type = XML_XPATH_NODE_ROOT;
+            if (relative && node)
+                run.inject = node;
+        } else {
+            start.type = XmlXPathTypeOf(node);
+            start.node = node;
+        }
+        run.visit = 1;
+        if (absolute)
+            err = XmlXPathBatchActivate(&run, batch->absolute, &start);
+        if (err == XML_NOERR && relative && start.node == node)
+            err = XmlXPathBatchActivate(&run, batch->relative, &start);
+        if (err == XML_NOERR)
+            err = XmlXPathBatchVisit(&run, &start, 0, run.numActive);
+    }
+
+    for (i = 0; i < batch->count && err == XML_NOERR; i++) {
+        if (run.unsorted[i])
+            XmlXPathSetSort(&values[i]->set);
+    }
+    if (run.unsorted)
+        free(run.unsorted);
+    if (run.stamps)
+        free(run.stamps);
+    if (run.isArmed)
+        free(run.isArmed);
+    if (run.active)
+        free(run.active);
+    if (run.armed)
+        free(run.armed);
+    if (err != XML_NOERR) {
+        for (i = 0; i < batch->count; i++) {
+            XmlXPathDestroyValue(values[i]);
+            values[i] = NULL;
+        }
+    }
+    return err;
+}
+
+void
+XmlXPathDestroyValue(XmlXPathValue *value)
+{
+    if (!value)
+        return;
+    XmlXPathValueClear(value);
+    free(value);
+}
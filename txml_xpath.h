@@ -0,0 +1,203 @@
+/*
+ *  txml_xpath.h
+ *
+ *  XPath 1.0 evaluator working directly on the TXml tree
+ *
+ */
+
+#ifndef __TINYXML_XPATH_H__
+#define __TINYXML_XPATH_H__
+
+#include "txml.h"
+
+// types of the nodes which can be found in a node-set
+#define XML_XPATH_NODE_ROOT 0      // the document itself (parent of the root elements)
+#define XML_XPATH_NODE_ELEMENT 1
+#define XML_XPATH_NODE_ATTRIBUTE 2
+#define XML_XPATH_NODE_TEXT 3      // the value of an element or a CDATA section
+#define XML_XPATH_NODE_COMMENT 4
+
+/**
+    @type XmlXPathNode
+    @brief A node selected by an XPath expression.
+           Attributes and text values are not nodes in the TXml tree,
+           so they are referred through the element holding them
+*/
+typedef struct __XmlXPathNode {
+    int type;
+    XmlNode *node; ///< the node, the element holding the attribute/text or NULL for the root
+    XmlNodeAttribute *attr; ///< the attribute (only for XML_XPATH_NODE_ATTRIBUTE)
+} XmlXPathNode;
+
+/**
+    @type XmlXPathNodeSet
+    @brief Nodes selected by an XPath expression (without duplicates and in document order)
+*/
+typedef struct __XmlXPathNodeSet {
+    XmlXPathNode *nodes;
+    size_t count;
+    size_t size; // allocated slots
+} XmlXPathNodeSet;
+
+#define XML_XPATH_NODESET 0
+#define XML_XPATH_BOOLEAN 1
+#define XML_XPATH_NUMBER 2
+#define XML_XPATH_STRING 3
+
+/**
+    @type XmlXPathValue
+    @brief Result of an XPath expression. Only the member matching type is meaningful
+*/
+typedef struct __XmlXPathValue {
+    int type;
+    XmlXPathNodeSet set;
+    int boolean;
+    double number;
+    char *string;
+} XmlXPathValue;
+
+/***
+    @brief evaluate an XPath 1.0 expression.
+           All the axes and the whole core function library are supported.
+           Name tests without a prefix match elements in any namespace,
+           while a prefix is matched against the one used in the document.
+           Variable references and processing-instruction() are not supported
+           (and there are no processing instructions in the tree anyway)
+    @arg pointer to a valid xml context
+    @arg the context node (NULL to evaluate the expression at the root of the document)
+    @arg the expression
+    @return a newly allocated XmlXPathValue (to be released using XmlXPathDestroyValue()),
+            NULL if the expression is malformed or can't be evaluated
+*/
+XmlXPathValue *XmlXPathEvaluate(TXml *xml, XmlNode *node, char *expr);
+
+/***
+    @brief release a value returned by XmlXPathEvaluate()
+    @arg pointer to a valid XmlXPathValue
+*/
+void XmlXPathDestroyValue(XmlXPathValue *value);
+
+/**
+    @type XmlXPathExpr
+    @brief A compiled XPath expression (opaque)
+*/
+typedef struct __XmlXPathExpr XmlXPathExpr;
+
+/***
+    @brief compile an XPath expression once, to evaluate it any number of times
+           (against any document) using XmlXPathEvaluateCompiled().
+           Evaluating a compiled expression doesn't modify it, so the same
+           compiled expression can be evaluated by many threads at once
+    @arg the expression
+    @return a newly allocated XmlXPathExpr (to be released using XmlXPathDestroyExpr()),
+            NULL if the expression is malformed
+*/
+XmlXPathExpr *XmlXPathCompile(char *expr);
+
+/***
+    @brief evaluate a compiled XPath expression (see XmlXPathEvaluate())
+    @arg pointer to a valid xml context
+    @arg the context node (NULL to evaluate the expression at the root of the document)
+    @arg the expression compiled by XmlXPathCompile()
+    @return a newly allocated XmlXPathValue (to be released using XmlXPathDestroyValue()),
+            NULL if the expression can't be evaluated
+*/
+XmlXPathValue *XmlXPathEvaluateCompiled(TXml *xml, XmlNode *node, XmlXPathExpr *compiled);
+
+/***
+    @brief release a compiled expression
+    @arg pointer to a valid XmlXPathExpr
+*/
+void XmlXPathDestroyExpr(XmlXPathExpr *compiled);
+
+/**
+    @type XmlXPathCache
+    @brief Expressions compiled on behalf of callers which can't keep the
+           compiled expressions around, looked up by their text (opaque)
+*/
+typedef struct __XmlXPathCache XmlXPathCache;
+
+/***
+    @brief create a cache of compiled expressions.
+           When full, the least recently used expression is dropped
+    @arg the maximum number of expressions kept in the cache
+    @return a pointer to a new XmlXPathCache, NULL on errors
+*/
+XmlXPathCache *XmlXPathCreateCache(size_t size);
+
+/***
+    @brief release a cache and all the expressions it holds
+    @arg pointer to a valid XmlXPathCache
+*/
+void XmlXPathDestroyCache(XmlXPathCache *cache);
+
+/***
+    @brief evaluate an XPath expression (see XmlXPathEvaluate()), compiling it
+           only if not found in the cache. The cache can be used by many threads at once
+    @arg pointer to a valid XmlXPathCache
+    @arg pointer to a valid xml context
+    @arg the context node (NULL to evaluate the expression at the root of the document)
+    @arg the expression
+    @return a newly allocated XmlXPathValue (to be released using XmlXPathDestroyValue()),
+            NULL if the expression is malformed or can't be evaluated
+*/
+XmlXPathValue *XmlXPathCacheEvaluate(XmlXPathCache *cache, TXml *xml, XmlNode *node, char *expr);
+
+/**
+    @type XmlXPathBatch
+    @brief Compiled expressions evaluated together against the same document (opaque)
+*/
+typedef struct __XmlXPathBatch XmlXPathBatch;
+
+/***
+    @brief group compiled expressions to evaluate all of them at once.
+           The location paths which only walk down the tree (child, descendant,
+           descendant-or-self and self steps, optionally ending with an attribute step,
+           without positional predicates) share their common prefixes and are all
+           evaluated during a single walk of the document.
+           The other expressions are evaluated one by one.
+           A batch is never modified by the evaluation, so it can be
+           evaluated by many threads at once
+    @arg array of expressions compiled by XmlXPathCompile()
+         (the batch takes its own reference to them, so they can be released at any time)
+    @arg the number of expressions
+    @return a newly allocated XmlXPathBatch (to be released using XmlXPathDestroyBatch()),
+            NULL on errors
+*/
+XmlXPathBatch *XmlXPathCreateBatch(XmlXPathExpr **exprs, size_t count);
+
+/***
+    @brief release a batch
+    @arg pointer to a valid XmlXPathBatch
+*/
+void XmlXPathDestroyBatch(XmlXPathBatch *batch);
+
+/***
+    @brief get the number of expressions in a batch
+    @arg pointer to a valid XmlXPathBatch
+    @return the number of expressions given to XmlXPathCreateBatch()
+*/
+size_t XmlXPathBatchCount(XmlXPathBatch *batch);
+
+/***
+    @brief evaluate all the expressions of a batch (see XmlXPathEvaluate())
+    @arg pointer to a valid XmlXPathBatch
+    @arg pointer to a valid xml context
+    @arg the context node (NULL to evaluate the expressions at the root of the document)
+    @arg array filled with the values of the expressions, in the order they were given to
+         XmlXPathCreateBatch(). Each value must be released using XmlXPathDestroyValue()
+         and is NULL if its expression can't be evaluated
+    @return XML_NOERR on success, XML_MEMORY_ERR (or XML_BADARGS) otherwise
+*/
+XmlErr XmlXPathBatchEvaluate(XmlXPathBatch *batch, TXml *xml, XmlNode *node, XmlXPathValue **values);
+
+/***
+    @brief get the string-value of a node, as defined by XPath
+           (the concatenation of all the text found in its subtree for elements)
+    @arg pointer to a valid xml context
+    @arg pointer to a valid XmlXPathNode
+    @return a newly allocated string (the caller must free() it), NULL on errors
+*/
+char *XmlXPathStringValue(TXml *xml, XmlXPathNode *node);
+
+#endif